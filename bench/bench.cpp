@@ -0,0 +1,574 @@
+// httplib's default listen backlog of 5 drops simultaneous connections beyond it, which then wait for a SYN retransmit.
+#define CPPHTTPLIB_LISTEN_BACKLOG 128
+
+#include "ollama.hpp"
+#include "mock_server.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Microbenchmarks for the client hot paths and macrobenchmarks against the local mock server.
+// Usage: build/bench [--filter <substring>] [--min-time <seconds>] [--json <output file>]
+
+using json = nlohmann::json;
+using bench_clock = std::chrono::steady_clock;
+
+static double min_time = 0.5;
+static std::string filter;
+static json results = json::array();
+
+// Prevents the compiler from discarding the result of a benchmarked expression.
+static volatile size_t sink;
+
+static bool selected(const std::string& name) { return filter.empty() || name.find(filter) != std::string::npos; }
+
+static double seconds_since(bench_clock::time_point start) { return std::chrono::duration<double>(bench_clock::now() - start).count(); }
+
+static double percentile(std::vector<double> values, double p)
+{
+    if (values.empty()) return 0;
+    std::sort(values.begin(), values.end());
+    size_t index = static_cast<size_t>(p * (values.size() - 1) + 0.5);
+    return values[std::min(index, values.size() - 1)];
+}
+
+// Runs fn in increasingly large batches until a batch takes at least min_time. bytes_per_op is used to report throughput.
+static void micro(const std::string& name, size_t bytes_per_op, const std::function<void()>& fn)
+{
+    if (!selected(name)) return;
+
+    size_t iterations = 1;
+    double elapsed = 0;
+
+    fn();
+    while (true)
+    {
+        bench_clock::time_point start = bench_clock::now();
+        for (size_t i = 0; i < iterations; ++i) fn();
+        elapsed = seconds_since(start);
+
+        if (elapsed >= min_time) break;
+        iterations = elapsed > 0 ? std::max(iterations * 2, static_cast<size_t>(iterations * min_time * 1.2 / elapsed)) : iterations * 10;
+    }
+
+    double ns_per_op = elapsed * 1e9 / iterations;
+
+    json result;
+    result["name"] = name;
+    result["type"] = "micro";
+    result["iterations"] = iterations;
+    result["ns_per_op"] = ns_per_op;
+    result["ops_per_second"] = iterations / elapsed;
+    if (bytes_per_op > 0) result["mb_per_second"] = bytes_per_op * iterations / elapsed / 1e6;
+    results.push_back(result);
+
+    std::cout << std::left << std::setw(40) << name << std::right << std::setw(14) << std::fixed << std::setprecision(1) << ns_per_op << " ns/op";
+    if (bytes_per_op > 0) std::cout << std::setw(12) << std::setprecision(1) << result["mb_per_second"].get<double>() << " MB/s";
+    std::cout << std::endl;
+}
+
+static void report(const std::string& name, json result)
+{
+    result["name"] = name;
+    result["type"] = "macro";
+    results.push_back(result);
+
+    std::cout << std::left << std::setw(40) << name << " ";
+    for (auto it = result.begin(); it != result.end(); ++it)
+        if (it.value().is_number()) std::cout << it.key() << "=" << std::setprecision(2) << it.value().get<double>() << " ";
+    std::cout << std::endl;
+}
+
+static std::string chat_line(const std::string& content, bool done)
+{
+    json line;
+    line["model"] = "llama3:8b";
+    line["created_at"] = "2025-01-01T00:00:00.000000Z";
+    line["message"]["role"] = "assistant";
+    line["message"]["content"] = content;
+    line["done"] = done;
+    return line.dump();
+}
+
+static void run_micro_benchmarks()
+{
+    ollama::options options;
+    options["seed"] = 1;
+    options["temperature"] = 0;
+    options["num_predict"] = 128;
+
+    micro("options/json_build_and_dump", 0, [&]{
+        ollama::options built;
+        built["seed"] = 1;
+        built["temperature"] = 0;
+        built["num_predict"] = 128;
+        sink = built.dump().size();
+    });
+
+    micro("options/typed_build_and_write", 0, [&]{
+        ollama::model_options built;
+        built.seed = 1;
+        built.temperature = 0;
+        built.num_predict = 128;
+        sink = built.dump().size();
+    });
+
+    // The whole request as generate() builds it, from the options to the serialized body.
+    micro("request/generation_with_options", 0, [&]{
+        ollama::options built;
+        built["seed"] = 1;
+        built["temperature"] = 0;
+        built["num_predict"] = 128;
+        ollama::request request("llama3:8b", "Why is the sky blue?", built, true);
+        sink = request.dump().size();
+    });
+
+    micro("request/generation_with_typed_options", 0, [&]{
+        ollama::model_options built;
+        built.seed = 1;
+        built.temperature = 0;
+        built.num_predict = 128;
+        std::string request_string;
+        ollama::request::write_generation(request_string, "llama3:8b", "Why is the sky blue?", built, true);
+        sink = request_string.size();
+    });
+
+    std::string prompt(100 * 1024, 'x');
+
+    micro("request/generation_serialize", 0, [&]{
+        ollama::request request("llama3:8b", "Why is the sky blue?", options, true);
+        sink = request.dump().size();
+    });
+
+    micro("request/generation_serialize_100kb_prompt", prompt.size(), [&]{
+        ollama::request request("llama3:8b", prompt, options, true);
+        sink = request.dump().size();
+    });
+
+    ollama::messages history;
+    for (int i = 0; i < 100; ++i) history.push_back(ollama::message(i % 2 ? "assistant" : "user", "Nimbus clouds are dense, moisture-filled clouds that produce rain. What are some other kinds of clouds?"));
+
+    micro("request/chat_serialize_100_messages", 0, [&]{
+        ollama::request request("llama3:8b", history, options, true);
+        sink = request.dump().size();
+    });
+
+    ollama::chat_request_builder builder("llama3:8b", options);
+    for (const ollama::message& message: history) builder.add(message);
+
+    micro("request/chat_builder_next_turn_100_messages", 0, [&]{
+        builder.add(history.back());
+        sink = builder.dump(true).size();
+        builder.pop_front();
+    });
+
+    std::string token_line = chat_line(" scattering", false);
+
+    micro("response/parse_chat_token", token_line.size(), [&]{
+        ollama::response response(token_line, ollama::message_type::chat);
+        sink = response.as_simple_string().size();
+    });
+
+    ollama::memory_arena arena;
+    ollama::response reused;
+
+    micro("response/parse_chat_token_reused_arena", token_line.size(), [&]{
+        reused.assign(token_line.data(), token_line.size(), ollama::message_type::chat, &arena);
+        sink = reused.as_simple_string().size();
+    });
+
+    std::string stream;
+    for (int i = 0; i < 1000; ++i) { stream += chat_line(ollama::mock_server::token(i), false); stream += '\n'; }
+
+    const size_t fragment_sizes[] = {7, 4096};
+    for (size_t fragment_size: fragment_sizes)
+    {
+        micro("stream/reassemble_1000_tokens_" + std::to_string(fragment_size) + "b_chunks", stream.size(), [&]{
+            ollama::stream_buffer buffer;
+            size_t tokens = 0;
+            auto on_line = [&](const char* line, size_t length) { reused.assign(line, length, ollama::message_type::chat, &arena); tokens += reused.as_simple_string().size(); return true; };
+
+            for (size_t offset = 0; offset < stream.size(); offset += fragment_size)
+                buffer.append(stream.data() + offset, std::min(fragment_size, stream.size() - offset), on_line);
+            buffer.finish(on_line);
+            sink = tokens;
+        });
+    }
+
+    ollama::content_extractor extractor;
+
+    micro("stream/extract_1000_tokens_4096b_chunks", stream.size(), [&]{
+        ollama::stream_buffer buffer;
+        size_t tokens = 0;
+        auto on_line = [&](const char* line, size_t length) { extractor.parse(line, length, ollama::message_type::chat); tokens += extractor.content().size(); return true; };
+
+        for (size_t offset = 0; offset < stream.size(); offset += 4096)
+            buffer.append(stream.data() + offset, std::min<size_t>(4096, stream.size() - offset), on_line);
+        buffer.finish(on_line);
+        sink = tokens;
+    });
+
+    json structured_schema = json::parse(R"({"type": "object", "properties": {"items": {"type": "array", "items": {"type": "object", "properties": {"id": {"type": "integer"}, "name": {"type": "string"}}, "required": ["id", "name"]}}}})");
+    json structured_reply;
+    for (int i = 0; i < 100; ++i) structured_reply["items"].push_back({{"id", i}, {"name", ollama::mock_server::token(i)}});
+    std::string structured_text = structured_reply.dump();
+    ollama::json_stream_parser structured_parser(structured_schema);
+
+    micro("structured/validate_100_items_4b_pieces", structured_text.size(), [&]{
+        structured_parser.reset();
+        for (size_t offset = 0; offset < structured_text.size(); offset += 4)
+            structured_parser.feed(structured_text.data() + offset, std::min<size_t>(4, structured_text.size() - offset));
+        sink = structured_parser.value().size();
+    });
+
+    std::string document;
+    while (document.size() < 1024 * 1024) document += ollama::mock_server::token(document.size()) + (document.size() % 7 == 0 ? ". " : " ");
+    ollama::chunk_options chunking;
+    chunking.size = 1000;
+    chunking.overlap = 100;
+    chunking.in_tokens = true;
+
+    micro("chunk/tokens_1mb", document.size(), [&]{ sink = ollama::chunk_text(document, chunking).size(); });
+
+    std::string image_bytes(1024 * 1024, '\0');
+    for (size_t i = 0; i < image_bytes.size(); ++i) image_bytes[i] = static_cast<char>(i * 2654435761u >> 24);
+    std::string image_base64 = ollama::base64::Encode(image_bytes);
+
+    micro("base64/encode_1mb", image_bytes.size(), [&]{ sink = ollama::base64::Encode(image_bytes).size(); });
+
+    micro("base64/decode_1mb", image_base64.size(), [&]{
+        std::string decoded;
+        ollama::base64::Decode(image_base64, decoded);
+        sink = decoded.size();
+    });
+
+    // An embedding reply as Ollama sends it, with float32 values, decoded through json and straight into floats. The
+    // second reply writes each value with 17 digits, which is beyond the exact fast path and goes through strtod.
+    json embed_reply, long_reply;
+    embed_reply["model"] = long_reply["model"] = "llama3:8b";
+    embed_reply["embeddings"] = long_reply["embeddings"] = json::array();
+    for (int i = 0; i < 8; ++i)
+    {
+        embed_reply["embeddings"].push_back(ollama::mock_server::embedding_json("input " + std::to_string(i), 4096));
+        long_reply["embeddings"].push_back(ollama::mock_server::embedding("input " + std::to_string(i), 4096));
+    }
+    std::string embed_body = embed_reply.dump(), long_body = long_reply.dump();
+
+    micro("embedding/decode_8x4096", embed_body.size(), [&]{
+        ollama::response response(embed_body);
+        std::vector<std::vector<float>> embeddings = response.as_json()["embeddings"].get<std::vector<std::vector<float>>>();
+        sink = embeddings.size();
+    });
+
+    std::vector<float> decoded(8 * 4096);
+    micro("embedding/decode_fast_8x4096", embed_body.size(), [&]{
+        ollama::response response(embed_body, ollama::message_type::embedding);
+        size_t count = 0, dimensions = 0;
+        response.get_embeddings(decoded.data(), decoded.size(), count, dimensions);
+        sink = count;
+    });
+
+    micro("embedding/decode_fast_8x4096_17_digits", long_body.size(), [&]{
+        size_t count = 0, dimensions = 0;
+        ollama::decode_embeddings(long_body.data(), long_body.size(), decoded.data(), decoded.size(), count, dimensions);
+        sink = count;
+    });
+
+    // Hashing a 1 MB input for a cache key, and looking up a cached 768-dimension embedding.
+    std::string hash_input(1 << 20, 'a');
+    for (size_t i = 0; i < hash_input.size(); ++i) hash_input[i] = static_cast<char>('a' + (i * 7) % 26);
+    micro("cache/murmur3_128_1mb", hash_input.size(), [&]{ sink = static_cast<size_t>(ollama::murmur3_128(hash_input).low); });
+
+    ollama::embedding_cache embedding_cache;
+    for (int i = 0; i < 4096; ++i) embedding_cache.put("llama3:8b", true, "chunk " + std::to_string(i), std::vector<float>(768, 0.5f));
+    std::vector<float> cached;
+    micro("cache/get_768", 768 * sizeof(float), [&]{ sink = embedding_cache.get("llama3:8b", true, "chunk 1234", cached); });
+
+    // Brute-force search over 100k 768-dimension vectors, serially with each kernel and then in parallel with the best.
+    const size_t vector_count = 100000, vector_dimensions = 768;
+    ollama::vector_index vectors(vector_dimensions, ollama::metric::dot);
+    vectors.reserve(vector_count);
+    std::vector<float> vector(vector_dimensions);
+    for (size_t i = 0; i < vector_count; ++i)
+    {
+        for (size_t d = 0; d < vector_dimensions; ++d) vector[d] = static_cast<float>(((i * 2654435761u + d * 40503u) >> 8) % 2001) / 1000.0f - 1.0f;
+        vectors.add(std::to_string(i), vector);
+    }
+    size_t vector_bytes = vector_count * vector_dimensions * sizeof(float);
+
+    for (const ollama::simd::kernels& kernels: ollama::simd::available())
+        micro(std::string("vector/dot_100k_x_768_") + kernels.name, vector_bytes, [&]{
+            float best = -1e30f;
+            for (size_t i = 0; i < vector_count; ++i) best = std::max(best, kernels.dot(vector.data(), vectors.vector(i), vector_dimensions));
+            sink = static_cast<size_t>(best);
+        });
+
+    micro("vector/search_100k_x_768_top10", vector_bytes, [&]{ sink = vectors.search(vector, 10).size(); });
+
+    // The same vectors stored as int8 codes and as signs, keeping the float32 vectors to rescore the candidates.
+    if (selected("vector/search_100k_x_768_int8") || selected("vector/search_100k_x_768_binary"))
+    {
+        ollama::vector_index int8_vectors(vector_dimensions, ollama::metric::dot, ollama::quantization::int8);
+        ollama::vector_index binary_vectors(vector_dimensions, ollama::metric::dot, ollama::quantization::binary);
+        int8_vectors.reserve(vector_count);
+        binary_vectors.reserve(vector_count);
+        for (size_t i = 0; i < vector_count; ++i)
+        {
+            int8_vectors.add(vectors.id(i), vectors.vector(i), vector_dimensions);
+            binary_vectors.add(vectors.id(i), vectors.vector(i), vector_dimensions);
+        }
+
+        micro("vector/search_100k_x_768_int8_top10", vector_count * vector_dimensions, [&]{ sink = int8_vectors.search(vector, 10).size(); });
+        micro("vector/search_100k_x_768_binary_top10", vector_count * vector_dimensions / 8, [&]{ sink = binary_vectors.search(vector, 10).size(); });
+    }
+
+    // The same vectors appended to a store on disk in batches of 10k, then opened and searched in place.
+    if (selected("store/"))
+    {
+        const std::string store_path = "bench_vectors.store";
+        std::remove(store_path.c_str());
+        {
+            std::shared_ptr<ollama::embedding_store> store = ollama::embedding_store::open(store_path, vector_dimensions);
+            for (size_t first = 0; first < vector_count; first += 10000)
+            {
+                std::vector<std::string> ids;
+                for (size_t i = first; i < first + 10000; ++i) ids.push_back(vectors.id(i));
+                store->append(ids, vectors.vector(first), vector_dimensions);
+            }
+        }
+
+        micro("store/open_100k_x_768", 0, [&]{ sink = ollama::embedding_store::open(store_path)->size(); });
+
+        std::shared_ptr<ollama::embedding_store> store = ollama::embedding_store::open(store_path);
+        micro("store/search_100k_x_768_top10", vector_bytes, [&]{ sink = store->search(vector, 10, ollama::metric::dot).size(); });
+        store.reset();
+        std::remove(store_path.c_str());
+    }
+
+    // Approximate search over 20k 128-dimension vectors gathered around 200 topics, against an exact search of the same
+    // vectors. Building the graph takes a while, so it is only built when selected.
+    if (selected("hnsw/") || selected("vector/exact_20k"))
+    {
+        const size_t graph_count = 20000, graph_dimensions = 128;
+        std::mt19937 generator(5);
+        std::normal_distribution<float> normal(0.0f, 1.0f);
+        std::vector<std::vector<float>> topics(200, std::vector<float>(graph_dimensions));
+        for (std::vector<float>& each: topics) for (float& value: each) value = normal(generator);
+        std::vector<std::vector<float>> graph_vectors(graph_count + 100, std::vector<float>(graph_dimensions));
+        for (size_t i = 0; i < graph_vectors.size(); ++i)
+            for (size_t d = 0; d < graph_dimensions; ++d) graph_vectors[i][d] = topics[i % topics.size()][d] + 0.5f * normal(generator);
+
+        ollama::hnsw_options graph_options;
+        graph_options.ef_construction = 100;
+        ollama::hnsw_index graph(graph_dimensions, ollama::metric::cosine, graph_options);
+        ollama::vector_index exact(graph_dimensions, ollama::metric::cosine);
+        std::chrono::steady_clock::time_point build_start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < graph_count; ++i) graph.add(std::to_string(i), graph_vectors[i]);
+        double build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - build_start).count();
+        for (size_t i = 0; i < graph_count; ++i) exact.add(std::to_string(i), graph_vectors[i]);
+
+        size_t query = graph_count, found = 0;
+        for (size_t q = graph_count; q < graph_vectors.size(); ++q)
+        {
+            std::vector<ollama::search_result> expected = exact.search(graph_vectors[q], 10), results = graph.search(graph_vectors[q], 10);
+            for (const ollama::search_result& result: results)
+                for (const ollama::search_result& each: expected) if (each.id == result.id) { ++found; break; }
+        }
+        std::printf("hnsw: built 20k x 128 in %.2f s, recall@10 %.3f\n", build_seconds, found / 1000.0);
+
+        micro("hnsw/search_20k_x_128_top10_ef64", graph_dimensions * sizeof(float), [&]{
+            sink = graph.search(graph_vectors[query], 10).size();
+            if (++query == graph_vectors.size()) query = graph_count;
+        });
+        micro("vector/exact_20k_x_128_top10", graph_count * graph_dimensions * sizeof(float), [&]{
+            sink = exact.search(graph_vectors[query], 10).size();
+            if (++query == graph_vectors.size()) query = graph_count;
+        });
+    }
+}
+
+static void run_macro_benchmarks()
+{
+    if (selected("mock/stream_tokens_per_second"))
+    {
+        ollama::mock_server server;
+        server.start();
+        Ollama client(server.url());
+
+        ollama::options options;
+        options["num_predict"] = 5000;
+
+        size_t tokens = 0;
+        std::vector<double> gaps;
+        bench_clock::time_point last;
+
+        std::function<bool(const ollama::response&)> on_token = [&](const ollama::response&) {
+            bench_clock::time_point now = bench_clock::now();
+            if (tokens++ > 0) gaps.push_back(std::chrono::duration<double, std::micro>(now - last).count());
+            last = now;
+            return true;
+        };
+
+        bench_clock::time_point start = bench_clock::now();
+        client.chat("llama3:8b", ollama::message("user", "Why is the sky blue?"), on_token, options);
+        double elapsed = seconds_since(start);
+
+        json result;
+        result["tokens"] = tokens;
+        result["tokens_per_second"] = tokens / elapsed;
+        result["p50_token_gap_us"] = percentile(gaps, 0.50);
+        result["p99_token_gap_us"] = percentile(gaps, 0.99);
+        report("mock/stream_tokens_per_second", result);
+    }
+
+    const size_t concurrencies[] = {1, 8};
+    for (size_t concurrency: concurrencies)
+    {
+        std::string name = "mock/concurrent_requests_c" + std::to_string(concurrency);
+        if (!selected(name)) continue;
+
+        ollama::mock_server::config config;
+        config.latency_ms = 2;
+        config.threads = concurrency + 2;
+
+        ollama::mock_server server(config);
+        server.start();
+
+        ollama::options options;
+        options["num_predict"] = 8;
+
+        const size_t requests_per_thread = 200 / concurrency + 1;
+        std::vector<std::vector<double>> latencies(concurrency);
+        std::vector<std::thread> threads;
+
+        bench_clock::time_point start = bench_clock::now();
+        for (size_t t = 0; t < concurrency; ++t)
+        {
+            threads.push_back(std::thread([&, t]{
+                Ollama client(server.url());
+                for (size_t i = 0; i < requests_per_thread; ++i)
+                {
+                    bench_clock::time_point request_start = bench_clock::now();
+                    client.generate("llama3:8b", "Why is the sky blue?", options);
+                    latencies[t].push_back(seconds_since(request_start) * 1000);
+                }
+            }));
+        }
+        for (std::thread& thread: threads) thread.join();
+        double elapsed = seconds_since(start);
+
+        std::vector<double> all;
+        for (const std::vector<double>& thread_latencies: latencies) all.insert(all.end(), thread_latencies.begin(), thread_latencies.end());
+
+        json result;
+        result["concurrency"] = concurrency;
+        result["requests"] = all.size();
+        result["requests_per_second"] = all.size() / elapsed;
+        result["p50_latency_ms"] = percentile(all, 0.50);
+        result["p99_latency_ms"] = percentile(all, 0.99);
+        report(name, result);
+    }
+
+    for (size_t concurrency: concurrencies)
+    {
+        std::string name = "mock/generate_batch_c" + std::to_string(concurrency);
+        if (!selected(name)) continue;
+
+        ollama::mock_server::config config;
+        config.latency_ms = 2;
+        config.threads = concurrency + 2;
+
+        ollama::mock_server server(config);
+        server.start();
+        Ollama client(server.url());
+
+        ollama::options options;
+        options["num_predict"] = 8;
+
+        std::vector<ollama::request> requests;
+        for (int i = 0; i < 200; ++i) requests.push_back(ollama::request("llama3:8b", "Why is the sky blue?", options));
+
+        bench_clock::time_point start = bench_clock::now();
+        std::vector<ollama::batch_result> batch = client.generate_batch(requests, concurrency);
+        double elapsed = seconds_since(start);
+
+        size_t succeeded = 0;
+        for (const ollama::batch_result& result: batch) succeeded += result.success ? 1 : 0;
+
+        json result;
+        result["concurrency"] = concurrency;
+        result["requests"] = batch.size();
+        result["succeeded"] = succeeded;
+        result["requests_per_second"] = batch.size() / elapsed;
+        report(name, result);
+    }
+
+    // Adding 1 MB of text to a RAG pipeline, with the mock server producing 768-dimension embeddings after 5 ms.
+    if (selected("mock/rag_add_1mb"))
+    {
+        ollama::mock_server::config config;
+        config.latency_ms = 5;
+        config.embedding_dimensions = 768;
+
+        ollama::mock_server server(config);
+        server.start();
+        Ollama client(server.url());
+
+        std::string document;
+        for (int i = 0; document.size() < (1 << 20); ++i) document += "Sentence number " + std::to_string(i) + " of the benchmark document. ";
+
+        ollama::rag_options settings;
+        settings.embedding_model = "llama3:8b";
+        ollama::rag pipeline(settings, client);
+
+        bench_clock::time_point start = bench_clock::now();
+        size_t chunks = pipeline.add(document);
+        double elapsed = seconds_since(start);
+
+        json result;
+        result["chunks"] = chunks;
+        result["chunks_per_second"] = chunks / elapsed;
+        result["mb_per_second"] = document.size() / elapsed / 1e6;
+        report("mock/rag_add_1mb", result);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string json_path;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--filter" && i + 1 < argc) filter = argv[++i];
+        else if (arg == "--min-time" && i + 1 < argc) min_time = std::stod(argv[++i]);
+        else if (arg == "--json" && i + 1 < argc) json_path = argv[++i];
+        else { std::cerr << "Usage: " << argv[0] << " [--filter <substring>] [--min-time <seconds>] [--json <output file>]" << std::endl; return 1; }
+    }
+
+    run_micro_benchmarks();
+    run_macro_benchmarks();
+
+    if (!json_path.empty())
+    {
+        json output;
+        output["library"] = "ollama-hpp";
+        output["cplusplus"] = static_cast<long>(__cplusplus);
+        output["hardware_concurrency"] = std::thread::hardware_concurrency();
+        output["benchmarks"] = results;
+
+        std::ofstream file(json_path);
+        file << output.dump(2) << std::endl;
+    }
+
+    return 0;
+}
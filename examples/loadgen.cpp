@@ -0,0 +1,331 @@
+#include "ollama.hpp"
+#include "mock_server.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*  ollama-loadgen replays a recorded trace of requests against one or more Ollama servers and
+    reports throughput, time to first token and tail latency.
+
+    The trace is a JSONL file. Each line is either a request payload with an optional "timestamp"
+    field in seconds, or an object of the form:
+
+        {"timestamp": 1.25, "endpoint": "chat", "request": {"model": "llama3:8b", "messages": [...]}}
+
+    The endpoint is inferred from the payload when omitted: "messages" selects chat, "input" selects
+    embeddings and anything else is sent to generate.
+
+    In closed-loop mode each worker sends its next request as soon as the previous one completes.
+    In open-loop mode requests are dispatched at their recorded timestamps (scaled by --speed)
+    regardless of how many are outstanding, and latency includes any time spent queued.
+*/
+
+using json = nlohmann::json;
+using loadgen_clock = std::chrono::steady_clock;
+
+struct trace_entry {
+    double timestamp = 0;
+    ollama::message_type type = ollama::message_type::generation;
+    json payload;
+};
+
+struct result {
+    bool ok = false;
+    double latency_ms = 0;
+    double ttft_ms = -1;
+    size_t output_tokens = 0;
+    size_t endpoint = 0;
+    std::string error;
+};
+
+struct settings {
+    std::string trace_path;
+    std::vector<std::string> endpoints;
+    bool open_loop = false;
+    size_t concurrency = 4;
+    double speed = 1.0;
+    size_t limit = 0;
+    bool stream = true;
+    bool mock = false;
+    std::string json_path;
+};
+
+static void usage(const char* program)
+{
+    std::cerr << "Usage: " << program << " --trace <file.jsonl> [options]\n"
+              << "  --endpoint <url>      Server to send requests to. Repeat to spread requests across servers. Default http://localhost:11434\n"
+              << "  --mode <open|closed>  Open-loop replays recorded timestamps; closed-loop sends as fast as workers allow. Default closed\n"
+              << "  --concurrency <n>     Number of concurrent workers. Default 4\n"
+              << "  --speed <x>           Time scale for open-loop replay. 2 replays twice as fast. Default 1\n"
+              << "  --limit <n>           Replay at most n requests from the trace\n"
+              << "  --no-stream           Send requests without streaming. Time to first token is not reported\n"
+              << "  --mock                Replay against an in-process mock server instead of --endpoint\n"
+              << "  --json <file>         Write a summary as JSON\n";
+}
+
+static bool parse_arguments(int argc, char** argv, settings& config)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (arg == "--trace" && has_value) config.trace_path = argv[++i];
+        else if (arg == "--endpoint" && has_value) config.endpoints.push_back(argv[++i]);
+        else if (arg == "--mode" && has_value) { std::string mode = argv[++i]; if (mode != "open" && mode != "closed") return false; config.open_loop = mode == "open"; }
+        else if (arg == "--concurrency" && has_value) config.concurrency = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--speed" && has_value) config.speed = std::stod(argv[++i]);
+        else if (arg == "--limit" && has_value) config.limit = std::stoul(argv[++i]);
+        else if (arg == "--no-stream") config.stream = false;
+        else if (arg == "--mock") config.mock = true;
+        else if (arg == "--json" && has_value) config.json_path = argv[++i];
+        else return false;
+    }
+
+    if (config.endpoints.empty()) config.endpoints.push_back("http://localhost:11434");
+    return !config.trace_path.empty() && config.speed > 0;
+}
+
+static std::vector<trace_entry> load_trace(const settings& config)
+{
+    std::vector<trace_entry> trace;
+    std::ifstream file(config.trace_path);
+    if (!file) throw ollama::exception("Unable to open trace file "+config.trace_path);
+
+    std::string line;
+    size_t line_number = 0;
+    while (std::getline(file, line))
+    {
+        ++line_number;
+        if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+
+        json record;
+        try { record = json::parse(line); }
+        catch (...) { throw ollama::exception("Invalid JSON on line "+std::to_string(line_number)+" of the trace"); }
+
+        trace_entry entry;
+        entry.timestamp = record.value("timestamp", 0.0);
+        entry.payload = record.contains("request") ? record["request"] : record;
+        entry.payload.erase("timestamp");
+        entry.payload.erase("endpoint");
+
+        std::string endpoint = record.value("endpoint", std::string());
+        if (endpoint == "chat" || (endpoint.empty() && entry.payload.contains("messages"))) entry.type = ollama::message_type::chat;
+        else if (endpoint == "embed" || endpoint == "embeddings" || (endpoint.empty() && entry.payload.contains("input"))) entry.type = ollama::message_type::embedding;
+
+        trace.push_back(entry);
+        if (config.limit > 0 && trace.size() == config.limit) break;
+    }
+
+    // Replay relative to the first request so that absolute timestamps can be used.
+    if (!trace.empty())
+    {
+        std::stable_sort(trace.begin(), trace.end(), [](const trace_entry& a, const trace_entry& b) { return a.timestamp < b.timestamp; });
+        double start = trace.front().timestamp;
+        for (trace_entry& entry: trace) entry.timestamp -= start;
+    }
+
+    return trace;
+}
+
+static double milliseconds_between(loadgen_clock::time_point start, loadgen_clock::time_point end) { return std::chrono::duration<double, std::milli>(end - start).count(); }
+
+// Sends one request and measures it from the time it was due to be sent.
+static result send(Ollama& client, const trace_entry& entry, bool stream, loadgen_clock::time_point due)
+{
+    result outcome;
+    ollama::request request(entry.type);
+    static_cast<json&>(request) = entry.payload;
+
+    try
+    {
+        if (entry.type == ollama::message_type::embedding)
+        {
+            ollama::response response = client.generate_embeddings(request);
+            outcome.ok = response.is_valid() && !response.has_error();
+            outcome.output_tokens = 0;
+        }
+        else if (stream)
+        {
+            std::function<bool(const ollama::response&)> on_token = [&](const ollama::response& response) {
+                if (outcome.ttft_ms < 0) outcome.ttft_ms = milliseconds_between(due, loadgen_clock::now());
+                // Only the final reply is parsed for its token count; the others are counted as they arrive.
+                if (response.is_done()) { outcome.output_tokens = response.as_json().value("eval_count", outcome.output_tokens); outcome.ok = !response.has_error(); }
+                else ++outcome.output_tokens;
+                return true;
+            };
+
+            if (entry.type == ollama::message_type::chat) client.chat(request, on_token);
+            else client.generate(request, on_token);
+        }
+        else
+        {
+            ollama::response response = entry.type == ollama::message_type::chat ? client.chat(request) : client.generate(request);
+            outcome.ok = response.is_valid() && !response.has_error();
+            outcome.output_tokens = response.as_json().value("eval_count", 0);
+        }
+
+        if (!outcome.ok && outcome.error.empty()) outcome.error = "incomplete response";
+    }
+    catch (const std::exception& e) { outcome.ok = false; outcome.error = e.what(); }
+
+    outcome.latency_ms = milliseconds_between(due, loadgen_clock::now());
+    return outcome;
+}
+
+static double percentile(std::vector<double> values, double p)
+{
+    if (values.empty()) return 0;
+    std::sort(values.begin(), values.end());
+    size_t index = static_cast<size_t>(p * (values.size() - 1) + 0.5);
+    return values[std::min(index, values.size() - 1)];
+}
+
+static json summarize(const std::vector<result>& results, double elapsed_seconds, const settings& config)
+{
+    std::vector<double> latencies, ttfts;
+    size_t errors = 0, tokens = 0;
+    std::vector<size_t> per_endpoint(config.endpoints.size(), 0);
+    json error_samples = json::array();
+
+    for (const result& outcome: results)
+    {
+        per_endpoint[outcome.endpoint]++;
+        if (!outcome.ok) { ++errors; if (error_samples.size() < 5) error_samples.push_back(outcome.error); continue; }
+        latencies.push_back(outcome.latency_ms);
+        if (outcome.ttft_ms >= 0) ttfts.push_back(outcome.ttft_ms);
+        tokens += outcome.output_tokens;
+    }
+
+    json summary;
+    summary["mode"] = config.open_loop ? "open" : "closed";
+    summary["concurrency"] = config.concurrency;
+    summary["requests"] = results.size();
+    summary["errors"] = errors;
+    summary["duration_seconds"] = elapsed_seconds;
+    summary["requests_per_second"] = elapsed_seconds > 0 ? (results.size() - errors) / elapsed_seconds : 0;
+    summary["output_tokens_per_second"] = elapsed_seconds > 0 ? tokens / elapsed_seconds : 0;
+
+    const double points[] = {0.5, 0.9, 0.99};
+    const char* names[] = {"p50", "p90", "p99"};
+    for (size_t i = 0; i < 3; ++i)
+    {
+        summary["latency_ms"][names[i]] = percentile(latencies, points[i]);
+        if (!ttfts.empty()) summary["ttft_ms"][names[i]] = percentile(ttfts, points[i]);
+    }
+    summary["latency_ms"]["max"] = latencies.empty() ? 0 : *std::max_element(latencies.begin(), latencies.end());
+
+    for (size_t i = 0; i < config.endpoints.size(); ++i) summary["endpoints"][config.endpoints[i]] = per_endpoint[i];
+    if (!error_samples.empty()) summary["error_samples"] = error_samples;
+
+    return summary;
+}
+
+int main(int argc, char** argv)
+{
+    settings config;
+    if (!parse_arguments(argc, argv, config)) { usage(argv[0]); return 1; }
+
+    std::unique_ptr<ollama::mock_server> mock;
+    if (config.mock)
+    {
+        ollama::mock_server::config mock_config;
+        mock_config.tokens_per_second = 200;
+        mock_config.latency_ms = 20;
+        mock_config.distribution = ollama::latency_distribution::exponential;
+        mock_config.threads = config.concurrency + 2;
+
+        mock.reset(new ollama::mock_server(mock_config));
+        if (!mock->start()) { std::cerr << "Unable to start mock server." << std::endl; return 1; }
+        config.endpoints.assign(1, mock->url());
+    }
+
+    std::vector<trace_entry> trace;
+    try { trace = load_trace(config); }
+    catch (const std::exception& e) { std::cerr << e.what() << std::endl; return 1; }
+
+    if (trace.empty()) { std::cerr << "The trace contains no requests." << std::endl; return 1; }
+
+    std::vector<result> results(trace.size());
+    std::atomic<size_t> next_index{0};
+
+    // Open-loop dispatch: requests become available at their scheduled time and wait in a queue for a free worker.
+    std::mutex queue_mutex;
+    std::condition_variable queue_ready;
+    std::deque<size_t> queue;
+    bool dispatch_finished = false;
+
+    loadgen_clock::time_point start = loadgen_clock::now();
+    auto due_time = [&](size_t index) { return start + std::chrono::duration_cast<loadgen_clock::duration>(std::chrono::duration<double>(trace[index].timestamp / config.speed)); };
+
+    std::vector<std::thread> workers;
+    for (size_t worker = 0; worker < config.concurrency; ++worker)
+    {
+        workers.push_back(std::thread([&]{
+            std::vector<std::unique_ptr<Ollama>> clients;
+            for (const std::string& endpoint: config.endpoints) clients.push_back(std::unique_ptr<Ollama>(new Ollama(endpoint)));
+
+            while (true)
+            {
+                size_t index;
+                loadgen_clock::time_point due;
+
+                if (config.open_loop)
+                {
+                    std::unique_lock<std::mutex> lock(queue_mutex);
+                    queue_ready.wait(lock, [&]{ return !queue.empty() || dispatch_finished; });
+                    if (queue.empty()) break;
+                    index = queue.front(); queue.pop_front();
+                    due = due_time(index);
+                }
+                else
+                {
+                    index = next_index++;
+                    if (index >= trace.size()) break;
+                    due = loadgen_clock::now();
+                }
+
+                size_t endpoint = index % clients.size();
+                results[index] = send(*clients[endpoint], trace[index], config.stream, due);
+                results[index].endpoint = endpoint;
+            }
+        }));
+    }
+
+    if (config.open_loop)
+    {
+        for (size_t index = 0; index < trace.size(); ++index)
+        {
+            std::this_thread::sleep_until(due_time(index));
+            { std::lock_guard<std::mutex> lock(queue_mutex); queue.push_back(index); }
+            queue_ready.notify_one();
+        }
+        { std::lock_guard<std::mutex> lock(queue_mutex); dispatch_finished = true; }
+        queue_ready.notify_all();
+    }
+
+    for (std::thread& worker: workers) worker.join();
+    double elapsed = std::chrono::duration<double>(loadgen_clock::now() - start).count();
+
+    json summary = summarize(results, elapsed, config);
+    std::cout << summary.dump(2) << std::endl;
+
+    if (!config.json_path.empty())
+    {
+        std::ofstream file(config.json_path);
+        file << summary.dump(2) << std::endl;
+    }
+
+    return summary["errors"].get<size_t>() == trace.size() ? 1 : 0;
+}
@@ -16,7 +16,7 @@ bool on_receive_response(const ollama::response& response)
 {   
     std::cout << response << std::flush;
 
-    if (response.as_json()["done"]==true) { done=true;  std::cout << std::endl;}
+    if (response.is_done()) { done=true;  std::cout << std::endl;}
 
     return !done; // Return true to continue streaming this response; return false to stop immediately.
 }
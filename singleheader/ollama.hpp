@@ -34853,12 +34853,73 @@ public:
 
 #include <string>
 #include <memory>
+#include <new>
 #include <fstream>
 #include <iostream>
 #include <numeric>
 #include <functional>
+#include <algorithm>
+#include <regex>
 #include <exception>
 #include <initializer_list>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <cctype>
+#include <map>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <queue>
+#include <random>
+#include <cstdint>
+#include <cmath>
+#include <clocale>
+#include <limits>
+#include <stdexcept>
+#include <cstddef>
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#endif
+
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#include <optional>
+#define OLLAMA_HAS_STD_OPTIONAL
+#if defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#endif
+#endif
+#if defined(__cpp_lib_memory_resource)
+#define OLLAMA_HAS_PMR
+#endif
+#endif
+
+// Vector search kernels for AVX2 and AVX-512 are compiled with target attributes and chosen at runtime on x86 with GCC and Clang.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define OLLAMA_HAS_X86_DISPATCH
+#endif
 
 // Namespace types and classes
 namespace ollama
@@ -34870,12 +34931,44 @@ namespace ollama
     static bool log_requests = false;      // Log raw requests to the Ollama server. Useful when debugging.       
     static bool log_replies = false;       // Log raw replies from the Ollama server. Useful when debugging.
 
-    static void allow_exceptions(bool enable) {use_exceptions = enable;}
-    static void show_requests(bool enable) {log_requests = enable;}
-    static void show_replies(bool enable) {log_replies = enable;}
+    static inline void allow_exceptions(bool enable) {use_exceptions = enable;}
+    static inline void show_requests(bool enable) {log_requests = enable;}
+    static inline void show_replies(bool enable) {log_replies = enable;}
 
     enum class message_type { generation, chat, embedding };
 
+    #ifdef OLLAMA_HAS_STD_OPTIONAL
+    template<typename T> using optional = std::optional<T>;
+    #else
+    // A minimal stand-in for std::optional when building as C++11 or C++14.
+    template<typename T>
+    class optional {
+        public:
+            optional(): engaged(false), stored() {}
+            optional(const T& value): engaged(true), stored(value) {}
+            optional(T&& value): engaged(true), stored(std::move(value)) {}
+
+            optional& operator=(const T& value) { stored = value; engaged = true; return *this; }
+            optional& operator=(T&& value) { stored = std::move(value); engaged = true; return *this; }
+
+            bool has_value() const { return engaged; }
+            explicit operator bool() const { return engaged; }
+
+            T& operator*() { return stored; }
+            const T& operator*() const { return stored; }
+            T* operator->() { return &stored; }
+            const T* operator->() const { return &stored; }
+
+            const T& value() const { if (!engaged) throw std::logic_error("bad optional access"); return stored; }
+            T value_or(const T& fallback) const { return engaged ? stored : fallback; }
+            void reset() { engaged = false; stored = T(); }
+
+        private:
+            bool engaged;
+            T stored;
+    };
+    #endif
+
     class exception : public std::exception {
     private:
         std::string message;
@@ -34887,12 +34980,275 @@ namespace ollama
 
     class invalid_json_exception : public ollama::exception { public: using exception::exception; };
 
-    class image {
+    enum class log_level { debug, info, warning, error, none };
+
+    inline const char* log_level_name(log_level level)
+    {
+        switch (level)
+        {
+            case log_level::debug: return "debug";
+            case log_level::info: return "info";
+            case log_level::warning: return "warning";
+            case log_level::error: return "error";
+            default: return "none";
+        }
+    }
+
+    struct log_record {
+        std::chrono::system_clock::time_point time;
+        log_level level;
+        std::string category;
+        std::string message;
+    };
+
+    // Destination for log records. Sinks are only ever called from one thread at a time.
+    class log_sink {
+        public:
+            virtual ~log_sink() {}
+            virtual void write(const log_record& record) = 0;
+            virtual void flush() {}
+    };
+
+    // Writes the message of each record on its own line. Pointed at std::cout this matches the output of earlier versions.
+    class ostream_log_sink: public log_sink {
+        public:
+            ostream_log_sink(std::ostream& stream): stream(stream) {}
+
+            void write(const log_record& record) override { stream << record.message << '\n'; }
+            void flush() override { stream.flush(); }
+
+        private:
+            std::ostream& stream;
+    };
+
+    // Writes each record as a single JSON object per line, suitable for log collectors.
+    class json_lines_log_sink: public log_sink {
         public:
-            image(const std::string base64_sequence, bool valid = true) 
+            json_lines_log_sink(std::ostream& stream): stream(&stream) {}
+            json_lines_log_sink(const std::string& filepath): file(new std::ofstream(filepath, std::ios::app)), stream(file.get())
+            {
+                if (!*file && ollama::use_exceptions) throw ollama::exception("Unable to open log file "+filepath);
+            }
+
+            void write(const log_record& record) override
+            {
+                std::time_t seconds = std::chrono::system_clock::to_time_t(record.time);
+                long milliseconds = static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(record.time.time_since_epoch()).count() % 1000);
+
+                std::tm utc{};
+                #ifdef _WIN32
+                gmtime_s(&utc, &seconds);
+                #else
+                gmtime_r(&seconds, &utc);
+                #endif
+
+                char timestamp[32];
+                size_t length = std::strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &utc);
+                std::snprintf(timestamp+length, sizeof(timestamp)-length, ".%03ldZ", milliseconds);
+
+                nlohmann::json line;
+                line["time"] = timestamp;
+                line["level"] = log_level_name(record.level);
+                line["category"] = record.category;
+                line["message"] = record.message;
+
+                // Truncated bodies may end in a partial UTF-8 sequence, so replace invalid bytes rather than throwing.
+                *stream << line.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace) << '\n';
+            }
+
+            void flush() override { stream->flush(); }
+
+        private:
+            std::unique_ptr<std::ofstream> file;
+            std::ostream* stream;
+    };
+
+    // Buffers log records in a fixed-size ring and writes them to the sink from a background thread so that
+    // logging never blocks a request or stream on I/O. Records are dropped, not blocked on, when the ring is full.
+    class logger {
+        public:
+            logger(size_t capacity=4096): ring(capacity > 0 ? capacity : 1), sink(std::make_shared<ostream_log_sink>(std::cout)) {}
+            ~logger() { stop(); }
+
+            void set_sink(std::shared_ptr<log_sink> new_sink)
+            {
+                flush();
+                std::lock_guard<std::mutex> lock(sink_mutex);
+                sink = new_sink;
+            }
+
+            void set_level(log_level level) { minimum_level = level; }
+            log_level get_level() const { return minimum_level; }
+            bool enabled(log_level level) const { return level >= minimum_level.load() && level != log_level::none; }
+
+            // When disabled, records are written to the sink on the calling thread.
+            void set_async(bool enable) { if (!enable) flush(); async = enable; }
+
+            // Only one of every n streamed chunks is logged.
+            void set_sample_rate(unsigned int n) { sample_rate = n > 0 ? n : 1; }
+
+            // Messages longer than this are cut short. Zero disables truncation.
+            void set_max_message_length(size_t length) { max_message_length = length; }
+
+            // JSON string values longer than this, such as base64-encoded images, are cut short. Zero disables truncation.
+            void set_max_string_length(size_t length) { max_string_length = length; }
+
+            size_t dropped() const { return dropped_records; }
+
+            void log(log_level level, const std::string& category, const char* data, size_t length)
+            {
+                if (!enabled(level)) return;
+
+                log_record record;
+                record.time = std::chrono::system_clock::now();
+                record.level = level;
+                record.category = category;
+                record.message = truncate(data, length);
+
+                if (!async) { std::lock_guard<std::mutex> lock(sink_mutex); if (sink) { sink->write(record); sink->flush(); } return; }
+
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                if (!worker.joinable() && !stopping) worker = std::thread(&logger::run, this);
+
+                if (count == ring.size()) { ++dropped_records; return; }
+
+                ring[(head + count) % ring.size()] = std::move(record);
+                ++count;
+                lock.unlock();
+                queue_not_empty.notify_one();
+            }
+
+            void log(log_level level, const std::string& category, const std::string& message) { log(level, category, message.data(), message.size()); }
+
+            void log_sampled(log_level level, const std::string& category, const char* data, size_t length)
+            {
+                if (sample_counter++ % sample_rate == 0) log(level, category, data, length);
+            }
+
+            // Blocks until every queued record has been written and the sink has been flushed.
+            void flush()
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                queue_drained.wait(lock, [this]{ return (count == 0 && !writing) || !worker.joinable(); });
+            }
+
+        private:
+
+            std::string truncate(const char* data, size_t length) const
+            {
+                std::string message;
+
+                if (max_string_length > 0) message = truncate_strings(data, length);
+                else message.assign(data, length);
+
+                if (max_message_length > 0 && message.size() > max_message_length)
+                {
+                    size_t cut = max_message_length;
+                    while (cut > 0 && (static_cast<unsigned char>(message[cut]) & 0xC0) == 0x80) --cut;
+                    size_t removed = message.size() - cut;
+                    message.resize(cut);
+                    message += "...[" + std::to_string(removed) + " bytes truncated]";
+                }
+
+                return message;
+            }
+
+            std::string truncate_strings(const char* data, size_t length) const
+            {
+                std::string output;
+                output.reserve(length);
+
+                bool in_string = false;
+                size_t kept = 0, skipped = 0, pending = 0;
+
+                for (size_t i = 0; i < length; ++i)
+                {
+                    char c = data[i];
+
+                    if (!in_string) { output += c; if (c == '"') { in_string = true; kept = 0; skipped = 0; pending = 0; } continue; }
+
+                    if (pending == 0 && c == '"')
+                    {
+                        if (skipped > 0) output += "...[" + std::to_string(skipped) + " bytes truncated]";
+                        output += c; in_string = false; continue;
+                    }
+
+                    // Escape sequences and multi-byte UTF-8 characters are kept or dropped as a whole.
+                    bool continuation = pending > 0 || (static_cast<unsigned char>(c) & 0xC0) == 0x80;
+                    if (pending > 0) pending = (pending == 1 && c == 'u') ? 4 : pending - 1;
+                    else if (c == '\\') pending = 1;
+
+                    if (skipped == 0 && (continuation || kept < max_string_length)) { output += c; if (!continuation) ++kept; }
+                    else ++skipped;
+                }
+
+                return output;
+            }
+
+            void run()
+            {
+                std::vector<log_record> batch;
+
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                while (true)
+                {
+                    queue_not_empty.wait(lock, [this]{ return count > 0 || stopping; });
+                    if (count == 0 && stopping) break;
+
+                    batch.clear();
+                    while (count > 0) { batch.push_back(std::move(ring[head])); head = (head + 1) % ring.size(); --count; }
+                    writing = true;
+                    lock.unlock();
+
+                    {
+                        std::lock_guard<std::mutex> sink_lock(sink_mutex);
+                        if (sink) { for (const log_record& record: batch) sink->write(record); sink->flush(); }
+                    }
+
+                    lock.lock();
+                    writing = false;
+                    if (count == 0) queue_drained.notify_all();
+                }
+                queue_drained.notify_all();
+            }
+
+            void stop()
             {
-                this->base64_sequence = base64_sequence; this->valid = valid;
+                {
+                    std::lock_guard<std::mutex> lock(queue_mutex);
+                    stopping = true;
+                }
+                queue_not_empty.notify_one();
+                if (worker.joinable()) worker.join();
             }
+
+            std::vector<log_record> ring;
+            size_t head = 0, count = 0;
+            bool writing = false, stopping = false;
+
+            std::mutex queue_mutex, sink_mutex;
+            std::condition_variable queue_not_empty, queue_drained;
+            std::thread worker;
+
+            std::shared_ptr<log_sink> sink;
+            std::atomic<log_level> minimum_level{log_level::debug};
+            std::atomic<bool> async{true};
+            std::atomic<unsigned int> sample_rate{1}, sample_counter{0};
+            std::atomic<size_t> max_message_length{0}, max_string_length{0}, dropped_records{0};
+    };
+
+    inline logger& get_logger() { static logger instance; return instance; }
+
+    static inline void set_log_sink(std::shared_ptr<log_sink> sink) { get_logger().set_sink(sink); }
+    static inline void set_log_level(log_level level) { get_logger().set_level(level); }
+
+    static inline void log_request(const std::string& request) { if (ollama::log_requests) get_logger().log(log_level::debug, "request", request); }
+    static inline void log_reply(const std::string& reply) { if (ollama::log_replies) get_logger().log(log_level::debug, "reply", reply); }
+    static inline void log_stream_reply(const char* data, size_t length) { if (ollama::log_replies) get_logger().log_sampled(log_level::debug, "reply", data, length); }
+
+    class image {
+        public:
+            image(std::string base64_sequence, bool valid = true): base64_sequence(std::move(base64_sequence)), valid(valid) {}
             ~image(){};
 
             static image from_file(const std::string& filepath)
@@ -34909,19 +35265,20 @@ namespace ollama
                 return image(macaron::Base64::Encode(file_contents), valid);
             }
 
-            static image from_base64_string(const std::string& base64_string)
+            static image from_base64_string(std::string base64_string)
             {
-                return image(base64_string);
+                return image(std::move(base64_string));
             }
 
-            const std::string as_base64_string() const
+            const std::string& as_base64_string() const
             {
                 return base64_sequence;
             }
 
             bool is_valid(){return valid;}
 
-            operator std::string() const { return base64_sequence; }
+            operator std::string() const& { return base64_sequence; }
+            operator std::string() && { return std::move(base64_sequence); }
 
             operator std::vector<ollama::image>() const { std::vector<ollama::image> images; images.push_back(*this); return images; }
             operator std::vector<std::string>() const { std::vector<std::string> images; images.push_back(*this); return images; }
@@ -34939,10 +35296,17 @@ namespace ollama
 
             }
             images(const std::initializer_list<ollama::image>& list) {
-                for (ollama::image value : list) {
-                    this->push_back(value);
+                this->reserve(list.size());
+                for (const ollama::image& value : list) {
+                    this->push_back(value.as_base64_string());
                 }
-            }        
+            }
+            images(std::vector<ollama::image>&& list) {
+                this->reserve(list.size());
+                for (ollama::image& value : list) {
+                    this->push_back(std::move(value));
+                }
+            }
             ~images(){};
             std::vector<std::string> to_strings()
             {
@@ -34972,10 +35336,172 @@ namespace ollama
 
     };
 
+    // Model parameters as typed fields rather than json keys, so that misspelled options fail to compile. Only the
+    // fields that have been set are sent. Converts to and from ollama::options wherever those are accepted.
+    struct model_options {
+
+        ollama::optional<int> seed, num_ctx, num_predict, num_keep, top_k, repeat_last_n, mirostat, num_batch, num_gpu, main_gpu, num_thread;
+        ollama::optional<double> temperature, top_p, min_p, typical_p, repeat_penalty, presence_penalty, frequency_penalty, mirostat_tau, mirostat_eta;
+        ollama::optional<bool> penalize_newline, use_mmap;
+        ollama::optional<std::vector<std::string>> stop;
+
+        // Appends the set fields as a JSON object. Keys are written in sorted order, matching the dump of the equivalent ollama::options.
+        void write(std::string& out) const
+        {
+            size_t start = out.size();
+            out += '{';
+            write_field(out, "frequency_penalty", frequency_penalty);
+            write_field(out, "main_gpu", main_gpu);
+            write_field(out, "min_p", min_p);
+            write_field(out, "mirostat", mirostat);
+            write_field(out, "mirostat_eta", mirostat_eta);
+            write_field(out, "mirostat_tau", mirostat_tau);
+            write_field(out, "num_batch", num_batch);
+            write_field(out, "num_ctx", num_ctx);
+            write_field(out, "num_gpu", num_gpu);
+            write_field(out, "num_keep", num_keep);
+            write_field(out, "num_predict", num_predict);
+            write_field(out, "num_thread", num_thread);
+            write_field(out, "penalize_newline", penalize_newline);
+            write_field(out, "presence_penalty", presence_penalty);
+            write_field(out, "repeat_last_n", repeat_last_n);
+            write_field(out, "repeat_penalty", repeat_penalty);
+            write_field(out, "seed", seed);
+            write_field(out, "stop", stop);
+            write_field(out, "temperature", temperature);
+            write_field(out, "top_k", top_k);
+            write_field(out, "top_p", top_p);
+            write_field(out, "typical_p", typical_p);
+            write_field(out, "use_mmap", use_mmap);
+
+            // Every field writes a leading comma; replace the first with the opening brace.
+            if (out.size() > start + 1) { out.erase(start, 1); out[start] = '{'; }
+            out += '}';
+        }
+
+        std::string dump() const { std::string out; write(out); return out; }
+
+        // Requests can take model_options directly, which writes them into the body without building ollama::options.
+        ollama::options to_options() const
+        {
+            ollama::options options;
+            json& values = static_cast<json&>(options)["options"];
+            set_field(values, "seed", seed); set_field(values, "num_ctx", num_ctx); set_field(values, "num_predict", num_predict);
+            set_field(values, "num_keep", num_keep); set_field(values, "top_k", top_k); set_field(values, "repeat_last_n", repeat_last_n);
+            set_field(values, "mirostat", mirostat); set_field(values, "num_batch", num_batch); set_field(values, "num_gpu", num_gpu);
+            set_field(values, "main_gpu", main_gpu); set_field(values, "num_thread", num_thread); set_field(values, "temperature", temperature);
+            set_field(values, "top_p", top_p); set_field(values, "min_p", min_p); set_field(values, "typical_p", typical_p);
+            set_field(values, "repeat_penalty", repeat_penalty); set_field(values, "presence_penalty", presence_penalty);
+            set_field(values, "frequency_penalty", frequency_penalty); set_field(values, "mirostat_tau", mirostat_tau);
+            set_field(values, "mirostat_eta", mirostat_eta); set_field(values, "penalize_newline", penalize_newline);
+            set_field(values, "use_mmap", use_mmap); set_field(values, "stop", stop);
+            return options;
+        }
+
+        operator ollama::options() const { return to_options(); }
+
+        // Reads the recognized fields from an ollama::options, or from a plain json object of option values.
+        static model_options from_options(const json& options)
+        {
+            const json& values = options.is_object() && options.contains("options") ? options["options"] : options;
+
+            model_options parsed;
+            if (!values.is_object()) return parsed;
+
+            read_field(values, "seed", parsed.seed);
+            read_field(values, "num_ctx", parsed.num_ctx);
+            read_field(values, "num_predict", parsed.num_predict);
+            read_field(values, "num_keep", parsed.num_keep);
+            read_field(values, "top_k", parsed.top_k);
+            read_field(values, "repeat_last_n", parsed.repeat_last_n);
+            read_field(values, "mirostat", parsed.mirostat);
+            read_field(values, "num_batch", parsed.num_batch);
+            read_field(values, "num_gpu", parsed.num_gpu);
+            read_field(values, "main_gpu", parsed.main_gpu);
+            read_field(values, "num_thread", parsed.num_thread);
+            read_field(values, "temperature", parsed.temperature);
+            read_field(values, "top_p", parsed.top_p);
+            read_field(values, "min_p", parsed.min_p);
+            read_field(values, "typical_p", parsed.typical_p);
+            read_field(values, "repeat_penalty", parsed.repeat_penalty);
+            read_field(values, "presence_penalty", parsed.presence_penalty);
+            read_field(values, "frequency_penalty", parsed.frequency_penalty);
+            read_field(values, "mirostat_tau", parsed.mirostat_tau);
+            read_field(values, "mirostat_eta", parsed.mirostat_eta);
+            read_field(values, "penalize_newline", parsed.penalize_newline);
+            read_field(values, "use_mmap", parsed.use_mmap);
+            read_field(values, "stop", parsed.stop);
+            return parsed;
+        }
+
+        private:
+
+            static void write_key(std::string& out, const char* key) { out += ",\""; out += key; out += "\":"; }
+
+            static void write_field(std::string& out, const char* key, const ollama::optional<int>& value)
+            {
+                if (!value.has_value()) return;
+                write_key(out, key);
+                out += std::to_string(*value);
+            }
+
+            static void write_field(std::string& out, const char* key, const ollama::optional<double>& value)
+            {
+                if (!value.has_value()) return;
+                write_key(out, key);
+                if (!std::isfinite(*value)) { out += "null"; return; }
+
+                // Use the json library's shortest round-trip formatting so the output matches a dump of the same value.
+                char buffer[64];
+                char* end = nlohmann::detail::to_chars(buffer, buffer + sizeof(buffer), *value);
+                out.append(buffer, end - buffer);
+            }
+
+            static void write_field(std::string& out, const char* key, const ollama::optional<bool>& value)
+            {
+                if (!value.has_value()) return;
+                write_key(out, key);
+                out += *value ? "true" : "false";
+            }
+
+            static void write_field(std::string& out, const char* key, const ollama::optional<std::vector<std::string>>& value)
+            {
+                if (!value.has_value()) return;
+                write_key(out, key);
+                out += json(*value).dump();
+            }
+
+            template<typename T>
+            static void set_field(json& values, const char* key, const ollama::optional<T>& field)
+            {
+                if (field.has_value()) values[key] = *field;
+            }
+
+            template<typename T>
+            static void read_field(const json& values, const char* key, ollama::optional<T>& field)
+            {
+                if (values.contains(key) && !values[key].is_null()) field = values[key].get<T>();
+            }
+    };
+
     class message: public json {
         public:
-            message(const std::string& role, const std::string& content, const std::vector<ollama::image>& images): json() { (*this)["role"] = role; (*this)["content"] = content; (*this)["images"] = images; }
-            message(const std::string& role, const std::string& content): json() { (*this)["role"] = role; (*this)["content"] = content; }           
+            message(std::string role, std::string content, const std::vector<ollama::image>& images): message(std::move(role), std::move(content))
+            {
+                json encoded = json::array();
+                encoded.get_ref<json::array_t&>().reserve(images.size());
+                for (const ollama::image& image: images) encoded.push_back(image.as_base64_string());
+                (*this)["images"] = std::move(encoded);
+            }
+            // Images passed as a temporary are moved into the message rather than copied.
+            message(std::string role, std::string content, std::vector<ollama::image>&& images): message(std::move(role), std::move(content))
+            {
+                json encoded = json::array();
+                encoded.get_ref<json::array_t&>().reserve(images.size());
+                for (ollama::image& image: images) encoded.push_back(std::string(std::move(image)));
+                (*this)["images"] = std::move(encoded);
+            }
+            message(std::string role, std::string content): json() { (*this)["role"] = std::move(role); (*this)["content"] = std::move(content); }
             message() : json() {}
             ~message() {}
 
@@ -34989,13 +35515,15 @@ namespace ollama
 
         public:
             messages(): std::vector<message>(0) {}            
-            messages(ollama::message message): messages() { this->push_back(message); }
+            messages(ollama::message message): messages() { this->push_back(std::move(message)); }
+            messages(std::vector<message> list): std::vector<message>(std::move(list)) {}
 
             messages(const std::initializer_list<message>& list) {
-                for (message value : list) {
+                this->reserve(list.size());
+                for (const message& value : list) {
                     this->push_back(value);
                 }
-            }        
+            }
             ~messages(){};
             const std::vector<std::string> to_strings() const
             {
@@ -35006,63 +35534,118 @@ namespace ollama
                 return strings;
             }        
         
-            const std::vector<json> to_json() const 
+            std::vector<json> to_json() const 
             { 
-                std::vector<json> output;  
+                std::vector<json> output;
+                output.reserve(this->size());
                 for (auto it = this->begin(); it != this->end(); ++it)
                     output.push_back(*it);
                 return output;
             }
 
+            // Builds the json array for a request directly. Called on a temporary, the messages are moved into it.
+            json to_json_array() const&
+            {
+                json array = json::array();
+                array.get_ref<json::array_t&>().reserve(this->size());
+                for (auto it = this->begin(); it != this->end(); ++it) array.push_back(static_cast<const json&>(*it));
+                return array;
+            }
+
+            json to_json_array() &&
+            {
+                json array = json::array();
+                array.get_ref<json::array_t&>().reserve(this->size());
+                for (auto it = this->begin(); it != this->end(); ++it) array.push_back(std::move(static_cast<json&>(*it)));
+                this->clear();
+                return array;
+            }
+
             operator std::vector<json>() const {return std::vector<json>();}
             operator std::vector<std::string>() const { return this->to_strings(); }    
         
     };
 
+    // The definition of a function the model may call. The parameters are described by a JSON schema.
+    class tool: public json {
+
+        public:
+
+            tool(const std::string& name, const std::string& description, const json& parameters=json::object({{"type", "object"}, {"properties", json::object()}})): json()
+            {
+                (*this)["type"] = "function";
+                (*this)["function"]["name"] = name;
+                (*this)["function"]["description"] = description;
+                (*this)["function"]["parameters"] = parameters;
+            }
+
+            std::string name() const { return (*this)["function"]["name"]; }
+    };
+
+    class tools: public std::vector<tool> {
+
+        public:
+
+            tools() {}
+            tools(const std::initializer_list<tool>& list): std::vector<tool>(list) {}
+            tools(std::vector<tool> list): std::vector<tool>(std::move(list)) {}
+
+            json to_json_array() const
+            {
+                json array = json::array();
+                for (const tool& definition: *this) array.push_back(static_cast<const json&>(definition));
+                return array;
+            }
+    };
+
+    // Whether a format argument asks for structured output. Null and an empty string leave the format unset.
+    inline bool format_requested(const json& format) { return format!=nullptr && format!=""; }
+
     class request: public json {
 
         public:
 
             // Create a request for a generation.
-            request(const std::string& model,const std::string& prompt, const json& options=nullptr, bool stream=false, const std::vector<std::string>& images=std::vector<std::string>()): request()
+            request(std::string model, std::string prompt, const json& options=nullptr, bool stream=false, std::vector<std::string> images=std::vector<std::string>()): request()
             {   
-                (*this)["model"] = model;
-                (*this)["prompt"] = prompt;
+                (*this)["model"] = std::move(model);
+                (*this)["prompt"] = std::move(prompt);
                 (*this)["stream"] = stream;
 
                 if (options!=nullptr) (*this)["options"] = options["options"];
-                if (!images.empty()) (*this)["images"] = images;
+                if (!images.empty()) (*this)["images"] = std::move(images);
 
                 type = message_type::generation;
             }
 
-            // Create a request for a chat completion.
-            request(const std::string& model, const ollama::messages& messages, const json& options=nullptr, bool stream=false, const std::string& format="json", const std::string& keep_alive_duration="5m"): request()
+            // Create a request for a chat completion. The format may be "json" or a JSON schema for structured output; null or an empty string leaves it unset.
+            // Messages are taken by value so that a temporary history is moved into the request rather than copied.
+            request(std::string model, ollama::messages messages, const json& options=nullptr, bool stream=false, const json& format=nullptr, const std::string& keep_alive_duration="5m"): request()
             {
-                (*this)["model"] = model;
-                (*this)["messages"] = messages.to_json();
+                (*this)["model"] = std::move(model);
+                (*this)["messages"] = std::move(messages).to_json_array();
                 (*this)["stream"] = stream;
 
                 if (options!=nullptr) (*this)["options"] = options["options"];
-                (void)format; //(*this)["format"] = format; // Commented out as providing the format causes issues with some models.
+                if (format_requested(format)) (*this)["format"] = format;
                 (*this)["keep_alive"] = keep_alive_duration;
                 type = message_type::chat;
 
             }
             // Request for a chat completion with a single message
-            request(const std::string& model, const ollama::message& message, const json& options=nullptr, bool stream=false, const std::string& format="json", const std::string& keep_alive_duration="5m") :request(model, messages(message), options, stream, format, keep_alive_duration ){}
+            request(std::string model, ollama::message message, const json& options=nullptr, bool stream=false, const json& format=nullptr, const std::string& keep_alive_duration="5m") :request(std::move(model), messages(std::move(message)), options, stream, format, keep_alive_duration ){}
            
             request(message_type type): request() { this->type = type; }
 
             request(): json() {}
             ~request(){};
 
-            static ollama::request from_embedding(const std::string& model, const std::string& input, const json& options=nullptr, bool truncate=true, const std::string& keep_alive_duration="5m")
+            static ollama::request from_embedding(std::string model, std::string input, const json& options=nullptr, bool truncate=true, const std::string& keep_alive_duration="5m")
             {
                 ollama::request request(message_type::embedding);
 
-                request["model"] = model;
-                request["input"] = input;
+                request["model"] = std::move(model);
+                request["input"] = std::move(input);
                 if (options!=nullptr) request["options"] = options["options"];
                 request["truncate"] = truncate;
                 request["keep_alive"] = keep_alive_duration;
@@ -35072,93 +35655,4583 @@ namespace ollama
 
             const message_type& get_type() const { return type; }
 
+            // Writes a generation request with the same bytes as the equivalent ollama::request would dump, with the typed options written in place.
+            static void write_generation(std::string& out, const std::string& model, std::string prompt, const ollama::model_options& options, bool stream, const std::vector<std::string>& images=std::vector<std::string>())
+            {
+                out.reserve(out.size() + model.size() + prompt.size() + 256);
+
+                out += '{';
+                if (!images.empty()) { out += "\"images\":"; out += json(images).dump(); out += ','; }
+                out += "\"model\":"; out += json(model).dump();
+                out += ",\"options\":"; options.write(out);
+                out += ",\"prompt\":"; out += json(std::move(prompt)).dump();
+                out += stream ? ",\"stream\":true" : ",\"stream\":false";
+                out += '}';
+            }
+
         private:
 
         message_type type;
     };
 
-    class response {
-
+    // A monotonic arena for short-lived allocations. Memory is handed out by bumping a pointer and is only reclaimed
+    // all at once by reset(), which keeps the largest block so that a steady workload stops allocating altogether.
+    // When std::pmr is available the arena is also a std::pmr::memory_resource.
+    class memory_arena
+    #ifdef OLLAMA_HAS_PMR
+        : public std::pmr::memory_resource
+    #endif
+    {
         public:
 
-            response(const std::string& json_string, message_type type=message_type::generation): type(type)
+            explicit memory_arena(size_t initial_size=4096): next_block_size(initial_size > 64 ? initial_size : 64) {}
+            ~memory_arena() { for (block& allocated: blocks) ::operator delete(allocated.data); }
+
+            memory_arena(const memory_arena&) = delete;
+            memory_arena& operator=(const memory_arena&) = delete;
+
+            #ifndef OLLAMA_HAS_PMR
+            void* allocate(size_t bytes, size_t alignment=alignof(std::max_align_t)) { return bump(bytes, alignment); }
+            void deallocate(void*, size_t, size_t=alignof(std::max_align_t)) {}
+            #endif
+
+            // Releases everything allocated since the last reset.
+            void reset()
             {
-                this->json_string = json_string;
-                try 
+                if (blocks.size() > 1)
                 {
-                    json_data = json::parse(json_string); 
-                    
-                    if (type==message_type::generation && json_data.contains("response")) simple_string=json_data["response"].get<std::string>(); 
-                    else
-                    if (type==message_type::embedding && json_data.contains("embeddings")) simple_string=json_data["embeddings"].get<std::string>();
-                    else
-                    if (type==message_type::chat && json_data.contains("message")) simple_string=json_data["message"]["content"].get<std::string>();
-                                         
-                    if ( json_data.contains("error") ) error_string =json_data["error"].get<std::string>();
+                    // Blocks grow geometrically, so the last one is the largest.
+                    for (size_t i = 0; i + 1 < blocks.size(); ++i) ::operator delete(blocks[i].data);
+                    blocks.erase(blocks.begin(), blocks.end() - 1);
                 }
-                catch(...) { if (ollama::use_exceptions) throw ollama::invalid_json_exception("Unable to parse JSON string:"+this->json_string); valid = false; }
+                offset = 0;
+                used = 0;
             }
-            
-            response() {json_string = ""; valid = false;}
-            ~response(){};
-
-            bool is_valid() const {return valid;};
 
-            const std::string& as_json_string() const
+            bool owns(const void* pointer) const
             {
-                return json_string;
+                const char* address = static_cast<const char*>(pointer);
+                for (const block& allocated: blocks) if (address >= allocated.data && address < allocated.data + allocated.size) return true;
+                return false;
             }
 
-            const json& as_json() const
-            {
-                return json_data;                
-            }
+            size_t bytes_used() const { return used; }
+            size_t capacity() const { size_t total = 0; for (const block& allocated: blocks) total += allocated.size; return total; }
 
-            const std::string& as_simple_string() const
-            {
-                return simple_string;               
-            }
+            // The arena used by arena_allocator on the calling thread, if any.
+            static memory_arena*& current() { static thread_local memory_arena* arena = nullptr; return arena; }
 
-            bool has_error() const
-            {
-                if ( json_data.contains("error") ) return true;
-                return false;                
-            }
+        private:
 
-            const std::string& get_error() const
+            #ifdef OLLAMA_HAS_PMR
+            void* do_allocate(size_t bytes, size_t alignment) override { return bump(bytes, alignment); }
+            void do_deallocate(void*, size_t, size_t) override {}
+            bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+            #endif
+
+            void* bump(size_t bytes, size_t alignment)
             {
-                return error_string;
+                if (!blocks.empty())
+                {
+                    size_t aligned = (offset + alignment - 1) & ~(alignment - 1);
+                    if (aligned + bytes <= blocks.back().size) { offset = aligned + bytes; used += bytes; return blocks.back().data + aligned; }
+                }
+
+                size_t size = next_block_size;
+                while (size < bytes + alignment) size *= 2;
+                next_block_size = size * 2;
+
+                block allocated;
+                allocated.data = static_cast<char*>(::operator new(size));
+                allocated.size = size;
+                blocks.push_back(allocated);
+
+                size_t aligned = (reinterpret_cast<uintptr_t>(allocated.data) % alignment) ? alignment - reinterpret_cast<uintptr_t>(allocated.data) % alignment : 0;
+                offset = aligned + bytes;
+                used += bytes;
+                return allocated.data + aligned;
             }
 
-            friend std::ostream& operator<<(std::ostream& os, const ollama::response& response) { os << response.as_simple_string(); return os; }
+            struct block { char* data; size_t size; };
+
+            std::vector<block> blocks;
+            size_t offset = 0, used = 0, next_block_size;
+    };
+
+    // Makes an arena current on this thread for the lifetime of the scope.
+    class arena_scope {
+        public:
+            arena_scope(memory_arena& arena): previous(memory_arena::current()) { memory_arena::current() = &arena; }
+            ~arena_scope() { memory_arena::current() = previous; }
+
+            arena_scope(const arena_scope&) = delete;
+            arena_scope& operator=(const arena_scope&) = delete;
+
+        private:
+            memory_arena* previous;
+    };
+
+    // Allocates from the thread's current arena, or from the heap when there is none. Memory from an arena is
+    // released with the arena, so containers using this allocator must not outlive the scope they were filled in.
+    template<typename T>
+    struct arena_allocator {
+        typedef T value_type;
+
+        arena_allocator() {}
+        template<typename U> arena_allocator(const arena_allocator<U>&) {}
+
+        T* allocate(size_t count)
+        {
+            memory_arena* arena = memory_arena::current();
+            if (arena) return static_cast<T*>(arena->allocate(count * sizeof(T), alignof(T)));
+            return static_cast<T*>(::operator new(count * sizeof(T)));
+        }
+
+        void deallocate(T* pointer, size_t)
+        {
+            memory_arena* arena = memory_arena::current();
+            if (arena && arena->owns(pointer)) return;
+            ::operator delete(pointer);
+        }
+    };
+
+    template<typename T, typename U> bool operator==(const arena_allocator<T>&, const arena_allocator<U>&) { return true; }
+    template<typename T, typename U> bool operator!=(const arena_allocator<T>&, const arena_allocator<U>&) { return false; }
+
+    using arena_string = std::basic_string<char, std::char_traits<char>, arena_allocator<char>>;
+
+    // A json type whose objects, arrays and strings are allocated from the current arena.
+    using arena_json = nlohmann::basic_json<std::map, std::vector, arena_string, bool, std::int64_t, std::uint64_t, double, arena_allocator>;
+
+    // Reads a reply from /api/embed without building a json document. Each number of the embeddings array is converted
+    // straight to a float and passed to an output, which receives value(float) for each number and row() at the end of
+    // each embedding. Numbers with at most 19 significant digits and a power of ten within 10^22 of them, which covers the
+    // float32 values Ollama sends, are converted exactly in double precision (Clinger's fast path); others go through
+    // strtod. Either way the float is the one nlohmann::json would give, since it also rounds through a double.
+    class embedding_reader {
+
+        public:
+
+            embedding_reader(const char* data, size_t length): position(data), end(data + length) {}
+
+            // other, when given, is called with the name and the raw JSON text of each other member of the reply.
+            template<typename Output>
+            bool read(Output& output, const std::function<void(const std::string&, const char*, size_t)>& other=nullptr)
+            {
+                bool found = false;
+                skip_space();
+                if (!take('{')) return false;
+                skip_space();
+                if (!take('}'))
+                {
+                    do
+                    {
+                        std::string key;
+                        skip_space();
+                        if (!read_string(key)) return false;
+                        skip_space();
+                        if (!take(':')) return false;
+                        skip_space();
+
+                        if (key == "embeddings")
+                        {
+                            if (found || !read_rows(output)) return false;
+                            found = true;
+                        }
+                        else
+                        {
+                            const char* start = position;
+                            if (!skip_value(0)) return false;
+                            if (other) other(key, start, static_cast<size_t>(position - start));
+                        }
+                        skip_space();
+                    }
+                    while (take(','));
+                    if (!take('}')) return false;
+                }
+                skip_space();
+                return found && position == end;
+            }
+
+            // Checks that the reply is valid and reports whether it has an error member, without converting any numbers.
+            bool scan(bool& has_error)
+            {
+                struct ignore { bool value(float) { return true; } bool row() { return true; } } output;
+                has_error = false;
+                convert = false;
+                bool valid = read(output, [&has_error](const std::string& key, const char*, size_t) { if (key == "error") has_error = true; });
+                return valid || has_error;
+            }
+
+            // Converts one JSON number at the current position.
+            bool read_number(float& value)
+            {
+                static const double powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+                // Magnitudes from halfway between the largest float and 2^128 upwards round to infinity.
+                static const double overflow = 340282356779733661637539395458142568448.0;
+
+                // Find the digits first, then convert them.
+                bool negative = take('-');
+                const char* integer = position;
+                while (position != end && is_digit(*position)) ++position;
+                const char* integer_end = position;
+                if (integer_end == integer || (*integer == '0' && integer_end - integer > 1)) return false;
+
+                const char* fraction = position;
+                const char* fraction_end = position;
+                if (take('.'))
+                {
+                    fraction = position;
+                    while (position != end && is_digit(*position)) ++position;
+                    fraction_end = position;
+                    if (fraction_end == fraction) return false;
+                }
+
+                int exponent = 0;
+                if (position != end && (*position == 'e' || *position == 'E'))
+                {
+                    ++position;
+                    bool negative_exponent = take('-');
+                    if (!negative_exponent) take('+');
+                    if (position == end || !is_digit(*position)) return false;
+                    for (; position != end && is_digit(*position); ++position) if (exponent < 100000) exponent = exponent * 10 + (*position - '0');
+                    if (negative_exponent) exponent = -exponent;
+                }
+                if (!convert) return true;
+
+                // Up to 19 significant digits fit in the mantissa. Later integer digits scale it, and later fraction digits
+                // are dropped, which makes the conversion inexact unless they are zeros.
+                uint64_t mantissa = 0;
+                int significant = 0;
+                bool truncated = false;
+                for (const char* digit = integer; digit != integer_end; ++digit)
+                {
+                    if (significant < 19) { mantissa = mantissa * 10 + static_cast<uint64_t>(*digit - '0'); if (mantissa != 0) ++significant; }
+                    else { ++exponent; truncated |= *digit != '0'; }
+                }
+                for (const char* digit = fraction; digit != fraction_end; ++digit)
+                {
+                    if (significant < 19) { mantissa = mantissa * 10 + static_cast<uint64_t>(*digit - '0'); if (mantissa != 0) ++significant; --exponent; }
+                    else truncated |= *digit != '0';
+                }
+
+                double result;
+                if (mantissa == 0 && !truncated) result = 0.0;
+                else if (!truncated && mantissa <= (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22)
+                    result = exponent < 0 ? static_cast<double>(mantissa) / powers[-exponent] : static_cast<double>(mantissa) * powers[exponent];
+                else
+                {
+                    // strtod reads the decimal point of the current locale, so the point is swapped for it as nlohmann::json does.
+                    std::string text(integer, position);
+                    char point = *std::localeconv()->decimal_point;
+                    if (point != '.') std::replace(text.begin(), text.end(), '.', point);
+                    result = std::strtod(text.c_str(), nullptr);
+                }
+                if (negative) result = -result;
+
+                if (result >= overflow) value = std::numeric_limits<float>::infinity();
+                else if (result <= -overflow) value = -std::numeric_limits<float>::infinity();
+                else value = static_cast<float>(result);
+                return true;
+            }
+
+        private:
+
+            static bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+            bool take(char c) { if (position != end && *position == c) { ++position; return true; } return false; }
+
+            void skip_space() { while (position != end && (*position == ' ' || *position == '\n' || *position == '\r' || *position == '\t')) ++position; }
+
+            template<typename Output>
+            bool read_rows(Output& output)
+            {
+                if (!take('[')) return false;
+                skip_space();
+                if (take(']')) return true;
+                do
+                {
+                    skip_space();
+                    if (!take('[')) return false;
+                    skip_space();
+                    if (!take(']'))
+                    {
+                        do
+                        {
+                            float value;
+                            skip_space();
+                            if (!read_number(value) || !output.value(value)) return false;
+                            skip_space();
+                        }
+                        while (take(','));
+                        if (!take(']')) return false;
+                    }
+                    if (!output.row()) return false;
+                    skip_space();
+                }
+                while (take(','));
+                return take(']');
+            }
+
+            // Reads a string, decoding its escapes. Characters escaped with \u are replaced by '?', which is enough for names.
+            bool read_string(std::string& text)
+            {
+                if (!take('"')) return false;
+                while (position != end && *position != '"')
+                {
+                    if (static_cast<unsigned char>(*position) < 0x20) return false;
+                    if (*position != '\\') { text += *position++; continue; }
+                    if (++position == end) return false;
+                    switch (*position++)
+                    {
+                        case '"': text += '"'; break;
+                        case '\\': text += '\\'; break;
+                        case '/': text += '/'; break;
+                        case 'b': text += '\b'; break;
+                        case 'f': text += '\f'; break;
+                        case 'n': text += '\n'; break;
+                        case 'r': text += '\r'; break;
+                        case 't': text += '\t'; break;
+                        case 'u':
+                            for (int i = 0; i < 4; ++i, ++position) if (position == end || !std::isxdigit(static_cast<unsigned char>(*position))) return false;
+                            text += '?';
+                            break;
+                        default: return false;
+                    }
+                }
+                return take('"');
+            }
+
+            bool skip_value(int depth)
+            {
+                if (position == end || depth > 256) return false;
+                char c = *position;
+                if (c == '"') { std::string ignored; return read_string(ignored); }
+                if (c == '-' || is_digit(c)) { float ignored; return read_number(ignored); }
+                if (c == '{' || c == '[')
+                {
+                    char close = c == '{' ? '}' : ']';
+                    ++position;
+                    skip_space();
+                    if (take(close)) return true;
+                    do
+                    {
+                        skip_space();
+                        if (c == '{')
+                        {
+                            std::string key;
+                            if (!read_string(key)) return false;
+                            skip_space();
+                            if (!take(':')) return false;
+                            skip_space();
+                        }
+                        if (!skip_value(depth + 1)) return false;
+                        skip_space();
+                    }
+                    while (take(','));
+                    return take(close);
+                }
+                for (const char* literal: {"true", "false", "null"})
+                {
+                    size_t length = std::strlen(literal);
+                    if (static_cast<size_t>(end - position) >= length && std::memcmp(position, literal, length) == 0) { position += length; return true; }
+                }
+                return false;
+            }
+
+            const char* position;
+            const char* end;
+            bool convert = true;
+    };
+
+    // Decodes the embeddings of a reply from /api/embed into a matrix with a row for each embedding. Returns false if the
+    // reply is not valid JSON, has no embeddings, or has embeddings of different lengths.
+    // Other members of the reply can be read with other, as for embedding_reader::read.
+    inline bool decode_embeddings(const char* data, size_t length, std::vector<float>& values, size_t& dimensions, const std::function<void(const std::string&, const char*, size_t)>& other=nullptr)
+    {
+        struct matrix {
+            std::vector<float>& values;
+            size_t& dimensions;
+            size_t row_start, count;
+            bool value(float v) { values.push_back(v); return true; }
+            bool row()
+            {
+                size_t size = values.size() - row_start;
+                if (count++ == 0) dimensions = size;
+                else if (size != dimensions) return false;
+                row_start = values.size();
+                return true;
+            }
+        } output = {values, dimensions, 0, 0};
+
+        values.clear();
+        dimensions = 0;
+        embedding_reader reader(data, length);
+        return reader.read(output, other);
+    }
+
+    // Decodes the embeddings straight into a caller's buffer, failing if they need more than capacity floats.
+    inline bool decode_embeddings(const char* data, size_t length, float* values, size_t capacity, size_t& count, size_t& dimensions)
+    {
+        struct buffer {
+            float* values;
+            size_t capacity, written, row_start, count, dimensions;
+            bool value(float v) { if (written == capacity) return false; values[written++] = v; return true; }
+            bool row()
+            {
+                size_t size = written - row_start;
+                if (count == 0) dimensions = size;
+                else if (size != dimensions) return false;
+                row_start = written;
+                ++count;
+                return true;
+            }
+        } output = {values, capacity, 0, 0, 0, 0};
+
+        embedding_reader reader(data, length);
+        if (!reader.read(output)) return false;
+        count = output.count;
+        dimensions = output.dimensions;
+        return true;
+    }
+
+    class response {
+
+        public:
+
+            response(std::string json_string, message_type type=message_type::generation): json_string(std::move(json_string)), type(type), valid(true)
+            {
+                try 
+                {
+                    // Replies with embeddings are mostly numbers, so they are only checked here, and the json returned by
+                    // as_json() is built on first use. get_embeddings() reads them without it.
+                    bool has_error = false;
+                    if (type == message_type::embedding && embedding_reader(this->json_string.data(), this->json_string.size()).scan(has_error) && !has_error) { json_parsed.store(false, std::memory_order_relaxed); return; }
+
+                    json_data = json::parse(this->json_string); 
+                    extract(json_data);
+                }
+                catch(...) { if (ollama::use_exceptions) throw ollama::invalid_json_exception("Unable to parse JSON string:"+this->json_string); valid = false; }
+            }
+            
+            response() {json_string = ""; valid = false;}
+            ~response(){};
+
+            // The json of a response may be built lazily by a const accessor, so copies take the same lock as as_json().
+            response(const response& other) { *this = other; }
+            response(response&& other) { *this = std::move(other); }
+
+            response& operator=(const response& other)
+            {
+                if (this == &other) return *this;
+                std::lock_guard<std::mutex> lock(parse_mutex(&other));
+                json_string = other.json_string; simple_string = other.simple_string; error_string = other.error_string;
+                json_data = other.json_data;
+                json_parsed.store(other.json_parsed.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                copy_flags(other);
+                return *this;
+            }
+
+            response& operator=(response&& other)
+            {
+                if (this == &other) return *this;
+                json_string = std::move(other.json_string); simple_string = std::move(other.simple_string); error_string = std::move(other.error_string);
+                json_data = std::move(other.json_data);
+                json_parsed.store(other.json_parsed.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                copy_flags(other);
+                return *this;
+            }
+
+            // Replaces the contents of this response with a new reply, reusing its buffers. When an arena is given the reply
+            // is parsed into the arena, which is reset afterwards, and the json returned by as_json() is only built on first use.
+            // This is how streamed tokens are parsed, so that a steady stream does not allocate per token.
+            bool assign(const char* data, size_t length, message_type type=message_type::generation, memory_arena* arena=nullptr)
+            {
+                json_string.assign(data, length);
+                this->type = type;
+                simple_string.clear();
+                error_string.clear();
+                error_present = false;
+                done = false;
+                tool_calls_present = false;
+                valid = true;
+
+                try
+                {
+                    if (arena)
+                    {
+                        {
+                            arena_scope scope(*arena);
+                            arena_json parsed = arena_json::parse(json_string.data(), json_string.data() + json_string.size());
+                            extract(parsed);
+                        }
+                        arena->reset();
+                        json_parsed.store(false, std::memory_order_relaxed);
+                    }
+                    else
+                    {
+                        json_data = json::parse(json_string);
+                        json_parsed.store(true, std::memory_order_relaxed);
+                        extract(json_data);
+                    }
+                }
+                catch(...)
+                {
+                    if (arena) arena->reset();
+                    json_data = nullptr; json_parsed.store(true, std::memory_order_relaxed);
+                    if (ollama::use_exceptions) throw ollama::invalid_json_exception("Unable to parse JSON string:"+this->json_string);
+                    valid = false;
+                }
+
+                return valid;
+            }
+
+            bool is_valid() const {return valid;};
+
+            const std::string& as_json_string() const
+            {
+                return json_string;
+            }
+
+            // Streamed tokens build their json here on first use, so a callback which only needs the text, is_done() or
+            // has_tool_calls() should use those instead. Concurrent calls on the same response are safe.
+            const json& as_json() const
+            {
+                if (!json_parsed.load(std::memory_order_acquire))
+                {
+                    std::lock_guard<std::mutex> lock(parse_mutex(this));
+                    if (!json_parsed.load(std::memory_order_relaxed))
+                    {
+                        try { json_data = json::parse(json_string); } catch(...) { json_data = nullptr; }
+                        json_parsed.store(true, std::memory_order_release);
+                    }
+                }
+                return json_data;                
+            }
+
+            const std::string& as_simple_string() const
+            {
+                return simple_string;               
+            }
+
+            bool has_error() const
+            {
+                return error_present;
+            }
+
+            // Whether this is the final reply of a generation or chat.
+            bool is_done() const { return done; }
+
+            // Whether the message of a chat reply contains tool calls.
+            bool has_tool_calls() const { return tool_calls_present; }
+
+            // The embeddings of a reply from generate_embeddings, as a matrix with a row for each embedding. These are read
+            // straight from the reply, which is much faster than converting the json returned by as_json().
+            bool get_embeddings(std::vector<float>& values, size_t& dimensions) const
+            {
+                return decode_embeddings(json_string.data(), json_string.size(), values, dimensions);
+            }
+
+            bool get_embeddings(float* values, size_t capacity, size_t& count, size_t& dimensions) const
+            {
+                return decode_embeddings(json_string.data(), json_string.size(), values, capacity, count, dimensions);
+            }
+
+            const std::string& get_error() const
+            {
+                return error_string;
+            }
+
+            friend std::ostream& operator<<(std::ostream& os, const ollama::response& response) { os << response.as_simple_string(); return os; }
 
             const message_type& get_type() const
             {
-                return type;
+                return type;
+            }
+
+            //operator std::string() const { return this->as_simple_string(); }
+            operator std::__cxx11::basic_string<char>() const { return this->as_simple_string(); }
+            //const operator std::string() const { return this->as_simple_string(); }           
+
+
+        private:
+
+        // Reads the fields used by the accessors. Shared by the json and arena_json parsing paths.
+        template<typename Json>
+        void extract(const Json& data)
+        {
+            typename Json::const_iterator field;
+
+            if (type==message_type::generation && (field = data.find("response")) != data.end()) copy_string(*field, simple_string);
+            else
+            if (type==message_type::chat && (field = data.find("message")) != data.end() && field->is_object())
+            {
+                typename Json::const_iterator content = field->find("content");
+                if (content != field->end()) copy_string(*content, simple_string);
+                tool_calls_present = field->find("tool_calls") != field->end();
+            }
+
+            if ((field = data.find("done")) != data.end() && field->is_boolean()) done = field->template get<bool>();
+            if ((field = data.find("error")) != data.end()) { error_present = true; copy_string(*field, error_string); }
+        }
+
+        void copy_flags(const response& other) { error_present = other.error_present; done = other.done; tool_calls_present = other.tool_calls_present; type = other.type; valid = other.valid; }
+
+        static std::mutex& parse_mutex(const response* instance)
+        {
+            static std::mutex mutexes[16];
+            return mutexes[(reinterpret_cast<uintptr_t>(instance) / sizeof(response)) % 16];
+        }
+
+        template<typename Json>
+        static void copy_string(const Json& value, std::string& out)
+        {
+            if (!value.is_string()) throw ollama::invalid_json_exception("Expected a string value.");
+            const typename Json::string_t& text = value.template get_ref<const typename Json::string_t&>();
+            out.assign(text.data(), text.size());
+        }
+
+        std::string json_string;
+        std::string simple_string;
+        std::string error_string;
+
+        mutable json json_data;
+        mutable std::atomic<bool> json_parsed{true};
+        bool error_present = false, done = false, tool_calls_present = false;
+        message_type type = message_type::generation;
+        bool valid = false;
+    };
+
+    // The messages of a chat history, each serialized once when it is added and kept as the contents of a JSON array.
+    class serialized_messages {
+
+        public:
+
+            void push_back(const json& message)
+            {
+                if (!offsets.empty()) text += ',';
+                offsets.push_back(text.size());
+                text += message.dump();
+            }
+
+            // Removes the messages in [first, last). Only the bytes of the following messages are moved; nothing is re-serialized.
+            void erase(size_t first, size_t last)
+            {
+                if (last > offsets.size()) last = offsets.size();
+                if (first >= last) return;
+
+                // Remove the comma before the range, or the one after it when erasing from the front.
+                size_t begin = first == 0 ? 0 : offsets[first] - 1;
+                size_t end = last == offsets.size() ? text.size() : (first == 0 ? offsets[last] : offsets[last] - 1);
+
+                text.erase(begin, end - begin);
+                for (size_t i = last; i < offsets.size(); ++i) offsets[i] -= end - begin;
+                offsets.erase(offsets.begin() + first, offsets.begin() + last);
+            }
+
+            void pop_front(size_t count=1) { erase(0, count); }
+            void clear() { text.clear(); offsets.clear(); }
+
+            size_t size() const { return offsets.size(); }
+            bool empty() const { return offsets.empty(); }
+            size_t bytes() const { return text.size() + 2; }
+
+            // Appends the history to out as a JSON array.
+            void write(std::string& out) const { out += '['; out += text; out += ']'; }
+
+        private:
+
+            std::string text;
+            std::vector<size_t> offsets;
+    };
+
+    // Builds chat requests for a growing conversation without re-serializing its history. Each message is serialized
+    // once when it is added, so the cost of a request grows with the new messages rather than the whole conversation.
+    class chat_request_builder {
+
+        public:
+
+            chat_request_builder(const std::string& model, const json& options=nullptr, const std::string& keep_alive_duration="5m")
+            {
+                set_model(model);
+                set_options(options);
+                set_keep_alive(keep_alive_duration);
+            }
+
+            chat_request_builder(const std::string& model, const ollama::model_options& options, const std::string& keep_alive_duration="5m")
+            {
+                set_model(model);
+                set_options(options);
+                set_keep_alive(keep_alive_duration);
+            }
+
+            void set_model(const std::string& model) { model_json = json(model).dump(); }
+            void set_options(const json& options) { options_json = options!=nullptr ? options["options"].dump() : ""; }
+            void set_options(const ollama::model_options& options) { options_json.clear(); options.write(options_json); }
+            void set_keep_alive(const std::string& keep_alive_duration) { keep_alive_json = json(keep_alive_duration).dump(); }
+            void set_format(const json& format) { format_json = format_requested(format) ? format.dump() : ""; }
+            void set_tools(const ollama::tools& tools) { tools_json = tools.empty() ? "" : tools.to_json_array().dump(); }
+
+            void add(const ollama::message& message) { history.push_back(message); }
+            void add(const std::string& role, const std::string& content) { history.push_back(ollama::message(role, content)); }
+
+            // Adds the assistant's reply from a chat response.
+            void add(const ollama::response& response)
+            {
+                const json& data = response.as_json();
+                if (data.contains("message")) history.push_back(data["message"]);
+            }
+
+            // Drops the oldest messages from the history.
+            void pop_front(size_t count=1) { history.pop_front(count); }
+            void clear() { history.clear(); }
+            size_t size() const { return history.size(); }
+
+            ollama::serialized_messages& messages() { return history; }
+            const ollama::serialized_messages& messages() const { return history; }
+
+            std::string dump(bool stream=false) const
+            {
+                std::string request_string;
+                write(request_string, stream);
+                return request_string;
+            }
+
+            void write(std::string& out, bool stream) const { write_request(out, model_json, history, options_json, keep_alive_json, stream, format_json, tools_json); }
+
+            // Writes a chat request with the same bytes as the equivalent ollama::request would dump. Fields are already serialized JSON values.
+            static void write_request(std::string& out, const std::string& model_json, const ollama::serialized_messages& messages, const std::string& options_json, const std::string& keep_alive_json, bool stream, const std::string& format_json="", const std::string& tools_json="")
+            {
+                out.reserve(out.size() + messages.bytes() + model_json.size() + options_json.size() + keep_alive_json.size() + format_json.size() + tools_json.size() + 64);
+
+                out += '{';
+                if (!format_json.empty()) { out += "\"format\":"; out += format_json; out += ','; }
+                out += "\"keep_alive\":"; out += keep_alive_json;
+                out += ",\"messages\":"; messages.write(out);
+                out += ",\"model\":"; out += model_json;
+                if (!options_json.empty()) { out += ",\"options\":"; out += options_json; }
+                out += stream ? ",\"stream\":true" : ",\"stream\":false";
+                if (!tools_json.empty()) { out += ",\"tools\":"; out += tools_json; }
+                out += '}';
+            }
+
+        private:
+
+            std::string model_json, options_json, keep_alive_json, format_json, tools_json;
+            ollama::serialized_messages history;
+    };
+
+    // Estimates the number of tokens in a string. Most tokenizers average roughly four characters per token for English text.
+    inline size_t estimate_tokens(const std::string& text) { return (text.size() + 3) / 4; }
+
+    // A chat history which keeps itself within a token budget. System messages are pinned and always kept, while the
+    // oldest remaining turns are dropped, or optionally summarized, once the history no longer fits within num_ctx.
+    class conversation {
+
+        public:
+
+            conversation(size_t context_size=2048, size_t reply_reserve=512): context_size(context_size), reply_reserve(reply_reserve) {}
+
+            // Number of tokens in the model's context window, matching the num_ctx option.
+            void set_context_size(size_t tokens) { context_size = tokens; enforce_budget(); }
+
+            // Tokens kept free for the model's reply.
+            void set_reply_reserve(size_t tokens) { reply_reserve = tokens; enforce_budget(); }
+
+            // When the budget is exceeded, turns are removed until the history fits within this fraction of the budget.
+            // Removing several turns at once keeps the start of the history stable so the server can reuse its cache.
+            void set_low_water_mark(double fraction) { low_water_mark = fraction > 0 && fraction <= 1 ? fraction : 1; }
+
+            void set_token_estimator(std::function<size_t(const std::string&)> estimator)
+            {
+                token_estimator = estimator;
+                total_tokens = 0;
+                for (entry& pinned_entry: pinned) total_tokens += (pinned_entry.tokens = estimate(pinned_entry.content));
+                if (has_summary) total_tokens += (summary.tokens = estimate(summary.content));
+                for (entry& turn: turns) total_tokens += (turn.tokens = estimate(turn.content));
+                enforce_budget();
+            }
+
+            // Called with the turns being removed, preceded by the previous summary if there is one. The returned text replaces them as a system message.
+            void set_summarizer(std::function<std::string(const ollama::messages&)> summarize) { summarizer = summarize; }
+
+            void add(const ollama::message& message)
+            {
+                entry added = make_entry(message);
+                total_tokens += added.tokens;
+
+                // A system message added after other turns is inserted ahead of them, so the serialized history is rebuilt.
+                bool is_system = message.value("role", "") == "system";
+                if (!is_system || (turns.empty() && !has_summary)) { if (serialized_valid) serialized_history.push_back(message); }
+                else serialized_valid = false;
+
+                if (is_system) pinned.push_back(std::move(added));
+                else turns.push_back(std::move(added));
+
+                enforce_budget();
+            }
+
+            void add(const std::string& role, const std::string& content) { add(ollama::message(role, content)); }
+
+            // Adds the assistant's reply from a chat response.
+            void add(const ollama::response& response)
+            {
+                const json& data = response.as_json();
+                if (!data.contains("message")) return;
+
+                ollama::message reply;
+                static_cast<json&>(reply) = data["message"];
+                add(reply);
+            }
+
+            size_t estimated_tokens() const { return total_tokens; }
+            size_t budget() const { return context_size > reply_reserve ? context_size - reply_reserve : 0; }
+            size_t size() const { return pinned.size() + (has_summary ? 1 : 0) + turns.size(); }
+            size_t dropped_turns() const { return dropped; }
+
+            void clear() { pinned.clear(); turns.clear(); summary = entry(); has_summary = false; total_tokens = 0; dropped = 0; serialized_history.clear(); serialized_valid = true; }
+
+            ollama::messages to_messages() const
+            {
+                ollama::messages output;
+                output.reserve(size());
+                for (const entry& pinned_entry: pinned) output.push_back(pinned_entry.content);
+                if (has_summary) output.push_back(summary.content);
+                for (const entry& turn: turns) output.push_back(turn.content);
+                return output;
+            }
+
+            operator ollama::messages() const { return to_messages(); }
+
+            // The history serialized for a chat request. Messages are serialized as they are added and dropped turns are
+            // erased from the cached bytes, so the full history is only re-serialized after a summary or a late system message.
+            const ollama::serialized_messages& serialized() const
+            {
+                if (!serialized_valid)
+                {
+                    serialized_history.clear();
+                    for (const entry& pinned_entry: pinned) serialized_history.push_back(pinned_entry.content);
+                    if (has_summary) serialized_history.push_back(summary.content);
+                    for (const entry& turn: turns) serialized_history.push_back(turn.content);
+                    serialized_valid = true;
+                }
+                return serialized_history;
+            }
+
+        private:
+
+            struct entry {
+                ollama::message content;
+                size_t tokens = 0;
+            };
+
+            // Each message carries a few tokens of role and formatting overhead, and images are counted at a typical vision encoder size.
+            static const size_t message_overhead = 4, image_tokens = 768;
+
+            size_t estimate(const ollama::message& message) const
+            {
+                size_t tokens = message_overhead;
+                if (message.contains("content") && message["content"].is_string()) tokens += token_estimator ? token_estimator(message["content"].get_ref<const std::string&>()) : estimate_tokens(message["content"].get_ref<const std::string&>());
+                if (message.contains("images") && message["images"].is_array()) tokens += image_tokens * message["images"].size();
+                return tokens;
+            }
+
+            entry make_entry(const ollama::message& message) const
+            {
+                entry created;
+                created.content = message;
+                created.tokens = estimate(message);
+                return created;
+            }
+
+            void enforce_budget()
+            {
+                if (total_tokens <= budget() || turns.size() <= 1) return;
+
+                size_t target = static_cast<size_t>(budget() * low_water_mark);
+
+                // If the pinned messages, the summary and the latest turn alone exceed the target, a new summary would not bring the
+                // history within budget and would be requested again on every add, so the turns are dropped without summarizing them.
+                size_t floor = total_tokens;
+                for (size_t i = 0; i + 1 < turns.size(); ++i) floor -= turns[i].tokens;
+                bool summarize = summarizer && floor <= target;
+
+                ollama::messages removed;
+                if (summarize && has_summary) removed.push_back(summary.content);
+
+                // The most recent turn is always kept so that there is something to reply to.
+                size_t removed_turns = 0;
+                while (total_tokens > target && turns.size() > 1)
+                {
+                    total_tokens -= turns.front().tokens;
+                    if (summarize) removed.push_back(std::move(turns.front().content));
+                    turns.pop_front();
+                    ++dropped;
+                    ++removed_turns;
+                }
+
+                if (!summarize)
+                {
+                    size_t first_turn = pinned.size() + (has_summary ? 1 : 0);
+                    if (serialized_valid) serialized_history.erase(first_turn, first_turn + removed_turns);
+                    return;
+                }
+                serialized_valid = false;
+
+                if (has_summary) total_tokens -= summary.tokens;
+                summary = make_entry(ollama::message("system", summarizer(removed)));
+                has_summary = true;
+                total_tokens += summary.tokens;
+            }
+
+            size_t context_size, reply_reserve;
+            double low_water_mark = 0.75;
+            size_t total_tokens = 0, dropped = 0;
+
+            std::vector<entry> pinned;
+            std::deque<entry> turns;
+            entry summary;
+            bool has_summary = false;
+
+            std::function<size_t(const std::string&)> token_estimator;
+            std::function<std::string(const ollama::messages&)> summarizer;
+
+            mutable ollama::serialized_messages serialized_history;
+            mutable bool serialized_valid = true;
+    };
+
+    // Reassembles the newline-delimited JSON sent by streaming endpoints, independent of how the transport splits it into chunks.
+    class stream_buffer {
+
+        public:
+
+            // Invokes on_line for every complete line in data. Returns false as soon as on_line returns false.
+            template<typename Callback>
+            bool append(const char* data, size_t length, Callback&& on_line)
+            {
+                const char* end = data + length;
+
+                while (data < end)
+                {
+                    const char* newline = static_cast<const char*>(std::memchr(data, '\n', end - data));
+                    if (!newline) { pending.append(data, end - data); break; }
+
+                    bool continue_stream = true;
+                    if (pending.empty()) continue_stream = emit(data, newline - data, on_line);
+                    else { pending.append(data, newline - data); continue_stream = emit(pending.data(), pending.size(), on_line); pending.clear(); }
+
+                    if (!continue_stream) return false;
+                    data = newline + 1;
+                }
+
+                return true;
+            }
+
+            // Handles a final line that was not terminated by a newline.
+            template<typename Callback>
+            bool finish(Callback&& on_line)
+            {
+                bool continue_stream = emit(pending.data(), pending.size(), on_line);
+                pending.clear();
+                return continue_stream;
+            }
+
+        private:
+
+            template<typename Callback>
+            static bool emit(const char* line, size_t length, Callback& on_line)
+            {
+                while (length > 0 && std::isspace(static_cast<unsigned char>(line[length-1]))) --length;
+                if (length == 0) return true;
+                return on_line(line, length);
+            }
+
+            std::string pending;
+    };
+
+    // Pulls the text, done flag and error out of a line of a streamed reply using the json SAX interface,
+    // so that no json document is built for the token.
+    class content_extractor {
+
+        public:
+
+            // Returns false if the line is not valid JSON.
+            bool parse(const char* line, size_t length, message_type type=message_type::generation)
+            {
+                handler.type = type;
+                handler.text.clear();
+                handler.error_text.clear();
+                handler.is_done = handler.error_present = handler.in_message = false;
+                handler.depth = 0;
+
+                return json::sax_parse(line, line + length, &handler);
+            }
+
+            const std::string& content() const { return handler.text; }
+            bool done() const { return handler.is_done; }
+            bool has_error() const { return handler.error_present; }
+            const std::string& error() const { return handler.error_text; }
+
+        private:
+
+            struct sax_handler: json::json_sax_t {
+
+                bool null() override { return true; }
+                bool boolean(bool value) override { if (depth == 1 && key_name == "done") is_done = value; return true; }
+                bool number_integer(number_integer_t) override { return true; }
+                bool number_unsigned(number_unsigned_t) override { return true; }
+                bool number_float(number_float_t, const string_t&) override { return true; }
+                bool binary(binary_t&) override { return true; }
+
+                bool string(string_t& value) override
+                {
+                    if (depth == 1 && key_name == "error") { error_text = value; error_present = true; }
+                    else if (depth == 1 && type == message_type::generation && key_name == "response") text = value;
+                    else if (depth == 2 && in_message && type == message_type::chat && key_name == "content") text = value;
+                    return true;
+                }
+
+                bool start_object(std::size_t) override
+                {
+                    // Objects nested in the message, such as the functions of tool calls, leave in_message set.
+                    if (depth == 1) in_message = key_name == "message";
+                    ++depth;
+                    return true;
+                }
+
+                bool end_object() override
+                {
+                    if (--depth == 1) in_message = false;
+                    return true;
+                }
+
+                bool start_array(std::size_t) override { ++depth; return true; }
+                bool end_array() override { --depth; return true; }
+                bool key(string_t& value) override { key_name = value; return true; }
+                bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception&) override { return false; }
+
+                message_type type = message_type::generation;
+                std::string text, error_text, key_name;
+                bool is_done = false, error_present = false, in_message = false;
+                int depth = 0;
+            };
+
+            sax_handler handler;
+    };
+
+    // Receives the text of a streamed reply as it arrives and forwards it to some destination. Writes are coalesced
+    // and passed on once flush_bytes have accumulated or flush_interval has passed since the first pending byte.
+    // When a stream is sent to a sink, pending text is also flushed on time while the server is between tokens.
+    // An optional prefix and suffix are written around each flushed block, for example "data: " and "\n\n" for
+    // server-sent events.
+    class stream_sink {
+
+        public:
+
+            stream_sink(size_t flush_bytes=4096, std::chrono::microseconds flush_interval=std::chrono::microseconds(2000)): flush_bytes(flush_bytes), flush_interval(flush_interval) {}
+            virtual ~stream_sink() {}
+
+            void set_framing(const std::string& prefix, const std::string& suffix) { this->prefix = prefix; this->suffix = suffix; }
+
+            // Returns false once the destination has failed, which stops the stream.
+            bool write(const char* data, size_t length)
+            {
+                std::lock_guard<std::mutex> lock(sink_mutex);
+                if (failed) return false;
+                if (length == 0) return true;
+
+                if (pending.empty()) first_pending = std::chrono::steady_clock::now();
+                pending.append(data, length);
+
+                if (pending.size() >= flush_bytes || std::chrono::steady_clock::now() - first_pending >= flush_interval) return flush_pending();
+                return true;
+            }
+
+            bool write(const std::string& text) { return write(text.data(), text.size()); }
+
+            bool flush()
+            {
+                std::lock_guard<std::mutex> lock(sink_mutex);
+                return flush_pending();
+            }
+
+            // Flushes the pending text if it has waited flush_interval. May be called from another thread than write().
+            bool flush_if_due()
+            {
+                std::lock_guard<std::mutex> lock(sink_mutex);
+                if (pending.empty() || std::chrono::steady_clock::now() - first_pending < flush_interval) return !failed;
+                return flush_pending();
+            }
+
+            // Whether text can wait in the sink at all, in which case it needs flush_if_due() to be called while a stream stalls.
+            bool coalesces() const { return flush_bytes > 1 && flush_interval.count() > 0; }
+            std::chrono::microseconds get_flush_interval() const { return flush_interval; }
+
+            size_t bytes_written() const { return written; }
+            size_t flushes() const { return flush_count; }
+            bool has_failed() const { return failed; }
+
+        protected:
+
+            // Writes one flushed block. The prefix and suffix may be empty.
+            virtual bool write_block(const char* prefix, size_t prefix_length, const char* data, size_t length, const char* suffix, size_t suffix_length) = 0;
+
+        private:
+
+            bool flush_pending()
+            {
+                if (failed) return false;
+                if (pending.empty()) return true;
+
+                failed = !write_block(prefix.data(), prefix.size(), pending.data(), pending.size(), suffix.data(), suffix.size());
+                written += pending.size();
+                ++flush_count;
+                pending.clear();
+                return !failed;
+            }
+
+            size_t flush_bytes;
+            std::chrono::microseconds flush_interval;
+            std::chrono::steady_clock::time_point first_pending;
+            std::string prefix, suffix, pending;
+            std::atomic<size_t> written{0}, flush_count{0};
+            std::atomic<bool> failed{false};
+            std::mutex sink_mutex;
+    };
+
+    // Writes to a file descriptor or socket. On POSIX systems each block and its framing go out in a single gathered write.
+    class fd_sink: public stream_sink {
+
+        public:
+
+            fd_sink(int fd, size_t flush_bytes=4096, std::chrono::microseconds flush_interval=std::chrono::microseconds(2000)): stream_sink(flush_bytes, flush_interval), fd(fd) {}
+            ~fd_sink() { flush(); }
+
+        protected:
+
+            #ifdef _WIN32
+            bool write_block(const char* prefix, size_t prefix_length, const char* data, size_t length, const char* suffix, size_t suffix_length) override
+            {
+                return write_all(prefix, prefix_length) && write_all(data, length) && write_all(suffix, suffix_length);
+            }
+
+            bool write_all(const char* data, size_t length)
+            {
+                while (length > 0)
+                {
+                    int count = _write(fd, data, static_cast<unsigned int>(length));
+                    if (count <= 0) return false;
+                    data += count; length -= count;
+                }
+                return true;
+            }
+            #else
+            bool write_block(const char* prefix, size_t prefix_length, const char* data, size_t length, const char* suffix, size_t suffix_length) override
+            {
+                struct iovec parts[3];
+                int count = 0;
+                if (prefix_length) { parts[count].iov_base = const_cast<char*>(prefix); parts[count++].iov_len = prefix_length; }
+                parts[count].iov_base = const_cast<char*>(data); parts[count++].iov_len = length;
+                if (suffix_length) { parts[count].iov_base = const_cast<char*>(suffix); parts[count++].iov_len = suffix_length; }
+
+                struct iovec* next = parts;
+                while (count > 0)
+                {
+                    ssize_t sent = gather(next, count);
+                    if (sent < 0)
+                    {
+                        if (errno == EINTR) continue;
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) { struct pollfd writable = {fd, POLLOUT, 0}; if (poll(&writable, 1, 1000) >= 0) continue; }
+                        return false;
+                    }
+
+                    // Skip the parts that were completely written and advance into a partially written one.
+                    size_t remaining = static_cast<size_t>(sent);
+                    while (count > 0 && remaining >= next->iov_len) { remaining -= next->iov_len; ++next; --count; }
+                    if (count > 0) { next->iov_base = static_cast<char*>(next->iov_base) + remaining; next->iov_len -= remaining; }
+                }
+                return true;
+            }
+
+            // Sockets are written with MSG_NOSIGNAL so that a disconnected client does not raise SIGPIPE.
+            ssize_t gather(struct iovec* parts, int count)
+            {
+                #ifdef MSG_NOSIGNAL
+                if (is_socket)
+                {
+                    struct msghdr message = {};
+                    message.msg_iov = parts;
+                    message.msg_iovlen = count;
+                    ssize_t sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+                    if (sent >= 0 || errno != ENOTSOCK) return sent;
+                    is_socket = false;
+                }
+                #endif
+                return writev(fd, parts, count);
+            }
+
+            bool is_socket = true;
+            #endif
+
+            int fd;
+    };
+
+    // Writes to a std::ostream, such as std::cout or a file.
+    class ostream_sink: public stream_sink {
+
+        public:
+
+            ostream_sink(std::ostream& stream, size_t flush_bytes=4096, std::chrono::microseconds flush_interval=std::chrono::microseconds(2000)): stream_sink(flush_bytes, flush_interval), stream(stream) {}
+            ~ostream_sink() { flush(); }
+
+        protected:
+
+            bool write_block(const char* prefix, size_t prefix_length, const char* data, size_t length, const char* suffix, size_t suffix_length) override
+            {
+                stream.write(prefix, prefix_length).write(data, length).write(suffix, suffix_length);
+                stream.flush();
+                return static_cast<bool>(stream);
+            }
+
+        private:
+
+            std::ostream& stream;
+    };
+
+    // Shares one streaming generation between several consumers. Tokens are kept in a ring buffer shared by all
+    // subscribers, so a subscriber that joins late first receives the tokens produced so far. A subscriber may fall at
+    // most capacity tokens behind; after that the producer either waits for it or disconnects it, depending on the policy.
+    class broadcast_stream {
+
+        struct shared_state {
+            std::mutex mutex;
+            std::condition_variable changed;
+            std::vector<ollama::response> ring;
+            uint64_t next_sequence = 0;
+            bool finished = false;
+        };
+
+        struct reader_state {
+            uint64_t cursor = 0;
+            bool active = true, dropped = false;
+        };
+
+        public:
+
+            enum class overflow_policy { block, disconnect };
+
+            class subscriber {
+
+                public:
+
+                    ~subscriber() { unsubscribe(); }
+
+                    subscriber(const subscriber&) = delete;
+                    subscriber& operator=(const subscriber&) = delete;
+
+                    // Waits for the next token. Returns false once the stream has finished and every token has been read,
+                    // or when this subscriber has been disconnected or unsubscribed.
+                    bool next(ollama::response& token)
+                    {
+                        std::unique_lock<std::mutex> lock(shared->mutex);
+                        shared->changed.wait(lock, [this]{ return ready(); });
+                        return read(token);
+                    }
+
+                    // As next(), but gives up after the timeout.
+                    bool next(ollama::response& token, std::chrono::milliseconds timeout)
+                    {
+                        std::unique_lock<std::mutex> lock(shared->mutex);
+                        shared->changed.wait_for(lock, timeout, [this]{ return ready(); });
+                        return read(token);
+                    }
+
+                    void unsubscribe()
+                    {
+                        std::lock_guard<std::mutex> lock(shared->mutex);
+                        reader->active = false;
+                        shared->changed.notify_all();
+                    }
+
+                    // Tokens that had already left the ring buffer when this subscriber joined.
+                    uint64_t skipped() const { return first_sequence; }
+                    bool disconnected() const { std::lock_guard<std::mutex> lock(shared->mutex); return reader->dropped; }
+
+                private:
+
+                    friend class broadcast_stream;
+
+                    subscriber(std::shared_ptr<shared_state> shared, std::shared_ptr<reader_state> reader): shared(shared), reader(reader), first_sequence(reader->cursor) {}
+
+                    bool ready() const { return reader->cursor < shared->next_sequence || shared->finished || !reader->active; }
+
+                    bool read(ollama::response& token)
+                    {
+                        if (!reader->active || reader->cursor >= shared->next_sequence) return false;
+                        token = shared->ring[reader->cursor % shared->ring.size()];
+                        ++reader->cursor;
+                        shared->changed.notify_all();
+                        return true;
+                    }
+
+                    std::shared_ptr<shared_state> shared;
+                    std::shared_ptr<reader_state> reader;
+                    uint64_t first_sequence;
+            };
+
+            broadcast_stream(size_t capacity=4096, overflow_policy policy=overflow_policy::block): shared(std::make_shared<shared_state>()), capacity(capacity > 0 ? capacity : 1), policy(policy) {}
+
+            ~broadcast_stream()
+            {
+                cancel();
+                wait();
+            }
+
+            broadcast_stream(const broadcast_stream&) = delete;
+            broadcast_stream& operator=(const broadcast_stream&) = delete;
+
+            // Runs the upstream generation on a background thread. The generation is given the callback to stream into:
+            //     stream.start([&](std::function<bool(const ollama::response&)> on_token) { ollama::chat("llama3:8b", messages, on_token); });
+            void start(std::function<void(std::function<bool(const ollama::response&)>)> generation)
+            {
+                std::function<bool(const ollama::response&)> on_token = publisher();
+                upstream = std::thread([this, generation, on_token]{
+                    try { generation(on_token); }
+                    catch (const std::exception& e) { std::lock_guard<std::mutex> lock(shared->mutex); error_message = e.what(); }
+                    finish();
+                });
+            }
+
+            // A callback that publishes every token it receives, for use as the callback of a streaming generate or chat.
+            std::function<bool(const ollama::response&)> publisher() { return [this](const ollama::response& token) { return publish(token); }; }
+
+            // Adds a token for all subscribers. Returns false once the stream has been cancelled, which stops the generation.
+            bool publish(const ollama::response& token)
+            {
+                std::unique_lock<std::mutex> lock(shared->mutex);
+
+                if (policy == overflow_policy::block)
+                    shared->changed.wait(lock, [this]{ return cancelled || slowest() + capacity > shared->next_sequence; });
+                else
+                    for (std::shared_ptr<reader_state>& reader: readers) if (reader->active && reader->cursor + capacity <= shared->next_sequence) { reader->active = false; reader->dropped = true; }
+
+                if (cancelled) return false;
+
+                if (shared->ring.size() < capacity) shared->ring.push_back(token);
+                else shared->ring[shared->next_sequence % capacity] = token;
+                ++shared->next_sequence;
+
+                shared->changed.notify_all();
+                return true;
+            }
+
+            // Marks the end of the stream. Subscribers finish reading the remaining tokens.
+            void finish()
+            {
+                std::lock_guard<std::mutex> lock(shared->mutex);
+                shared->finished = true;
+                shared->changed.notify_all();
+            }
+
+            // Stops the upstream generation at its next token and ends the stream.
+            void cancel()
+            {
+                std::lock_guard<std::mutex> lock(shared->mutex);
+                cancelled = true;
+                shared->finished = true;
+                shared->changed.notify_all();
+            }
+
+            std::shared_ptr<subscriber> subscribe()
+            {
+                std::lock_guard<std::mutex> lock(shared->mutex);
+
+                // Forget subscribers which have gone away.
+                readers.erase(std::remove_if(readers.begin(), readers.end(), [](const std::shared_ptr<reader_state>& reader) { return !reader->active; }), readers.end());
+
+                std::shared_ptr<reader_state> reader = std::make_shared<reader_state>();
+                reader->cursor = shared->next_sequence - shared->ring.size();
+                readers.push_back(reader);
+
+                return std::shared_ptr<subscriber>(new subscriber(shared, reader));
+            }
+
+            // Delivers every token to the callback on the calling thread until the stream ends or the callback returns false.
+            void subscribe(std::function<bool(const ollama::response&)> on_token)
+            {
+                std::shared_ptr<subscriber> reader = subscribe();
+                ollama::response token;
+                while (reader->next(token)) if (!on_token(token)) break;
+            }
+
+            // Waits for the upstream generation started with start() to complete.
+            void wait() { if (upstream.joinable()) upstream.join(); }
+
+            uint64_t tokens_published() const { std::lock_guard<std::mutex> lock(shared->mutex); return shared->next_sequence; }
+            bool is_finished() const { std::lock_guard<std::mutex> lock(shared->mutex); return shared->finished; }
+
+            // The message of an exception thrown by the upstream generation, if any.
+            std::string error() const { std::lock_guard<std::mutex> lock(shared->mutex); return error_message; }
+
+        private:
+
+            uint64_t slowest() const
+            {
+                uint64_t cursor = shared->next_sequence;
+                for (const std::shared_ptr<reader_state>& reader: readers) if (reader->active && reader->cursor < cursor) cursor = reader->cursor;
+                return cursor;
+            }
+
+            std::shared_ptr<shared_state> shared;
+            std::vector<std::shared_ptr<reader_state>> readers;
+            size_t capacity;
+            overflow_policy policy;
+            bool cancelled = false;
+            std::string error_message;
+            std::thread upstream;
+    };
+
+    // Finds the first occurrence of any of a set of strings in text that arrives in pieces. An Aho-Corasick automaton
+    // carries the partial match state from one piece to the next, so matches split across tokens are found and each
+    // byte is examined only once.
+    class stop_matcher {
+
+        public:
+
+            stop_matcher() { reset_automaton(); }
+            stop_matcher(const std::vector<std::string>& patterns): stop_matcher() { for (const std::string& pattern: patterns) add(pattern); }
+
+            void add(const std::string& pattern)
+            {
+                if (pattern.empty()) return;
+                patterns.push_back(pattern);
+                built = false;
+            }
+
+            bool empty() const { return patterns.empty(); }
+
+            // Returns the offset just past the end of the first match within data, or std::string::npos if there is none yet.
+            size_t feed(const char* data, size_t length)
+            {
+                if (patterns.empty()) return std::string::npos;
+                if (!built) build();
+
+                for (size_t i = 0; i < length; ++i)
+                {
+                    state = nodes[state].next[static_cast<unsigned char>(data[i])];
+                    if (nodes[state].output >= 0) { match = nodes[state].output; return i + 1; }
+                }
+                return std::string::npos;
+            }
+
+            // The pattern found by the last successful feed.
+            const std::string& matched() const { static const std::string none; return match >= 0 ? patterns[match] : none; }
+
+            // Forgets any partial match, ready for a new stream.
+            void reset() { state = 0; match = -1; }
+
+        private:
+
+            struct node {
+                int32_t next[256];
+                int32_t fail = 0;
+                int32_t output = -1;    // Index of a pattern ending here, including through failure links.
+            };
+
+            void reset_automaton()
+            {
+                nodes.assign(1, node());
+                std::fill(nodes[0].next, nodes[0].next + 256, -1);
+                state = 0; match = -1;
+            }
+
+            void build()
+            {
+                reset_automaton();
+
+                // Build the trie of all patterns.
+                for (size_t index = 0; index < patterns.size(); ++index)
+                {
+                    int32_t current = 0;
+                    for (unsigned char c: patterns[index])
+                    {
+                        if (nodes[current].next[c] < 0)
+                        {
+                            nodes[current].next[c] = static_cast<int32_t>(nodes.size());
+                            nodes.push_back(node());
+                            std::fill(nodes.back().next, nodes.back().next + 256, -1);
+                        }
+                        current = nodes[current].next[c];
+                    }
+                    if (nodes[current].output < 0) nodes[current].output = static_cast<int32_t>(index);
+                }
+
+                // Breadth-first, fill in failure links and turn missing edges into transitions so matching is a single table lookup per byte.
+                std::deque<int32_t> queue;
+                for (int c = 0; c < 256; ++c)
+                {
+                    int32_t child = nodes[0].next[c];
+                    if (child < 0) nodes[0].next[c] = 0;
+                    else { nodes[child].fail = 0; queue.push_back(child); }
+                }
+
+                while (!queue.empty())
+                {
+                    int32_t current = queue.front();
+                    queue.pop_front();
+                    if (nodes[current].output < 0) nodes[current].output = nodes[nodes[current].fail].output;
+
+                    for (int c = 0; c < 256; ++c)
+                    {
+                        int32_t child = nodes[current].next[c];
+                        if (child < 0) nodes[current].next[c] = nodes[nodes[current].fail].next[c];
+                        else { nodes[child].fail = nodes[nodes[current].fail].next[c]; queue.push_back(child); }
+                    }
+                }
+
+                built = true;
+            }
+
+            std::vector<std::string> patterns;
+            std::vector<node> nodes;
+            int32_t state = 0, match = -1;
+            bool built = false;
+    };
+
+    enum class stop_reason { none, stop_string, regex, max_characters, max_time, callback };
+
+    // Client-side conditions which end a streamed reply early. Wrap a streaming callback with wrap() and the stream is
+    // cancelled, closing the connection and freeing the server, as soon as a stop string or the regex is found, the
+    // reply reaches max_characters, or max_time has passed. The text up to the stop point is available from text().
+    class stop_conditions {
+
+        public:
+
+            stop_conditions() {}
+            ~stop_conditions() { stop_watchdog(); }
+
+            // The watchdog thread refers to the conditions, so they are not copied.
+            stop_conditions(const stop_conditions&) = delete;
+            stop_conditions& operator=(const stop_conditions&) = delete;
+
+            stop_conditions& add_stop(const std::string& stop) { matcher.add(stop); return *this; }
+            stop_conditions& add_stops(const std::vector<std::string>& stops) { for (const std::string& stop: stops) matcher.add(stop); return *this; }
+
+            // The regex is searched for in the text added by each token and the regex_window bytes before it, so a match
+            // longer than the window is not found. Prefer stop strings for long replies.
+            stop_conditions& set_regex(const std::string& pattern) { expression = std::regex(pattern); has_expression = true; return *this; }
+            stop_conditions& set_regex_window(size_t bytes) { regex_window = bytes; return *this; }
+            stop_conditions& set_max_characters(size_t characters) { max_characters = characters; return *this; }
+            stop_conditions& set_max_time(std::chrono::milliseconds duration) { max_time = duration; return *this; }
+
+            // Without a token to check, a stream which stalls cannot be stopped from the callback. When a cancel function is
+            // set, such as [&client]{ client.cancel(); }, a watchdog calls it once max_time has passed while the stream is open.
+            stop_conditions& set_cancel(std::function<void()> cancel) { this->cancel = cancel; return *this; }
+
+            // Returns a callback which checks each token against the conditions before passing it on. The token that
+            // triggers a stop is still delivered, and stopped() is already true while it is handled. The conditions must
+            // outlive the stream.
+            std::function<bool(const ollama::response&)> wrap(std::function<bool(const ollama::response&)> on_token=nullptr)
+            {
+                reset();
+                if (max_time.count() > 0 && cancel) start_watchdog();
+
+                return [this, on_token](const ollama::response& token) -> bool {
+
+                    if (reason != stop_reason::none) return false;
+
+                    check(token.as_simple_string());
+                    bool continue_stream = on_token ? on_token(token) : true;
+                    if (!continue_stream && reason == stop_reason::none) reason = stop_reason::callback;
+
+                    bool continuing = reason == stop_reason::none;
+                    if (!continuing || token.is_done()) finish_watchdog();
+                    return continuing;
+                };
+            }
+
+            // Checks the next piece of text. Returns false once a condition has been met.
+            bool check(const std::string& piece)
+            {
+                if (reason != stop_reason::none) return false;
+
+                if (max_time.count() > 0 && std::chrono::steady_clock::now() - started >= max_time) { reason = stop_reason::max_time; return false; }
+
+                size_t start = output.size();
+                output += piece;
+
+                size_t end = matcher.feed(piece.data(), piece.size());
+                if (end != std::string::npos)
+                {
+                    // Like the server's stop option, the stop string itself is not part of the text.
+                    output.resize(start + end - matcher.matched().size());
+                    reason = stop_reason::stop_string;
+                    return false;
+                }
+
+                if (has_expression)
+                {
+                    // Earlier text has already been searched, so only a window ending in the new text can hold a new match.
+                    size_t from = start > regex_window ? start - regex_window : 0;
+                    std::smatch found;
+                    if (std::regex_search(output.cbegin() + from, output.cend(), found, expression, from > 0 ? std::regex_constants::match_prev_avail : std::regex_constants::match_default))
+                    {
+                        output.resize(from + found.position(0) + found.length(0));
+                        reason = stop_reason::regex;
+                        return false;
+                    }
+                }
+
+                if (max_characters > 0)
+                {
+                    // Count UTF-8 code points rather than bytes.
+                    for (size_t i = start; i < output.size(); ++i)
+                    {
+                        if ((static_cast<unsigned char>(output[i]) & 0xC0) == 0x80) continue;
+                        if (characters++ == max_characters) { output.resize(i); reason = stop_reason::max_characters; return false; }
+                    }
+                }
+
+                return true;
+            }
+
+            void reset()
+            {
+                stop_watchdog();
+                matcher.reset();
+                output.clear();
+                characters = 0;
+                reason = stop_reason::none;
+                started = std::chrono::steady_clock::now();
+            }
+
+            bool stopped() const { return reason != stop_reason::none; }
+            stop_reason get_reason() const { return reason; }
+            const std::string& text() const { return output; }
+            const std::string& matched_stop() const { return matcher.matched(); }
+
+        private:
+
+            void start_watchdog()
+            {
+                stream_open = true;
+                watchdog = std::thread([this]{
+                    std::unique_lock<std::mutex> lock(watchdog_mutex);
+                    if (watchdog_wake.wait_until(lock, started + max_time, [this]{ return !stream_open; })) return;
+
+                    stop_reason expected = stop_reason::none;
+                    if (reason.compare_exchange_strong(expected, stop_reason::max_time)) cancel();
+                });
+            }
+
+            // Ends the watchdog without cancelling, once the stream has stopped or finished.
+            void finish_watchdog()
+            {
+                { std::lock_guard<std::mutex> lock(watchdog_mutex); stream_open = false; }
+                watchdog_wake.notify_one();
+            }
+
+            void stop_watchdog()
+            {
+                if (!watchdog.joinable()) return;
+                finish_watchdog();
+                watchdog.join();
+            }
+
+            stop_matcher matcher;
+            std::regex expression;
+            bool has_expression = false;
+            size_t regex_window = 4096;
+            size_t max_characters = 0, characters = 0;
+            std::chrono::milliseconds max_time = std::chrono::milliseconds(0);
+            std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+            std::string output;
+            std::atomic<stop_reason> reason{stop_reason::none};
+
+            std::function<void()> cancel;
+            std::thread watchdog;
+            std::mutex watchdog_mutex;
+            std::condition_variable watchdog_wake;
+            bool stream_open = false;
+    };
+
+    // Parses structured output incrementally as it streams in. Each value is reported with its path, such as
+    // "items[3].name", as soon as it is complete, so fields can be used before the rest of the reply arrives. When a
+    // JSON schema is given, the text is checked against it as it arrives and parsing fails at the first character that
+    // goes off-schema, so that the stream can be abandoned rather than generated to the end. The supported keywords
+    // are type, enum, const, properties, required, additionalProperties, items, minItems, maxItems, minLength,
+    // maxLength, minimum and maximum. Other keywords are ignored.
+    class json_stream_parser {
+
+        public:
+
+            json_stream_parser(const json& schema=nullptr): schema(schema) {}
+
+            // The compiled rules point into the schema, so a parser is not copied.
+            json_stream_parser(const json_stream_parser&) = delete;
+            json_stream_parser& operator=(const json_stream_parser&) = delete;
+
+            void set_schema(const json& schema) { this->schema = schema; compiled.clear(); reset(); }
+            const json& get_schema() const { return schema; }
+
+            // Called with the path and value of each completed value, innermost first. The root value has an empty path.
+            void on_value(std::function<void(const std::string&, const json&)> callback) { value_callback = callback; }
+
+            // Called with each completed value whose path matches the pattern, such as "items[3].name". In a pattern, [*]
+            // matches any index and * matches any property name, so "items[*].name" fires once for each item as it closes.
+            void on_field(const std::string& pattern, std::function<void(const std::string&, const json&)> callback) { field_callbacks.push_back(std::make_pair(pattern, callback)); }
+
+            // Matches a path against an on_field pattern.
+            static bool path_matches(const std::string& pattern, const std::string& path)
+            {
+                size_t i = 0, j = 0;
+                while (i < pattern.size())
+                {
+                    if (pattern.compare(i, 3, "[*]") == 0)
+                    {
+                        if (j >= path.size() || path[j] != '[') return false;
+                        j = path.find(']', j);
+                        if (j == std::string::npos) return false;
+                        ++j; i += 3;
+                    }
+                    else if (pattern[i] == '*')
+                    {
+                        size_t end = std::min(path.find_first_of(".[", j), path.size());
+                        if (end == j) return false;
+                        j = end; ++i;
+                    }
+                    else if (j < path.size() && pattern[i] == path[j]) { ++i; ++j; }
+                    else return false;
+                }
+                return j == path.size();
+            }
+
+            // Cancels the stream returned by wrap() once the value is complete. Some models keep producing whitespace after
+            // a JSON reply, but the final token which carries the statistics for the reply is not received.
+            void set_stop_when_complete(bool stop) { stop_when_complete = stop; }
+
+            // Returns a callback which feeds the content of each token to the parser before passing the token on. The stream
+            // is cancelled when the reply stops being valid JSON or goes off-schema. The parser must outlive the stream.
+            std::function<bool(const ollama::response&)> wrap(std::function<bool(const ollama::response&)> on_token=nullptr)
+            {
+                reset();
+                return [this, on_token](const ollama::response& token) -> bool {
+
+                    bool valid = feed(token.as_simple_string());
+                    bool continue_stream = on_token ? on_token(token) : true;
+
+                    return valid && continue_stream && !(stop_when_complete && is_complete());
+                };
+            }
+
+            // Feeds the next piece of text. Returns false once the text is not valid JSON or does not match the schema.
+            bool feed(const char* data, size_t length)
+            {
+                for (size_t i = 0; i < length && current != state::failed; ++i) step(data[i]);
+                return current != state::failed;
+            }
+
+            bool feed(const std::string& text) { return feed(text.data(), text.size()); }
+
+            // Marks the end of the text. A number at the end of the text is only complete once the text ends.
+            bool finish()
+            {
+                if (current == state::in_number) finish_number();
+                if (current != state::complete && current != state::failed) fail("Incomplete JSON value");
+                return current == state::complete;
+            }
+
+            void reset()
+            {
+                current = state::value;
+                stack.clear();
+                path.clear();
+                scalar.clear();
+                root = nullptr;
+                error_message.clear();
+                value_rules = nullptr;
+                escaped = false;
+                unicode_digits = 0;
+                high_surrogate = 0;
+            }
+
+            bool is_complete() const { return current == state::complete; }
+            bool has_error() const { return current == state::failed; }
+            const std::string& error() const { return error_message; }
+
+            // The parsed value, which is null until the value is complete.
+            const json& value() const { return root; }
+
+            // A copy of the value parsed so far, in which open objects and arrays hold the values completed within them.
+            // A value which is still being parsed, such as a partial string, is left out.
+            json partial() const
+            {
+                if (stack.empty()) return root;
+
+                json child = stack.back().value;
+                for (size_t i = stack.size() - 1; i-- > 0;)
+                {
+                    json parent = stack[i].value;
+                    if (stack[i].is_object) parent[stack[i].key] = std::move(child);
+                    else parent.push_back(std::move(child));
+                    child = std::move(parent);
+                }
+                return child;
+            }
+
+        private:
+
+            enum class state { value, first_value_or_end, first_key_or_end, key, colon, after_value, in_string, in_key, in_number, in_literal, complete, failed };
+
+            enum type_bits : unsigned int { object_type = 1, array_type = 2, string_type = 4, number_type = 8, integer_type = 16, boolean_type = 32, null_type = 64, any_type = 127 };
+
+            // The keywords of one schema, looked up once rather than for every value that the schema applies to.
+            struct rules {
+                unsigned int types = any_type;
+                const json* type = nullptr;
+                const json* allowed = nullptr;              // enum
+                const json* constant = nullptr;
+                const json* properties = nullptr;
+                const json* additional = nullptr;           // additionalProperties, when it is a schema.
+                bool closed = false;                        // additionalProperties is false.
+                const json* items = nullptr;
+                const json* required = nullptr;
+                size_t min_items = 0, max_items = std::string::npos, min_length = 0, max_length = std::string::npos;
+                bool has_minimum = false, has_maximum = false;
+                double minimum = 0, maximum = 0;
+            };
+
+            struct frame {
+                bool is_object;
+                json value;
+                const rules* container_rules;
+                size_t path_length;     // Length of the path to the container itself.
+                std::string key;
+                size_t index = 0;
+            };
+
+            static bool is_space(char c) { return c == ' ' || c == '\n' || c == '\r' || c == '\t'; }
+            static bool is_number_char(char c) { return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E'; }
+
+            static int hex_value(char c)
+            {
+                if (c >= '0' && c <= '9') return c - '0';
+                if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+                if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+                return -1;
+            }
+
+            static unsigned int type_bit(const json& name)
+            {
+                static const char* names[] = {"object", "array", "string", "number", "integer", "boolean", "null"};
+                for (unsigned int i = 0; i < 7; ++i) if (name == names[i]) return 1u << i;
+                return 0;
+            }
+
+            const rules* compile(const json* schema)
+            {
+                if (schema == nullptr || !schema->is_object()) return nullptr;
+
+                std::map<const json*, rules>::iterator found = compiled.find(schema);
+                if (found != compiled.end()) return &found->second;
+
+                rules& compiled_rules = compiled[schema];
+                for (json::const_iterator it = schema->begin(); it != schema->end(); ++it)
+                {
+                    const std::string& name = it.key();
+                    const json& value = it.value();
+
+                    if (name == "type")
+                    {
+                        compiled_rules.type = &value;
+                        if (value.is_string()) compiled_rules.types = type_bit(value);
+                        else if (value.is_array()) { compiled_rules.types = 0; for (const json& type: value) compiled_rules.types |= type_bit(type); }
+                    }
+                    else if (name == "enum" && value.is_array()) compiled_rules.allowed = &value;
+                    else if (name == "const") compiled_rules.constant = &value;
+                    else if (name == "properties" && value.is_object()) compiled_rules.properties = &value;
+                    else if (name == "additionalProperties") { compiled_rules.closed = value == false; if (value.is_object()) compiled_rules.additional = &value; }
+                    else if (name == "items" && value.is_object()) compiled_rules.items = &value;
+                    else if (name == "required" && value.is_array()) compiled_rules.required = &value;
+                    else if (!value.is_number()) continue;
+                    else if (name == "minItems") compiled_rules.min_items = value.get<size_t>();
+                    else if (name == "maxItems") compiled_rules.max_items = value.get<size_t>();
+                    else if (name == "minLength") compiled_rules.min_length = value.get<size_t>();
+                    else if (name == "maxLength") compiled_rules.max_length = value.get<size_t>();
+                    else if (name == "minimum") { compiled_rules.has_minimum = true; compiled_rules.minimum = value.get<double>(); }
+                    else if (name == "maximum") { compiled_rules.has_maximum = true; compiled_rules.maximum = value.get<double>(); }
+                }
+
+                return &compiled_rules;
+            }
+
+            static std::string type_names(const rules* value_rules)
+            {
+                const json* types = value_rules->type;
+                if (types->is_string()) return types->get<std::string>();
+
+                std::string names;
+                for (const json& type: *types) { if (!names.empty()) names += " or "; names += type.is_string() ? type.get<std::string>() : type.dump(); }
+                return names;
+            }
+
+            const rules* property_rules(const rules* object_rules, const std::string& key)
+            {
+                if (object_rules == nullptr) return nullptr;
+
+                if (object_rules->properties != nullptr)
+                {
+                    json::const_iterator found = object_rules->properties->find(key);
+                    if (found != object_rules->properties->end()) return compile(&*found);
+                }
+
+                return compile(object_rules->additional);
+            }
+
+            static bool has_prefix(const json& candidates, const std::string& prefix)
+            {
+                for (const json& candidate: candidates)
+                {
+                    if (!candidate.is_string()) continue;
+                    const std::string& text = candidate.get_ref<const std::string&>();
+                    if (text.compare(0, prefix.size(), prefix) == 0) return true;
+                }
+                return false;
+            }
+
+            static bool has_prefix_value(const json& candidate, const std::string& prefix)
+            {
+                return candidate.is_string() && candidate.get_ref<const std::string&>().compare(0, prefix.size(), prefix) == 0;
+            }
+
+            void fail(const std::string& message)
+            {
+                error_message = path.empty() ? message : message + " at " + path;
+                current = state::failed;
+            }
+
+            void step(char c)
+            {
+                switch (current)
+                {
+                    case state::in_string: case state::in_key: string_char(c); return;
+                    case state::in_literal: literal_char(c); return;
+                    case state::in_number:
+                        if (is_number_char(c)) { scalar += c; return; }
+                        if (!finish_number()) return;
+                        break;   // The character which ended the number is handled below.
+                    default: break;
+                }
+
+                if (is_space(c)) return;
+
+                switch (current)
+                {
+                    case state::value: begin_value(c); break;
+                    case state::first_value_or_end: if (c == ']') close_container(); else begin_value(c); break;
+                    case state::first_key_or_end: if (c == '}') close_container(); else begin_key(c); break;
+                    case state::key: begin_key(c); break;
+                    case state::colon: if (c == ':') current = state::value; else fail("Expected ':'"); break;
+                    case state::after_value: after_value(c); break;
+                    case state::complete: fail("Unexpected text after the JSON value"); break;
+                    default: break;
+                }
+            }
+
+            void begin_value(char c)
+            {
+                if (stack.empty()) value_rules = compile(&schema);
+                else
+                {
+                    frame& parent = stack.back();
+                    if (parent.is_object) value_rules = property_rules(parent.container_rules, parent.key);
+                    else
+                    {
+                        path.resize(parent.path_length);
+                        path += '['; path += std::to_string(parent.index); path += ']';
+
+                        value_rules = parent.container_rules != nullptr ? compile(parent.container_rules->items) : nullptr;
+                        if (parent.container_rules != nullptr && parent.index >= parent.container_rules->max_items) { fail("Too many items"); return; }
+                    }
+                }
+
+                const char* type;
+                unsigned int bits;
+                if (c == '{') { type = "object"; bits = object_type; }
+                else if (c == '[') { type = "array"; bits = array_type; }
+                else if (c == '"') { type = "string"; bits = string_type; }
+                else if (c == '-' || (c >= '0' && c <= '9')) { type = "number"; bits = number_type | integer_type; }
+                else if (c == 't' || c == 'f') { type = "boolean"; bits = boolean_type; }
+                else if (c == 'n') { type = "null"; bits = null_type; }
+                else { fail(std::string("Unexpected character '") + c + "'"); return; }
+
+                if (value_rules != nullptr && (value_rules->types & bits) == 0) { fail("Expected " + type_names(value_rules) + " but found " + type); return; }
+
+                scalar.clear();
+                if (c == '{' || c == '[')
+                {
+                    frame opened;
+                    opened.is_object = c == '{';
+                    opened.value = opened.is_object ? json::object() : json::array();
+                    opened.container_rules = value_rules;
+                    opened.path_length = path.size();
+                    stack.push_back(std::move(opened));
+                    current = c == '{' ? state::first_key_or_end : state::first_value_or_end;
+                }
+                else if (c == '"') { string_length = 0; current = state::in_string; }
+                else if (bits & number_type) { scalar += c; current = state::in_number; }
+                else { literal = c == 't' ? "true" : c == 'f' ? "false" : "null"; scalar += c; current = state::in_literal; }
+            }
+
+            void begin_key(char c)
+            {
+                path.resize(stack.back().path_length);
+                if (c != '"') { fail("Expected a property name"); return; }
+                scalar.clear();
+                current = state::in_key;
+            }
+
+            void after_value(char c)
+            {
+                frame& parent = stack.back();
+                if (c == ',') current = parent.is_object ? state::key : state::value;
+                else if (c == (parent.is_object ? '}' : ']')) close_container();
+                else fail(parent.is_object ? "Expected ',' or '}'" : "Expected ',' or ']'");
+            }
+
+            void close_container()
+            {
+                frame closed = std::move(stack.back());
+                stack.pop_back();
+                path.resize(closed.path_length);
+
+                if (closed.container_rules != nullptr && closed.is_object && closed.container_rules->required != nullptr)
+                {
+                    for (const json& name: *closed.container_rules->required)
+                        if (name.is_string() && !closed.value.contains(name.get_ref<const std::string&>())) { fail("Missing required property \"" + name.get<std::string>() + "\""); return; }
+                }
+                else if (closed.container_rules != nullptr && !closed.is_object && closed.value.size() < closed.container_rules->min_items) { fail("Too few items"); return; }
+
+                complete_value(std::move(closed.value), closed.container_rules);
+            }
+
+            void complete_value(json value, const rules* value_rules)
+            {
+                if (value_rules != nullptr)
+                {
+                    if (value_rules->allowed != nullptr && std::find(value_rules->allowed->begin(), value_rules->allowed->end(), value) == value_rules->allowed->end()) { fail("Value is not one of the allowed values"); return; }
+                    if (value_rules->constant != nullptr && *value_rules->constant != value) { fail("Value does not match the constant"); return; }
+
+                    if (value.is_number())
+                    {
+                        double number = value.get<double>();
+                        if ((value_rules->types & (number_type | integer_type)) == integer_type && !value.is_number_integer() && std::floor(number) != number) { fail("Expected integer but found number"); return; }
+                        if (value_rules->has_minimum && number < value_rules->minimum) { fail("Value is below the minimum"); return; }
+                        if (value_rules->has_maximum && number > value_rules->maximum) { fail("Value is above the maximum"); return; }
+                    }
+                    else if (value.is_string() && string_length < value_rules->min_length) { fail("String is too short"); return; }
+                }
+
+                if (value_callback) value_callback(path, value);
+                for (const std::pair<std::string, std::function<void(const std::string&, const json&)>>& field: field_callbacks)
+                    if (path_matches(field.first, path)) field.second(path, value);
+
+                if (stack.empty()) { root = std::move(value); current = state::complete; return; }
+
+                frame& parent = stack.back();
+                if (parent.is_object) parent.value[parent.key] = std::move(value);
+                else { parent.value.push_back(std::move(value)); ++parent.index; }
+                current = state::after_value;
+            }
+
+            void string_char(char c)
+            {
+                if (unicode_digits > 0)
+                {
+                    int digit = hex_value(c);
+                    if (digit < 0) { fail("Invalid unicode escape"); return; }
+                    code_unit = code_unit * 16 + static_cast<unsigned int>(digit);
+                    if (--unicode_digits == 0) append_code_unit();
+                    return;
+                }
+
+                // The high half of a surrogate pair must be followed by the escaped low half.
+                if (high_surrogate != 0 && !(escaped ? c == 'u' : c == '\\')) { fail("Invalid surrogate pair"); return; }
+
+                if (escaped)
+                {
+                    escaped = false;
+                    switch (c)
+                    {
+                        case '"': case '\\': case '/': append(c); break;
+                        case 'b': append('\b'); break;
+                        case 'f': append('\f'); break;
+                        case 'n': append('\n'); break;
+                        case 'r': append('\r'); break;
+                        case 't': append('\t'); break;
+                        case 'u': unicode_digits = 4; code_unit = 0; break;
+                        default: fail("Invalid escape sequence");
+                    }
+                    return;
+                }
+
+                if (c == '\\') { escaped = true; return; }
+                if (c == '"') { end_string(); return; }
+                if (static_cast<unsigned char>(c) < 0x20) { fail("Control character in string"); return; }
+                append(c);
+            }
+
+            void append_code_unit()
+            {
+                unsigned int code_point = code_unit;
+
+                if (code_unit >= 0xD800 && code_unit <= 0xDBFF)
+                {
+                    if (high_surrogate != 0) { fail("Invalid surrogate pair"); return; }
+                    high_surrogate = code_unit;
+                    return;
+                }
+
+                if (code_unit >= 0xDC00 && code_unit <= 0xDFFF)
+                {
+                    if (high_surrogate == 0) { fail("Invalid surrogate pair"); return; }
+                    code_point = 0x10000 + ((high_surrogate - 0xD800) << 10) + (code_unit - 0xDC00);
+                    high_surrogate = 0;
+                }
+
+                if (code_point < 0x80) append(static_cast<char>(code_point));
+                else if (code_point < 0x800) { append(static_cast<char>(0xC0 | (code_point >> 6))); append(static_cast<char>(0x80 | (code_point & 0x3F))); }
+                else if (code_point < 0x10000)
+                {
+                    append(static_cast<char>(0xE0 | (code_point >> 12)));
+                    append(static_cast<char>(0x80 | ((code_point >> 6) & 0x3F)));
+                    append(static_cast<char>(0x80 | (code_point & 0x3F)));
+                }
+                else
+                {
+                    append(static_cast<char>(0xF0 | (code_point >> 18)));
+                    append(static_cast<char>(0x80 | ((code_point >> 12) & 0x3F)));
+                    append(static_cast<char>(0x80 | ((code_point >> 6) & 0x3F)));
+                    append(static_cast<char>(0x80 | (code_point & 0x3F)));
+                }
+            }
+
+            // Adds a decoded character to the current string and checks the partial string, so that a property name or
+            // value which cannot match the schema fails as soon as it diverges.
+            void append(char c)
+            {
+                scalar += c;
+
+                if (current == state::in_key)
+                {
+                    const rules* object_rules = stack.back().container_rules;
+                    if (object_rules == nullptr || !object_rules->closed) return;
+
+                    const json* properties = object_rules->properties;
+                    if (properties != nullptr)
+                        for (json::const_iterator it = properties->begin(); it != properties->end(); ++it)
+                        if (it.key().compare(0, scalar.size(), scalar) == 0) return;
+
+                    fail("Unexpected property \"" + scalar + "\"");
+                    return;
+                }
+
+                if ((static_cast<unsigned char>(c) & 0xC0) != 0x80) ++string_length;
+                if (value_rules == nullptr) return;
+
+                if (string_length > value_rules->max_length) { fail("String is too long"); return; }
+                if (value_rules->allowed != nullptr && !has_prefix(*value_rules->allowed, scalar)) { fail("Value is not one of the allowed values"); return; }
+                if (value_rules->constant != nullptr && !has_prefix_value(*value_rules->constant, scalar)) fail("Value does not match the constant");
+            }
+
+            void end_string()
+            {
+                if (high_surrogate != 0) { fail("Invalid surrogate pair"); return; }
+
+                if (current == state::in_key)
+                {
+                    frame& parent = stack.back();
+                    parent.key = std::move(scalar);
+                    scalar.clear();
+
+                    path.resize(parent.path_length);
+                    if (!path.empty()) path += '.';
+                    path += parent.key;
+
+                    current = state::colon;
+                    return;
+                }
+
+                complete_value(json(std::move(scalar)), value_rules);
+            }
+
+            bool finish_number()
+            {
+                // Check the grammar, since strtod accepts more than JSON does: -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+                const char* p = scalar.c_str();
+                auto digits = [&p]() { const char* start = p; while (*p >= '0' && *p <= '9') ++p; return p > start; };
+
+                if (*p == '-') ++p;
+                bool valid = *p == '0' ? (++p, true) : (*p >= '1' && *p <= '9' && digits());
+                bool integer = true;
+                if (valid && *p == '.') { ++p; valid = digits(); integer = false; }
+                if (valid && (*p == 'e' || *p == 'E')) { ++p; if (*p == '+' || *p == '-') ++p; valid = digits(); integer = false; }
+                if (!valid || *p != '\0') { fail("Invalid number"); return false; }
+
+                json number;
+                errno = 0;
+                if (integer && scalar[0] == '-') { long long value = std::strtoll(scalar.c_str(), nullptr, 10); if (errno != ERANGE) number = static_cast<json::number_integer_t>(value); }
+                else if (integer) { unsigned long long value = std::strtoull(scalar.c_str(), nullptr, 10); if (errno != ERANGE) number = static_cast<json::number_unsigned_t>(value); }
+                if (number.is_null()) number = json::parse(scalar);     // Unlike strtod, this does not depend on the locale.
+
+                complete_value(std::move(number), value_rules);
+                return current != state::failed;
+            }
+
+            void literal_char(char c)
+            {
+                scalar += c;
+                if (std::strncmp(literal, scalar.c_str(), scalar.size()) != 0) { fail("Invalid literal"); return; }
+                if (scalar.size() == std::strlen(literal)) complete_value(literal[0] == 'n' ? json() : json(literal[0] == 't'), value_rules);
+            }
+
+            json schema;
+            std::function<void(const std::string&, const json&)> value_callback;
+            std::vector<std::pair<std::string, std::function<void(const std::string&, const json&)>>> field_callbacks;
+            bool stop_when_complete = false;
+
+            state current = state::value;
+            std::vector<frame> stack;
+            std::string path, scalar;
+            const char* literal = "";
+            std::map<const json*, rules> compiled;
+            const rules* value_rules = nullptr;
+            json root;
+            std::string error_message;
+
+            size_t string_length = 0;
+            bool escaped = false;
+            int unicode_digits = 0;
+            unsigned int code_unit = 0, high_surrogate = 0;
+    };
+
+    // A fixed set of worker threads which run submitted tasks in the order they are submitted. A task should not wait on
+    // another task submitted to the same pool, since every worker may already be busy.
+    class thread_pool {
+
+        public:
+
+            thread_pool(size_t threads=std::thread::hardware_concurrency())
+            {
+                if (threads == 0) threads = 1;
+                workers.reserve(threads);
+                for (size_t i = 0; i < threads; ++i) workers.push_back(std::thread([this]{ run(); }));
+            }
+
+            ~thread_pool()
+            {
+                { std::lock_guard<std::mutex> lock(mutex); stopping = true; }
+                ready.notify_all();
+                for (std::thread& worker: workers) worker.join();
+            }
+
+            thread_pool(const thread_pool&) = delete;
+            thread_pool& operator=(const thread_pool&) = delete;
+
+            // Queues a task and returns a future for its result. An exception thrown by the task is stored in the future.
+            template<typename Task>
+            auto submit(Task task) -> std::future<decltype(task())>
+            {
+                typedef decltype(task()) result_type;
+                std::shared_ptr<std::packaged_task<result_type()>> packaged = std::make_shared<std::packaged_task<result_type()>>(std::move(task));
+                std::future<result_type> result = packaged->get_future();
+
+                { std::lock_guard<std::mutex> lock(mutex); tasks.push_back([packaged]{ (*packaged)(); }); }
+                ready.notify_one();
+                return result;
+            }
+
+            size_t size() const { return workers.size(); }
+
+            // Runs body(0) to body(count-1) on the pool, with the calling thread taking part, and returns once every call has
+            // finished. The caller only waits for calls which have started, so this can be used from a task in the same pool.
+            // The first exception thrown by a call is rethrown.
+            void parallel_for(size_t count, const std::function<void(size_t)>& body)
+            {
+                if (count == 0) return;
+
+                struct progress {
+                    std::atomic<size_t> next{0};
+                    size_t finished = 0;
+                    std::exception_ptr error;
+                    std::mutex mutex;
+                    std::condition_variable done;
+                };
+                std::shared_ptr<progress> state = std::make_shared<progress>();
+                const std::function<void(size_t)>* work = &body;
+
+                // Helpers which start after the last call has been claimed return without touching the body.
+                std::function<void()> drain = [state, work, count] {
+                    size_t i;
+                    while ((i = state->next.fetch_add(1)) < count)
+                    {
+                        std::exception_ptr error;
+                        try { (*work)(i); } catch (...) { error = std::current_exception(); }
+
+                        std::lock_guard<std::mutex> lock(state->mutex);
+                        if (error && !state->error) state->error = error;
+                        if (++state->finished == count) state->done.notify_all();
+                    }
+                };
+
+                size_t helpers = std::min(count - 1, workers.size());
+                if (helpers > 0)
+                {
+                    { std::lock_guard<std::mutex> lock(mutex); for (size_t i = 0; i < helpers; ++i) tasks.push_back(drain); }
+                    ready.notify_all();
+                }
+                drain();
+
+                std::unique_lock<std::mutex> lock(state->mutex);
+                state->done.wait(lock, [&state, count]{ return state->finished == count; });
+                if (state->error) std::rethrow_exception(state->error);
+            }
+
+            // A pool shared by the library, with one thread for each hardware thread.
+            static thread_pool& shared() { static thread_pool pool; return pool; }
+
+        private:
+
+            void run()
+            {
+                while (true)
+                {
+                    std::function<void()> task;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        ready.wait(lock, [this]{ return stopping || !tasks.empty(); });
+                        if (tasks.empty()) return;
+                        task = std::move(tasks.front());
+                        tasks.pop_front();
+                    }
+                    task();
+                }
+            }
+
+            std::vector<std::thread> workers;
+            std::deque<std::function<void()>> tasks;
+            std::mutex mutex;
+            std::condition_variable ready;
+            bool stopping = false;
+    };
+
+    // A call to a tool made by the model.
+    struct tool_call {
+
+        std::string name;
+        json arguments = json::object();
+
+        json to_json() const
+        {
+            json call;
+            call["function"]["name"] = name;
+            call["function"]["arguments"] = arguments;
+            return call;
+        }
+
+        // Reads the tool calls of a message from a chat response.
+        static std::vector<tool_call> from_message(const json& message)
+        {
+            std::vector<tool_call> calls;
+            if (!message.is_object() || !message.contains("tool_calls") || !message["tool_calls"].is_array()) return calls;
+
+            for (const json& entry: message["tool_calls"])
+            {
+                if (!entry.contains("function")) continue;
+                tool_call call;
+                call.name = entry["function"].value("name", "");
+                if (entry["function"].contains("arguments")) call.arguments = entry["function"]["arguments"];
+                calls.push_back(std::move(call));
+            }
+            return calls;
+        }
+    };
+
+    // Assembles the reply of a streamed chat, including tool calls which may arrive over several chunks. A call with an
+    // index continues the call with the same index, and arguments sent as string fragments are joined and parsed.
+    class tool_call_assembler {
+
+        public:
+
+            // Returns a callback which adds each token before passing it on. The assembler must outlive the stream.
+            std::function<bool(const ollama::response&)> wrap(std::function<bool(const ollama::response&)> on_token=nullptr)
+            {
+                reset();
+                return [this, on_token](const ollama::response& token) -> bool {
+                    add(token);
+                    return on_token ? on_token(token) : true;
+                };
+            }
+
+            void add(const ollama::response& response)
+            {
+                content += response.as_simple_string();
+
+                // Only the replies which carry calls need their json, so a streamed answer is not parsed a second time.
+                if (!response.has_tool_calls()) return;
+
+                const json& data = response.as_json();
+                if (!data.contains("message") || !data["message"].is_object()) return;
+
+                const json& message = data["message"];
+                if (!message.contains("tool_calls") || !message["tool_calls"].is_array()) return;
+
+                for (const json& entry: message["tool_calls"])
+                {
+                    if (!entry.contains("function") || !entry["function"].is_object()) continue;
+                    const json& function = entry["function"];
+
+                    size_t index = function.contains("index") && function["index"].is_number() ? function["index"].get<size_t>() : pending.size();
+                    if (index >= pending.size()) pending.resize(index + 1);
+                    partial_call& call = pending[index];
+
+                    if (function.contains("name") && function["name"].is_string() && !function["name"].get_ref<const std::string&>().empty()) call.name = function["name"];
+                    if (!function.contains("arguments")) continue;
+
+                    const json& arguments = function["arguments"];
+                    if (arguments.is_string()) call.fragments += arguments.get_ref<const std::string&>();
+                    else if (arguments.is_object()) call.arguments.update(arguments);
+                }
+            }
+
+            // The completed calls in index order.
+            std::vector<tool_call> calls() const
+            {
+                std::vector<tool_call> completed;
+                for (const partial_call& call: pending)
+                {
+                    if (call.name.empty()) continue;
+
+                    tool_call assembled;
+                    assembled.name = call.name;
+                    assembled.arguments = call.arguments;
+                    if (!call.fragments.empty())
+                    {
+                        json parsed = json::parse(call.fragments, nullptr, false);
+                        if (parsed.is_object()) assembled.arguments.update(parsed);
+                        else assembled.arguments = call.fragments;
+                    }
+                    completed.push_back(std::move(assembled));
+                }
+                return completed;
+            }
+
+            const std::string& text() const { return content; }
+
+            // The assistant message for the history, including its tool calls.
+            ollama::message message() const
+            {
+                ollama::message reply("assistant", content);
+                std::vector<tool_call> completed = calls();
+                if (!completed.empty())
+                {
+                    json& calls_json = reply["tool_calls"] = json::array();
+                    for (const tool_call& call: completed) calls_json.push_back(call.to_json());
+                }
+                return reply;
+            }
+
+            void reset() { content.clear(); pending.clear(); }
+
+        private:
+
+            struct partial_call {
+                std::string name;
+                json arguments = json::object();
+                std::string fragments;
+            };
+
+            std::string content;
+            std::vector<partial_call> pending;
+    };
+
+    // C++ functions which the model can call, along with their definitions.
+    class tool_registry {
+
+        public:
+
+            typedef std::function<json(const json& arguments)> function;
+
+            tool_registry& add(const std::string& name, const std::string& description, const json& parameters, function callable)
+            {
+                definitions_list.push_back(ollama::tool(name, description, parameters));
+                functions[name] = callable;
+                return *this;
+            }
+
+            bool contains(const std::string& name) const { return functions.count(name) > 0; }
+            const ollama::tools& definitions() const { return definitions_list; }
+
+            // Runs a call and returns the content of its tool message. A string result is used as it is and other results
+            // are serialized. An unknown tool or an exception thrown by the tool is reported to the model as an error.
+            std::string call(const tool_call& call) const
+            {
+                std::map<std::string, function>::const_iterator found = functions.find(call.name);
+                if (found == functions.end()) return "Error: unknown tool \"" + call.name + "\"";
+
+                try
+                {
+                    json result = found->second(call.arguments);
+                    return result.is_string() ? result.get<std::string>() : result.dump();
+                }
+                catch (const std::exception& e) { return std::string("Error: ") + e.what(); }
+                catch (...) { return "Error: the tool failed"; }
+            }
+
+            // Runs independent calls in parallel on the pool and returns their results in the order of the calls.
+            std::vector<std::string> call_all(const std::vector<tool_call>& calls, ollama::thread_pool& pool=ollama::thread_pool::shared()) const
+            {
+                std::vector<std::string> results;
+                results.reserve(calls.size());
+
+                if (calls.size() == 1) { results.push_back(call(calls.front())); return results; }
+
+                std::vector<std::future<std::string>> pending;
+                pending.reserve(calls.size());
+                for (const tool_call& each: calls) pending.push_back(pool.submit([this, &each]{ return call(each); }));
+                for (std::future<std::string>& result: pending) results.push_back(result.get());
+
+                return results;
+            }
+
+            // The tool message which returns a result to the model.
+            static ollama::message result_message(const tool_call& call, const std::string& content)
+            {
+                ollama::message result("tool", content);
+                result["tool_name"] = call.name;
+                return result;
+            }
+
+        private:
+
+            ollama::tools definitions_list;
+            std::map<std::string, function> functions;
+    };
+
+    // Similarity measures for vector search.
+    enum class metric { cosine, dot, l2 };
+
+    // Kernels used by vector search. The widest instruction set supported by the processor is chosen the first time a
+    // kernel is needed, with a portable version used everywhere else.
+    namespace simd {
+
+        typedef float (*kernel)(const float* a, const float* b, size_t n);
+        typedef int32_t (*int8_kernel)(const int8_t* a, const int8_t* b, size_t n);
+        typedef uint32_t (*bit_kernel)(const uint64_t* a, const uint64_t* b, size_t words);
+
+        struct kernels {
+            const char* name;
+            kernel dot;
+            kernel l2;              // Squared Euclidean distance.
+            int8_kernel dot_int8;
+            bit_kernel hamming;     // Number of differing bits.
+        };
+
+        inline float dot_scalar(const float* a, const float* b, size_t n)
+        {
+            float sum[4] = {0, 0, 0, 0};
+            size_t i = 0;
+            for (; i + 4 <= n; i += 4)
+                for (size_t lane = 0; lane < 4; ++lane) sum[lane] += a[i+lane] * b[i+lane];
+            for (; i < n; ++i) sum[0] += a[i] * b[i];
+            return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+        }
+
+        inline float l2_scalar(const float* a, const float* b, size_t n)
+        {
+            float sum[4] = {0, 0, 0, 0};
+            size_t i = 0;
+            for (; i + 4 <= n; i += 4)
+                for (size_t lane = 0; lane < 4; ++lane) { float d = a[i+lane] - b[i+lane]; sum[lane] += d * d; }
+            for (; i < n; ++i) { float d = a[i] - b[i]; sum[0] += d * d; }
+            return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+        }
+
+        inline int32_t dot_int8_scalar(const int8_t* a, const int8_t* b, size_t n)
+        {
+            int32_t sum = 0;
+            for (size_t i = 0; i < n; ++i) sum += static_cast<int32_t>(a[i]) * b[i];
+            return sum;
+        }
+
+        inline uint32_t hamming_scalar(const uint64_t* a, const uint64_t* b, size_t words)
+        {
+            uint32_t count = 0;
+            for (size_t i = 0; i < words; ++i)
+            {
+                uint64_t x = a[i] ^ b[i];
+                x = x - ((x >> 1) & 0x5555555555555555ULL);
+                x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+                x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+                count += static_cast<uint32_t>((x * 0x0101010101010101ULL) >> 56);
+            }
+            return count;
+        }
+
+#ifdef OLLAMA_HAS_X86_DISPATCH
+        __attribute__((target("avx2,fma"))) inline float sum_avx2(__m256 v)
+        {
+            __m128 half = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+            half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+            half = _mm_add_ss(half, _mm_movehdup_ps(half));
+            return _mm_cvtss_f32(half);
+        }
+
+        __attribute__((target("avx2,fma"))) inline float dot_avx2(const float* a, const float* b, size_t n)
+        {
+            __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+            size_t i = 0;
+            for (; i + 16 <= n; i += 16)
+            {
+                sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i), sum0);
+                sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a+i+8), _mm256_loadu_ps(b+i+8), sum1);
+            }
+            if (i + 8 <= n) { sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i), sum0); i += 8; }
+            float sum = sum_avx2(_mm256_add_ps(sum0, sum1));
+            for (; i < n; ++i) sum += a[i] * b[i];
+            return sum;
+        }
+
+        __attribute__((target("avx2,fma"))) inline float l2_avx2(const float* a, const float* b, size_t n)
+        {
+            __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+            size_t i = 0;
+            for (; i + 16 <= n; i += 16)
+            {
+                __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i));
+                __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a+i+8), _mm256_loadu_ps(b+i+8));
+                sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+                sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+            }
+            if (i + 8 <= n) { __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i)); sum0 = _mm256_fmadd_ps(d, d, sum0); i += 8; }
+            float sum = sum_avx2(_mm256_add_ps(sum0, sum1));
+            for (; i < n; ++i) { float d = a[i] - b[i]; sum += d * d; }
+            return sum;
+        }
+
+        // Adds the halves through zero-masked extracts. The unmasked extracts, which _mm512_reduce_add_ps is built on, pass
+        // an undefined vector through that GCC 12 reports as uninitialized at -O2.
+        __attribute__((target("avx512f,avx2,fma"))) inline float sum_avx512(__m512 v)
+        {
+            __m256 low = _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xFF, _mm512_castps_pd(v), 0));
+            __m256 high = _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xFF, _mm512_castps_pd(v), 1));
+            return sum_avx2(_mm256_add_ps(low, high));
+        }
+
+        __attribute__((target("avx512f,avx2,fma"))) inline float dot_avx512(const float* a, const float* b, size_t n)
+        {
+            __m512 sum0 = _mm512_setzero_ps(), sum1 = _mm512_setzero_ps();
+            size_t i = 0;
+            for (; i + 32 <= n; i += 32)
+            {
+                sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a+i), _mm512_loadu_ps(b+i), sum0);
+                sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(a+i+16), _mm512_loadu_ps(b+i+16), sum1);
+            }
+            for (; i < n; i += 16)
+            {
+                __mmask16 mask = n - i >= 16 ? static_cast<__mmask16>(0xFFFF) : static_cast<__mmask16>((1u << (n - i)) - 1);
+                sum0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a+i), _mm512_maskz_loadu_ps(mask, b+i), sum0);
+            }
+            return sum_avx512(_mm512_add_ps(sum0, sum1));
+        }
+
+        __attribute__((target("avx512f,avx2,fma"))) inline float l2_avx512(const float* a, const float* b, size_t n)
+        {
+            __m512 sum0 = _mm512_setzero_ps(), sum1 = _mm512_setzero_ps();
+            size_t i = 0;
+            for (; i + 32 <= n; i += 32)
+            {
+                __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a+i), _mm512_loadu_ps(b+i));
+                __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a+i+16), _mm512_loadu_ps(b+i+16));
+                sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+                sum1 = _mm512_fmadd_ps(d1, d1, sum1);
+            }
+            for (; i < n; i += 16)
+            {
+                __mmask16 mask = n - i >= 16 ? static_cast<__mmask16>(0xFFFF) : static_cast<__mmask16>((1u << (n - i)) - 1);
+                __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a+i), _mm512_maskz_loadu_ps(mask, b+i));
+                sum0 = _mm512_fmadd_ps(d, d, sum0);
+            }
+            return sum_avx512(_mm512_add_ps(sum0, sum1));
+        }
+
+        __attribute__((target("avx2"))) inline int32_t sum_epi32_avx2(__m256i v)
+        {
+            __m128i half = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+            half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4E));
+            half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xB1));
+            return _mm_cvtsi128_si32(half);
+        }
+
+        // Int8 values are widened to int16 and multiplied in pairs into int32 sums.
+        __attribute__((target("avx2"))) inline int32_t dot_int8_avx2(const int8_t* a, const int8_t* b, size_t n)
+        {
+            __m256i sum = _mm256_setzero_si256();
+            size_t i = 0;
+            for (; i + 16 <= n; i += 16)
+            {
+                __m256i x = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a+i)));
+                __m256i y = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b+i)));
+                sum = _mm256_add_epi32(sum, _mm256_madd_epi16(x, y));
+            }
+            int32_t total = sum_epi32_avx2(sum);
+            for (; i < n; ++i) total += static_cast<int32_t>(a[i]) * b[i];
+            return total;
+        }
+
+        __attribute__((target("avx512f,avx512bw,avx2"))) inline int32_t dot_int8_avx512(const int8_t* a, const int8_t* b, size_t n)
+        {
+            __m512i sum = _mm512_setzero_si512();
+            size_t i = 0;
+            for (; i + 32 <= n; i += 32)
+            {
+                __m512i x = _mm512_cvtepi8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a+i)));
+                __m512i y = _mm512_cvtepi8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(b+i)));
+                sum = _mm512_add_epi32(sum, _mm512_madd_epi16(x, y));
+            }
+            // As with sum_avx512, zero-masked extracts avoid the uninitialized warnings of _mm512_reduce_add_epi32.
+            int32_t total = sum_epi32_avx2(_mm256_add_epi32(_mm512_maskz_extracti64x4_epi64(0xFF, sum, 0), _mm512_maskz_extracti64x4_epi64(0xFF, sum, 1)));
+            for (; i < n; ++i) total += static_cast<int32_t>(a[i]) * b[i];
+            return total;
+        }
+
+        __attribute__((target("popcnt"))) inline uint32_t hamming_popcnt(const uint64_t* a, const uint64_t* b, size_t words)
+        {
+            uint32_t count = 0;
+            for (size_t i = 0; i < words; ++i) count += static_cast<uint32_t>(__builtin_popcountll(a[i] ^ b[i]));
+            return count;
+        }
+#endif
+
+        // Every set of kernels the processor can run, from the most portable to the widest.
+        inline std::vector<kernels> available()
+        {
+            std::vector<kernels> supported;
+            supported.push_back(kernels{"scalar", dot_scalar, l2_scalar, dot_int8_scalar, hamming_scalar});
+#ifdef OLLAMA_HAS_X86_DISPATCH
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("popcnt"))
+                supported.push_back(kernels{"avx2", dot_avx2, l2_avx2, dot_int8_avx2, hamming_popcnt});
+            if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("popcnt"))
+                supported.push_back(kernels{"avx512", dot_avx512, l2_avx512, dot_int8_avx512, hamming_popcnt});
+#endif
+            return supported;
+        }
+
+        inline const kernels& best() { static const kernels chosen = available().back(); return chosen; }
+    }
+
+    // One match from a vector search. For cosine and dot the score is the similarity, where higher is closer, and for
+    // l2 it is the squared distance, where lower is closer.
+    struct search_result {
+        std::string id;
+        float score = 0;
+        size_t index = 0;           // Position of the vector in the index.
+    };
+
+    // Keeps the k closest of a stream of scored positions, where a higher score is closer. Ties go to the earlier position.
+    class nearest_k {
+
+        public:
+
+            typedef std::pair<float, size_t> candidate;
+
+            nearest_k(size_t k=0): k(k) {}
+
+            void add(float score, size_t index)
+            {
+                if (heap.size() < k) { heap.push_back(candidate(score, index)); std::push_heap(heap.begin(), heap.end(), closer); }
+                else if (k > 0 && closer(candidate(score, index), heap.front()))
+                {
+                    std::pop_heap(heap.begin(), heap.end(), closer);
+                    heap.back() = candidate(score, index);
+                    std::push_heap(heap.begin(), heap.end(), closer);
+                }
+            }
+
+            void merge(const nearest_k& other) { for (const candidate& each: other.heap) add(each.first, each.second); }
+
+            // The candidates kept so far, closest first.
+            std::vector<candidate> sorted() const
+            {
+                std::vector<candidate> result = heap;
+                std::sort(result.begin(), result.end(), closer);
+                return result;
+            }
+
+        private:
+
+            static bool closer(const candidate& a, const candidate& b) { return a.first > b.first || (a.first == b.first && a.second < b.second); }
+
+            size_t k;
+            std::vector<candidate> heap;    // The furthest candidate is on top.
+    };
+
+    // Scores positions 0 to count-1 and returns the k highest, closest first. The positions are split into parts which
+    // are scored in parallel on the pool once there is enough work, where cost is the work for each position.
+    template<typename Score>
+    std::vector<nearest_k::candidate> nearest_scan(size_t count, size_t k, size_t cost, Score score, ollama::thread_pool& pool)
+    {
+        const size_t work_per_part = 1 << 18;
+        size_t parts = std::max<size_t>(1, std::min(pool.size() + 1, (count * cost + work_per_part - 1) / work_per_part));
+
+        std::vector<nearest_k> tops(parts, nearest_k(k));
+        auto scan_part = [&](size_t part) {
+            size_t last = count * (part + 1) / parts;
+            for (size_t i = count * part / parts; i < last; ++i) tops[part].add(score(i), i);
+        };
+        if (parts == 1) scan_part(0);
+        else pool.parallel_for(parts, scan_part);
+
+        for (size_t part = 1; part < parts; ++part) tops[0].merge(tops[part]);
+        return tops[0].sorted();
+    }
+
+    // How a vector_index stores its vectors. Int8 keeps one byte for each dimension and a scale for each vector, using a
+    // quarter of the memory of float32, while binary keeps only the sign of each dimension, using a thirty-second.
+    enum class quantization { none, int8, binary };
+
+    struct quantization_options {
+        quantization_options(ollama::quantization type=ollama::quantization::none): type(type) {}
+
+        ollama::quantization type;
+        size_t rescore = 4;             // Candidates rescored in full precision for each result. Zero ranks by the quantized scores alone.
+        bool keep_vectors = true;       // Keep float32 vectors for rescoring. Without them, rescoring reads vectors from set_vector_source.
+    };
+
+    // Embeddings stored contiguously with an ID for each, searched by brute force. Vectors are normalized when added to a
+    // cosine index, so that cosine similarity is computed as a dot product. A quantized index searches its compact codes
+    // first, then rescores the closest candidates with full precision vectors where they are available.
+    class vector_index {
+
+        public:
+
+            // With zero dimensions, the dimensions are taken from the first vector added.
+            vector_index(size_t dimensions=0, ollama::metric measure=ollama::metric::cosine, const quantization_options& quantized=quantization_options()):
+                dims(dimensions), measure(measure), quantized(quantized) {}
+
+            size_t dimensions() const { return dims; }
+            size_t size() const { return ids.size(); }
+            bool empty() const { return ids.empty(); }
+            ollama::metric get_metric() const { return measure; }
+            const quantization_options& get_quantization() const { return quantized; }
+
+            const std::string& id(size_t index) const { return ids[index]; }
+
+            // The stored vector, or nullptr when a quantized index does not keep its vectors.
+            const float* vector(size_t index) const { return has_vectors() ? values.data() + index * dims : nullptr; }
+
+            // Supplies full precision vectors for rescoring when the index does not keep them, for example from a file.
+            void set_vector_source(std::function<const float*(size_t index)> source) { vector_source = source; }
+
+            // Memory used by the stored vectors and codes, not counting IDs.
+            size_t memory_bytes() const
+            {
+                return values.capacity() * sizeof(float) + codes.capacity() + scales.capacity() * sizeof(float) +
+                       norms.capacity() * sizeof(float) + bits.capacity() * sizeof(uint64_t);
+            }
+
+            void reserve(size_t count)
+            {
+                ids.reserve(count);
+                if (dims == 0) return;
+                if (has_vectors()) values.reserve(count * dims);
+                if (quantized.type == ollama::quantization::int8) { codes.reserve(count * dims); scales.reserve(count); norms.reserve(count); }
+                if (quantized.type == ollama::quantization::binary) { bits.reserve(count * words()); norms.reserve(count); }
+            }
+
+            void clear() { ids.clear(); values.clear(); codes.clear(); scales.clear(); norms.clear(); bits.clear(); }
+
+            bool add(const std::string& id, const float* vector, size_t dimensions)
+            {
+                if (dims == 0) dims = dimensions;
+                if (dimensions != dims || dims == 0)
+                {
+                    if (ollama::use_exceptions) throw ollama::exception("Vector for \""+id+"\" has "+std::to_string(dimensions)+" dimensions but the index has "+std::to_string(dims));
+                    return false;
+                }
+
+                std::vector<float> normalized;
+                if (measure == ollama::metric::cosine) { normalized.assign(vector, vector + dims); normalize(normalized.data()); vector = normalized.data(); }
+
+                if (has_vectors()) values.insert(values.end(), vector, vector + dims);
+                if (quantized.type == ollama::quantization::int8)
+                {
+                    codes.resize(codes.size() + dims);
+                    float scale, norm;
+                    quantize_int8(vector, &codes[codes.size() - dims], scale, norm);
+                    scales.push_back(scale);
+                    norms.push_back(norm);
+                }
+                if (quantized.type == ollama::quantization::binary)
+                {
+                    bits.resize(bits.size() + words());
+                    quantize_binary(vector, &bits[bits.size() - words()]);
+                    norms.push_back(simd::best().dot(vector, vector, dims));
+                }
+                ids.push_back(id);
+                return true;
+            }
+
+            bool add(const std::string& id, const std::vector<float>& vector) { return add(id, vector.data(), vector.size()); }
+
+            // Adds each embedding of a response from generate_embeddings, in order, under the given IDs. Returns the number added.
+            size_t add(const std::vector<std::string>& ids, const ollama::response& response)
+            {
+                std::vector<float> embeddings;
+                size_t dimensions = 0;
+                size_t count = response.get_embeddings(embeddings, dimensions) && dimensions > 0 ? embeddings.size() / dimensions : 0;
+                if (count != ids.size())
+                {
+                    if (ollama::use_exceptions) throw ollama::exception("Response has "+std::to_string(count)+" embeddings for "+std::to_string(ids.size())+" IDs");
+                    return 0;
+                }
+
+                size_t added = 0;
+                for (size_t i = 0; i < ids.size(); ++i)
+                    if (add(ids[i], embeddings.data() + i * dimensions, dimensions)) ++added;
+                return added;
+            }
+
+            // Returns the k closest vectors to the query, closest first. Large indexes are searched in parallel on the pool.
+            std::vector<search_result> search(const float* query, size_t dimensions, size_t k, ollama::thread_pool& pool=ollama::thread_pool::shared()) const
+            {
+                if (dims != 0 && dimensions != dims)
+                {
+                    if (ollama::use_exceptions) throw ollama::exception("Query has "+std::to_string(dimensions)+" dimensions but the index has "+std::to_string(dims));
+                    return std::vector<search_result>();
+                }
+                if (k == 0 || empty()) return std::vector<search_result>();
+
+                std::vector<float> normalized;
+                if (measure == ollama::metric::cosine) { normalized.assign(query, query + dims); normalize(normalized.data()); query = normalized.data(); }
+
+                encoded_query encoded;
+                encoded.values = query;
+                encoded.norm = simd::best().dot(query, query, dims);
+                if (quantized.type == ollama::quantization::int8) { encoded.codes.resize(dims); quantize_int8(query, encoded.codes.data(), encoded.scale, encoded.norm); }
+                if (quantized.type == ollama::quantization::binary) { encoded.bits.resize(words()); quantize_binary(query, encoded.bits.data()); }
+
+                // A quantized search gathers extra candidates to rescore.
+                bool rescoring = quantized.type != ollama::quantization::none && quantized.rescore > 0 && (has_vectors() || vector_source);
+                size_t gathered = rescoring ? std::min(size(), k * quantized.rescore) : k;
+                std::vector<candidate> nearest = scan(encoded, gathered, pool);
+
+                if (rescoring)
+                {
+                    nearest_k rescored(k);
+                    for (const candidate& each: nearest) rescored.add(exact_score(query, each.second), each.second);
+                    nearest = rescored.sorted();
+                }
+
+                std::vector<search_result> results;
+                results.reserve(nearest.size());
+                for (const candidate& each: nearest)
+                {
+                    search_result result;
+                    result.id = ids[each.second];
+                    result.score = measure == ollama::metric::l2 ? -each.first : each.first;
+                    result.index = each.second;
+                    results.push_back(std::move(result));
+                }
+                return results;
+            }
+
+            std::vector<search_result> search(const std::vector<float>& query, size_t k, ollama::thread_pool& pool=ollama::thread_pool::shared()) const
+            {
+                return search(query.data(), query.size(), k, pool);
+            }
+
+        private:
+
+            typedef nearest_k::candidate candidate;
+
+            // A query in each of the forms the index may compare it in.
+            struct encoded_query {
+                const float* values = nullptr;
+                float norm = 0;                 // Squared length.
+                std::vector<int8_t> codes;
+                float scale = 0;
+                std::vector<uint64_t> bits;
+            };
+
+            bool has_vectors() const { return quantized.type == ollama::quantization::none || quantized.keep_vectors; }
+            size_t words() const { return (dims + 63) / 64; }
+
+            // A score from a dot product and the squared lengths of the two vectors.
+            float score(float dot, float query_norm, float vector_norm) const
+            {
+                return measure == ollama::metric::l2 ? -(query_norm + vector_norm - 2 * dot) : dot;
+            }
+
+            std::vector<candidate> scan(const encoded_query& query, size_t k, ollama::thread_pool& pool) const
+            {
+                const simd::kernels& kernels = simd::best();
+
+                if (quantized.type == ollama::quantization::int8)
+                {
+                    return nearest_scan(size(), k, dims, [&](size_t i) {
+                        return score(kernels.dot_int8(query.codes.data(), codes.data() + i * dims, dims) * query.scale * scales[i], query.norm, norms[i]);
+                    }, pool);
+                }
+
+                if (quantized.type == ollama::quantization::binary)
+                {
+                    // The angle between two vectors is estimated from the share of dimensions whose signs differ.
+                    const double pi = 3.14159265358979323846;
+                    std::vector<float> cosines(dims + 1);
+                    for (size_t h = 0; h <= dims; ++h) cosines[h] = static_cast<float>(std::cos(pi * h / dims));
+
+                    return nearest_scan(size(), k, words(), [&](size_t i) {
+                        float dot = cosines[kernels.hamming(query.bits.data(), bits.data() + i * words(), words())] * std::sqrt(query.norm * norms[i]);
+                        return score(dot, query.norm, norms[i]);
+                    }, pool);
+                }
+
+                return nearest_scan(size(), k, dims, [&](size_t i) {
+                    const float* vector = values.data() + i * dims;
+                    return measure == ollama::metric::l2 ? -kernels.l2(query.values, vector, dims) : kernels.dot(query.values, vector, dims);
+                }, pool);
+            }
+
+            // The full precision score of a stored vector. Vectors from a source are normalized here for a cosine index.
+            float exact_score(const float* query, size_t index) const
+            {
+                const simd::kernels& kernels = simd::best();
+                const float* vector = has_vectors() ? values.data() + index * dims : vector_source(index);
+                if (measure == ollama::metric::l2) return -kernels.l2(query, vector, dims);
+
+                float dot = kernels.dot(query, vector, dims);
+                if (measure == ollama::metric::cosine && !has_vectors())
+                {
+                    float norm = std::sqrt(kernels.dot(vector, vector, dims));
+                    if (norm > 0) dot /= norm;
+                }
+                return dot;
+            }
+
+            // Scales a vector so its largest magnitude becomes 127, and returns the scale and the squared length of the codes.
+            void quantize_int8(const float* vector, int8_t* code, float& scale, float& norm) const
+            {
+                float largest = 0;
+                for (size_t i = 0; i < dims; ++i) largest = std::max(largest, std::fabs(vector[i]));
+                scale = largest / 127.0f;
+
+                int32_t squares = 0;
+                for (size_t i = 0; i < dims; ++i)
+                {
+                    code[i] = scale > 0 ? static_cast<int8_t>(std::lround(vector[i] / scale)) : 0;
+                    squares += static_cast<int32_t>(code[i]) * code[i];
+                }
+                norm = squares * scale * scale;
+            }
+
+            void quantize_binary(const float* vector, uint64_t* code) const
+            {
+                std::fill(code, code + words(), 0);
+                for (size_t i = 0; i < dims; ++i)
+                    if (vector[i] > 0) code[i / 64] |= uint64_t(1) << (i % 64);
+            }
+
+            void normalize(float* vector) const
+            {
+                float norm = std::sqrt(simd::best().dot(vector, vector, dims));
+                if (norm > 0) for (size_t i = 0; i < dims; ++i) vector[i] /= norm;
+            }
+
+            size_t dims;
+            ollama::metric measure;
+            quantization_options quantized;
+            std::function<const float*(size_t)> vector_source;
+
+            std::vector<float> values;
+            std::vector<int8_t> codes;          // Int8 codes, with a scale for each vector.
+            std::vector<float> scales;
+            std::vector<float> norms;           // Squared length of each vector, for int8 and binary.
+            std::vector<uint64_t> bits;         // Signs of each dimension, packed 64 to a word.
+            std::vector<std::string> ids;
+    };
+
+    // Embeddings kept in a file which is mapped into memory, so that opening even a large store is quick and vectors are
+    // read in place rather than parsed. Each append writes a segment holding the vectors of a batch as a contiguous matrix,
+    // followed by their squared lengths and their IDs and metadata. The header records the size of the last complete
+    // segment, so a partly written append is ignored when the file is next opened. Numbers are stored little-endian.
+    class embedding_store {
+
+        public:
+
+            ~embedding_store()
+            {
+                for (mapping& each: mappings) unmap(each);
+                if (file) std::fclose(file);
+            }
+
+            embedding_store(const embedding_store&) = delete;
+            embedding_store& operator=(const embedding_store&) = delete;
+
+            // Opens a store, creating it if it does not exist. Dimensions are needed to create a store and are checked
+            // against an existing store when given.
+            static std::shared_ptr<embedding_store> open(const std::string& filepath, size_t dimensions=0)
+            {
+                uint16_t byte_order = 1;
+                if (*reinterpret_cast<unsigned char*>(&byte_order) != 1) { if (ollama::use_exceptions) throw ollama::exception("Embedding stores are only supported on little-endian machines"); return nullptr; }
+
+                std::shared_ptr<embedding_store> store(new embedding_store());
+                store->path = filepath;
+                store->file = std::fopen(filepath.c_str(), "r+b");
+
+                if (!store->file)
+                {
+                    if (dimensions == 0) { if (ollama::use_exceptions) throw ollama::exception("Dimensions are needed to create embedding store "+filepath); return nullptr; }
+                    store->file = std::fopen(filepath.c_str(), "w+b");
+                    if (!store->file) { if (ollama::use_exceptions) throw ollama::exception("Unable to create embedding store "+filepath); return nullptr; }
+
+                    store->dims = dimensions;
+                    store->committed = header_size;
+                    if (!store->write_header(0)) { if (ollama::use_exceptions) throw ollama::exception("Unable to write embedding store "+filepath); return nullptr; }
+                }
+                else
+                {
+                    unsigned char header[header_size];
+                    if (std::fread(header, 1, header_size, store->file) != header_size || std::memcmp(header, file_magic, 8) != 0 || get(header + 8, 4) != 1)
+                    {
+                        if (ollama::use_exceptions) throw ollama::exception("Invalid embedding store "+filepath);
+                        return nullptr;
+                    }
+                    store->dims = static_cast<size_t>(get(header + 12, 4));
+                    store->committed = static_cast<size_t>(get(header + 16, 8));
+
+                    if (dimensions != 0 && dimensions != store->dims)
+                    {
+                        if (ollama::use_exceptions) throw ollama::exception("Embedding store "+filepath+" has "+std::to_string(store->dims)+" dimensions rather than "+std::to_string(dimensions));
+                        return nullptr;
+                    }
+                }
+
+                if (!store->remap(header_size))
+                {
+                    if (ollama::use_exceptions) throw ollama::exception("Invalid embedding store "+filepath);
+                    return nullptr;
+                }
+                return store;
+            }
+
+            size_t dimensions() const { return dims; }
+            size_t size() const { std::lock_guard<std::mutex> lock(segments_mutex); return count; }
+            bool empty() const { return size() == 0; }
+
+            // The vector stored at a position, which points into the mapped file and stays valid while the store is open.
+            const float* vector(size_t index) const
+            {
+                segment found = find(index);
+                return found.vectors + (index - found.first) * dims;
+            }
+
+            std::string id(size_t index) const { return entry(index, 0); }
+            std::string metadata(size_t index) const { return entry(index, 1); }
+
+            // Appends a batch of vectors, given as a matrix with a row for each ID, with optional metadata for each.
+            bool append(const std::vector<std::string>& ids, const float* vectors, size_t dimensions, const std::vector<std::string>& metadata=std::vector<std::string>())
+            {
+                if (dimensions != dims || (!metadata.empty() && metadata.size() != ids.size()))
+                {
+                    if (ollama::use_exceptions) throw ollama::exception("Batch does not match embedding store "+path+" with "+std::to_string(dims)+" dimensions");
+                    return false;
+                }
+                if (ids.empty()) return true;
+
+                std::lock_guard<std::mutex> lock(append_mutex);
+                size_t start = committed;
+
+                // Segment header, vectors, squared lengths, then offsets into the IDs and metadata that follow.
+                std::string head(segment_header_size, '\0');
+                std::memcpy(&head[0], segment_magic, 8);
+                std::string blob;
+                std::vector<uint64_t> offsets(1, 0);
+                for (size_t i = 0; i < ids.size(); ++i)
+                {
+                    blob += ids[i];
+                    offsets.push_back(blob.size());
+                    if (!metadata.empty()) blob += metadata[i];
+                    offsets.push_back(blob.size());
+                }
+                put(&head[8], ids.size(), 8);
+                put(&head[16], blob.size(), 8);
+
+                std::vector<float> norms(ids.size());
+                for (size_t i = 0; i < ids.size(); ++i) norms[i] = simd::best().dot(vectors + i * dims, vectors + i * dims, dims);
+
+                size_t numbers = (ids.size() * dims + ids.size()) * sizeof(float);
+                std::string padding((8 - numbers % 8) % 8, '\0');
+                std::string offset_bytes(offsets.size() * 8, '\0');
+                for (size_t i = 0; i < offsets.size(); ++i) put(&offset_bytes[i * 8], offsets[i], 8);
+
+                size_t length = segment_header_size + numbers + padding.size() + offset_bytes.size() + blob.size();
+                std::string tail((64 - length % 64) % 64, '\0');
+
+                bool written = std::fseek(file, static_cast<long>(start), SEEK_SET) == 0 &&
+                    std::fwrite(head.data(), 1, head.size(), file) == head.size() &&
+                    std::fwrite(vectors, sizeof(float), ids.size() * dims, file) == ids.size() * dims &&
+                    std::fwrite(norms.data(), sizeof(float), norms.size(), file) == norms.size() &&
+                    std::fwrite(padding.data(), 1, padding.size(), file) == padding.size() &&
+                    std::fwrite(offset_bytes.data(), 1, offset_bytes.size(), file) == offset_bytes.size() &&
+                    std::fwrite(blob.data(), 1, blob.size(), file) == blob.size() &&
+                    std::fwrite(tail.data(), 1, tail.size(), file) == tail.size() &&
+                    std::fflush(file) == 0;
+
+                // The segment only becomes part of the store once the header records it.
+                committed = start + length + tail.size();
+                if (!written || !write_header(count + ids.size()) || !remap(start))
+                {
+                    committed = start;
+                    write_header(count);
+                    if (ollama::use_exceptions) throw ollama::exception("Unable to append to embedding store "+path);
+                    return false;
+                }
+                return true;
+            }
+
+            bool append(const std::vector<std::string>& ids, const std::vector<std::vector<float>>& vectors, const std::vector<std::string>& metadata=std::vector<std::string>())
+            {
+                if (vectors.size() != ids.size())
+                {
+                    if (ollama::use_exceptions) throw ollama::exception("Batch has "+std::to_string(vectors.size())+" vectors for "+std::to_string(ids.size())+" IDs");
+                    return false;
+                }
+
+                std::vector<float> matrix;
+                matrix.reserve(vectors.size() * dims);
+                for (const std::vector<float>& vector: vectors)
+                {
+                    if (vector.size() != dims)
+                    {
+                        if (ollama::use_exceptions) throw ollama::exception("Batch does not match embedding store "+path+" with "+std::to_string(dims)+" dimensions");
+                        return false;
+                    }
+                    matrix.insert(matrix.end(), vector.begin(), vector.end());
+                }
+                return append(ids, matrix.data(), dims, metadata);
+            }
+
+            // Appends the embeddings of a response from generate_embeddings under the given IDs.
+            bool append(const std::vector<std::string>& ids, const ollama::response& response, const std::vector<std::string>& metadata=std::vector<std::string>())
+            {
+                std::vector<float> embeddings;
+                size_t dimensions = 0;
+                size_t count = response.get_embeddings(embeddings, dimensions) && dimensions > 0 ? embeddings.size() / dimensions : 0;
+                if (count != ids.size())
+                {
+                    if (ollama::use_exceptions) throw ollama::exception("Response has "+std::to_string(count)+" embeddings for "+std::to_string(ids.size())+" IDs");
+                    return false;
+                }
+                return append(ids, embeddings.data(), dimensions, metadata);
+            }
+
+            // Returns the k closest vectors to the query, closest first, reading the vectors in place from the file.
+            std::vector<search_result> search(const float* query, size_t dimensions, size_t k, ollama::metric measure=ollama::metric::cosine, ollama::thread_pool& pool=ollama::thread_pool::shared()) const
+            {
+                if (dimensions != dims)
+                {
+                    if (ollama::use_exceptions) throw ollama::exception("Query has "+std::to_string(dimensions)+" dimensions but the embedding store has "+std::to_string(dims));
+                    return std::vector<search_result>();
+                }
+
+                std::vector<segment> snapshot;
+                { std::lock_guard<std::mutex> lock(segments_mutex); snapshot = segments; }
+
+                const simd::kernels& kernels = simd::best();
+                float query_norm = std::sqrt(kernels.dot(query, query, dims));
+
+                nearest_k nearest(k);
+                for (const segment& each: snapshot)
+                {
+                    std::vector<nearest_k::candidate> found = nearest_scan(each.count, k, dims, [&](size_t i) {
+                        const float* vector = each.vectors + i * dims;
+                        if (measure == ollama::metric::l2) return -kernels.l2(query, vector, dims);
+                        float dot = kernels.dot(query, vector, dims);
+                        if (measure == ollama::metric::dot) return dot;
+                        float norms = query_norm * std::sqrt(each.norms[i]);
+                        return norms > 0 ? dot / norms : 0.0f;
+                    }, pool);
+                    for (const nearest_k::candidate& candidate: found) nearest.add(candidate.first, each.first + candidate.second);
+                }
+
+                std::vector<search_result> results;
+                for (const nearest_k::candidate& each: nearest.sorted())
+                {
+                    search_result result;
+                    result.id = id(each.second);
+                    result.score = measure == ollama::metric::l2 ? -each.first : each.first;
+                    result.index = each.second;
+                    results.push_back(std::move(result));
+                }
+                return results;
+            }
+
+            std::vector<search_result> search(const std::vector<float>& query, size_t k, ollama::metric measure=ollama::metric::cosine, ollama::thread_pool& pool=ollama::thread_pool::shared()) const
+            {
+                return search(query.data(), query.size(), k, measure, pool);
+            }
+
+        private:
+
+            embedding_store() {}
+
+            struct segment {
+                size_t first = 0, count = 0;
+                const float* vectors = nullptr;
+                const float* norms = nullptr;           // Squared length of each vector.
+                const unsigned char* offsets = nullptr; // Two for each entry, ending its ID and its metadata.
+                const char* blob = nullptr;
+            };
+
+            struct mapping {
+                const char* data = nullptr;
+                size_t offset = 0, size = 0;            // The part of the file the data starts at, and its length.
+#ifdef _WIN32
+                HANDLE file = INVALID_HANDLE_VALUE;
+                HANDLE map = NULL;
+#endif
+            };
+
+            static constexpr const char* file_magic = "OLEMBED1";
+            static constexpr const char* segment_magic = "OLSEGMNT";
+            static const size_t header_size = 64;
+            static const size_t segment_header_size = 64;
+
+            // Limits on the part of the address space reserved past the end of the file for later appends.
+            static const size_t min_reserve = size_t(16) << 20;
+            static const size_t max_reserve = size_t(1) << 30;
+
+            static void put(char* out, uint64_t value, size_t bytes) { for (size_t i = 0; i < bytes; ++i) out[i] = static_cast<char>((value >> (8 * i)) & 0xFF); }
+            static uint64_t get(const void* in, size_t bytes)
+            {
+                const unsigned char* data = static_cast<const unsigned char*>(in);
+                uint64_t value = 0;
+                for (size_t i = 0; i < bytes; ++i) value |= static_cast<uint64_t>(data[i]) << (8 * i);
+                return value;
+            }
+
+            bool write_header(size_t entries)
+            {
+                char header[header_size] = {0};
+                std::memcpy(header, file_magic, 8);
+                put(header + 8, 1, 4);
+                put(header + 12, dims, 4);
+                put(header + 16, committed, 8);
+                put(header + 24, entries, 8);
+                return std::fseek(file, 0, SEEK_SET) == 0 && std::fwrite(header, 1, header_size, file) == header_size && std::fflush(file) == 0;
+            }
+
+            // Maps size bytes of the file from an offset, which is rounded down to the granularity the platform maps at.
+            bool map(mapping& view, size_t offset, size_t size)
+            {
+#ifdef _WIN32
+                SYSTEM_INFO system;
+                GetSystemInfo(&system);
+                view.offset = offset / system.dwAllocationGranularity * system.dwAllocationGranularity;
+                view.size = offset - view.offset + size;
+                view.file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+                if (view.file == INVALID_HANDLE_VALUE) return false;
+                view.map = CreateFileMappingA(view.file, NULL, PAGE_READONLY, 0, 0, NULL);
+                if (view.map == NULL) { CloseHandle(view.file); view.file = INVALID_HANDLE_VALUE; return false; }
+                view.data = static_cast<const char*>(MapViewOfFile(view.map, FILE_MAP_READ, static_cast<DWORD>(static_cast<uint64_t>(view.offset) >> 32), static_cast<DWORD>(view.offset & 0xFFFFFFFF), view.size));
+                if (!view.data) { CloseHandle(view.map); CloseHandle(view.file); view.map = NULL; view.file = INVALID_HANDLE_VALUE; return false; }
+#else
+                size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+                view.offset = offset / page * page;
+                view.size = offset - view.offset + size;
+                int descriptor = ::open(path.c_str(), O_RDONLY);
+                if (descriptor < 0) return false;
+                void* data = mmap(nullptr, view.size, PROT_READ, MAP_SHARED, descriptor, static_cast<off_t>(view.offset));
+                ::close(descriptor);
+                if (data == MAP_FAILED) return false;
+                view.data = static_cast<const char*>(data);
+#endif
+                return true;
+            }
+
+            static void unmap(mapping& view)
+            {
+#ifdef _WIN32
+                if (view.data) UnmapViewOfFile(view.data);
+                if (view.map) CloseHandle(view.map);
+                if (view.file != INVALID_HANDLE_VALUE) CloseHandle(view.file);
+#else
+                if (view.data) munmap(const_cast<char*>(view.data), view.size);
+#endif
+                view.data = nullptr;
+            }
+
+            // Reads the segments from an offset onwards. Where the platform allows mapping past the end of a file, they are
+            // mapped in a region which reserves room for later appends, so that most appends need no mapping of their own;
+            // each new region is as large as those before it together. Otherwise only the new segments are mapped. Earlier
+            // mappings are kept until the store is closed, since vectors returned from them may still be in use.
+            bool remap(size_t from)
+            {
+                mapping view;
+                bool reused = !mappings.empty() && mappings.back().offset <= from && committed <= mappings.back().offset + mappings.back().size;
+                if (reused) view = mappings.back();
+                else
+                {
+                    size_t size = committed - from;
+#ifndef _WIN32
+                    size_t mapped = 0;
+                    for (const mapping& each: mappings) mapped += each.size;
+                    size = std::max(size, std::min(std::max(mapped, size_t(min_reserve)), size_t(max_reserve)));
+#endif
+                    if (!map(view, from, size)) return false;
+                }
+
+                std::vector<segment> added;
+                size_t total = count;
+                for (size_t offset = from; offset < committed; )
+                {
+                    const char* base = view.data + (offset - view.offset);
+                    if (committed - offset < segment_header_size || std::memcmp(base, segment_magic, 8) != 0) { if (!reused) unmap(view); return false; }
+
+                    segment each;
+                    each.first = total;
+                    each.count = static_cast<size_t>(get(base + 8, 8));
+                    uint64_t blob_size = get(base + 16, 8);
+
+                    uint64_t numbers = (static_cast<uint64_t>(each.count) * dims + each.count) * sizeof(float);
+                    uint64_t offsets_at = segment_header_size + numbers + (8 - numbers % 8) % 8;
+                    uint64_t length = offsets_at + (2 * static_cast<uint64_t>(each.count) + 1) * 8 + blob_size;
+                    if (each.count == 0 || length > committed - offset) { if (!reused) unmap(view); return false; }
+
+                    each.vectors = reinterpret_cast<const float*>(base + segment_header_size);
+                    each.norms = each.vectors + each.count * dims;
+                    each.offsets = reinterpret_cast<const unsigned char*>(base + offsets_at);
+                    each.blob = base + offsets_at + (2 * each.count + 1) * 8;
+                    if (get(each.offsets + 2 * each.count * 8, 8) != blob_size) { if (!reused) unmap(view); return false; }
+
+                    added.push_back(each);
+                    total += each.count;
+                    offset += static_cast<size_t>(length + (64 - length % 64) % 64);
+                }
+
+                std::lock_guard<std::mutex> lock(segments_mutex);
+                if (!reused) mappings.push_back(view);
+                segments.insert(segments.end(), added.begin(), added.end());
+                count = total;
+                return true;
+            }
+
+            segment find(size_t index) const
+            {
+                std::lock_guard<std::mutex> lock(segments_mutex);
+                if (index >= count) throw std::out_of_range("Embedding store position "+std::to_string(index)+" is out of range");
+                size_t low = 0, high = segments.size() - 1;
+                while (low < high)
+                {
+                    size_t middle = (low + high + 1) / 2;
+                    if (segments[middle].first <= index) low = middle;
+                    else high = middle - 1;
+                }
+                return segments[low];
+            }
+
+            // Part 0 of an entry is its ID and part 1 is its metadata.
+            std::string entry(size_t index, size_t part) const
+            {
+                segment found = find(index);
+                size_t position = 2 * (index - found.first) + part;
+                uint64_t begin = get(found.offsets + position * 8, 8), end = get(found.offsets + (position + 1) * 8, 8);
+                return std::string(found.blob + begin, found.blob + end);
+            }
+
+            std::string path;
+            std::FILE* file = nullptr;
+            size_t dims = 0;
+            size_t committed = 0;       // Bytes of the file holding complete segments.
+
+            std::mutex append_mutex;
+            mutable std::mutex segments_mutex;
+            std::vector<segment> segments;
+            std::vector<mapping> mappings;
+            size_t count = 0;
+    };
+
+    // A 128-bit hash of a block of memory, computed with MurmurHash3 (x64, 128-bit variant).
+    struct hash128 {
+        uint64_t low = 0, high = 0;
+
+        bool operator==(const hash128& other) const { return low == other.low && high == other.high; }
+        bool operator!=(const hash128& other) const { return !(*this == other); }
+
+        struct hasher { size_t operator()(const hash128& hash) const { return static_cast<size_t>(hash.low ^ (hash.high * 0x9E3779B97F4A7C15ULL)); } };
+    };
+
+    inline hash128 murmur3_128(const void* data, size_t length, uint32_t seed=0)
+    {
+        struct mix {
+            static uint64_t rotate(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+            static uint64_t final(uint64_t k) { k ^= k >> 33; k *= 0xFF51AFD7ED558CCDULL; k ^= k >> 33; k *= 0xC4CEB9FE1A85EC53ULL; return k ^ (k >> 33); }
+            static uint64_t block(const unsigned char* bytes)
+            {
+                const uint16_t byte_order = 1;
+                uint64_t value = 0;
+                if (*reinterpret_cast<const unsigned char*>(&byte_order) == 1) { std::memcpy(&value, bytes, 8); return value; }
+                for (int b = 0; b < 8; ++b) value |= static_cast<uint64_t>(bytes[b]) << (8 * b);
+                return value;
+            }
+        };
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        const uint64_t c1 = 0x87C37B91114253D5ULL, c2 = 0x4CF5AD432745937FULL;
+        uint64_t h1 = seed, h2 = seed;
+
+        size_t blocks = length / 16;
+        for (size_t i = 0; i < blocks; ++i)
+        {
+            uint64_t k1 = mix::block(bytes + i * 16), k2 = mix::block(bytes + i * 16 + 8);
+
+            k1 *= c1; k1 = mix::rotate(k1, 31); k1 *= c2; h1 ^= k1;
+            h1 = mix::rotate(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52DCE729;
+            k2 *= c2; k2 = mix::rotate(k2, 33); k2 *= c1; h2 ^= k2;
+            h2 = mix::rotate(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495AB5;
+        }
+
+        const unsigned char* tail = bytes + blocks * 16;
+        uint64_t k1 = 0, k2 = 0;
+        size_t remaining = length & 15;
+        for (size_t b = remaining; b > 8; --b) k2 |= static_cast<uint64_t>(tail[b - 1]) << (8 * (b - 9));
+        for (size_t b = std::min<size_t>(remaining, 8); b > 0; --b) k1 |= static_cast<uint64_t>(tail[b - 1]) << (8 * (b - 1));
+        if (remaining > 8) { k2 *= c2; k2 = mix::rotate(k2, 33); k2 *= c1; h2 ^= k2; }
+        if (remaining > 0) { k1 *= c1; k1 = mix::rotate(k1, 31); k1 *= c2; h1 ^= k1; }
+
+        h1 ^= length; h2 ^= length;
+        h1 += h2; h2 += h1;
+        h1 = mix::final(h1); h2 = mix::final(h2);
+        h1 += h2; h2 += h1;
+
+        hash128 hash;
+        hash.low = h1;
+        hash.high = h2;
+        return hash;
+    }
+
+    inline hash128 murmur3_128(const std::string& data, uint32_t seed=0) { return murmur3_128(data.data(), data.size(), seed); }
+
+    // Embeddings which have already been generated, keyed by a hash of the model, the truncate setting and the input.
+    // The most recently used embeddings are kept in memory. An embedding_store can be attached as a second tier, which
+    // keeps every embedding on disk so that later runs can reuse them; it holds embeddings with the dimensions of the
+    // first one stored, and embeddings from models with other dimensions are only kept in memory. Other options of a
+    // request are not part of the key.
+    class embedding_cache {
+
+        public:
+
+            embedding_cache(size_t capacity=4096): capacity(capacity) {}
+
+            embedding_cache(const embedding_cache&) = delete;
+            embedding_cache& operator=(const embedding_cache&) = delete;
+
+            // Keeps embeddings in a store on disk as well as in memory, reusing those already there.
+            bool persist(const std::string& filepath)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                path.clear();
+                stored.clear();
+                store.reset();
+
+                bool exists = static_cast<bool>(std::ifstream(filepath, std::ios::binary));
+                if (exists && !(store = embedding_store::open(filepath))) return false;
+                if (store) for (size_t i = 0; i < store->size(); ++i) stored[from_id(store->id(i))] = i;
+                path = filepath;    // A new store is created when the first embedding is added.
+                return true;
+            }
+
+            static hash128 key(const std::string& model, bool truncate, const std::string& input)
+            {
+                std::string keyed;
+                keyed.reserve(model.size() + input.size() + 2);
+                keyed += model;
+                keyed += '\0';
+                keyed += truncate ? '1' : '0';
+                keyed += input;
+                return murmur3_128(keyed);
+            }
+
+            bool get(const hash128& key, std::vector<float>& embedding)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto found = entries.find(key);
+                if (found != entries.end())
+                {
+                    recent.splice(recent.begin(), recent, found->second);
+                    embedding = found->second->second;
+                    ++hit_count;
+                    return true;
+                }
+
+                auto on_disk = stored.find(key);
+                if (on_disk != stored.end())
+                {
+                    const float* vector = store->vector(on_disk->second);
+                    embedding.assign(vector, vector + store->dimensions());
+                    remember(key, embedding);
+                    ++hit_count;
+                    return true;
+                }
+
+                ++miss_count;
+                return false;
+            }
+
+            bool get(const std::string& model, bool truncate, const std::string& input, std::vector<float>& embedding) { return get(key(model, truncate, input), embedding); }
+
+            // Adds a batch of embeddings, which is written to the attached store in a single append. If the store cannot be
+            // written, the batch is only kept in memory.
+            void put(const std::vector<hash128>& keys, const std::vector<std::vector<float>>& embeddings)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                std::vector<hash128> added;
+                std::vector<std::string> ids;
+                std::vector<float> rows;
+                try
+                {
+                    for (size_t i = 0; i < keys.size() && i < embeddings.size(); ++i)
+                    {
+                        remember(keys[i], embeddings[i]);
+                        if (path.empty() || embeddings[i].empty() || stored.count(keys[i]) || (store && embeddings[i].size() != store->dimensions())) continue;
+                        if (!store && !(store = embedding_store::open(path, embeddings[i].size()))) { path.clear(); continue; }
+
+                        stored[keys[i]] = store->size() + ids.size();
+                        added.push_back(keys[i]);
+                        ids.push_back(to_id(keys[i]));
+                        rows.insert(rows.end(), embeddings[i].begin(), embeddings[i].end());
+                    }
+
+                    if (!ids.empty() && !store->append(ids, rows.data(), store->dimensions()))
+                        for (const hash128& each: added) stored.erase(each);
+                }
+                catch (...)
+                {
+                    // Positions recorded for the batch would otherwise point past the end of the store.
+                    for (const hash128& each: added) stored.erase(each);
+                    throw;
+                }
+            }
+
+            void put(const hash128& key, const std::vector<float>& embedding) { put(std::vector<hash128>(1, key), std::vector<std::vector<float>>(1, embedding)); }
+            void put(const std::string& model, bool truncate, const std::string& input, const std::vector<float>& embedding) { put(key(model, truncate, input), embedding); }
+
+            // Empties the memory tier. Embeddings in an attached store are kept.
+            void clear() { std::lock_guard<std::mutex> lock(mutex); entries.clear(); recent.clear(); }
+
+            size_t size() const { std::lock_guard<std::mutex> lock(mutex); return entries.size(); }
+            size_t stored_size() const { std::lock_guard<std::mutex> lock(mutex); return stored.size(); }
+            size_t get_capacity() const { return capacity; }
+            size_t hits() const { std::lock_guard<std::mutex> lock(mutex); return hit_count; }
+            size_t misses() const { std::lock_guard<std::mutex> lock(mutex); return miss_count; }
+
+        private:
+
+            typedef std::list<std::pair<hash128, std::vector<float>>> recency_list;
+
+            void remember(const hash128& key, const std::vector<float>& embedding)
+            {
+                if (capacity == 0) return;
+                auto found = entries.find(key);
+                if (found != entries.end())
+                {
+                    found->second->second = embedding;
+                    recent.splice(recent.begin(), recent, found->second);
+                    return;
+                }
+
+                if (entries.size() >= capacity)
+                {
+                    entries.erase(recent.back().first);
+                    recent.pop_back();
+                }
+                recent.emplace_front(key, embedding);
+                entries[key] = recent.begin();
+            }
+
+            static std::string to_id(const hash128& key)
+            {
+                std::string id(16, '\0');
+                for (int b = 0; b < 8; ++b) { id[b] = static_cast<char>(key.low >> (8 * b)); id[8 + b] = static_cast<char>(key.high >> (8 * b)); }
+                return id;
+            }
+
+            static hash128 from_id(const std::string& id)
+            {
+                hash128 key;
+                for (size_t b = 0; b < 8 && id.size() == 16; ++b)
+                {
+                    key.low |= static_cast<uint64_t>(static_cast<unsigned char>(id[b])) << (8 * b);
+                    key.high |= static_cast<uint64_t>(static_cast<unsigned char>(id[8 + b])) << (8 * b);
+                }
+                return key;
+            }
+
+            size_t capacity;
+            mutable std::mutex mutex;
+            recency_list recent;                                            // Most recently used first.
+            std::unordered_map<hash128, recency_list::iterator, hash128::hasher> entries;
+
+            std::string path;
+            std::shared_ptr<embedding_store> store;
+            std::unordered_map<hash128, size_t, hash128::hasher> stored;    // Position of each embedding in the store.
+
+            size_t hit_count = 0, miss_count = 0;
+    };
+
+    // Settings for an hnsw_index.
+    struct hnsw_options {
+        size_t M = 16;                      // Links made by each new node, and kept by each node on the upper layers. The bottom layer keeps twice as many.
+        size_t ef_construction = 200;       // Candidates considered when linking a new node. Higher builds a better graph more slowly.
+        size_t ef_search = 64;              // Candidates considered by a search. Higher improves recall at the cost of speed.
+        unsigned int seed = 100;            // Seed used to choose the layers of each node.
+    };
+
+    // An approximate nearest neighbor index over a Hierarchical Navigable Small World graph. Vectors can be added and
+    // searched from several threads at once, with the links of each node guarded by a lock of its own, and nodes are
+    // never moved once added. Scores follow the same conventions as vector_index.
+    class hnsw_index {
+
+        public:
+
+            // With zero dimensions, the dimensions are taken from the first vector added.
+            hnsw_index(size_t dimensions=0, ollama::metric measure=ollama::metric::cosine, const hnsw_options& options=hnsw_options()):
+                dims(dimensions), measure(measure), settings(options), ef_search(options.ef_search), generator(options.seed)
+            {
+                if (settings.M < 2) settings.M = 2;
+                level_scale = 1.0 / std::log(static_cast<double>(settings.M));
+                for (size_t i = 0; i < max_segments; ++i) { segments[i] = nullptr; allocations[i] = nullptr; }
+            }
+
+            ~hnsw_index()
+            {
+                for (size_t i = 0; i < reserved; ++i)
+                {
+                    size_t segment, offset;
+                    locate(i, segment, offset);
+                    if (segments[segment].load()) node_at(i).~node();
+                }
+                for (size_t segment = 0; segment < max_segments; ++segment) ::operator delete(allocations[segment]);
+            }
+
+            hnsw_index(const hnsw_index&) = delete;
+            hnsw_index& operator=(const hnsw_index&) = delete;
+
+            size_t dimensions() const { return dims; }
+            size_t size() const { return inserted; }
+
+            // The number of vectors which fit in the slots allocated so far.
+            size_t capacity() const
+            {
+                size_t total = 0;
+                for (size_t segment = 0; segment < max_segments; ++segment) if (segments[segment].load()) total += first_segment << segment;
+                return total;
+            }
+
+            // Allocates slots for at least count vectors up front, much like max_elements in hnswlib, so that adding them never
+            // waits for a new segment. The dimensions must be known.
+            bool reserve(size_t count)
+            {
+                if (dims == 0)
+                {
+                    if (ollama::use_exceptions) throw ollama::exception("Cannot reserve space in an index before its dimensions are known");
+                    return false;
+                }
+                for (size_t segment = 0; segment < max_segments && first_index(segment) < count; ++segment) allocate(first_index(segment));
+                return true;
+            }
+            bool empty() const { return inserted == 0; }
+            ollama::metric get_metric() const { return measure; }
+            const hnsw_options& get_options() const { return settings; }
+
+            // Changes the default number of candidates considered by each search.
+            void set_ef_search(size_t ef) { ef_search = ef; }
+
+            const std::string& id(size_t index) const { return node_at(index).id; }
+            const float* vector(size_t index) const { return vector_at(index); }
+
+            bool add(const std::string& id, const float* vector, size_t dimensions)
+            {
+                size_t expected = 0;
+                dims.compare_exchange_strong(expected, dimensions);
+                if (dimensions != dims || dimensions == 0)
+                {
+                    if (ollama::use_exceptions) throw ollama::exception("Vector for \""+id+"\" has "+std::to_string(dimensions)+" dimensions but the index has "+std::to_string(dims));
+                    return false;
+                }
+
+                uint32_t index = claim();
+
+                float* stored = vector_at(index);
+                std::copy(vector, vector + dimensions, stored);
+                if (measure == ollama::metric::cosine) normalize(stored);
+
+                int level = random_level();
+                node& added = node_at(index);
+                {
+                    std::lock_guard<std::mutex> lock(added.lock);
+                    added.id = id;
+                    added.level = level;
+                    added.upper_links.assign(level, std::vector<uint32_t>());
+                }
+
+                // A node which reaches above the top layer holds the entry point until it can become the new entry point.
+                std::unique_lock<std::mutex> top(entry_mutex);
+                if (entry_point == no_node) { entry_point = index; max_level = level; ++inserted; return true; }
+                uint32_t entry = entry_point;
+                int top_level = max_level;
+                if (level <= top_level) top.unlock();
+
+                std::unique_ptr<visited_list> visited = take_visited();
+                std::vector<scored> nearest(1, scored(distance(stored, vector_at(entry)), entry));
+                for (int layer = top_level; layer > level; --layer) nearest = search_layer(stored, nearest, 1, layer, *visited);
+
+                // The node is linked back from its neighbors only once its own links are set on every layer. Otherwise another
+                // insertion could reach it on an upper layer and find no links to follow below.
+                std::vector<std::vector<uint32_t>> neighbors(std::min(level, top_level) + 1);
+                for (int layer = std::min(level, top_level); layer >= 0; --layer)
+                {
+                    nearest = search_layer(stored, nearest, settings.ef_construction, layer, *visited);
+                    neighbors[layer] = select_neighbors(nearest, settings.M);
+                    std::lock_guard<std::mutex> lock(added.lock);
+                    set_links(index, layer, neighbors[layer]);
+                }
+                give_visited(std::move(visited));
+                for (int layer = static_cast<int>(neighbors.size()) - 1; layer >= 0; --layer)
+                    for (uint32_t neighbor: neighbors[layer]) link(neighbor, index, layer);
+
+                if (level > top_level) { entry_point = index; max_level = level; }
+                ++inserted;
+                return true;
+            }
+
+            bool add(const std::string& id, const std::vector<float>& vector) { return add(id, vector.data(), vector.size()); }
+
+            // Adds each embedding of a response from generate_embeddings under the given IDs, inserting them in parallel on the
+            // pool. Returns the number added.
+            size_t add(const std::vector<std::string>& ids, const ollama::response& response, ollama::thread_pool& pool=ollama::thread_pool::shared())
+            {
+                std::vector<float> embeddings;
+                size_t dimensions = 0;
+                size_t count = response.get_embeddings(embeddings, dimensions) && dimensions > 0 ? embeddings.size() / dimensions : 0;
+                if (count != ids.size())
+                {
+                    if (ollama::use_exceptions) throw ollama::exception("Response has "+std::to_string(count)+" embeddings for "+std::to_string(ids.size())+" IDs");
+                    return 0;
+                }
+
+                std::atomic<size_t> added(0);
+                pool.parallel_for(ids.size(), [&](size_t i) { if (add(ids[i], embeddings.data() + i * dimensions, dimensions)) ++added; });
+                return added;
+            }
+
+            // Returns about the k closest vectors to the query, closest first, considering max(ef, k) candidates. An ef of zero
+            // uses the index's ef_search.
+            std::vector<search_result> search(const float* query, size_t dimensions, size_t k, size_t ef=0) const
+            {
+                if (dims != 0 && dimensions != dims)
+                {
+                    if (ollama::use_exceptions) throw ollama::exception("Query has "+std::to_string(dimensions)+" dimensions but the index has "+std::to_string(dims));
+                    return std::vector<search_result>();
+                }
+                if (k == 0) return std::vector<search_result>();
+
+                uint32_t entry;
+                int top_level;
+                {
+                    std::lock_guard<std::mutex> lock(entry_mutex);
+                    if (entry_point == no_node) return std::vector<search_result>();
+                    entry = entry_point;
+                    top_level = max_level;
+                }
+
+                std::vector<float> normalized;
+                if (measure == ollama::metric::cosine) { normalized.assign(query, query + dimensions); normalize(normalized.data()); query = normalized.data(); }
+
+                std::unique_ptr<visited_list> visited = take_visited();
+                std::vector<scored> nearest(1, scored(distance(query, vector_at(entry)), entry));
+                for (int layer = top_level; layer > 0; --layer) nearest = search_layer(query, nearest, 1, layer, *visited);
+                nearest = search_layer(query, nearest, std::max(ef == 0 ? ef_search.load() : ef, k), 0, *visited);
+                give_visited(std::move(visited));
+
+                std::vector<search_result> results;
+                results.reserve(std::min(k, nearest.size()));
+                for (size_t i = 0; i < nearest.size() && i < k; ++i)
+                {
+                    search_result result;
+                    result.id = node_at(nearest[i].second).id;
+                    result.score = measure == ollama::metric::l2 ? nearest[i].first : -nearest[i].first;
+                    result.index = nearest[i].second;
+                    results.push_back(std::move(result));
+                }
+                return results;
+            }
+
+            std::vector<search_result> search(const std::vector<float>& query, size_t k, size_t ef=0) const { return search(query.data(), query.size(), k, ef); }
+
+            // Writes the index to a file, which should not happen while vectors are being added. Numbers are stored little-endian.
+            bool save(const std::string& filepath) const
+            {
+                std::ofstream file(filepath, std::ios::binary | std::ios::trunc);
+                if (!file) { if (ollama::use_exceptions) throw ollama::exception("Unable to create index file "+filepath); return false; }
+
+                std::string header(file_magic, 8);
+                put(header, dims, 8);
+                put(header, static_cast<uint64_t>(measure), 4);
+                put(header, settings.M, 8);
+                put(header, settings.ef_construction, 8);
+                put(header, ef_search, 8);
+                put(header, settings.seed, 4);
+                put(header, inserted, 8);
+                put(header, entry_point, 4);
+                put(header, static_cast<uint32_t>(max_level), 4);
+                file.write(header.data(), header.size());
+
+                std::string record;
+                std::vector<uint32_t> links;
+                for (size_t i = 0; i < inserted; ++i)
+                {
+                    const node& each = node_at(i);
+                    std::lock_guard<std::mutex> lock(each.lock);
+
+                    record.clear();
+                    put(record, each.id.size(), 4);
+                    record += each.id;
+                    put(record, static_cast<uint32_t>(each.level), 4);
+                    const float* values = vector_at(i);
+                    for (size_t d = 0; d < dims; ++d) { uint32_t bits; std::memcpy(&bits, values + d, 4); put(record, bits, 4); }
+                    for (int layer = 0; layer <= each.level; ++layer)
+                    {
+                        copy_links(static_cast<uint32_t>(i), layer, links);
+                        put(record, links.size(), 4);
+                        for (uint32_t link: links) put(record, link, 4);
+                    }
+                    file.write(record.data(), record.size());
+                }
+
+                if (!file) { if (ollama::use_exceptions) throw ollama::exception("Unable to write index file "+filepath); return false; }
+                return true;
+            }
+
+            // Loads an index written by save.
+            static std::shared_ptr<hnsw_index> load(const std::string& filepath)
+            {
+                std::ifstream file(filepath, std::ios::binary);
+                if (!file) { if (ollama::use_exceptions) throw ollama::exception("Unable to open index file "+filepath); return nullptr; }
+
+                std::shared_ptr<hnsw_index> index = read(file);
+                if (!index && ollama::use_exceptions) throw ollama::exception("Invalid index file "+filepath);
+                return index;
+            }
+
+        private:
+
+            // Each node is stored in a slot followed by its links on the bottom layer and then its vector, so that a search
+            // finds what it needs for a node together in memory.
+            struct node {
+                std::string id;
+                int level = 0;
+                uint32_t bottom_count = 0;                          // Links on the bottom layer.
+                std::vector<std::vector<uint32_t>> upper_links;     // Links on each layer above the bottom.
+                mutable std::mutex lock;
+            };
+
+            // Marks the nodes seen by one search. Marks from earlier searches are ignored by moving to a new epoch.
+            struct visited_list {
+                std::vector<uint32_t> marks;
+                uint32_t epoch = 0;
+
+                void begin() { if (++epoch == 0) { std::fill(marks.begin(), marks.end(), 0); epoch = 1; } }
+                bool visit(uint32_t index)
+                {
+                    if (index >= marks.size()) marks.resize(index + 1 + marks.size() / 2, 0);
+                    if (marks[index] == epoch) return false;
+                    marks[index] = epoch;
+                    return true;
+                }
+            };
+
+            // A distance, where lower is closer, and a node.
+            typedef std::pair<float, uint32_t> scored;
+
+            static constexpr uint32_t no_node = 0xFFFFFFFF;
+            static constexpr const char* file_magic = "OLHNSW01";
+
+            // Slots are stored in segments which double in size, so they never move as the index grows.
+            static const size_t first_segment = 1024;
+            static const size_t max_segments = 32;
+
+            static void locate(size_t index, size_t& segment, size_t& offset)
+            {
+                size_t block = index / first_segment + 1;
+                segment = 0;
+                while (block >>= 1) ++segment;
+                offset = index - first_index(segment);
+            }
+
+            static size_t first_index(size_t segment) { return first_segment * ((size_t(1) << segment) - 1); }
+
+            size_t bottom_capacity() const { return settings.M * 2; }
+            size_t slot_size() const { return (sizeof(node) + bottom_capacity() * sizeof(uint32_t) + dims * sizeof(float) + 63) / 64 * 64; }
+
+            void allocate(size_t index)
+            {
+                size_t segment, offset;
+                locate(index, segment, offset);
+                if (segments[segment].load(std::memory_order_acquire)) return;
+
+                std::lock_guard<std::mutex> lock(segment_mutex);
+                if (segments[segment].load()) return;
+
+                // Slots start on cache lines. Their nodes are constructed as they are claimed, so the pages of a large segment
+                // are only touched once vectors reach them.
+                allocations[segment] = ::operator new((first_segment << segment) * slot_size() + 64);
+                char* aligned = static_cast<char*>(allocations[segment]) + (64 - reinterpret_cast<uintptr_t>(allocations[segment]) % 64) % 64;
+                segments[segment].store(aligned, std::memory_order_release);
+            }
+
+            // Takes the next slot and constructs its node.
+            uint32_t claim()
+            {
+                size_t index = reserved.fetch_add(1);
+                allocate(index);
+                new (slot(index)) node();
+                return static_cast<uint32_t>(index);
             }
 
-            //operator std::string() const { return this->as_simple_string(); }
-            operator std::__cxx11::basic_string<char>() const { return this->as_simple_string(); }
-            //const operator std::string() const { return this->as_simple_string(); }           
+            char* slot(size_t index) const
+            {
+                size_t segment, offset;
+                locate(index, segment, offset);
+                return segments[segment].load(std::memory_order_acquire) + offset * slot_size();
+            }
+
+            node& node_at(size_t index) const { return *reinterpret_cast<node*>(slot(index)); }
+            uint32_t* bottom_links(size_t index) const { return reinterpret_cast<uint32_t*>(slot(index) + sizeof(node)); }
+            float* vector_at(size_t index) const { return reinterpret_cast<float*>(slot(index) + sizeof(node) + bottom_capacity() * sizeof(uint32_t)); }
+
+            // Reads or replaces the links of a node on one layer, while holding the node's lock.
+            void copy_links(uint32_t index, int layer, std::vector<uint32_t>& links) const
+            {
+                const node& each = node_at(index);
+                if (layer == 0) { const uint32_t* bottom = bottom_links(index); links.assign(bottom, bottom + each.bottom_count); }
+                else if (layer <= each.level) links = each.upper_links[layer - 1];
+                else links.clear();
+            }
+
+            void set_links(uint32_t index, int layer, const std::vector<uint32_t>& links)
+            {
+                node& each = node_at(index);
+                if (layer == 0) { std::copy(links.begin(), links.end(), bottom_links(index)); each.bottom_count = static_cast<uint32_t>(links.size()); }
+                else each.upper_links[layer - 1] = links;
+            }
+
+            float distance(const float* a, const float* b) const
+            {
+                const simd::kernels& kernels = simd::best();
+                return measure == ollama::metric::l2 ? kernels.l2(a, b, dims) : -kernels.dot(a, b, dims);
+            }
+
+            void normalize(float* vector) const
+            {
+                float norm = std::sqrt(simd::best().dot(vector, vector, dims));
+                if (norm > 0) for (size_t i = 0; i < dims; ++i) vector[i] /= norm;
+            }
+
+            void prefetch(const float* vector) const
+            {
+#if defined(__GNUC__)
+                for (size_t offset = 0; offset < dims; offset += 16) __builtin_prefetch(vector + offset);
+#else
+                (void)vector;
+#endif
+            }
+
+            int random_level()
+            {
+                std::lock_guard<std::mutex> lock(generator_mutex);
+                double uniform = std::uniform_real_distribution<double>(0.0, 1.0)(generator);
+                return static_cast<int>(-std::log(std::max(uniform, 1e-12)) * level_scale);
+            }
+
+            // The ef closest nodes found by a best-first search of one layer, closest first.
+            std::vector<scored> search_layer(const float* query, const std::vector<scored>& entries, size_t ef, int layer, visited_list& visited) const
+            {
+                visited.begin();
+                std::priority_queue<scored, std::vector<scored>, std::greater<scored>> candidates;
+                std::priority_queue<scored> found;
+                for (const scored& entry: entries)
+                {
+                    visited.visit(entry.second);
+                    candidates.push(entry);
+                    found.push(entry);
+                    if (found.size() > ef) found.pop();
+                }
+
+                std::vector<uint32_t> neighbors;
+                while (!candidates.empty())
+                {
+                    scored current = candidates.top();
+                    if (found.size() >= ef && current.first > found.top().first) break;
+                    candidates.pop();
+
+                    {
+                        std::lock_guard<std::mutex> lock(node_at(current.second).lock);
+                        copy_links(current.second, layer, neighbors);
+                    }
+
+                    // Fetch the unvisited neighbors into cache together, so that their memory latency overlaps.
+                    size_t unvisited = 0;
+                    for (uint32_t neighbor: neighbors)
+                        if (visited.visit(neighbor)) { neighbors[unvisited++] = neighbor; prefetch(vector_at(neighbor)); }
+                    neighbors.resize(unvisited);
+
+                    for (uint32_t neighbor: neighbors)
+                    {
+                        float d = distance(query, vector_at(neighbor));
+                        if (found.size() < ef || d < found.top().first)
+                        {
+                            candidates.push(scored(d, neighbor));
+                            found.push(scored(d, neighbor));
+                            if (found.size() > ef) found.pop();
+                        }
+                    }
+                }
+
+                std::vector<scored> nearest(found.size());
+                for (size_t i = nearest.size(); i-- > 0; found.pop()) nearest[i] = found.top();
+                return nearest;
+            }
+
+            // Picks up to count neighbors from candidates sorted closest first, skipping any candidate which is closer to an
+            // already chosen neighbor than to the node itself, so that links spread out in different directions.
+            std::vector<uint32_t> select_neighbors(const std::vector<scored>& candidates, size_t count) const
+            {
+                std::vector<uint32_t> chosen;
+                for (const scored& candidate: candidates)
+                {
+                    if (chosen.size() >= count) break;
+                    const float* vector = vector_at(candidate.second);
+                    bool diverse = true;
+                    for (uint32_t other: chosen)
+                        if (distance(vector, vector_at(other)) < candidate.first) { diverse = false; break; }
+                    if (diverse) chosen.push_back(candidate.second);
+                }
+                return chosen;
+            }
+
+            // Links a neighbor back to a new node, pruning the neighbor's links once it has too many.
+            void link(uint32_t neighbor, uint32_t added, int layer)
+            {
+                size_t max_links = layer == 0 ? settings.M * 2 : settings.M;
+                std::lock_guard<std::mutex> lock(node_at(neighbor).lock);
+
+                std::vector<uint32_t> links;
+                copy_links(neighbor, layer, links);
+                if (links.size() < max_links) { links.push_back(added); set_links(neighbor, layer, links); return; }
+
+                const float* base = vector_at(neighbor);
+                std::vector<scored> candidates;
+                candidates.reserve(links.size() + 1);
+                candidates.push_back(scored(distance(base, vector_at(added)), added));
+                for (uint32_t each: links) candidates.push_back(scored(distance(base, vector_at(each)), each));
+                std::sort(candidates.begin(), candidates.end());
+                set_links(neighbor, layer, select_neighbors(candidates, max_links));
+            }
+
+            std::unique_ptr<visited_list> take_visited() const
+            {
+                std::lock_guard<std::mutex> lock(visited_mutex);
+                if (visited_pool.empty()) return std::unique_ptr<visited_list>(new visited_list());
+                std::unique_ptr<visited_list> visited = std::move(visited_pool.back());
+                visited_pool.pop_back();
+                return visited;
+            }
+
+            void give_visited(std::unique_ptr<visited_list> visited) const
+            {
+                std::lock_guard<std::mutex> lock(visited_mutex);
+                visited_pool.push_back(std::move(visited));
+            }
 
+            static void put(std::string& out, uint64_t value, size_t bytes)
+            {
+                for (size_t i = 0; i < bytes; ++i) out += static_cast<char>((value >> (8 * i)) & 0xFF);
+            }
+
+            static bool get(std::istream& in, uint64_t& value, size_t bytes)
+            {
+                unsigned char buffer[8];
+                if (!in.read(reinterpret_cast<char*>(buffer), bytes)) return false;
+                value = 0;
+                for (size_t i = 0; i < bytes; ++i) value |= static_cast<uint64_t>(buffer[i]) << (8 * i);
+                return true;
+            }
+
+            static std::shared_ptr<hnsw_index> read(std::istream& in)
+            {
+                char magic[8];
+                if (!in.read(magic, 8) || std::memcmp(magic, file_magic, 8) != 0) return nullptr;
+
+                uint64_t dimensions, measure, M, ef_construction, ef_search, seed, count, entry, top_level;
+                if (!get(in, dimensions, 8) || !get(in, measure, 4) || !get(in, M, 8) || !get(in, ef_construction, 8) || !get(in, ef_search, 8) ||
+                    !get(in, seed, 4) || !get(in, count, 8) || !get(in, entry, 4) || !get(in, top_level, 4)) return nullptr;
+                if (measure > static_cast<uint64_t>(ollama::metric::l2) || (count > 0 && (dimensions == 0 || entry >= count)) || count >= no_node) return nullptr;
+
+                hnsw_options options;
+                options.M = M;
+                options.ef_construction = ef_construction;
+                options.ef_search = ef_search;
+                options.seed = static_cast<unsigned int>(seed);
+                std::shared_ptr<hnsw_index> index(new hnsw_index(dimensions, static_cast<ollama::metric>(measure), options));
+
+                for (size_t i = 0; i < count; ++i)
+                {
+                    node& each = index->node_at(index->claim());
+
+                    uint64_t length, level, value;
+                    if (!get(in, length, 4) || length > (1u << 24)) return nullptr;
+                    each.id.resize(length);
+                    if (length > 0 && !in.read(&each.id[0], length)) return nullptr;
+                    if (!get(in, level, 4) || level > 64) return nullptr;
+                    each.level = static_cast<int>(level);
+
+                    float* values = index->vector_at(i);
+                    for (size_t d = 0; d < dimensions; ++d)
+                    {
+                        if (!get(in, value, 4)) return nullptr;
+                        uint32_t bits = static_cast<uint32_t>(value);
+                        std::memcpy(values + d, &bits, 4);
+                    }
+
+                    each.upper_links.resize(level);
+                    std::vector<uint32_t> links;
+                    for (int layer = 0; layer <= each.level; ++layer)
+                    {
+                        uint64_t size;
+                        if (!get(in, size, 4) || size > (layer == 0 ? index->bottom_capacity() : index->settings.M)) return nullptr;
+                        links.resize(size);
+                        for (uint32_t& link: links) { if (!get(in, value, 4) || value >= count) return nullptr; link = static_cast<uint32_t>(value); }
+                        index->set_links(static_cast<uint32_t>(i), layer, links);
+                    }
+                }
+
+                index->inserted = count;
+                if (count > 0) { index->entry_point = static_cast<uint32_t>(entry); index->max_level = static_cast<int>(top_level); }
+                return index;
+            }
+
+            std::atomic<size_t> dims;
+            ollama::metric measure;
+            hnsw_options settings;
+            std::atomic<size_t> ef_search;
+            double level_scale;
+
+            std::atomic<char*> segments[max_segments];
+            void* allocations[max_segments];
+            std::mutex segment_mutex;
+            std::atomic<size_t> reserved{0}, inserted{0};
+
+            mutable std::mutex entry_mutex;
+            uint32_t entry_point = no_node;
+            int max_level = -1;
+
+            std::mt19937 generator;
+            std::mutex generator_mutex;
+
+            mutable std::mutex visited_mutex;
+            mutable std::vector<std::unique_ptr<visited_list>> visited_pool;
+    };
+
+    // Records interactions with an Ollama server, including the timing and boundaries of streamed chunks,
+    // so they can later be replayed without a server. Each interaction is stored as a length-prefixed
+    // MessagePack record and is appended to the file as soon as it completes.
+    class cassette {
+
+        public:
+
+            struct chunk {
+                uint64_t offset_us;         // Time since the request was sent.
+                std::string data;
+            };
+
+            struct interaction {
+                std::string method, path, request_body;
+                int status = 0;
+                int error = 0;              // httplib::Error of the request, if no response was received.
+                std::string response_body;
+                std::vector<chunk> chunks;  // Only populated for streamed responses.
+                uint64_t duration_us = 0;
+            };
+
+            // Creates a new cassette file for recording, replacing any existing file.
+            static std::shared_ptr<cassette> record(const std::string& filepath)
+            {
+                std::shared_ptr<cassette> recording(new cassette());
+                recording->file.open(filepath, std::ios::binary | std::ios::trunc);
+                if (!recording->file) { if (ollama::use_exceptions) throw ollama::exception("Unable to create cassette file "+filepath); return nullptr; }
+                return recording;
+            }
+
+            // Loads a recorded cassette file for replay.
+            static std::shared_ptr<cassette> load(const std::string& filepath)
+            {
+                std::ifstream input(filepath, std::ios::binary);
+                if (!input) { if (ollama::use_exceptions) throw ollama::exception("Unable to open cassette file "+filepath); return nullptr; }
+
+                std::shared_ptr<cassette> recording(new cassette());
+                recording->replaying = true;
+
+                unsigned char prefix[4];
+                while (input.read(reinterpret_cast<char*>(prefix), 4))
+                {
+                    uint32_t length = prefix[0] | (prefix[1] << 8) | (prefix[2] << 16) | (static_cast<uint32_t>(prefix[3]) << 24);
+                    std::vector<uint8_t> record(length);
+                    if (!input.read(reinterpret_cast<char*>(record.data()), length)) break;
+
+                    try { recording->add(from_json(json::from_msgpack(record))); }
+                    catch (...) { if (ollama::use_exceptions) throw ollama::exception("Invalid record in cassette file "+filepath); return nullptr; }
+                }
+
+                return recording;
+            }
+
+            bool is_replaying() const { return replaying; }
+
+            void append(const interaction& recorded)
+            {
+                std::vector<uint8_t> record = json::to_msgpack(to_json(recorded));
+                uint32_t length = static_cast<uint32_t>(record.size());
+                unsigned char prefix[4] = { static_cast<unsigned char>(length), static_cast<unsigned char>(length >> 8), static_cast<unsigned char>(length >> 16), static_cast<unsigned char>(length >> 24) };
+
+                std::lock_guard<std::mutex> lock(mutex);
+                file.write(reinterpret_cast<const char*>(prefix), 4);
+                file.write(reinterpret_cast<const char*>(record.data()), record.size());
+                file.flush();
+            }
+
+            // Removes and returns the next recorded interaction for an identical request. Identical requests are replayed in the order they were recorded.
+            bool take(const std::string& method, const std::string& path, const std::string& request_body, interaction& recorded)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto found = interactions.find(method+" "+path+"\n"+request_body);
+                if (found == interactions.end() || found->second.empty()) return false;
+
+                recorded = std::move(found->second.front());
+                found->second.pop_front();
+                return true;
+            }
+
+            size_t remaining() const
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                size_t count = 0;
+                for (auto& entry: interactions) count += entry.second.size();
+                return count;
+            }
 
         private:
 
-        std::string json_string;
-        std::string simple_string;
-        std::string error_string;
+            cassette() {}
 
-        json json_data;        
-        message_type type;
-        bool valid;        
+            void add(interaction&& recorded)
+            {
+                std::string key = recorded.method+" "+recorded.path+"\n"+recorded.request_body;
+                interactions[key].push_back(std::move(recorded));
+            }
+
+            static json to_json(const interaction& recorded)
+            {
+                json record;
+                record["m"] = recorded.method;
+                record["p"] = recorded.path;
+                record["q"] = recorded.request_body;
+                record["s"] = recorded.status;
+                record["e"] = recorded.error;
+                record["b"] = recorded.response_body;
+                record["d"] = recorded.duration_us;
+                record["c"] = json::array();
+                for (const chunk& received: recorded.chunks) record["c"].push_back(json::array({received.offset_us, received.data}));
+                return record;
+            }
+
+            static interaction from_json(const json& record)
+            {
+                interaction recorded;
+                recorded.method = record.at("m").get<std::string>();
+                recorded.path = record.at("p").get<std::string>();
+                recorded.request_body = record.at("q").get<std::string>();
+                recorded.status = record.at("s").get<int>();
+                recorded.error = record.at("e").get<int>();
+                recorded.response_body = record.at("b").get<std::string>();
+                recorded.duration_us = record.at("d").get<uint64_t>();
+                for (const json& received: record.at("c")) recorded.chunks.push_back({ received.at(0).get<uint64_t>(), received.at(1).get<std::string>() });
+                return recorded;
+            }
+
+            bool replaying = false;
+            std::ofstream file;
+            std::map<std::string, std::deque<interaction>> interactions;
+            mutable std::mutex mutex;
+    };
+
+}
+
+namespace ollama
+{
+    // A piece of a larger text, with the byte offset at which it starts.
+    struct text_chunk {
+        std::string text;
+        size_t offset = 0;
+    };
+
+    struct chunk_options {
+        size_t size = 4000;                 // Maximum size of each chunk.
+        size_t overlap = 400;               // Size of the text repeated from the end of the previous chunk.
+        bool in_tokens = false;             // Measure sizes in estimated tokens rather than characters.
+        std::function<size_t(const std::string&)> token_estimator = ollama::estimate_tokens;
+    };
+
+    // Splits a text into chunks of at most options.size, each overlapping the previous one. Chunks end at the last paragraph
+    // break, line break, sentence end or space in the final fifth of the chunk where there is one, and never split a UTF-8
+    // character. Sizes in characters count bytes.
+    inline std::vector<text_chunk> chunk_text(const std::string& text, const chunk_options& options=chunk_options())
+    {
+        std::vector<text_chunk> chunks;
+        if (text.empty() || options.size == 0) return chunks;
+
+        auto is_continuation = [&text](size_t position) { return position < text.size() && (static_cast<unsigned char>(text[position]) & 0xC0) == 0x80; };
+
+        // The end of the longest chunk starting at start which fits within size units.
+        auto fit = [&](size_t start, size_t size) -> size_t {
+            if (!options.in_tokens || !options.token_estimator) return std::min(text.size(), start + size);
+
+            // Grow the span until it no longer fits, so each estimate only looks at text near the chunk, then bisect.
+            size_t low = start, span = std::max<size_t>(size * 4, 16), high;
+            while (true)
+            {
+                high = std::min(text.size(), start + span);
+                if (options.token_estimator(text.substr(start, high - start)) > size) { --high; break; }
+                low = high;
+                if (high == text.size()) return high;
+                span *= 2;
+            }
+            while (low < high)
+            {
+                size_t middle = low + (high - low + 1) / 2;
+                if (options.token_estimator(text.substr(start, middle - start)) <= size) low = middle;
+                else high = middle - 1;
+            }
+            return low;
+        };
+
+        size_t start = 0;
+        while (start < text.size())
+        {
+            size_t end = fit(start, options.size);
+            while (end > start && is_continuation(end)) --end;
+            if (end <= start) { end = start + 1; while (is_continuation(end)) ++end; }
+
+            if (end < text.size())
+            {
+                size_t window = start + (end - start) * 4 / 5;
+                const char* breaks[] = {"\n\n", "\n", ". ", " "};
+                bool found = false;
+                for (const char* separator: breaks)
+                {
+                    size_t length = std::strlen(separator);
+                    for (size_t position = end - 1; position >= window && position > start && !found; --position)
+                        if (position + length <= end && text.compare(position, length, separator) == 0) { end = position + length; found = true; }
+                    if (found) break;
+                }
+            }
+
+            text_chunk chunk;
+            chunk.text = text.substr(start, end - start);
+            chunk.offset = start;
+            chunks.push_back(std::move(chunk));
+
+            if (end >= text.size()) break;
+
+            // Step back by the overlap, measured in the same units, while keeping each chunk ahead of the last.
+            size_t next = end;
+            if (options.overlap > 0)
+            {
+                if (!options.in_tokens || !options.token_estimator) next = end - std::min(options.overlap, end - start - 1);
+                else
+                {
+                    size_t low = start + 1, high = end;
+                    while (low < high)
+                    {
+                        size_t middle = low + (high - low) / 2;
+                        if (options.token_estimator(text.substr(middle, end - middle)) <= options.overlap) high = middle;
+                        else low = middle + 1;
+                    }
+                    next = low;
+                }
+
+                // Start the overlap at a word rather than part way through one.
+                if (next < end && text[next - 1] != ' ' && text[next - 1] != '\n')
+                {
+                    size_t word = text.find_first_of(" \n", next);
+                    if (word != std::string::npos && word + 1 < end) next = word + 1;
+                }
+                while (next > start + 1 && is_continuation(next)) --next;
+            }
+            start = next;
+        }
+
+        return chunks;
+    }
+
+    // Prompts and limits for map-reduce summarization.
+    struct summarize_options {
+        chunk_options chunking;
+        // {text} is replaced with the chunk, or with the summaries being combined.
+        std::string map_prompt = "Summarize the following text. Keep the important facts, names and figures.\n\n{text}";
+        std::string reduce_prompt = "Combine the following summaries into a single summary. Keep the important facts, names and figures.\n\n{text}";
+        size_t fan_in = 4;                  // Number of summaries combined by each reduce request.
+        size_t concurrency = 4;             // Requests in flight at once.
+        std::string separator = "\n\n";     // Placed between the summaries being combined.
+        std::function<void(size_t level, size_t completed, size_t total)> on_progress; // Level 0 is the map step.
+    };
+
+    // Fills in the {text} placeholder of a prompt, or appends the text when there is no placeholder.
+    inline std::string fill_prompt(const std::string& prompt, const std::string& text)
+    {
+        size_t placeholder = prompt.find("{text}");
+        if (placeholder == std::string::npos) return prompt + "\n\n" + text;
+        return prompt.substr(0, placeholder) + text + prompt.substr(placeholder + 6);
+    }
+
+    // The outcome of one request in a batch. Errors are recorded for each request rather than thrown.
+    struct batch_result {
+        size_t index = 0;               // Position of the request in the batch.
+        bool success = false;
+        ollama::response response;
+        std::string error;
     };
 
+    class rag;
 }
 
 class Ollama
 {
     using json = nlohmann::json;
 
+    friend class ollama::rag;
+
     public:
 
         Ollama(const std::string& url)
@@ -35171,171 +40244,210 @@ class Ollama
         Ollama(): Ollama("http://localhost:11434") {}
         ~Ollama() { delete this->cli; }
 
-    ollama::response generate(const std::string& model,const std::string& prompt, const ollama::response& context, const json& options=nullptr, const std::vector<std::string>& images=std::vector<std::string>())
+    ollama::response generate(const std::string& model, std::string prompt, const ollama::response& context, const json& options=nullptr, std::vector<std::string> images=std::vector<std::string>())
     {
-        ollama::request request(model, prompt, options, false, images);
+        ollama::request request(model, std::move(prompt), options, false, std::move(images));
         if ( context.as_json().contains("context") ) request["context"] = context.as_json()["context"];
         return generate(request);
     }
 
-    ollama::response generate(const std::string& model,const std::string& prompt, const json& options=nullptr, const std::vector<std::string>& images=std::vector<std::string>())
+    ollama::response generate(const std::string& model, std::string prompt, const json& options=nullptr, std::vector<std::string> images=std::vector<std::string>())
     {
-        ollama::request request(model, prompt, options, false, images);
+        ollama::request request(model, std::move(prompt), options, false, std::move(images));
         return generate(request);
     }
 
     // Generate a non-streaming reply as a string.
     ollama::response generate(ollama::request& request)
     {
-        ollama::response response;
-
         request["stream"] = false;
-        std::string request_string = request.dump();
-        if (ollama::log_requests) std::cout << request_string << std::endl;      
-
-        if (auto res = this->cli->Post("/api/generate",request_string, "application/json"))
-        {
-            if (ollama::log_replies) std::cout << res->body << std::endl;
+        return generate_request(request.dump());
+    }
 
-            response = ollama::response(res->body);
-            if ( response.has_error() ) { if (ollama::use_exceptions) throw ollama::exception("Ollama response returned error: "+response.get_error() ); }
-           
-        }
-        else
-        {
-            if (ollama::use_exceptions) throw ollama::exception("No response returned from server "+this->server_url+". Error was: "+httplib::to_string( res.error() ));
-        }
+    // Typed options are written straight into the request body rather than converted to ollama::options.
+    ollama::response generate(const std::string& model, std::string prompt, const ollama::model_options& options, std::vector<std::string> images=std::vector<std::string>())
+    {
+        std::string request_string;
+        ollama::request::write_generation(request_string, model, std::move(prompt), options, false, images);
+        return generate_request(request_string);
+    }
 
-        return response;        
+    bool generate(const std::string& model, std::string prompt, std::function<bool(const ollama::response&)> on_receive_token, const ollama::model_options& options, std::vector<std::string> images=std::vector<std::string>())
+    {
+        std::string request_string;
+        ollama::request::write_generation(request_string, model, std::move(prompt), options, true, images);
+        return generate_request(request_string, on_receive_token);
     }
 
-    bool generate(const std::string& model,const std::string& prompt, ollama::response& context, std::function<bool(const ollama::response&)> on_receive_token, const json& options=nullptr, const std::vector<std::string>& images=std::vector<std::string>())
+    bool generate(const std::string& model, std::string prompt, ollama::response& context, std::function<bool(const ollama::response&)> on_receive_token, const json& options=nullptr, std::vector<std::string> images=std::vector<std::string>())
     {
-        ollama::request request(model, prompt, options, true, images);
+        ollama::request request(model, std::move(prompt), options, true, std::move(images));
         if ( context.as_json().contains("context") ) request["context"] = context.as_json()["context"];
         return generate(request, on_receive_token);
     }
 
-    bool generate(const std::string& model,const std::string& prompt, std::function<bool(const ollama::response&)> on_receive_token, const json& options=nullptr, const std::vector<std::string>& images=std::vector<std::string>())
+    bool generate(const std::string& model, std::string prompt, std::function<bool(const ollama::response&)> on_receive_token, const json& options=nullptr, std::vector<std::string> images=std::vector<std::string>())
     {
-        ollama::request request(model, prompt, options, true, images);
+        ollama::request request(model, std::move(prompt), options, true, std::move(images));
         return generate(request, on_receive_token);
     }
 
-
     // Generate a streaming reply where a user-defined callback function is invoked when each token is received.
     bool generate(ollama::request& request, std::function<bool(const ollama::response&)> on_receive_token)
     {
         request["stream"] = true;
+        return generate_request(request.dump(), on_receive_token);
+    }
 
-        std::string request_string = request.dump();
-        if (ollama::log_requests) std::cout << request_string << std::endl;
+    ollama::response chat(const std::string& model, ollama::messages messages, const json& options=nullptr, const json& format=nullptr, const std::string& keep_alive_duration="5m")
+    {
+        ollama::request request(model, std::move(messages), options, false, format, keep_alive_duration);
+        return chat(request);
+    }
 
-        std::shared_ptr<std::vector<std::string>> partial_responses = std::make_shared<std::vector<std::string>>();
+    ollama::response chat(const std::string& model, const ollama::messages& messages, const ollama::model_options& options, const json& format=nullptr, const std::string& keep_alive_duration="5m")
+    {
+        return chat_request(write_chat(model, messages, options, false, format, keep_alive_duration));
+    }
 
-        auto stream_callback = [on_receive_token, partial_responses](const char *data, size_t data_length)->bool{
-            
-            std::string message(data, data_length);
-            bool continue_stream = true;
 
-            if (ollama::log_replies) std::cout << message << std::endl;
-            try 
-            {   
-                partial_responses->push_back(message);
-                std::string total_response = std::accumulate(partial_responses->begin(), partial_responses->end(), std::string(""));                
-                ollama::response response(total_response);
-                partial_responses->clear();  
-                continue_stream = on_receive_token(response); 
-            }
-            catch (const ollama::invalid_json_exception& e) { /* Partial response was received. Will do nothing and attempt to concatenate with the next response. */ }
-            
-            return continue_stream;
-        };
+    // Generate a non-streaming reply as a string.
+    ollama::response chat(ollama::request& request)
+    {
+        request["stream"] = false;
+        return chat_request(request.dump());
+    }
 
-        if (auto res = this->cli->Post("/api/generate", request_string, "application/json", stream_callback)) { return true; }
-        else if (res.error()==httplib::Error::Canceled) { /* Request cancelled by user. */ return true; }        
-        else { if (ollama::use_exceptions) throw ollama::exception( "No response from server returned at URL "+this->server_url+" Error: "+httplib::to_string( res.error() ) ); } 
+    bool chat(const std::string& model, ollama::messages messages, std::function<bool(const ollama::response&)> on_receive_token, const json& options=nullptr, const json& format=nullptr, const std::string& keep_alive_duration="5m")
+    {
+        ollama::request request(model, std::move(messages), options, true, format, keep_alive_duration);
+        return chat(request, on_receive_token);
+    }
 
-        return false;
+
+    bool chat(ollama::request& request, std::function<bool(const ollama::response&)> on_receive_token)
+    {
+        request["stream"] = true;
+        return chat_request(request.dump(), on_receive_token);
     }
 
-    ollama::response chat(const std::string& model, const ollama::messages& messages, json options=nullptr, const std::string& format="json", const std::string& keep_alive_duration="5m")
+    bool chat(const std::string& model, const ollama::messages& messages, std::function<bool(const ollama::response&)> on_receive_token, const ollama::model_options& options, const json& format=nullptr, const std::string& keep_alive_duration="5m")
     {
-        ollama::request request(model, messages, options, false, format, keep_alive_duration);
-        return chat(request);
+        return chat_request(write_chat(model, messages, options, true, format, keep_alive_duration), on_receive_token);
     }
 
+    // Send a chat request prepared by a chat_request_builder, reusing its serialized history.
+    ollama::response chat(const ollama::chat_request_builder& builder) { return chat_request(builder.dump(false)); }
 
-    // Generate a non-streaming reply as a string.
-    ollama::response chat(ollama::request& request)
+    bool chat(const ollama::chat_request_builder& builder, std::function<bool(const ollama::response&)> on_receive_token) { return chat_request(builder.dump(true), on_receive_token); }
+
+    // Chat with tools the model may call. The calls are in the message of the reply, and can be run with a tool_registry.
+    ollama::response chat(const std::string& model, ollama::messages messages, const ollama::tools& tools, const json& options=nullptr, const std::string& keep_alive_duration="5m")
     {
-        ollama::response response;
+        ollama::request request(model, std::move(messages), options, false, nullptr, keep_alive_duration);
+        request["tools"] = tools.to_json_array();
+        return chat(request);
+    }
 
-        request["stream"] = false;        
-        std::string request_string = request.dump();
-        if (ollama::log_requests) std::cout << request_string << std::endl;      
+    // Streamed tool calls can be collected with a tool_call_assembler.
+    bool chat(const std::string& model, ollama::messages messages, const ollama::tools& tools, std::function<bool(const ollama::response&)> on_receive_token, const json& options=nullptr, const std::string& keep_alive_duration="5m")
+    {
+        ollama::request request(model, std::move(messages), options, true, nullptr, keep_alive_duration);
+        request["tools"] = tools.to_json_array();
+        return chat(request, on_receive_token);
+    }
 
-        if (auto res = this->cli->Post("/api/chat",request_string, "application/json"))
-        {
-            if (ollama::log_replies) std::cout << res->body << std::endl;
+    // Chats with a model which may call the tools in the registry. The calls made in each reply are run in parallel on the
+    // pool and their results are sent back as tool messages, until the model replies without calling a tool or max_rounds
+    // replies have been received. The assistant and tool messages are appended to the messages, and the last reply is returned.
+    ollama::message chat_with_tools(const std::string& model, ollama::messages& messages, const ollama::tool_registry& registry, std::function<bool(const ollama::response&)> on_receive_token=nullptr, const json& options=nullptr, size_t max_rounds=8, ollama::thread_pool& pool=ollama::thread_pool::shared())
+    {
+        ollama::tool_call_assembler assembler;
+        ollama::message reply;
 
-            response = ollama::response(res->body, ollama::message_type::chat);
-            if ( response.has_error() ) { if (ollama::use_exceptions) throw ollama::exception("Ollama response returned error: "+response.get_error() ); }
-           
-        }
-        else
+        // A stream cancelled by the callback ends the loop with the partial reply.
+        bool cancelled = false;
+        std::function<bool(const ollama::response&)> on_token = [&on_receive_token, &cancelled](const ollama::response& token) {
+            cancelled = on_receive_token && !on_receive_token(token);
+            return !cancelled;
+        };
+
+        for (size_t round = 0; round < max_rounds; ++round)
         {
-            if (ollama::use_exceptions) throw ollama::exception("No response returned from server "+this->server_url+". Error was: "+httplib::to_string( res.error() ));
+            if (!chat(model, messages, registry.definitions(), assembler.wrap(on_token), options)) return ollama::message();
+
+            reply = assembler.message();
+            messages.push_back(reply);
+            if (cancelled) break;
+
+            std::vector<ollama::tool_call> calls = assembler.calls();
+            if (calls.empty()) break;
+
+            std::vector<std::string> results = registry.call_all(calls, pool);
+            for (size_t i = 0; i < calls.size(); ++i) messages.push_back(ollama::tool_registry::result_message(calls[i], results[i]));
         }
 
-        return response;
+        return reply;
     }
 
-    bool chat(const std::string& model, const ollama::messages& messages, std::function<bool(const ollama::response&)> on_receive_token, const json& options=nullptr, const std::string& format="json", const std::string& keep_alive_duration="5m")
+    // Send a chat request for a conversation, reusing the history it has already serialized.
+    ollama::response chat(const std::string& model, const ollama::conversation& conversation, const json& options=nullptr, const json& format=nullptr, const std::string& keep_alive_duration="5m")
     {
-        ollama::request request(model, messages, options, true, format, keep_alive_duration);
-        return chat(request, on_receive_token);
+        std::string request_string;
+        ollama::chat_request_builder::write_request(request_string, json(model).dump(), conversation.serialized(), options!=nullptr ? options["options"].dump() : "", json(keep_alive_duration).dump(), false, ollama::format_requested(format) ? format.dump() : "");
+        return chat_request(request_string);
     }
 
-
-    bool chat(ollama::request& request, std::function<bool(const ollama::response&)> on_receive_token)
+    bool chat(const std::string& model, const ollama::conversation& conversation, std::function<bool(const ollama::response&)> on_receive_token, const json& options=nullptr, const json& format=nullptr, const std::string& keep_alive_duration="5m")
     {
-        ollama::response response;        
-        request["stream"] = true;
-
-        std::string request_string = request.dump();
-        if (ollama::log_requests) std::cout << request_string << std::endl;      
-
-        std::shared_ptr<std::vector<std::string>> partial_responses = std::make_shared<std::vector<std::string>>();
+        std::string request_string;
+        ollama::chat_request_builder::write_request(request_string, json(model).dump(), conversation.serialized(), options!=nullptr ? options["options"].dump() : "", json(keep_alive_duration).dump(), true, ollama::format_requested(format) ? format.dump() : "");
+        return chat_request(request_string, on_receive_token);
+    }
 
-        auto stream_callback = [on_receive_token, partial_responses](const char *data, size_t data_length)->bool{
-            
-            std::string message(data, data_length);
-            bool continue_stream = true;
+    ollama::response chat(const std::string& model, const ollama::conversation& conversation, const ollama::model_options& options, const json& format=nullptr, const std::string& keep_alive_duration="5m")
+    {
+        std::string request_string, options_json;
+        options.write(options_json);
+        ollama::chat_request_builder::write_request(request_string, json(model).dump(), conversation.serialized(), options_json, json(keep_alive_duration).dump(), false, ollama::format_requested(format) ? format.dump() : "");
+        return chat_request(request_string);
+    }
 
-            if (ollama::log_replies) std::cout << message << std::endl;
-            try 
-            {   
-                partial_responses->push_back(message);
-                std::string total_response = std::accumulate(partial_responses->begin(), partial_responses->end(), std::string(""));                
-                ollama::response response(total_response, ollama::message_type::chat);
-                partial_responses->clear();  
+    bool chat(const std::string& model, const ollama::conversation& conversation, std::function<bool(const ollama::response&)> on_receive_token, const ollama::model_options& options, const json& format=nullptr, const std::string& keep_alive_duration="5m")
+    {
+        std::string request_string, options_json;
+        options.write(options_json);
+        ollama::chat_request_builder::write_request(request_string, json(model).dump(), conversation.serialized(), options_json, json(keep_alive_duration).dump(), true, ollama::format_requested(format) ? format.dump() : "");
+        return chat_request(request_string, on_receive_token);
+    }
 
-                if ( response.has_error() ) { if (ollama::use_exceptions) throw ollama::exception("Ollama response returned error: "+response.get_error() ); }
-                continue_stream = on_receive_token(response);
-            }
-            catch (const ollama::invalid_json_exception& e) { /* Partial response was received. Will do nothing and attempt to concatenate with the next response. */ }
+    // Stream generated text straight into a sink such as an fd_sink or ostream_sink. No response is built per token.
+    bool generate(const std::string& model, std::string prompt, ollama::stream_sink& sink, const json& options=nullptr, std::vector<std::string> images=std::vector<std::string>())
+    {
+        ollama::request request(model, std::move(prompt), options, true, std::move(images));
+        return generate(request, sink);
+    }
 
-            return continue_stream;
-        };
+    bool generate(ollama::request& request, ollama::stream_sink& sink)
+    {
+        request["stream"] = true;
+        return stream_to_sink("/api/generate", request.dump(), ollama::message_type::generation, sink);
+    }
 
-        if (auto res = this->cli->Post("/api/chat", request_string, "application/json", stream_callback)) { return true; }
-        else if (res.error()==httplib::Error::Canceled) { /* Request cancelled by user. */ return true; }
-        else { if (ollama::use_exceptions) throw ollama::exception( "No response from server returned at URL"+this->server_url+" Error: "+httplib::to_string( res.error() ) ); }
+    bool chat(const std::string& model, ollama::messages messages, ollama::stream_sink& sink, const json& options=nullptr, const json& format=nullptr, const std::string& keep_alive_duration="5m")
+    {
+        ollama::request request(model, std::move(messages), options, true, format, keep_alive_duration);
+        return chat(request, sink);
+    }
 
-        return false;
+    bool chat(ollama::request& request, ollama::stream_sink& sink)
+    {
+        request["stream"] = true;
+        return stream_to_sink("/api/chat", request.dump(), ollama::message_type::chat, sink);
     }
 
+    bool chat(const ollama::chat_request_builder& builder, ollama::stream_sink& sink) { return stream_to_sink("/api/chat", builder.dump(true), ollama::message_type::chat, sink); }
+
     bool create_model(const std::string& modelName, const std::string& modelFile, bool loadFromFile=true)
     {
 
@@ -35363,13 +40475,13 @@ class Ollama
         else request["modelFile"] = modelFile;
 
         std::string request_string = request.dump();
-        if (ollama::log_requests) std::cout << request_string << std::endl;  
+        ollama::log_request(request_string);
 
         std::string response;
 
-        if (auto res = this->cli->Post("/api/create",request_string, "application/json"))
+        if (auto res = this->send("POST", "/api/create", request_string))
         {
-            if (ollama::log_replies) std::cout << res->body << std::endl;
+            ollama::log_reply(res->body);
 
             json chunk = json::parse(res->body);
             if (chunk["status"]=="success") return true;        
@@ -35388,12 +40500,12 @@ class Ollama
         json request;
         request["model"] = model;
         std::string request_string = request.dump();
-        if (ollama::log_requests) std::cout << request_string << std::endl;
+        ollama::log_request(request_string);
 
         // Send a blank request with the model name to instruct ollama to load the model into memory.
-        if (auto res = this->cli->Post("/api/generate", request_string, "application/json"))
+        if (auto res = this->send("POST", "/api/generate", request_string))
         {
-            if (ollama::log_replies) std::cout << res->body << std::endl;
+            ollama::log_reply(res->body);
             json response = json::parse(res->body);
             return response["done"];        
         }
@@ -35408,7 +40520,7 @@ class Ollama
 
     bool is_running()
     {
-        auto res = cli->Get("/");
+        auto res = this->send("GET", "/");
         if (res) if (res->body=="Ollama is running") return true;
         return false;
     }
@@ -35416,9 +40528,9 @@ class Ollama
     json list_model_json()
     {
         json models;
-        if (auto res = cli->Get("/api/tags"))
+        if (auto res = this->send("GET", "/api/tags"))
         {
-            if (ollama::log_replies) std::cout << res->body << std::endl;
+            ollama::log_reply(res->body);
             models = json::parse(res->body);
         }
         else { if (ollama::use_exceptions) throw ollama::exception("No response returned from server when querying model list: "+httplib::to_string( res.error() ) );}        
@@ -35443,9 +40555,9 @@ class Ollama
     json running_model_json()
     {
         json models;
-        if (auto res = cli->Get("/api/ps"))
+        if (auto res = this->send("GET", "/api/ps"))
         {
-            if (ollama::log_replies) std::cout << res->body << std::endl;
+            ollama::log_reply(res->body);
             models = json::parse(res->body);
         }
         else { if (ollama::use_exceptions) throw ollama::exception("No response returned from server when querying running models: "+httplib::to_string( res.error() ) );}        
@@ -35469,7 +40581,7 @@ class Ollama
 
     bool blob_exists(const std::string& digest)
     {
-        if (auto res = cli->Head("/api/blobs/"+digest))
+        if (auto res = this->send("HEAD", "/api/blobs/"+digest))
         {
             if (res->status==httplib::StatusCode::OK_200) return true;
             if (res->status==httplib::StatusCode::NotFound_404) return false;            
@@ -35481,7 +40593,7 @@ class Ollama
 
     bool create_blob(const std::string& digest)
     {
-        if (auto res = cli->Post("/api/blobs/"+digest))
+        if (auto res = this->send("POST", "/api/blobs/"+digest))
         {
             if (res->status==httplib::StatusCode::Created_201) return true;
             if (res->status==httplib::StatusCode::BadRequest_400) { if (ollama::use_exceptions) throw ollama::exception("Received bad request (Code 400) from Ollama server when creating blob."); }            
@@ -35499,11 +40611,11 @@ class Ollama
         if (verbose) request["verbose"] = true;
 
         std::string request_string = request.dump();
-        if (ollama::log_requests) std::cout << request_string << std::endl;
+        ollama::log_request(request_string);
 
-        if (auto res = cli->Post("/api/show", request_string, "application/json"))
+        if (auto res = this->send("POST", "/api/show", request_string))
         {
-            if (ollama::log_replies) std::cout << "Reply was " << res->body << std::endl;
+            ollama::log_reply(res->body);
             try
             { 
                 response = json::parse(res->body); 
@@ -35523,9 +40635,9 @@ class Ollama
         request["destination"] = dest_model;
 
         std::string request_string = request.dump();
-        if (ollama::log_requests) std::cout << request_string << std::endl;
+        ollama::log_request(request_string);
         
-        if (auto res = cli->Post("/api/copy", request_string, "application/json"))
+        if (auto res = this->send("POST", "/api/copy", request_string))
         {
             if (res->status==httplib::StatusCode::OK_200) return true;
             if (res->status==httplib::StatusCode::NotFound_404) { if (ollama::use_exceptions) throw ollama::exception("Source model not found when copying model (Code 404)."); }            
@@ -35541,9 +40653,9 @@ class Ollama
         request["name"] = model;
 
         std::string request_string = request.dump();
-        if (ollama::log_requests) std::cout << request_string << std::endl;
+        ollama::log_request(request_string);
         
-        if (auto res = cli->Delete("/api/delete", request_string, "application/json"))
+        if (auto res = this->send("DELETE", "/api/delete", request_string))
         {
             if (res->status==httplib::StatusCode::OK_200) return true;
             if (res->status==httplib::StatusCode::NotFound_404) { if (ollama::use_exceptions) throw ollama::exception("Model not found when trying to delete (Code 404)."); }            
@@ -35561,9 +40673,9 @@ class Ollama
         request["stream"] = false;
 
         std::string request_string = request.dump();
-        if (ollama::log_requests) std::cout << request_string << std::endl;
+        ollama::log_request(request_string);
         
-        if (auto res = cli->Post("/api/pull", request_string, "application/json"))
+        if (auto res = this->send("POST", "/api/pull", request_string))
         {
             if (res->status==httplib::StatusCode::OK_200) return true;
             if (res->status==httplib::StatusCode::NotFound_404) { if (ollama::use_exceptions) throw ollama::exception("Model not found when trying to pull (Code 404)."); return false; }
@@ -35576,107 +40688,592 @@ class Ollama
         return false;
     }
 
-    bool push_model(const std::string& model, bool allow_insecure = false)
+    bool push_model(const std::string& model, bool allow_insecure = false)
+    {
+        json request, response;
+        request["name"] = model;
+        request["insecure"] = allow_insecure;
+        request["stream"] = false;
+
+        std::string request_string = request.dump();
+        ollama::log_request(request_string);
+        
+        if (auto res = this->send("POST", "/api/push", request_string))
+        {
+            if (res->status==httplib::StatusCode::OK_200) return true;
+            if (res->status==httplib::StatusCode::NotFound_404) { if (ollama::use_exceptions) throw ollama::exception("Model not found when trying to push (Code 404)."); return false; }
+
+            response = json::parse(res->body);
+            if ( response.contains("error") ) { if (ollama::use_exceptions) throw ollama::exception( "Error returned from ollama when pushing model: "+response["error"].get<std::string>() ); return false; }          
+        }
+        else { if (ollama::use_exceptions) throw ollama::exception("No response returned from server when pushing model: "+httplib::to_string( res.error() ) );}        
+
+        return false;
+    }
+
+    ollama::response generate_embeddings(const std::string& model, const std::string& input, const json& options=nullptr, bool truncate = true, const std::string& keep_alive_duration="5m")
+    {
+        ollama::request request = ollama::request::from_embedding(model, input, options, truncate, keep_alive_duration);
+        return generate_embeddings(request);
+    }
+
+
+    // Generates embeddings through a cache. Only inputs which are not cached are sent to the server, in one request, and
+    // the response holds an embedding for every input in order.
+    ollama::response generate_embeddings(ollama::request& request, ollama::embedding_cache& cache)
+    {
+        std::string model = request.contains("model") ? request["model"].get<std::string>() : "";
+        bool truncate = !request.contains("truncate") || request["truncate"].get<bool>();
+
+        std::vector<std::string> inputs;
+        if (request.contains("input") && request["input"].is_array()) inputs = request["input"].get<std::vector<std::string>>();
+        else if (request.contains("input")) inputs.push_back(request["input"].get<std::string>());
+
+        std::vector<ollama::hash128> keys(inputs.size());
+        std::vector<std::vector<float>> embeddings(inputs.size());
+        std::vector<bool> cached(inputs.size());
+        for (size_t i = 0; i < inputs.size(); ++i) { keys[i] = ollama::embedding_cache::key(model, truncate, inputs[i]); cached[i] = cache.get(keys[i], embeddings[i]); }
+
+        // Each distinct input which is not cached is sent once.
+        std::unordered_map<ollama::hash128, size_t, ollama::hash128::hasher> missing;
+        std::vector<ollama::hash128> missing_keys;
+        json missing_inputs = json::array();
+        for (size_t i = 0; i < inputs.size(); ++i)
+            if (!cached[i] && missing.emplace(keys[i], missing_keys.size()).second) { missing_keys.push_back(keys[i]); missing_inputs.push_back(inputs[i]); }
+
+        json reply;
+        reply["model"] = model;
+        if (!missing_keys.empty())
+        {
+            ollama::request upstream = request;
+            upstream["input"] = missing_inputs;
+            ollama::response response = generate_embeddings(upstream);
+
+            // The other members of the reply, such as its durations, are kept.
+            std::vector<float> values;
+            size_t dimensions = 0;
+            const std::string& body = response.as_json_string();
+            bool decoded = response.is_valid() && ollama::decode_embeddings(body.data(), body.size(), values, dimensions, [&reply](const std::string& key, const char* value, size_t length) { reply[key] = json::parse(value, value + length); });
+            if (!decoded || dimensions == 0 || values.size() / dimensions != missing_keys.size())
+            {
+                if (ollama::use_exceptions) throw ollama::exception("Unable to generate embeddings for "+std::to_string(missing_keys.size())+" uncached inputs");
+                return response;
+            }
+
+            std::vector<std::vector<float>> generated(missing_keys.size());
+            for (size_t i = 0; i < generated.size(); ++i) generated[i].assign(values.begin() + i * dimensions, values.begin() + (i + 1) * dimensions);
+            cache.put(missing_keys, generated);
+            for (size_t i = 0; i < inputs.size(); ++i) if (!cached[i]) embeddings[i] = generated[missing[keys[i]]];
+        }
+
+        reply["embeddings"] = embeddings;
+        return ollama::response(reply.dump(), ollama::message_type::embedding);
+    }
+
+    ollama::response generate_embeddings(ollama::request& request)
+    {
+        ollama::response response;
+
+        std::string request_string = request.dump();
+        ollama::log_request(request_string);
+        
+        if (auto res = this->send("POST", "/api/embed", request_string))
+        {
+            ollama::log_reply(res->body);
+
+
+            if (res->status==httplib::StatusCode::OK_200) {response = ollama::response(res->body, ollama::message_type::embedding); return response; };
+            if (res->status==httplib::StatusCode::NotFound_404) { if (ollama::use_exceptions) throw ollama::exception("Model not found when trying to push (Code 404)."); }
+
+            if ( response.has_error() ) { if (ollama::use_exceptions) throw ollama::exception( "Error returned from ollama when generating embeddings: "+response.get_error() ); }          
+        }
+        else { if (ollama::use_exceptions) throw ollama::exception("No response returned from server when pushing model: "+httplib::to_string( res.error() ) );}        
+
+        return response;
+    }
+
+    std::string get_version()
+    {
+        std::string version;
+
+        auto res = this->send("GET", "/api/version");
+
+        if (res)
+        {
+            json response = json::parse(res->body);        
+            version = response["version"];
+        }
+        else
+        {
+            throw ollama::exception("Error retrieving version: "+res->status);
+        }
+
+        return version;
+
+    }
+
+    void setServerURL(const std::string& server_url)
+    {
+        this->server_url = server_url;
+        delete(this->cli);        
+        this->cli = new httplib::Client(server_url);
+    }
+
+    void setReadTimeout(const int seconds)
+    {
+        this->read_timeout = seconds;
+        this->cli->set_read_timeout(seconds);
+    }
+
+    void setWriteTimeout(const int seconds)
+    {
+        this->write_timeout = seconds;
+        this->cli->set_write_timeout(seconds);
+    }
+
+    // Cancels the request in flight on this client from another thread, for example when a stream has stalled. A
+    // cancelled stream ends as if its callback had returned false.
+    void cancel()
+    {
+        this->cancel_requested = true;
+        this->cli->stop();
+    }
+
+    // Servers that batches are spread across. Each batch worker keeps its own connection to one of them, in turn.
+    // Without endpoints, batches are sent to this client's server.
+    void set_batch_endpoints(const std::vector<std::string>& urls) { this->batch_endpoints = urls; }
+
+    // Runs generation requests with at most concurrency requests in flight, and returns the results in the order of the
+    // requests. A request which fails does not stop the batch; its error is recorded in its result. on_complete is called
+    // with each result and the number of requests completed so far as soon as each request completes. It is called from
+    // the batch's worker threads, one call at a time, and must not throw.
+    std::vector<ollama::batch_result> generate_batch(std::vector<ollama::request> requests, size_t concurrency=4, std::function<void(const ollama::batch_result&, size_t)> on_complete=nullptr)
+    {
+        return run_batch(requests, concurrency, on_complete, [](Ollama& client, ollama::request& request) { return client.generate(request); });
+    }
+
+    std::vector<ollama::batch_result> chat_batch(std::vector<ollama::request> requests, size_t concurrency=4, std::function<void(const ollama::batch_result&, size_t)> on_complete=nullptr)
+    {
+        return run_batch(requests, concurrency, on_complete, [](Ollama& client, ollama::request& request) { return client.chat(request); });
+    }
+
+    // Runs embedding requests in the same way, looking each input up in a cache first when one is given.
+    std::vector<ollama::batch_result> embed_batch(std::vector<ollama::request> requests, size_t concurrency=4, std::function<void(const ollama::batch_result&, size_t)> on_complete=nullptr, ollama::embedding_cache* cache=nullptr)
+    {
+        return run_batch(requests, concurrency, on_complete, [cache](Ollama& client, ollama::request& request) { return cache ? client.generate_embeddings(request, *cache) : client.generate_embeddings(request); });
+    }
+
+    // Summarizes a long document with map-reduce. The document is split into overlapping chunks which are summarized in
+    // parallel through generate_batch, and the summaries are then combined fan_in at a time, level by level, until one
+    // summary remains. If a request fails, an empty string is returned, or an exception is thrown when exceptions are enabled.
+    std::string summarize(const std::string& model, const std::string& document, const ollama::summarize_options& settings=ollama::summarize_options(), const json& options=nullptr)
+    {
+        std::vector<std::string> prompts;
+        for (const ollama::text_chunk& chunk: ollama::chunk_text(document, settings.chunking)) prompts.push_back(ollama::fill_prompt(settings.map_prompt, chunk.text));
+        if (prompts.empty()) return "";
+
+        std::vector<std::string> summaries;
+        if (!summarize_level(model, prompts, settings, options, 0, summaries)) return "";
+
+        size_t fan_in = std::max<size_t>(settings.fan_in, 2);
+        for (size_t level = 1; summaries.size() > 1; ++level)
+        {
+            // A group of one summary is carried up to the next level as it is.
+            std::vector<std::string> combined, reduced;
+            std::vector<size_t> slots;
+            prompts.clear();
+
+            for (size_t first = 0; first < summaries.size(); first += fan_in)
+            {
+                size_t last = std::min(first + fan_in, summaries.size());
+                if (last - first == 1) { combined.push_back(summaries[first]); continue; }
+
+                std::string joined = summaries[first];
+                for (size_t i = first + 1; i < last; ++i) { joined += settings.separator; joined += summaries[i]; }
+
+                slots.push_back(combined.size());
+                combined.push_back("");
+                prompts.push_back(ollama::fill_prompt(settings.reduce_prompt, joined));
+            }
+
+            if (!summarize_level(model, prompts, settings, options, level, reduced)) return "";
+            for (size_t i = 0; i < slots.size(); ++i) combined[slots[i]] = std::move(reduced[i]);
+            summaries = std::move(combined);
+        }
+
+        return summaries.front();
+    }
+
+    // Record every request and response, including streamed chunks and their timing, to a cassette file.
+    void record_cassette(const std::string& filepath)
+    {
+        this->tape = ollama::cassette::record(filepath);
+    }
+
+    // Serve responses from a recorded cassette file instead of the server. A speed of 1 replays with the
+    // original timing, larger values replay proportionally faster and 0 replays without any delay.
+    void replay_cassette(const std::string& filepath, double speed=0)
+    {
+        this->tape = ollama::cassette::load(filepath);
+        this->replay_speed = speed;
+    }
+
+    // Stop recording or replaying and resume normal communication with the server.
+    void eject_cassette()
+    {
+        this->tape.reset();
+    }
+
+    private:
+
+    ollama::response generate_request(const std::string& request_string)
+    {
+        ollama::response response;
+        ollama::log_request(request_string);
+
+        if (auto res = this->send("POST", "/api/generate", request_string))
+        {
+            ollama::log_reply(res->body);
+
+            response = ollama::response(res->body);
+            if ( response.has_error() ) { if (ollama::use_exceptions) throw ollama::exception("Ollama response returned error: "+response.get_error() ); }
+           
+        }
+        else
+        {
+            if (ollama::use_exceptions) throw ollama::exception("No response returned from server "+this->server_url+". Error was: "+httplib::to_string( res.error() ));
+        }
+
+        return response;        
+    }
+
+    bool generate_request(const std::string& request_string, std::function<bool(const ollama::response&)> on_receive_token)
+    {
+        ollama::log_request(request_string);
+
+        ollama::stream_buffer buffer;
+
+        // A single response and arena are reused for every token in the stream.
+        ollama::response response;
+        ollama::memory_arena arena;
+
+        auto on_line = [&on_receive_token, &response, &arena](const char *line, size_t line_length)->bool{
+
+            bool continue_stream = true;
+            try 
+            {   
+                if ( response.assign(line, line_length, ollama::message_type::generation, &arena) ) continue_stream = on_receive_token(response); 
+            }
+            catch (const ollama::invalid_json_exception& e) { /* A malformed line was received. Will skip it and continue with the next line. */ }
+            
+            return continue_stream;
+        };
+
+        auto stream_callback = [&buffer, &on_line](const char *data, size_t data_length)->bool{
+
+            ollama::log_stream_reply(data, data_length);
+            return buffer.append(data, data_length, on_line);
+        };
+
+        if (auto res = this->send("POST", "/api/generate", request_string, stream_callback)) { buffer.finish(on_line); return true; }
+        else if (res.error()==httplib::Error::Canceled) { /* Request cancelled by user. */ return true; }        
+        else { if (ollama::use_exceptions) throw ollama::exception( "No response from server returned at URL "+this->server_url+" Error: "+httplib::to_string( res.error() ) ); } 
+
+        return false;
+    }
+
+    // Serializes a chat request with typed options, producing the same bytes as the equivalent ollama::request.
+    static std::string write_chat(const std::string& model, const ollama::messages& messages, const ollama::model_options& options, bool stream, const json& format, const std::string& keep_alive_duration)
+    {
+        ollama::serialized_messages history;
+        for (const ollama::message& message: messages) history.push_back(message);
+
+        std::string options_json, request_string;
+        options.write(options_json);
+        ollama::chat_request_builder::write_request(request_string, json(model).dump(), history, options_json, json(keep_alive_duration).dump(), stream, ollama::format_requested(format) ? format.dump() : "");
+        return request_string;
+    }
+
+    ollama::response chat_request(const std::string& request_string)
+    {
+        ollama::response response;
+        ollama::log_request(request_string);
+
+        if (auto res = this->send("POST", "/api/chat", request_string))
+        {
+            ollama::log_reply(res->body);
+
+            response = ollama::response(res->body, ollama::message_type::chat);
+            if ( response.has_error() ) { if (ollama::use_exceptions) throw ollama::exception("Ollama response returned error: "+response.get_error() ); }
+           
+        }
+        else
+        {
+            if (ollama::use_exceptions) throw ollama::exception("No response returned from server "+this->server_url+". Error was: "+httplib::to_string( res.error() ));
+        }
+
+        return response;
+    }
+
+    bool chat_request(const std::string& request_string, std::function<bool(const ollama::response&)> on_receive_token)
+    {
+        ollama::log_request(request_string);
+
+        ollama::stream_buffer buffer;
+
+        // A single response and arena are reused for every token in the stream.
+        ollama::response response;
+        ollama::memory_arena arena;
+
+        auto on_line = [&on_receive_token, &response, &arena](const char *line, size_t line_length)->bool{
+
+            bool continue_stream = true;
+            try 
+            {   
+                if ( !response.assign(line, line_length, ollama::message_type::chat, &arena) ) return true;
+
+                if ( response.has_error() ) { if (ollama::use_exceptions) throw ollama::exception("Ollama response returned error: "+response.get_error() ); }
+                continue_stream = on_receive_token(response);
+            }
+            catch (const ollama::invalid_json_exception& e) { /* A malformed line was received. Will skip it and continue with the next line. */ }
+
+            return continue_stream;
+        };
+
+        auto stream_callback = [&buffer, &on_line](const char *data, size_t data_length)->bool{
+
+            ollama::log_stream_reply(data, data_length);
+            return buffer.append(data, data_length, on_line);
+        };
+
+        if (auto res = this->send("POST", "/api/chat", request_string, stream_callback)) { buffer.finish(on_line); return true; }
+        else if (res.error()==httplib::Error::Canceled) { /* Request cancelled by user. */ return true; }
+        else { if (ollama::use_exceptions) throw ollama::exception( "No response from server returned at URL"+this->server_url+" Error: "+httplib::to_string( res.error() ) ); }
+
+        return false;
+    }
+
+    bool stream_to_sink(const std::string& path, const std::string& request_string, ollama::message_type type, ollama::stream_sink& sink)
     {
-        json request, response;
-        request["name"] = model;
-        request["insecure"] = allow_insecure;
-        request["stream"] = false;
+        ollama::log_request(request_string);
 
-        std::string request_string = request.dump();
-        if (ollama::log_requests) std::cout << request_string << std::endl;
-        
-        if (auto res = cli->Post("/api/push", request_string, "application/json"))
-        {
-            if (res->status==httplib::StatusCode::OK_200) return true;
-            if (res->status==httplib::StatusCode::NotFound_404) { if (ollama::use_exceptions) throw ollama::exception("Model not found when trying to push (Code 404)."); return false; }
+        ollama::stream_buffer buffer;
+        ollama::content_extractor extractor;
 
-            response = json::parse(res->body);
-            if ( response.contains("error") ) { if (ollama::use_exceptions) throw ollama::exception( "Error returned from ollama when pushing model: "+response["error"].get<std::string>() ); return false; }          
+        auto on_line = [&extractor, &sink, type](const char *line, size_t line_length)->bool{
+
+            if ( !extractor.parse(line, line_length, type) ) return true; // A malformed line was received. Will skip it and continue with the next line.
+
+            if ( extractor.has_error() )
+            {
+                sink.flush();
+                if (ollama::use_exceptions) throw ollama::exception("Ollama response returned error: "+extractor.error() );
+                return false;
+            }
+
+            if ( !sink.write(extractor.content()) ) return false;
+            if ( extractor.done() ) return sink.flush();
+            return true;
+        };
+
+        auto stream_callback = [&buffer, &on_line](const char *data, size_t data_length)->bool{
+
+            ollama::log_stream_reply(data, data_length);
+            return buffer.append(data, data_length, on_line);
+        };
+
+        // Text which has waited flush_interval is flushed by a timer, so a token is not held back until the next one arrives.
+        std::mutex timer_mutex;
+        std::condition_variable timer_stop;
+        bool streaming = true;
+        std::thread timer;
+        if (sink.coalesces()) timer = std::thread([&sink, &timer_mutex, &timer_stop, &streaming]{
+            std::unique_lock<std::mutex> lock(timer_mutex);
+            while (!timer_stop.wait_for(lock, sink.get_flush_interval(), [&streaming]{ return !streaming; })) sink.flush_if_due();
+        });
+
+        auto stop_timer = [&]{
+            if (!timer.joinable()) return;
+            { std::lock_guard<std::mutex> lock(timer_mutex); streaming = false; }
+            timer_stop.notify_one();
+            timer.join();
+        };
+
+        httplib::Result res;
+        try
+        {
+            res = this->send("POST", path, request_string, stream_callback);
+            if (res) buffer.finish(on_line);
         }
-        else { if (ollama::use_exceptions) throw ollama::exception("No response returned from server when pushing model: "+httplib::to_string( res.error() ) );}        
+        catch (...) { stop_timer(); throw; }
+        stop_timer();
 
+        bool flushed = sink.flush();
+        if (res) return flushed;
+        if (res.error()==httplib::Error::Canceled) return !sink.has_failed();
+
+        if (ollama::use_exceptions) throw ollama::exception( "No response from server returned at URL"+this->server_url+" Error: "+httplib::to_string( res.error() ) );
         return false;
     }
 
-    ollama::response generate_embeddings(const std::string& model, const std::string& input, const json& options=nullptr, bool truncate = true, const std::string& keep_alive_duration="5m")
+    // All communication with the server passes through here so that it can be recorded or replayed.
+    httplib::Result send(const std::string& method, const std::string& path, const std::string& body="", httplib::ContentReceiver on_receive=nullptr)
     {
-        ollama::request request = ollama::request::from_embedding(model, input, options, truncate, keep_alive_duration);
-        return generate_embeddings(request);
-    }
+        std::shared_ptr<ollama::cassette> tape = this->tape;
 
+        if (!tape) return transmit(method, path, body, on_receive);
+        if (tape->is_replaying()) return replay(*tape, method, path, body, on_receive);
 
-    ollama::response generate_embeddings(ollama::request& request)
-    {
-        ollama::response response;
+        ollama::cassette::interaction recorded;
+        recorded.method = method; recorded.path = path; recorded.request_body = body;
 
-        std::string request_string = request.dump();
-        if (ollama::log_requests) std::cout << request_string << std::endl;
-        
-        if (auto res = cli->Post("/api/embed", request_string, "application/json"))
-        {
-            if (ollama::log_replies) std::cout << res->body << std::endl;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        auto elapsed_us = [start]() { return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count()); };
 
+        httplib::ContentReceiver recording_receiver = nullptr;
+        if (on_receive) recording_receiver = [&recorded, &on_receive, &elapsed_us](const char* data, size_t data_length)->bool {
+            recorded.chunks.push_back({ elapsed_us(), std::string(data, data_length) });
+            return on_receive(data, data_length);
+        };
 
-            if (res->status==httplib::StatusCode::OK_200) {response = ollama::response(res->body); return response; };
-            if (res->status==httplib::StatusCode::NotFound_404) { if (ollama::use_exceptions) throw ollama::exception("Model not found when trying to push (Code 404)."); }
+        httplib::Result res = transmit(method, path, body, recording_receiver);
 
-            if ( response.has_error() ) { if (ollama::use_exceptions) throw ollama::exception( "Error returned from ollama when generating embeddings: "+response.get_error() ); }          
-        }
-        else { if (ollama::use_exceptions) throw ollama::exception("No response returned from server when pushing model: "+httplib::to_string( res.error() ) );}        
+        recorded.duration_us = elapsed_us();
+        recorded.error = static_cast<int>(res.error());
+        if (res) { recorded.status = res->status; recorded.response_body = res->body; }
 
-        return response;
+        tape->append(recorded);
+        return res;
     }
 
-    std::string get_version()
+    httplib::Result transmit(const std::string& method, const std::string& path, const std::string& body, httplib::ContentReceiver on_receive)
     {
-        std::string version;
+        httplib::Result res;
+        if (method == "GET") res = this->cli->Get(path);
+        else if (method == "HEAD") res = this->cli->Head(path);
+        else if (method == "DELETE") res = this->cli->Delete(path, body, "application/json");
+        else if (on_receive) res = this->cli->Post(path, body, "application/json", on_receive);
+        else res = this->cli->Post(path, body, "application/json");
 
-        auto res = this->cli->Get("/api/version");
+        // A request cut off by cancel() is reported like one cancelled by its callback.
+        if (this->cancel_requested.exchange(false) && !res) return httplib::Result(nullptr, httplib::Error::Canceled);
+        return res;
+    }
 
-        if (res)
+    httplib::Result replay(ollama::cassette& tape, const std::string& method, const std::string& path, const std::string& body, httplib::ContentReceiver on_receive)
+    {
+        ollama::cassette::interaction recorded;
+        if (!tape.take(method, path, body, recorded))
         {
-            json response = json::parse(res->body);        
-            version = response["version"];
+            if (ollama::use_exceptions) throw ollama::exception("No recorded response in cassette for "+method+" "+path);
+            return httplib::Result(nullptr, httplib::Error::Unknown);
         }
-        else
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        auto wait_until = [this, start](uint64_t offset_us) {
+            if (this->replay_speed > 0) std::this_thread::sleep_until(start + std::chrono::microseconds(static_cast<int64_t>(offset_us / this->replay_speed)));
+        };
+
+        if (on_receive)
         {
-            throw ollama::exception("Error retrieving version: "+res->status);
+            for (const ollama::cassette::chunk& received: recorded.chunks)
+            {
+                wait_until(received.offset_us);
+                if (this->cancel_requested.exchange(false) || !on_receive(received.data.data(), received.data.size())) return httplib::Result(nullptr, httplib::Error::Canceled);
+            }
         }
 
-        return version;
+        wait_until(recorded.duration_us);
+        if (recorded.error != static_cast<int>(httplib::Error::Success)) return httplib::Result(nullptr, static_cast<httplib::Error>(recorded.error));
 
+        std::unique_ptr<httplib::Response> response(new httplib::Response());
+        response->status = recorded.status;
+        response->body = std::move(recorded.response_body);
+        return httplib::Result(std::move(response), httplib::Error::Success);
     }
 
-    void setServerURL(const std::string& server_url)
+    bool summarize_level(const std::string& model, const std::vector<std::string>& prompts, const ollama::summarize_options& settings, const json& options, size_t level, std::vector<std::string>& summaries)
     {
-        this->server_url = server_url;
-        delete(this->cli);        
-        this->cli = new httplib::Client(server_url);
-    }
+        std::vector<ollama::request> requests;
+        requests.reserve(prompts.size());
+        for (const std::string& prompt: prompts) requests.push_back(ollama::request(model, prompt, options));
 
-    void setReadTimeout(const int seconds)
-    {
-        this->cli->set_read_timeout(seconds);
+        size_t total = requests.size();
+        std::function<void(const ollama::batch_result&, size_t)> on_complete = nullptr;
+        if (settings.on_progress) on_complete = [&settings, level, total](const ollama::batch_result&, size_t completed) { settings.on_progress(level, completed, total); };
+
+        summaries.clear();
+        for (const ollama::batch_result& result: generate_batch(std::move(requests), settings.concurrency, on_complete))
+        {
+            if (!result.success)
+            {
+                if (ollama::use_exceptions) throw ollama::exception("Summarization failed at level "+std::to_string(level)+" for part "+std::to_string(result.index)+": "+result.error);
+                return false;
+            }
+            summaries.push_back(result.response.as_simple_string());
+        }
+        return true;
     }
 
-    void setWriteTimeout(const int seconds)
+    // An httplib client handles one request at a time, so each worker sends its share of the batch on its own client.
+    // on_complete may take a non-const result, to move the response out rather than leaving it in the returned results.
+    template<typename Complete, typename Send>
+    std::vector<ollama::batch_result> run_batch(std::vector<ollama::request>& requests, size_t concurrency, const Complete& on_complete, Send send)
     {
-        this->cli->set_write_timeout(seconds);
-    }
+        std::vector<ollama::batch_result> results(requests.size());
+        if (requests.empty()) return results;
 
-    private:
+        std::vector<std::string> endpoints = this->batch_endpoints.empty() ? std::vector<std::string>(1, this->server_url) : this->batch_endpoints;
+        concurrency = std::max<size_t>(1, std::min(concurrency, requests.size()));
 
-/*
-    bool send_request(const ollama::request& request, std::function<bool(const ollama::response&)> on_receive_response=nullptr)
-    {
+        std::atomic<size_t> next(0);
+        size_t completed = 0;
+        std::mutex completion_mutex;
 
-        return true;
+        auto work = [&](size_t worker) {
+
+            Ollama client(endpoints[worker % endpoints.size()]);
+            client.setReadTimeout(this->read_timeout);
+            if (this->write_timeout >= 0) client.setWriteTimeout(this->write_timeout);
+            client.tape = this->tape;
+            client.replay_speed = this->replay_speed;
+
+            for (size_t i = next++; i < requests.size(); i = next++)
+            {
+                ollama::batch_result& result = results[i];
+                result.index = i;
+
+                try
+                {
+                    result.response = send(client, requests[i]);
+                    if (result.response.has_error()) result.error = result.response.get_error();
+                    else if (!result.response.is_valid()) result.error = "No response from server at "+client.server_url;
+                    else result.success = true;
+                }
+                catch (const std::exception& e) { result.error = e.what(); }
+
+                std::lock_guard<std::mutex> lock(completion_mutex);
+                ++completed;
+                if (on_complete) on_complete(result, completed);
+            }
+        };
+
+        std::vector<std::thread> workers;
+        workers.reserve(concurrency);
+        for (size_t worker = 0; worker < concurrency; ++worker) workers.push_back(std::thread(work, worker));
+        for (std::thread& worker: workers) worker.join();
+
+        return results;
     }
-*/
 
     std::string server_url;
     httplib::Client *cli;
+    int read_timeout = 120, write_timeout = -1;
+    std::vector<std::string> batch_endpoints;
+
+    std::shared_ptr<ollama::cassette> tape;
+    std::atomic<bool> cancel_requested{false};
+    double replay_speed = 0;
 
 };
 
@@ -35691,14 +41288,14 @@ namespace ollama
         ollama.setServerURL(server_url);
     }
 
-    inline ollama::response generate(const std::string& model, const std::string& prompt, const json& options=nullptr, const std::vector<std::string>& images=std::vector<std::string>())
+    inline ollama::response generate(const std::string& model, std::string prompt, const json& options=nullptr, std::vector<std::string> images=std::vector<std::string>())
     {
-        return ollama.generate(model, prompt, options, images);
+        return ollama.generate(model, std::move(prompt), options, std::move(images));
     }
 
-    inline ollama::response generate(const std::string& model,const std::string& prompt, const ollama::response& context, const json& options=nullptr, const std::vector<std::string>& images=std::vector<std::string>())
+    inline ollama::response generate(const std::string& model, std::string prompt, const ollama::response& context, const json& options=nullptr, std::vector<std::string> images=std::vector<std::string>())
     {
-        return ollama.generate(model, prompt, context, options, images);
+        return ollama.generate(model, std::move(prompt), context, options, std::move(images));
     }
 
     inline ollama::response generate(ollama::request& request)
@@ -35706,14 +41303,14 @@ namespace ollama
         return ollama.generate(request);
     }
 
-    inline bool generate(const std::string& model,const std::string& prompt, std::function<bool(const ollama::response&)> on_receive_response, const json& options=nullptr, const std::vector<std::string>& images=std::vector<std::string>())
+    inline bool generate(const std::string& model, std::string prompt, std::function<bool(const ollama::response&)> on_receive_response, const json& options=nullptr, std::vector<std::string> images=std::vector<std::string>())
     {
-        return ollama.generate(model, prompt, on_receive_response, options, images);
+        return ollama.generate(model, std::move(prompt), on_receive_response, options, std::move(images));
     }
 
-    inline bool generate(const std::string& model,const std::string& prompt, ollama::response& context, std::function<bool(const ollama::response&)> on_receive_response, const json& options=nullptr, const std::vector<std::string>& images=std::vector<std::string>())
+    inline bool generate(const std::string& model, std::string prompt, ollama::response& context, std::function<bool(const ollama::response&)> on_receive_response, const json& options=nullptr, std::vector<std::string> images=std::vector<std::string>())
     {
-        return ollama.generate(model, prompt, context, on_receive_response, options, images);
+        return ollama.generate(model, std::move(prompt), context, on_receive_response, options, std::move(images));
     }
 
     inline bool generate(ollama::request& request, std::function<bool(const ollama::response&)> on_receive_response)
@@ -35721,19 +41318,39 @@ namespace ollama
         return ollama.generate(request, on_receive_response);
     }
 
-    inline ollama::response chat(const std::string& model, const ollama::messages& messages, const json& options=nullptr, const std::string& format="json", const std::string& keep_alive_duration="5m")
+    inline ollama::response chat(const std::string& model, ollama::messages messages, const json& options=nullptr, const json& format=nullptr, const std::string& keep_alive_duration="5m")
+    {
+        return ollama.chat(model, std::move(messages), options, format, keep_alive_duration);
+    }
+
+    inline ollama::response generate(const std::string& model, std::string prompt, const ollama::model_options& options, std::vector<std::string> images=std::vector<std::string>())
+    {
+        return ollama.generate(model, std::move(prompt), options, std::move(images));
+    }
+
+    inline bool generate(const std::string& model, std::string prompt, std::function<bool(const ollama::response&)> on_receive_response, const ollama::model_options& options, std::vector<std::string> images=std::vector<std::string>())
+    {
+        return ollama.generate(model, std::move(prompt), on_receive_response, options, std::move(images));
+    }
+
+    inline ollama::response chat(const std::string& model, const ollama::messages& messages, const ollama::model_options& options, const json& format=nullptr, const std::string& keep_alive_duration="5m")
     {
         return ollama.chat(model, messages, options, format, keep_alive_duration);
     }
 
+    inline bool chat(const std::string& model, const ollama::messages& messages, std::function<bool(const ollama::response&)> on_receive_response, const ollama::model_options& options, const json& format=nullptr, const std::string& keep_alive_duration="5m")
+    {
+        return ollama.chat(model, messages, on_receive_response, options, format, keep_alive_duration);
+    }
+
     inline ollama::response chat(ollama::request& request)
     {
         return ollama.chat(request);
     }
 
-    inline bool chat(const std::string& model, const ollama::messages& messages, std::function<bool(const ollama::response&)> on_receive_response, const json& options=nullptr, const std::string& format="json", const std::string& keep_alive_duration="5m")
+    inline bool chat(const std::string& model, ollama::messages messages, std::function<bool(const ollama::response&)> on_receive_response, const json& options=nullptr, const json& format=nullptr, const std::string& keep_alive_duration="5m")
     {
-        return ollama.chat(model, messages, on_receive_response, options, format, keep_alive_duration);
+        return ollama.chat(model, std::move(messages), on_receive_response, options, format, keep_alive_duration);
     }
 
     inline bool chat(ollama::request& request, std::function<bool(const ollama::response&)> on_receive_response)
@@ -35741,6 +41358,101 @@ namespace ollama
         return ollama.chat(request, on_receive_response);
     }
 
+    inline ollama::response chat(const ollama::chat_request_builder& builder)
+    {
+        return ollama.chat(builder);
+    }
+
+    inline bool chat(const ollama::chat_request_builder& builder, std::function<bool(const ollama::response&)> on_receive_response)
+    {
+        return ollama.chat(builder, on_receive_response);
+    }
+
+    inline ollama::response chat(const std::string& model, ollama::messages messages, const ollama::tools& tools, const json& options=nullptr, const std::string& keep_alive_duration="5m")
+    {
+        return ollama.chat(model, std::move(messages), tools, options, keep_alive_duration);
+    }
+
+    inline bool chat(const std::string& model, ollama::messages messages, const ollama::tools& tools, std::function<bool(const ollama::response&)> on_receive_response, const json& options=nullptr, const std::string& keep_alive_duration="5m")
+    {
+        return ollama.chat(model, std::move(messages), tools, on_receive_response, options, keep_alive_duration);
+    }
+
+    inline ollama::message chat_with_tools(const std::string& model, ollama::messages& messages, const ollama::tool_registry& registry, std::function<bool(const ollama::response&)> on_receive_response=nullptr, const json& options=nullptr, size_t max_rounds=8, ollama::thread_pool& pool=ollama::thread_pool::shared())
+    {
+        return ollama.chat_with_tools(model, messages, registry, on_receive_response, options, max_rounds, pool);
+    }
+
+    inline void set_batch_endpoints(const std::vector<std::string>& urls)
+    {
+        ollama.set_batch_endpoints(urls);
+    }
+
+    inline std::vector<ollama::batch_result> generate_batch(std::vector<ollama::request> requests, size_t concurrency=4, std::function<void(const ollama::batch_result&, size_t)> on_complete=nullptr)
+    {
+        return ollama.generate_batch(std::move(requests), concurrency, on_complete);
+    }
+
+    inline std::vector<ollama::batch_result> chat_batch(std::vector<ollama::request> requests, size_t concurrency=4, std::function<void(const ollama::batch_result&, size_t)> on_complete=nullptr)
+    {
+        return ollama.chat_batch(std::move(requests), concurrency, on_complete);
+    }
+
+    inline std::vector<ollama::batch_result> embed_batch(std::vector<ollama::request> requests, size_t concurrency=4, std::function<void(const ollama::batch_result&, size_t)> on_complete=nullptr, ollama::embedding_cache* cache=nullptr)
+    {
+        return ollama.embed_batch(std::move(requests), concurrency, on_complete, cache);
+    }
+
+    inline std::string summarize(const std::string& model, const std::string& document, const ollama::summarize_options& settings=ollama::summarize_options(), const json& options=nullptr)
+    {
+        return ollama.summarize(model, document, settings, options);
+    }
+
+    inline ollama::response chat(const std::string& model, const ollama::conversation& conversation, const json& options=nullptr, const json& format=nullptr, const std::string& keep_alive_duration="5m")
+    {
+        return ollama.chat(model, conversation, options, format, keep_alive_duration);
+    }
+
+    inline bool chat(const std::string& model, const ollama::conversation& conversation, std::function<bool(const ollama::response&)> on_receive_response, const json& options=nullptr, const json& format=nullptr, const std::string& keep_alive_duration="5m")
+    {
+        return ollama.chat(model, conversation, on_receive_response, options, format, keep_alive_duration);
+    }
+
+    inline ollama::response chat(const std::string& model, const ollama::conversation& conversation, const ollama::model_options& options, const json& format=nullptr, const std::string& keep_alive_duration="5m")
+    {
+        return ollama.chat(model, conversation, options, format, keep_alive_duration);
+    }
+
+    inline bool chat(const std::string& model, const ollama::conversation& conversation, std::function<bool(const ollama::response&)> on_receive_response, const ollama::model_options& options, const json& format=nullptr, const std::string& keep_alive_duration="5m")
+    {
+        return ollama.chat(model, conversation, on_receive_response, options, format, keep_alive_duration);
+    }
+
+    inline bool generate(const std::string& model, std::string prompt, ollama::stream_sink& sink, const json& options=nullptr, std::vector<std::string> images=std::vector<std::string>())
+    {
+        return ollama.generate(model, std::move(prompt), sink, options, std::move(images));
+    }
+
+    inline bool generate(ollama::request& request, ollama::stream_sink& sink)
+    {
+        return ollama.generate(request, sink);
+    }
+
+    inline bool chat(const std::string& model, ollama::messages messages, ollama::stream_sink& sink, const json& options=nullptr, const json& format=nullptr, const std::string& keep_alive_duration="5m")
+    {
+        return ollama.chat(model, std::move(messages), sink, options, format, keep_alive_duration);
+    }
+
+    inline bool chat(ollama::request& request, ollama::stream_sink& sink)
+    {
+        return ollama.chat(request, sink);
+    }
+
+    inline bool chat(const ollama::chat_request_builder& builder, ollama::stream_sink& sink)
+    {
+        return ollama.chat(builder, sink);
+    }
+
     inline bool create(const std::string& modelName, const std::string& modelFile, bool loadFromFile=true)
     {
         return ollama.create_model(modelName, modelFile, loadFromFile);
@@ -35826,6 +41538,16 @@ namespace ollama
         return ollama.generate_embeddings(request);
     }
 
+    inline ollama::response generate_embeddings(ollama::request& request, ollama::embedding_cache& cache)
+    {
+        return ollama.generate_embeddings(request, cache);
+    }
+
+    inline void cancel()
+    {
+        ollama.cancel();
+    }
+
     inline void setReadTimeout(const int& seconds)
     {
         ollama.setReadTimeout(seconds);
@@ -35836,7 +41558,231 @@ namespace ollama
         ollama.setWriteTimeout(seconds);
     }
 
+    inline void record_cassette(const std::string& filepath)
+    {
+        ollama.record_cassette(filepath);
+    }
+
+    inline void replay_cassette(const std::string& filepath, double speed=0)
+    {
+        ollama.replay_cassette(filepath, speed);
+    }
+
+    inline void eject_cassette()
+    {
+        ollama.eject_cassette();
+    }
+
 }
 
 
+
+namespace ollama
+{
+    // A piece of a document returned by retrieval, with the score of its embedding against the query.
+    struct passage {
+        std::string id;                 // The source followed by # and the number of the chunk within it.
+        std::string source;
+        std::string text;
+        size_t offset = 0;              // Byte offset of the chunk within its document.
+        float score = 0;
+    };
+
+    struct rag_options {
+        rag_options() { chunking.size = 1000; chunking.overlap = 100; }
+
+        std::string embedding_model = "nomic-embed-text";
+        chunk_options chunking;
+        size_t batch_size = 32;                 // Chunks embedded by each request.
+        size_t concurrency = 4;                 // Embedding requests in flight at once.
+        ollama::metric metric = ollama::metric::cosine;
+        size_t top_k = 4;                       // Passages retrieved for each question.
+        size_t context_tokens = 2048;           // Estimated tokens of retrieved text placed in a chat request.
+        // {text} is replaced with the retrieved passages, and the result is sent as the system message.
+        std::string prompt = "Answer the question using the context below. If the context does not contain the answer, say so.\n\nContext:\n{text}";
+        std::string separator = "\n\n";         // Placed between passages.
+        ollama::embedding_cache* cache = nullptr;
+    };
+
+    // Retrieval-augmented generation over an in-process vector_index. Documents are chunked, embedded in batches and
+    // indexed; a question is then embedded, the closest chunks are retrieved, and as many as fit within the token budget
+    // are placed in a chat request. Adding and retrieving may happen from different threads.
+    class rag {
+
+        public:
+
+            rag(const rag_options& settings=rag_options(), Ollama& client=ollama): settings(settings), client(client), index(0, settings.metric) {}
+
+            rag(const rag&) = delete;
+            rag& operator=(const rag&) = delete;
+
+            size_t add(const std::string& document, const std::string& source="")
+            {
+                return add(std::vector<std::string>(1, document), source.empty() ? std::vector<std::string>() : std::vector<std::string>(1, source));
+            }
+
+            // Chunks, embeds and indexes documents, and returns the number of chunks added. Documents without a source are
+            // numbered by how many documents were added before them. Batches are embedded on another thread while those already
+            // returned are indexed here, so the server always has requests waiting while replies are parsed. Replies which have
+            // not been indexed yet are limited to a few for each request in flight; the embedding workers wait for room before
+            // sending more.
+            size_t add(const std::vector<std::string>& documents, const std::vector<std::string>& sources=std::vector<std::string>())
+            {
+                size_t numbered;
+                { std::lock_guard<std::mutex> lock(index_mutex); numbered = documents_added; documents_added += documents.size(); }
+
+                std::vector<passage> pending;
+                for (size_t d = 0; d < documents.size(); ++d)
+                {
+                    std::string source = d < sources.size() ? sources[d] : std::to_string(numbered + d);
+                    std::vector<text_chunk> chunks = chunk_text(documents[d], settings.chunking);
+                    for (size_t c = 0; c < chunks.size(); ++c)
+                    {
+                        passage chunk;
+                        chunk.id = source + "#" + std::to_string(c);
+                        chunk.source = source;
+                        chunk.text = std::move(chunks[c].text);
+                        chunk.offset = chunks[c].offset;
+                        pending.push_back(std::move(chunk));
+                    }
+                }
+
+                size_t batch_size = std::max<size_t>(settings.batch_size, 1), concurrency = std::max<size_t>(settings.concurrency, 1);
+                size_t batches = (pending.size() + batch_size - 1) / batch_size, queued = concurrency * 4;
+
+                std::vector<ollama::request> requests;
+                requests.reserve(batches);
+                for (size_t batch = 0; batch < batches; ++batch)
+                {
+                    json inputs = json::array();
+                    for (size_t i = batch * batch_size; i < std::min((batch + 1) * batch_size, pending.size()); ++i) inputs.push_back(pending[i].text);
+                    ollama::request request = ollama::request::from_embedding(settings.embedding_model, "");
+                    request["input"] = std::move(inputs);
+                    requests.push_back(std::move(request));
+                }
+
+                std::mutex arrived_mutex;
+                std::condition_variable ready, room;
+                std::deque<ollama::batch_result> arrived;
+
+                // Each reply is moved out of the batch's results as it arrives, so only the queued ones are held in memory.
+                std::function<void(ollama::batch_result&, size_t)> on_complete = [&](ollama::batch_result& result, size_t) {
+                    std::unique_lock<std::mutex> lock(arrived_mutex);
+                    room.wait(lock, [&]() { return arrived.size() < queued; });
+                    arrived.push_back(std::move(result));
+                    ready.notify_one();
+                };
+                ollama::embedding_cache* cache = settings.cache;
+                std::thread embedder([&]() {
+                    client.run_batch(requests, concurrency, on_complete, [cache](Ollama& each, ollama::request& request) { return cache ? each.generate_embeddings(request, *cache) : each.generate_embeddings(request); });
+                });
+
+                size_t added = 0, failed = 0;
+                std::string error;
+                for (size_t received = 0; received < batches; ++received)
+                {
+                    ollama::batch_result result;
+                    {
+                        std::unique_lock<std::mutex> lock(arrived_mutex);
+                        ready.wait(lock, [&arrived]() { return !arrived.empty(); });
+                        result = std::move(arrived.front());
+                        arrived.pop_front();
+                        room.notify_one();
+                    }
+
+                    size_t first = result.index * batch_size, last = std::min(first + batch_size, pending.size());
+                    try
+                    {
+                        if (!result.success) throw ollama::exception(result.error);
+                        std::vector<float> embeddings;
+                        size_t dimensions = 0;
+                        if (!result.response.get_embeddings(embeddings, dimensions) || dimensions == 0 || embeddings.size() / dimensions != last - first)
+                            throw ollama::exception("Response has the wrong number of embeddings");
+
+                        std::lock_guard<std::mutex> lock(index_mutex);
+                        for (size_t i = first; i < last; ++i)
+                            if (index.add(pending[i].id, embeddings.data() + (i - first) * dimensions, dimensions)) { passages.push_back(std::move(pending[i])); ++added; }
+                    }
+                    catch (const std::exception& e) { if (failed++ == 0) error = e.what(); }
+                }
+                embedder.join();
+
+                if (failed > 0 && ollama::use_exceptions) throw ollama::exception("Unable to embed "+std::to_string(failed)+" of "+std::to_string(batches)+" batches: "+error);
+                return added;
+            }
+
+            // The passages closest to a question, closest first. k defaults to top_k.
+            std::vector<passage> retrieve(const std::string& question, size_t k=0)
+            {
+                ollama::request request = ollama::request::from_embedding(settings.embedding_model, question);
+                ollama::response response = settings.cache ? client.generate_embeddings(request, *settings.cache) : client.generate_embeddings(request);
+                std::vector<float> embedding;
+                size_t dimensions = 0;
+                if (!response.is_valid() || !response.get_embeddings(embedding, dimensions) || dimensions == 0)
+                {
+                    if (ollama::use_exceptions) throw ollama::exception("Unable to embed the question for retrieval");
+                    return std::vector<passage>();
+                }
+                embedding.resize(dimensions);
+
+                std::vector<passage> found;
+                std::lock_guard<std::mutex> lock(index_mutex);
+                for (const search_result& result: index.search(embedding, k == 0 ? settings.top_k : k))
+                {
+                    found.push_back(passages[result.index]);
+                    found.back().score = result.score;
+                }
+                return found;
+            }
+
+            // A chat request answering the question from the given passages. Passages are taken in order, and any which
+            // would take the context past context_tokens are left out.
+            ollama::request build_chat(const std::string& model, const std::string& question, const std::vector<passage>& retrieved, const json& options=nullptr) const
+            {
+                std::string context;
+                size_t tokens = 0;
+                for (const passage& each: retrieved)
+                {
+                    std::string text = each.source.empty() ? each.text : "[" + each.source + "]\n" + each.text;
+                    size_t needed = (settings.chunking.token_estimator ? settings.chunking.token_estimator(text) : estimate_tokens(text)) + (context.empty() ? 0 : estimate_tokens(settings.separator));
+                    if (tokens + needed > settings.context_tokens) continue;
+
+                    if (!context.empty()) context += settings.separator;
+                    context += text;
+                    tokens += needed;
+                }
+
+                ollama::messages messages;
+                messages.push_back(ollama::message("system", fill_prompt(settings.prompt, context)));
+                messages.push_back(ollama::message("user", question));
+                return ollama::request(model, messages, options);
+            }
+
+            ollama::request build_chat(const std::string& model, const std::string& question, const json& options=nullptr)
+            {
+                return build_chat(model, question, retrieve(question), options);
+            }
+
+            // Retrieves passages for the question and asks the model to answer it.
+            ollama::response chat(const std::string& model, const std::string& question, const json& options=nullptr)
+            {
+                ollama::request request = build_chat(model, question, options);
+                return client.chat(request);
+            }
+
+            size_t size() const { std::lock_guard<std::mutex> lock(index_mutex); return passages.size(); }
+            const rag_options& get_options() const { return settings; }
+
+        private:
+
+            rag_options settings;
+            Ollama& client;
+
+            mutable std::mutex index_mutex;
+            vector_index index;
+            std::vector<passage> passages;      // In the order of the index.
+            size_t documents_added = 0;
+    };
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,482 @@
+#ifndef OLLAMA_MOCK_SERVER_HPP
+#define OLLAMA_MOCK_SERVER_HPP
+
+/*  A local stand-in for an Ollama server built on the httplib Server.
+
+    The mock server implements the endpoints used by ollama.hpp and produces deterministic
+    replies, which allows the tests, benchmarks and tools to run without a GPU or a real
+    model. Token rates, latency, chunk fragmentation and error injection can be configured
+    to exercise the client under realistic or adverse conditions.
+*/
+
+#include "httplib.h"
+#include "json.hpp"
+
+#include <string>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+
+namespace ollama
+{
+    enum class latency_distribution { fixed, uniform, normal, exponential };
+
+    class mock_server {
+
+        using json = nlohmann::json;
+
+        public:
+
+            struct config {
+                double tokens_per_second = 0;               // Rate at which tokens are produced. Zero produces tokens as fast as possible.
+                double latency_ms = 0;                      // Mean delay before the first token or a non-streaming reply.
+                double latency_jitter_ms = 0;               // Spread of the delay for uniform and normal distributions.
+                latency_distribution distribution = latency_distribution::fixed;
+
+                unsigned int default_num_predict = 16;      // Tokens generated when a request does not set num_predict.
+                size_t embedding_dimensions = 64;
+
+                size_t fragment_size = 0;                   // Split each streamed chunk into writes of at most this many bytes. Zero disables.
+                unsigned int lines_per_chunk = 1;           // Coalesce this many streamed lines into each write.
+
+                double error_rate = 0;                      // Probability that a generation, chat or embedding request fails with a 500.
+                int stream_error_after = -1;                // Stream this many tokens and then an error. Negative disables.
+
+                unsigned int seed = 42;
+                size_t threads = 8;
+
+                std::vector<std::string> models = {"llama3:8b", "llava"};
+
+                // Reply for requests which set a format. It is streamed in pieces of structured_piece_size bytes.
+                std::string structured_reply = R"({"name": "Nimbus", "kind": "cumulonimbus", "altitude": 2000, "tags": ["rain", "thunder"], "rain": true})";
+                size_t structured_piece_size = 4;
+            };
+
+            mock_server(): mock_server(config()) {}
+            mock_server(const config& settings): settings(settings), random(settings.seed), models(settings.models.begin(), settings.models.end())
+            {
+                size_t thread_count = settings.threads;
+                server.new_task_queue = [thread_count] { return new httplib::ThreadPool(thread_count); };
+                register_routes();
+            }
+            ~mock_server() { stop(); }
+
+            // Starts serving on a background thread. A port of zero binds to any free port.
+            bool start(int port=0, const std::string& host="127.0.0.1")
+            {
+                this->host = host;
+                if (port == 0) this->port = server.bind_to_any_port(host);
+                else this->port = server.bind_to_port(host, port) ? port : -1;
+
+                if (this->port < 0) return false;
+
+                listener = std::thread([this]{ server.listen_after_bind(); });
+                server.wait_until_ready();
+                return true;
+            }
+
+            void stop()
+            {
+                if (server.is_running()) server.stop();
+                if (listener.joinable()) listener.join();
+            }
+
+            std::string url() const { return "http://"+host+":"+std::to_string(port); }
+            int get_port() const { return port; }
+
+            size_t requests_served() const { return request_count; }
+
+            // The most non-streaming generation or chat replies that were being produced at the same time.
+            size_t peak_concurrency() const { return peak_in_flight; }
+
+            // Deterministic text produced for the nth token of every generation.
+            static std::string token(size_t n)
+            {
+                static const char* words[] = {"The", " sky", " appears", " blue", " because", " of", " a", " phenomenon", " called", " Rayleigh", " scattering", ",", " in", " which", " shorter", " wavelengths", " of", " light", " are", " scattered", " more", "."};
+                return words[n % (sizeof(words)/sizeof(words[0]))];
+            }
+
+            // Deterministic unit-length embedding for an input string.
+            static std::vector<float> embedding(const std::string& input, size_t dimensions)
+            {
+                std::vector<float> values(dimensions);
+                std::mt19937 generator(static_cast<unsigned int>(std::hash<std::string>()(input)));
+                std::normal_distribution<float> normal(0.0f, 1.0f);
+
+                double norm = 0;
+                for (float& value: values) { value = normal(generator); norm += value*value; }
+                norm = std::sqrt(norm);
+                for (float& value: values) value = static_cast<float>(value/norm);
+
+                return values;
+            }
+
+            // The embedding as Ollama writes it. Values are float32, which need at most 9 significant digits, rather than
+            // the 17 which json would write for them as doubles.
+            static json embedding_json(const std::string& input, size_t dimensions)
+            {
+                json values = json::array();
+                char text[32];
+                for (float value: embedding(input, dimensions))
+                {
+                    std::snprintf(text, sizeof(text), "%.9g", value);
+                    values.push_back(std::strtod(text, nullptr));
+                }
+                return values;
+            }
+
+        private:
+
+            void register_routes()
+            {
+                server.Get("/", [](const httplib::Request&, httplib::Response& res) { res.set_content("Ollama is running", "text/plain"); });
+                server.Get("/api/version", [](const httplib::Request&, httplib::Response& res) { res.set_content("{\"version\":\"0.5.0-mock\"}", "application/json"); });
+
+                server.Post("/api/generate", [this](const httplib::Request& req, httplib::Response& res) { generate(req, res, false); });
+                server.Post("/api/chat", [this](const httplib::Request& req, httplib::Response& res) { generate(req, res, true); });
+                server.Post("/api/embed", [this](const httplib::Request& req, httplib::Response& res) { embed(req, res); });
+
+                server.Get("/api/tags", [this](const httplib::Request&, httplib::Response& res) { list_models(res); });
+                server.Get("/api/ps", [this](const httplib::Request&, httplib::Response& res) { list_models(res); });
+                server.Post("/api/show", [this](const httplib::Request& req, httplib::Response& res) { show(req, res); });
+                server.Post("/api/copy", [this](const httplib::Request& req, httplib::Response& res) { copy(req, res); });
+                server.Delete("/api/delete", [this](const httplib::Request& req, httplib::Response& res) { remove(req, res); });
+                server.Post("/api/pull", [this](const httplib::Request& req, httplib::Response& res) { add_model(req, res, true); });
+                server.Post("/api/create", [this](const httplib::Request& req, httplib::Response& res) { add_model(req, res, true); });
+                server.Post("/api/push", [this](const httplib::Request& req, httplib::Response& res) { add_model(req, res, false); });
+
+                server.Post(R"(/api/blobs/([^/]+))", [this](const httplib::Request& req, httplib::Response& res) {
+                    std::lock_guard<std::mutex> lock(state_mutex);
+                    blobs.insert(req.matches[1]);
+                    res.status = httplib::StatusCode::Created_201;
+                });
+                // httplib serves HEAD requests with the GET handlers.
+                server.Get(R"(/api/blobs/([^/]+))", [this](const httplib::Request& req, httplib::Response& res) {
+                    std::lock_guard<std::mutex> lock(state_mutex);
+                    res.status = blobs.count(req.matches[1]) ? httplib::StatusCode::OK_200 : httplib::StatusCode::NotFound_404;
+                });
+            }
+
+            bool parse(const httplib::Request& req, httplib::Response& res, json& body)
+            {
+                ++request_count;
+                try { body = json::parse(req.body); return true; }
+                catch (...) { reply_error(res, httplib::StatusCode::BadRequest_400, "invalid request body"); return false; }
+            }
+
+            bool has_model(const std::string& model)
+            {
+                std::lock_guard<std::mutex> lock(state_mutex);
+                return models.count(model) > 0;
+            }
+
+            bool check_model(const json& body, httplib::Response& res)
+            {
+                std::string model = body.value("model", body.value("name", std::string()));
+                if (has_model(model)) return true;
+                reply_error(res, httplib::StatusCode::NotFound_404, "model \""+model+"\" not found, try pulling it first");
+                return false;
+            }
+
+            bool inject_error(httplib::Response& res)
+            {
+                if (settings.error_rate <= 0) return false;
+                std::lock_guard<std::mutex> lock(random_mutex);
+                if (std::uniform_real_distribution<double>(0, 1)(random) >= settings.error_rate) return false;
+                reply_error(res, httplib::StatusCode::InternalServerError_500, "injected error");
+                return true;
+            }
+
+            static void reply_error(httplib::Response& res, int status, const std::string& message)
+            {
+                json error; error["error"] = message;
+                res.status = status;
+                res.set_content(error.dump(), "application/json");
+            }
+
+            double sample_latency()
+            {
+                std::lock_guard<std::mutex> lock(random_mutex);
+                double mean = settings.latency_ms, jitter = settings.latency_jitter_ms, value = mean;
+
+                switch (settings.distribution)
+                {
+                    case latency_distribution::uniform: value = std::uniform_real_distribution<double>(mean-jitter, mean+jitter)(random); break;
+                    case latency_distribution::normal: value = jitter > 0 ? std::normal_distribution<double>(mean, jitter)(random) : mean; break;
+                    case latency_distribution::exponential: value = mean > 0 ? std::exponential_distribution<double>(1.0/mean)(random) : 0; break;
+                    default: break;
+                }
+
+                return value > 0 ? value : 0;
+            }
+
+            static void sleep_ms(double milliseconds)
+            {
+                if (milliseconds > 0) std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(milliseconds));
+            }
+
+            double token_interval_ms() const { return settings.tokens_per_second > 0 ? 1000.0/settings.tokens_per_second : 0; }
+
+            json chunk(const std::string& model, const std::string& text, bool chat, bool done, size_t tokens) const
+            {
+                json line;
+                line["model"] = model;
+                line["created_at"] = "2025-01-01T00:00:00.000000Z";
+                if (chat) { line["message"]["role"] = "assistant"; line["message"]["content"] = text; }
+                else line["response"] = text;
+                line["done"] = done;
+
+                if (done)
+                {
+                    line["done_reason"] = "stop";
+                    line["total_duration"] = 1000;
+                    line["load_duration"] = 100;
+                    line["prompt_eval_count"] = 8;
+                    line["prompt_eval_duration"] = 100;
+                    line["eval_count"] = tokens;
+                    line["eval_duration"] = 800;
+                    if (!chat) line["context"] = {1, 2, 3};
+                }
+
+                return line;
+            }
+
+            void generate(const httplib::Request& req, httplib::Response& res, bool chat)
+            {
+                json body;
+                if (!parse(req, res, body) || !check_model(body, res) || inject_error(res)) return;
+
+                std::string model = body["model"];
+
+                // A request without a prompt or messages loads the model, as in Ollama.
+                if (!chat && !body.contains("prompt"))
+                {
+                    json reply = chunk(model, "", false, true, 0);
+                    reply["done_reason"] = "load";
+                    res.set_content(reply.dump(), "application/json");
+                    return;
+                }
+
+                size_t tokens = settings.default_num_predict;
+                if (body.contains("options") && body["options"].is_object() && body["options"].contains("num_predict") && body["options"]["num_predict"].is_number())
+                    tokens = body["options"]["num_predict"].get<size_t>();
+
+                // Structured output is split into fixed-size pieces rather than words.
+                std::vector<std::string> pieces;
+                if (body.contains("format") && !body["format"].is_null())
+                {
+                    size_t piece_size = std::max<size_t>(settings.structured_piece_size, 1);
+                    for (size_t offset = 0; offset < settings.structured_reply.size(); offset += piece_size) pieces.push_back(settings.structured_reply.substr(offset, piece_size));
+                    tokens = pieces.size();
+                }
+
+                // A chat with tools first calls each tool once with the last message as its input. Once the results are
+                // sent back as tool messages, the reply lists them.
+                json tool_calls = json::array();
+                if (chat && body.contains("tools") && body["tools"].is_array() && body.contains("messages") && body["messages"].is_array() && !body["messages"].empty())
+                {
+                    const json& messages = body["messages"];
+                    if (messages.back().value("role", "") != "tool")
+                    {
+                        for (const json& tool: body["tools"])
+                        {
+                            json call;
+                            call["function"]["index"] = tool_calls.size();
+                            call["function"]["name"] = tool["function"].value("name", "");
+                            call["function"]["arguments"]["input"] = messages.back().value("content", "");
+                            tool_calls.push_back(call);
+                        }
+                        tokens = tool_calls.size();
+                    }
+                    else
+                    {
+                        pieces.assign(1, "Results:");
+                        for (size_t i = messages.size(); i-- > 0 && messages[i].value("role", "") == "tool";) pieces.insert(pieces.begin() + 1, " " + messages[i].value("content", ""));
+                        tokens = pieces.size();
+                    }
+                }
+
+                auto token_text = [pieces](size_t i) { return pieces.empty() ? token(i) : pieces[i]; };
+                auto token_chunk = [this, model, chat, tool_calls, token_text](size_t i) {
+                    if (tool_calls.empty()) return chunk(model, token_text(i), chat, false, i);
+                    json line = chunk(model, "", chat, false, i);
+                    line["message"]["tool_calls"] = json::array({tool_calls[i]});
+                    return line;
+                };
+
+                double latency = sample_latency();
+
+                if (!body.value("stream", true))
+                {
+                    std::string text;
+                    for (size_t i = 0; i < tokens; ++i) text += token_text(i);
+
+                    size_t running = ++in_flight, peak = peak_in_flight;
+                    while (running > peak && !peak_in_flight.compare_exchange_weak(peak, running)) {}
+                    sleep_ms(latency + token_interval_ms()*tokens);
+                    --in_flight;
+                    json reply = chunk(model, tool_calls.empty() ? text : "", chat, true, tokens);
+                    if (!tool_calls.empty()) reply["message"]["tool_calls"] = tool_calls;
+                    res.set_content(reply.dump(), "application/json");
+                    return;
+                }
+
+                res.set_chunked_content_provider("application/x-ndjson", [this, model, chat, tokens, latency, token_chunk](size_t, httplib::DataSink& sink) {
+                    std::string pending;
+                    unsigned int pending_lines = 0;
+
+                    auto write = [this, &sink, &pending, &pending_lines](const std::string& line, bool last) -> bool {
+                        pending += line; pending += '\n';
+                        if (++pending_lines < settings.lines_per_chunk && !last) return true;
+
+                        size_t piece = settings.fragment_size > 0 ? settings.fragment_size : pending.size();
+                        for (size_t offset = 0; offset < pending.size(); offset += piece)
+                            if (!sink.write(pending.data()+offset, std::min(piece, pending.size()-offset))) return false;
+
+                        pending.clear(); pending_lines = 0;
+                        return true;
+                    };
+
+                    sleep_ms(latency);
+
+                    for (size_t i = 0; i < tokens; ++i)
+                    {
+                        if (settings.stream_error_after >= 0 && i == static_cast<size_t>(settings.stream_error_after))
+                        {
+                            json error; error["error"] = "injected stream error";
+                            write(error.dump(), true); sink.done(); return true;
+                        }
+
+                        if (i > 0) sleep_ms(token_interval_ms());
+                        if (!write(token_chunk(i).dump(), false)) return false;
+                    }
+
+                    if (!write(chunk(model, "", chat, true, tokens).dump(), true)) return false;
+                    sink.done();
+                    return true;
+                });
+            }
+
+            void embed(const httplib::Request& req, httplib::Response& res)
+            {
+                json body;
+                if (!parse(req, res, body) || !check_model(body, res) || inject_error(res)) return;
+
+                std::vector<std::string> inputs;
+                if (body["input"].is_array()) for (auto& input: body["input"]) inputs.push_back(input.get<std::string>());
+                else inputs.push_back(body.value("input", std::string()));
+
+                sleep_ms(sample_latency());
+
+                json reply;
+                reply["model"] = body["model"];
+                reply["embeddings"] = json::array();
+                for (const std::string& input: inputs) reply["embeddings"].push_back(embedding_json(input, settings.embedding_dimensions));
+                reply["total_duration"] = 1000;
+                reply["load_duration"] = 100;
+                reply["prompt_eval_count"] = inputs.size();
+
+                res.set_content(reply.dump(), "application/json");
+            }
+
+            void list_models(httplib::Response& res)
+            {
+                ++request_count;
+                json reply;
+                reply["models"] = json::array();
+
+                std::lock_guard<std::mutex> lock(state_mutex);
+                for (const std::string& name: models)
+                {
+                    json model;
+                    model["name"] = name;
+                    model["model"] = name;
+                    model["size"] = 4661224676;
+                    model["digest"] = "sha256:365c0bd3c000a25d28ddbf732fe1c6add414de7275464c4e4d1c3b5fcb5d8ad1";
+                    model["details"] = details();
+                    reply["models"].push_back(model);
+                }
+
+                res.set_content(reply.dump(), "application/json");
+            }
+
+            static json details()
+            {
+                json details;
+                details["format"] = "gguf";
+                details["family"] = "llama";
+                details["parameter_size"] = "8.0B";
+                details["quantization_level"] = "Q4_0";
+                return details;
+            }
+
+            void show(const httplib::Request& req, httplib::Response& res)
+            {
+                json body;
+                if (!parse(req, res, body) || !check_model(body, res)) return;
+
+                json reply;
+                reply["modelfile"] = "FROM "+body.value("name", std::string());
+                reply["parameters"] = "stop \"<|eot_id|>\"";
+                reply["template"] = "{{ .Prompt }}";
+                reply["details"] = details();
+                res.set_content(reply.dump(), "application/json");
+            }
+
+            void copy(const httplib::Request& req, httplib::Response& res)
+            {
+                json body;
+                if (!parse(req, res, body)) return;
+
+                std::lock_guard<std::mutex> lock(state_mutex);
+                if (!models.count(body.value("source", std::string()))) { res.status = httplib::StatusCode::NotFound_404; return; }
+                models.insert(body.value("destination", std::string()));
+            }
+
+            void remove(const httplib::Request& req, httplib::Response& res)
+            {
+                json body;
+                if (!parse(req, res, body)) return;
+
+                std::lock_guard<std::mutex> lock(state_mutex);
+                if (!models.erase(body.value("name", body.value("model", std::string())))) res.status = httplib::StatusCode::NotFound_404;
+            }
+
+            void add_model(const httplib::Request& req, httplib::Response& res, bool create)
+            {
+                json body;
+                if (!parse(req, res, body)) return;
+
+                std::string name = body.value("name", body.value("model", std::string()));
+                {
+                    std::lock_guard<std::mutex> lock(state_mutex);
+                    if (create) models.insert(name);
+                    else if (!models.count(name)) { res.status = httplib::StatusCode::NotFound_404; return; }
+                }
+
+                res.set_content("{\"status\":\"success\"}", "application/json");
+            }
+
+            config settings;
+            httplib::Server server;
+            std::thread listener;
+            std::string host = "127.0.0.1";
+            int port = -1;
+
+            std::mutex random_mutex, state_mutex;
+            std::mt19937 random;
+            std::set<std::string> models, blobs;
+            std::atomic<size_t> request_count{0}, in_flight{0}, peak_in_flight{0};
+    };
+}
+
+#endif
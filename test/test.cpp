@@ -2,18 +2,60 @@
 #include "doctest.h"
 
 #include "ollama.hpp"
+#include "mock_server.hpp"
 
 #include <algorithm>
+#include <random>
+#include <cstdio>
 #include <atomic>
 #include <iostream>
+#include <sstream>
 #include <string>
 
+#ifndef _WIN32
+#include <csignal>
+#include <sys/resource.h>
+#endif
+
 // Use a seed and 0 temperature to generate deterministic outputs. num_predict determines the number of tokens generated.
 // Note that this is static. We will use these options for other generations.
 static ollama::options options;
 
 static std::string test_model = "llama3:8b", image_test_model = "llava";
 
+// The start and end of a task. Tests check that tasks ran at the same time by comparing these, rather than by timing
+// the whole run, which is unreliable on a loaded machine.
+struct task_interval { std::chrono::steady_clock::time_point start, end; };
+
+static bool all_overlap(const std::vector<task_interval>& intervals)
+{
+    if (intervals.empty()) return false;
+    std::chrono::steady_clock::time_point latest_start = intervals[0].start, earliest_end = intervals[0].end;
+    for (const task_interval& interval: intervals) { latest_start = std::max(latest_start, interval.start); earliest_end = std::min(earliest_end, interval.end); }
+    return latest_start < earliest_end;
+}
+
+static std::vector<float> random_vector(std::mt19937& generator, size_t dimensions)
+{
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+    std::vector<float> values(dimensions);
+    for (float& value: values) value = normal(generator);
+    return values;
+}
+
+// The share of the exact k closest vectors found by an approximate or quantized index, matched by ID.
+template<typename Index> static double recall(const Index& index, const ollama::vector_index& exact, const std::vector<std::vector<float>>& queries, size_t k)
+{
+    size_t found = 0;
+    for (const std::vector<float>& query: queries)
+    {
+        std::vector<ollama::search_result> expected = exact.search(query, k), results = index.search(query, k);
+        for (const ollama::search_result& result: results)
+            for (const ollama::search_result& each: expected) if (each.id == result.id) { ++found; break; }
+    }
+    return double(found) / double(queries.size() * k);
+}
+
 TEST_SUITE("Ollama Tests") {
 
     TEST_CASE("Initialize Options") {
@@ -356,6 +398,37 @@ TEST_SUITE("Ollama Tests") {
         CHECK(true);
     }
 
+    TEST_CASE("Asynchronous Structured Logging") {
+
+        std::stringstream log_stream;
+        ollama::logger logger;
+        logger.set_sink(std::make_shared<ollama::json_lines_log_sink>(log_stream));
+        logger.set_max_string_length(8);
+        logger.set_sample_rate(2);
+
+        // Long JSON string values such as base64-encoded images are truncated before being queued.
+        logger.log(ollama::log_level::debug, "request", "{\"images\":[\"iVBORw0KGgoAAAANSUhEUgAAAAoAAAAKCAYAAACNMs+9AAAAFUlEQVR42mNkYPhfz0AEYBxVSF+FAP5FDvcfRYWgAAAAAElFTkSuQmCC\"]}");
+
+        // Only every second streamed chunk is logged with a sample rate of 2.
+        for (int i=0; i<4; i++) logger.log_sampled(ollama::log_level::debug, "reply", "{}", 2);
+
+        logger.set_level(ollama::log_level::warning);
+        logger.log(ollama::log_level::debug, "request", "This record is below the minimum level.");
+
+        logger.flush();
+
+        std::vector<nlohmann::json> lines;
+        std::string line;
+        while (std::getline(log_stream, line)) lines.push_back(nlohmann::json::parse(line));
+
+        REQUIRE(lines.size() == 3);
+        CHECK(lines[0]["category"] == "request");
+        CHECK(lines[0]["level"] == "debug");
+        CHECK(lines[0]["message"] == "{\"images\":[\"iVBORw0K...[96 bytes truncated]\"]}");
+        CHECK(lines[1]["category"] == "reply");
+        CHECK(logger.dropped() == 0);
+    }
+
     /*
     TEST_CASE("Create and Check Blobs") {
 
@@ -369,4 +442,2438 @@ TEST_SUITE("Ollama Tests") {
         CHECK(ollama::blob_exists("sha256:29fdb92e57cf0827ded04ae6461b5931d01fa595843f55d36f5b275a52087dd2") == true);
     }    
 */
-}
\ No newline at end of file
+}
+// These tests run against the local mock server in mock_server.hpp and do not require an Ollama instance.
+TEST_SUITE("Mock Server Tests") {
+
+    static std::string expected_text(size_t tokens)
+    {
+        std::string text;
+        for (size_t i=0; i<tokens; i++) text += ollama::mock_server::token(i);
+        return text;
+    }
+
+    TEST_CASE("Mock Generation and Chat") {
+
+        ollama::mock_server server;
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+
+        ollama::options options;
+        options["num_predict"] = 10;
+
+        CHECK( ollama_server.is_running() );
+        CHECK( ollama_server.generate("llama3:8b", "Why is the sky blue?", options).as_simple_string() == expected_text(10) );
+        CHECK( ollama_server.chat("llama3:8b", ollama::message("user", "Why is the sky blue?"), options).as_simple_string() == expected_text(10) );
+    }
+
+    TEST_CASE("Mock Streaming with Fragmented Chunks") {
+
+        // Split lines across several writes and also combine several lines into one write.
+        ollama::mock_server::config config;
+        config.fragment_size = 7;
+        config.lines_per_chunk = 3;
+
+        ollama::mock_server server(config);
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+
+        ollama::options options;
+        options["num_predict"] = 20;
+
+        std::string streamed;
+        bool finished = false;
+        std::function<bool(const ollama::response&)> on_token = [&](const ollama::response& response) { streamed += response.as_simple_string(); finished = response.as_json()["done"]; return true; };
+
+        ollama_server.generate("llama3:8b", "Why is the sky blue?", on_token, options);
+        CHECK( streamed == expected_text(20) );
+        CHECK( finished );
+
+        streamed = ""; finished = false;
+        ollama_server.chat("llama3:8b", ollama::message("user", "Why is the sky blue?"), on_token, options);
+        CHECK( streamed == expected_text(20) );
+        CHECK( finished );
+    }
+
+    TEST_CASE("Mock Model Management and Embeddings") {
+
+        ollama::mock_server::config config;
+        config.embedding_dimensions = 32;
+
+        ollama::mock_server server(config);
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+
+        std::vector<std::string> models = ollama_server.list_models();
+        CHECK( std::find(models.begin(), models.end(), "llama3:8b") != models.end() );
+
+        CHECK( ollama_server.copy_model("llama3:8b", "llama3_copy") );
+        CHECK( ollama_server.delete_model("llama3_copy") );
+        CHECK( ollama_server.show_model_info("llama3:8b")["details"]["family"] == "llama" );
+        CHECK( ollama_server.load_model("llama3:8b") );
+
+        CHECK( ollama_server.create_blob("sha256:29fdb92e57cf0827ded04ae6461b5931d01fa595843f55d36f5b275a52087dd2") );
+        CHECK( ollama_server.blob_exists("sha256:29fdb92e57cf0827ded04ae6461b5931d01fa595843f55d36f5b275a52087dd2") );
+
+        ollama::response response = ollama_server.generate_embeddings("llama3:8b", "Why is the sky blue?");
+        CHECK( response.as_json()["embeddings"][0].size() == 32 );
+    }
+
+    TEST_CASE("Mock Error Injection") {
+
+        ollama::mock_server::config config;
+        config.error_rate = 1.0;
+
+        ollama::mock_server server(config);
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+
+        bool exception_handled = false;
+        try { ollama_server.generate("llama3:8b", "Why is the sky blue?"); }
+        catch (ollama::exception& e) { exception_handled = true; }
+        CHECK( exception_handled );
+
+        exception_handled = false;
+        try { ollama_server.generate("Non-existent-model", "Requesting this model will throw an error"); }
+        catch (ollama::exception& e) { exception_handled = true; }
+        CHECK( exception_handled );
+
+        // Errors can also be injected part way through a stream.
+        ollama::mock_server::config stream_config;
+        stream_config.stream_error_after = 2;
+
+        ollama::mock_server stream_server(stream_config);
+        REQUIRE( stream_server.start() );
+
+        Ollama stream_ollama_server(stream_server.url());
+
+        size_t tokens_received = 0;
+        std::function<bool(const ollama::response&)> on_token = [&](const ollama::response&) { tokens_received++; return true; };
+
+        exception_handled = false;
+        try { stream_ollama_server.chat("llama3:8b", ollama::message("user", "Why is the sky blue?"), on_token); }
+        catch (ollama::exception& e) { exception_handled = true; }
+        CHECK( exception_handled );
+        CHECK( tokens_received == 2 );
+    }
+}
+
+TEST_SUITE("Cassette Tests") {
+
+    TEST_CASE("Record and Replay Cassette") {
+
+        std::string cassette_path = "test_cassette.bin";
+
+        ollama::options options;
+        options["num_predict"] = 12;
+
+        std::vector<std::string> recorded_chunks;
+        std::function<bool(const ollama::response&)> record_token = [&](const ollama::response& response) { recorded_chunks.push_back(response.as_simple_string()); return true; };
+
+        ollama::response recorded_response, recorded_embedding;
+        {
+            ollama::mock_server::config config;
+            config.tokens_per_second = 400;
+            config.fragment_size = 9;
+
+            ollama::mock_server server(config);
+            REQUIRE( server.start() );
+
+            Ollama ollama_server(server.url());
+            ollama_server.record_cassette(cassette_path);
+
+            recorded_response = ollama_server.generate("llama3:8b", "Why is the sky blue?", options);
+            ollama_server.chat("llama3:8b", ollama::message("user", "Why is the sky blue?"), record_token, options);
+            recorded_embedding = ollama_server.generate_embeddings("llama3:8b", "Why is the sky blue?");
+        }
+
+        // No server is running at this address during replay.
+        Ollama replay_server("http://127.0.0.1:1");
+        replay_server.replay_cassette(cassette_path);
+
+        CHECK( replay_server.generate("llama3:8b", "Why is the sky blue?", options).as_json_string() == recorded_response.as_json_string() );
+
+        std::vector<std::string> replayed_chunks;
+        std::function<bool(const ollama::response&)> replay_token = [&](const ollama::response& response) { replayed_chunks.push_back(response.as_simple_string()); return true; };
+        replay_server.chat("llama3:8b", ollama::message("user", "Why is the sky blue?"), replay_token, options);
+        CHECK( replayed_chunks == recorded_chunks );
+
+        CHECK( replay_server.generate_embeddings("llama3:8b", "Why is the sky blue?").as_json_string() == recorded_embedding.as_json_string() );
+
+        // Each recorded interaction is only replayed once, and requests which were never recorded fail.
+        bool exception_handled = false;
+        try { replay_server.generate("llama3:8b", "Why is the sky blue?", options); }
+        catch (ollama::exception& e) { exception_handled = true; }
+        CHECK( exception_handled );
+
+        // Replaying at the original speed reproduces the recorded token timing.
+        replay_server.replay_cassette(cassette_path, 1.0);
+        replayed_chunks.clear();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        replay_server.generate("llama3:8b", "Why is the sky blue?", options);
+        replay_server.chat("llama3:8b", ollama::message("user", "Why is the sky blue?"), replay_token, options);
+        CHECK( std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(20) );
+        CHECK( replayed_chunks == recorded_chunks );
+
+        std::remove(cassette_path.c_str());
+    }
+}
+
+TEST_SUITE("Conversation Tests") {
+
+    TEST_CASE("Token-Budgeted Conversation") {
+
+        // A context of 100 tokens with 20 reserved for the reply leaves a budget of 80 tokens.
+        ollama::conversation conversation(100, 20);
+        conversation.add("system", "You are a helpful assistant.");
+
+        for (int i=0; i<20; i++) conversation.add(i % 2 ? "assistant" : "user", "Turn number "+std::to_string(i)+" of a long conversation.");
+
+        ollama::messages messages = conversation.to_messages();
+
+        CHECK( conversation.estimated_tokens() <= conversation.budget() );
+        CHECK( conversation.dropped_turns() > 0 );
+        CHECK( messages.front()["role"] == "system" );
+        CHECK( messages.back()["content"] == "Turn number 19 of a long conversation." );
+        CHECK( messages.size() == conversation.size() );
+    }
+
+    TEST_CASE("Summarized Conversation") {
+
+        ollama::conversation conversation(100, 20);
+        conversation.add("system", "You are a helpful assistant.");
+
+        size_t summarized_turns = 0;
+        conversation.set_summarizer([&](const ollama::messages& removed) { summarized_turns += removed.size(); return std::string("Summary of earlier turns."); });
+
+        for (int i=0; i<20; i++) conversation.add(i % 2 ? "assistant" : "user", "Turn number "+std::to_string(i)+" of a long conversation.");
+
+        ollama::messages messages = conversation.to_messages();
+
+        CHECK( summarized_turns >= conversation.dropped_turns() );
+        CHECK( messages[0]["content"] == "You are a helpful assistant." );
+        CHECK( messages[1]["content"] == "Summary of earlier turns." );
+        CHECK( conversation.estimated_tokens() <= conversation.budget() );
+
+        conversation.clear();
+        CHECK( conversation.dropped_turns() == 0 );
+
+        // When the pinned messages alone exceed the budget, turns are dropped without asking for a summary on every add.
+        conversation.add("system", std::string(400, 'x'));
+        summarized_turns = 0;
+        for (int i=0; i<10; i++) conversation.add("user", "Turn number "+std::to_string(i)+".");
+
+        CHECK( summarized_turns == 0 );
+        CHECK( conversation.size() == 2 );
+    }
+
+    TEST_CASE("Conversation with Mock Chat") {
+
+        ollama::mock_server server;
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+
+        ollama::conversation conversation(4096);
+        conversation.add("user", "Why is the sky blue?");
+        conversation.add( ollama_server.chat("llama3:8b", conversation) );
+
+        CHECK( conversation.size() == 2 );
+        CHECK( conversation.to_messages()[1]["role"] == "assistant" );
+    }
+
+    TEST_CASE("Incremental Chat Request Serialization") {
+
+        ollama::options options;
+        options["seed"] = 1;
+
+        ollama::chat_request_builder builder("llama3:8b", options);
+        ollama::messages messages;
+
+        for (int i=0; i<6; i++)
+        {
+            ollama::message message(i % 2 ? "assistant" : "user", "Turn \"" + std::to_string(i) + "\"\n");
+            builder.add(message);
+            messages.push_back(message);
+        }
+
+        // The builder should produce exactly what the equivalent request would.
+        ollama::request request("llama3:8b", messages, options, true);
+        CHECK( builder.dump(true) == request.dump() );
+
+        builder.pop_front(2);
+        ollama::messages remaining;
+        remaining.insert(remaining.end(), messages.begin()+2, messages.end());
+        CHECK( builder.dump(false) == ollama::request("llama3:8b", remaining, options, false).dump() );
+
+        ollama::serialized_messages history;
+        for (const ollama::message& message: messages) history.push_back(message);
+        history.erase(1, 3);
+        std::string array;
+        history.write(array);
+        CHECK( ollama::json::parse(array).size() == 4 );
+        CHECK( ollama::json::parse(array)[1] == static_cast<const ollama::json&>(messages[3]) );
+
+        // Dropped turns are erased from the conversation's cached serialization.
+        ollama::conversation conversation(100, 20);
+        conversation.add("system", "You are a helpful assistant.");
+        for (int i=0; i<20; i++) conversation.add(i % 2 ? "assistant" : "user", "Turn number "+std::to_string(i)+" of a long conversation.");
+
+        std::string serialized;
+        conversation.serialized().write(serialized);
+        CHECK( conversation.dropped_turns() > 0 );
+        CHECK( serialized == ollama::json(conversation.to_messages().to_json()).dump() );
+
+        ollama::mock_server server;
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+
+        ollama::chat_request_builder session("llama3:8b");
+        session.add("user", "Why is the sky blue?");
+        session.add( ollama_server.chat(session) );
+
+        std::string streamed;
+        session.add("user", "And why are sunsets red?");
+        CHECK( ollama_server.chat(session, [&streamed](const ollama::response& response) { streamed += response.as_simple_string(); return true; }) );
+        CHECK( session.size() == 3 );
+        CHECK( streamed.size() > 0 );
+    }
+}
+
+TEST_SUITE("Model Options Tests") {
+
+    TEST_CASE("Typed Model Options") {
+
+        ollama::model_options typed;
+        typed.seed = 42;
+        typed.temperature = 0.7;
+        typed.num_ctx = 4096;
+        typed.penalize_newline = false;
+        typed.stop = std::vector<std::string>{"\n\n", "User:"};
+
+        ollama::options options;
+        options["seed"] = 42;
+        options["temperature"] = 0.7;
+        options["num_ctx"] = 4096;
+        options["penalize_newline"] = false;
+        options["stop"] = {"\n\n", "User:"};
+
+        // The direct writer emits exactly what the json-backed options would.
+        CHECK( typed.dump() == static_cast<const ollama::json&>(options)["options"].dump() );
+        CHECK( typed.to_options() == options );
+        CHECK( ollama::model_options().dump() == "{}" );
+
+        ollama::model_options parsed = ollama::model_options::from_options(options);
+        CHECK( parsed.dump() == typed.dump() );
+        CHECK( !parsed.top_k.has_value() );
+
+        ollama::chat_request_builder typed_builder("llama3:8b", typed), builder("llama3:8b", options);
+        typed_builder.add("user", "Why is the sky blue?");
+        builder.add("user", "Why is the sky blue?");
+        CHECK( typed_builder.dump() == builder.dump() );
+
+        // Typed options are written into a generation request without going through ollama::options.
+        std::string request_string;
+        ollama::request::write_generation(request_string, "llama3:8b", "Why is the sky blue?", typed, true, std::vector<std::string>{"aW1hZ2U="});
+        CHECK( request_string == ollama::request("llama3:8b", "Why is the sky blue?", options, true, std::vector<std::string>{"aW1hZ2U="}).dump() );
+    }
+
+    TEST_CASE("Typed Model Options with Mock Server") {
+
+        ollama::mock_server server;
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+
+        ollama::model_options options;
+        options.num_predict = 5;
+
+        ollama::response response = ollama_server.generate("llama3:8b", "Why is the sky blue?", options);
+        CHECK( response.as_json()["eval_count"] == 5 );
+
+        size_t tokens = 0;
+        CHECK( ollama_server.generate("llama3:8b", "Why is the sky blue?", [&tokens](const ollama::response&) { ++tokens; return true; }, options) );
+        CHECK( tokens >= 5 );
+
+        ollama::response reply = ollama_server.chat("llama3:8b", ollama::messages({ollama::message("user", "Why is the sky blue?")}), options);
+        CHECK( reply.as_json()["eval_count"] == 5 );
+
+        ollama::conversation conversation;
+        conversation.add("user", "Why is the sky blue?");
+        CHECK( ollama_server.chat("llama3:8b", conversation, options).as_json()["eval_count"] == 5 );
+    }
+}
+
+TEST_SUITE("Request Construction Tests") {
+
+    TEST_CASE("Move-Aware Construction") {
+
+        std::string prompt(100 * 1024, 'x');
+        const char* prompt_data = prompt.data();
+
+        ollama::request request("llama3:8b", std::move(prompt));
+        CHECK( request["prompt"].get_ref<const std::string&>().data() == prompt_data );
+
+        std::string encoded = ollama::base64::Encode(std::string(64 * 1024, 'y'));
+        ollama::image image = ollama::image::from_base64_string(encoded);
+        CHECK( image.as_base64_string() == encoded );
+
+        ollama::message message("user", "What do you see in this image?", std::vector<ollama::image>{image});
+        CHECK( message["images"][0] == encoded );
+
+        ollama::messages history = {ollama::message("system", "You are a helpful assistant."), message};
+        ollama::request chat_request("llama3:8b", history);
+        CHECK( chat_request["messages"] == ollama::json(history.to_json()) );
+
+        const ollama::json* image_data = &history[1]["images"];
+        ollama::json moved = std::move(history).to_json_array();
+        CHECK( moved.size() == 2 );
+        CHECK( moved[1]["images"][0] == encoded );
+
+        // Moving a message hands over its object storage, so the images are still at the same address.
+        CHECK( image_data == &moved[1]["images"] );
+
+        // generate and chat take the prompt and history by value, so a temporary is moved all the way into the request.
+        ollama::mock_server server;
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+        CHECK( !ollama_server.generate("llama3:8b", std::string(100 * 1024, 'x')).as_simple_string().empty() );
+
+        ollama::messages long_history;
+        for (int i=0; i<50; i++) long_history.push_back(ollama::message(i % 2 ? "assistant" : "user", std::string(1024, 'z')));
+        CHECK( ollama_server.chat("llama3:8b", std::move(long_history)).as_json()["message"]["role"] == "assistant" );
+    }
+}
+
+TEST_SUITE("Allocation Tests") {
+
+    TEST_CASE("Memory Arena") {
+
+        ollama::memory_arena arena(256);
+
+        void* first = arena.allocate(100, 8);
+        void* second = arena.allocate(1000, 64);
+
+        CHECK( arena.owns(first) );
+        CHECK( arena.owns(second) );
+        CHECK( reinterpret_cast<uintptr_t>(second) % 64 == 0 );
+        CHECK( arena.bytes_used() == 1100 );
+
+        // A reset keeps the largest block, which is then reused without allocating.
+        arena.reset();
+        size_t retained = arena.capacity();
+        for (int i=0; i<10; i++) CHECK( arena.allocate(50, 8) != nullptr );
+
+        CHECK( arena.bytes_used() == 500 );
+        CHECK( arena.capacity() == retained );
+
+        #ifdef OLLAMA_HAS_PMR
+        std::pmr::vector<int> values(&arena);
+        values.assign(100, 1);
+        CHECK( arena.owns(values.data()) );
+        #endif
+    }
+
+    TEST_CASE("Reusing a Response with an Arena") {
+
+        ollama::memory_arena arena;
+        ollama::response response;
+
+        std::string content = "Rayleigh scattering causes shorter wavelengths to scatter more.";
+        std::string line = "{\"model\":\"llama3:8b\",\"created_at\":\"2025-01-01T00:00:00.000000Z\",\"message\":{\"role\":\"assistant\",\"content\":\""+content+"\"},\"done\":false}";
+
+        for (int i=0; i<3; i++)
+        {
+            CHECK( response.assign(line.data(), line.size(), ollama::message_type::chat, &arena) );
+            CHECK( response.as_simple_string() == content );
+            CHECK( arena.bytes_used() == 0 );
+        }
+
+        // The json is only built when requested.
+        CHECK( response.as_json()["done"] == false );
+        CHECK( !response.has_error() );
+
+        std::string error = "{\"error\":\"model 'llama9' not found\"}";
+        CHECK( response.assign(error.data(), error.size(), ollama::message_type::chat, &arena) );
+        CHECK( response.has_error() );
+        CHECK( response.get_error() == "model 'llama9' not found" );
+        CHECK( response.as_simple_string().empty() );
+
+        ollama::allow_exceptions(false);
+        std::string malformed = "{\"message\":";
+        CHECK( !response.assign(malformed.data(), malformed.size(), ollama::message_type::chat, &arena) );
+        CHECK( !response.is_valid() );
+        ollama::allow_exceptions(true);
+    }
+
+    TEST_CASE("Lazily Parsed Response Fields") {
+
+        ollama::memory_arena arena;
+        ollama::response response;
+
+        std::string line = "{\"model\":\"llama3:8b\",\"message\":{\"role\":\"assistant\",\"content\":\"\",\"tool_calls\":[{\"function\":{\"name\":\"get_weather\",\"arguments\":{}}}]},\"done\":true}";
+        CHECK( response.assign(line.data(), line.size(), ollama::message_type::chat, &arena) );
+        CHECK( response.is_done() );
+        CHECK( response.has_tool_calls() );
+
+        // Copies and concurrent readers of a response whose json has not been built yet all see the same json.
+        ollama::response copy = response;
+        std::vector<std::thread> readers;
+        std::atomic<int> matches{0};
+        for (int i=0; i<4; i++) readers.push_back(std::thread([&]{ if (response.as_json()["message"]["tool_calls"].size() == 1) ++matches; }));
+        for (std::thread& reader: readers) reader.join();
+
+        CHECK( matches == 4 );
+        CHECK( copy.as_json() == response.as_json() );
+
+        std::string token = "{\"model\":\"llama3:8b\",\"message\":{\"role\":\"assistant\",\"content\":\"Hi\"},\"done\":false}";
+        CHECK( response.assign(token.data(), token.size(), ollama::message_type::chat, &arena) );
+        CHECK( !response.is_done() );
+        CHECK( !response.has_tool_calls() );
+    }
+}
+
+TEST_SUITE("Stream Sink Tests") {
+
+    TEST_CASE("Extract Streamed Content") {
+
+        ollama::content_extractor extractor;
+
+        std::string chat_line = "{\"model\":\"llama3:8b\",\"message\":{\"role\":\"assistant\",\"content\":\"Hello \\\"world\\\"\",\"images\":null},\"done\":false}";
+        REQUIRE( extractor.parse(chat_line.data(), chat_line.size(), ollama::message_type::chat) );
+        CHECK( extractor.content() == "Hello \"world\"" );
+        CHECK( !extractor.done() );
+
+        std::string final_line = "{\"model\":\"llama3:8b\",\"response\":\"\",\"done\":true,\"context\":[1,2,3]}";
+        REQUIRE( extractor.parse(final_line.data(), final_line.size()) );
+        CHECK( extractor.content().empty() );
+        CHECK( extractor.done() );
+
+        std::string error_line = "{\"error\":\"model not found\"}";
+        REQUIRE( extractor.parse(error_line.data(), error_line.size()) );
+        CHECK( extractor.has_error() );
+        CHECK( extractor.error() == "model not found" );
+
+        CHECK( !extractor.parse(chat_line.data(), chat_line.size() / 2, ollama::message_type::chat) );
+
+        // Content which follows objects nested in the message is still found.
+        std::string tool_line = "{\"message\":{\"role\":\"assistant\",\"tool_calls\":[{\"function\":{\"name\":\"get_weather\",\"arguments\":{}}}],\"content\":\"Checking.\"},\"done\":false}";
+        REQUIRE( extractor.parse(tool_line.data(), tool_line.size(), ollama::message_type::chat) );
+        CHECK( extractor.content() == "Checking." );
+    }
+
+    TEST_CASE("Stream into an ostream Sink") {
+
+        ollama::mock_server::config config;
+        config.fragment_size = 5;
+
+        ollama::mock_server server(config);
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+
+        ollama::options options;
+        options["num_predict"] = 50;
+
+        std::string expected;
+        for (size_t i=0; i<50; i++) expected += ollama::mock_server::token(i);
+
+        // Coalesce everything into as few writes as possible.
+        std::ostringstream output;
+        ollama::ostream_sink sink(output, 1 << 20, std::chrono::seconds(60));
+
+        CHECK( ollama_server.chat("llama3:8b", ollama::message("user", "Why is the sky blue?"), sink, options) );
+        CHECK( output.str() == expected );
+        CHECK( sink.flushes() == 1 );
+
+        std::ostringstream generated;
+        ollama::ostream_sink unbuffered(generated, 1);
+        CHECK( ollama_server.generate("llama3:8b", "Why is the sky blue?", unbuffered, options) );
+        CHECK( generated.str() == expected );
+        CHECK( unbuffered.flushes() == 50 );
+    }
+
+    TEST_CASE("Flush a Stalled Stream on Time") {
+
+        // Tokens 200 ms apart are each flushed once they have waited 10 ms, rather than when the next token arrives.
+        ollama::mock_server::config config;
+        config.tokens_per_second = 5;
+
+        ollama::mock_server server(config);
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+
+        ollama::options options;
+        options["num_predict"] = 3;
+
+        std::ostringstream output;
+        ollama::ostream_sink sink(output, 1 << 20, std::chrono::milliseconds(10));
+
+        CHECK( ollama_server.generate("llama3:8b", "Why is the sky blue?", sink, options) );
+        CHECK( output.str() == ollama::mock_server::token(0) + ollama::mock_server::token(1) + ollama::mock_server::token(2) );
+        CHECK( sink.flushes() == 3 );
+    }
+
+    #ifndef _WIN32
+    TEST_CASE("Stream into a File Descriptor Sink") {
+
+        int fds[2];
+        REQUIRE( pipe(fds) == 0 );
+
+        {
+            ollama::fd_sink sink(fds[1], 16);
+            sink.set_framing("data: ", "\n\n");
+            CHECK( sink.write("Rayleigh ", 9) );
+            CHECK( sink.write("scattering", 10) );
+            CHECK( sink.write(".", 1) );
+        }
+        close(fds[1]);
+
+        std::string received;
+        char buffer[256];
+        ssize_t count;
+        while ((count = read(fds[0], buffer, sizeof(buffer))) > 0) received.append(buffer, count);
+        close(fds[0]);
+
+        CHECK( received == "data: Rayleigh scattering\n\ndata: .\n\n" );
+    }
+    #endif
+}
+
+TEST_SUITE("Broadcast Stream Tests") {
+
+    TEST_CASE("Broadcast a Stream to Late Subscribers") {
+
+        ollama::mock_server::config config;
+        config.tokens_per_second = 500;
+
+        ollama::mock_server server(config);
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+
+        ollama::options options;
+        options["num_predict"] = 40;
+
+        std::string expected;
+        for (size_t i=0; i<40; i++) expected += ollama::mock_server::token(i);
+
+        ollama::broadcast_stream stream;
+        std::shared_ptr<ollama::broadcast_stream::subscriber> early = stream.subscribe();
+
+        stream.start([&](std::function<bool(const ollama::response&)> on_token) { ollama_server.chat("llama3:8b", ollama::message("user", "Why is the sky blue?"), on_token, options); });
+
+        // Join once part of the answer has been produced. The tokens so far are replayed first.
+        while (stream.tokens_published() < 10) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        std::shared_ptr<ollama::broadcast_stream::subscriber> late = stream.subscribe();
+
+        std::string late_text;
+        std::thread late_reader([&]{ ollama::response token; while (late->next(token)) late_text += token.as_simple_string(); });
+
+        std::string early_text;
+        ollama::response token;
+        while (early->next(token)) early_text += token.as_simple_string();
+
+        late_reader.join();
+        stream.wait();
+
+        CHECK( early_text == expected );
+        CHECK( late_text == expected );
+        CHECK( late->skipped() == 0 );
+        CHECK( stream.error().empty() );
+    }
+
+    TEST_CASE("Broadcast Backpressure") {
+
+        auto token = [](int i) { return ollama::response("{\"response\":\"" + std::to_string(i) + " \",\"done\":false}"); };
+
+        // A blocking stream never gets more than its capacity ahead of the slowest subscriber.
+        ollama::broadcast_stream stream(4);
+        std::shared_ptr<ollama::broadcast_stream::subscriber> slow = stream.subscribe();
+
+        std::thread producer([&]{ for (int i=0; i<20; i++) stream.publish(token(i)); stream.finish(); });
+
+        size_t received = 0;
+        ollama::response next;
+        while (slow->next(next))
+        {
+            CHECK( stream.tokens_published() <= received + 4 + 1 );
+            CHECK( next.as_simple_string() == std::to_string(received) + " " );
+            received++;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        producer.join();
+        CHECK( received == 20 );
+
+        // With the disconnect policy a subscriber that falls too far behind is dropped instead.
+        ollama::broadcast_stream lossy(4, ollama::broadcast_stream::overflow_policy::disconnect);
+        std::shared_ptr<ollama::broadcast_stream::subscriber> stalled = lossy.subscribe();
+        for (int i=0; i<10; i++) CHECK( lossy.publish(token(i)) );
+        lossy.finish();
+
+        CHECK( stalled->disconnected() );
+        CHECK( !stalled->next(next) );
+
+        // A late subscriber starts at the oldest token still in the ring.
+        std::shared_ptr<ollama::broadcast_stream::subscriber> late = lossy.subscribe();
+        CHECK( late->skipped() == 6 );
+        CHECK( late->next(next) );
+        CHECK( next.as_simple_string() == "6 " );
+
+        lossy.cancel();
+        CHECK( !lossy.publish(token(10)) );
+    }
+}
+
+TEST_SUITE("Stop Condition Tests") {
+
+    TEST_CASE("Match Stop Strings Across Tokens") {
+
+        ollama::stop_matcher matcher({"</answer>", "\n\n", "swer"});
+
+        // The match starts in one piece and ends in a later one.
+        CHECK( matcher.feed("The an", 6) == std::string::npos );
+        CHECK( matcher.feed("s", 1) == std::string::npos );
+        CHECK( matcher.feed("wer is", 6) == 3 );
+        CHECK( matcher.matched() == "swer" );
+
+        matcher.reset();
+        CHECK( matcher.feed("blue.\n", 6) == std::string::npos );
+        CHECK( matcher.feed("\nNext", 5) == 1 );
+        CHECK( matcher.matched() == "\n\n" );
+
+        ollama::stop_conditions conditions;
+        conditions.add_stop("\n");
+        std::function<bool(const ollama::response&)> on_token = conditions.wrap();
+
+        CHECK( on_token(ollama::response("{\"response\":\"First\"}")) );
+        CHECK( !on_token(ollama::response("{\"response\":\" line\\nSecond\"}")) );
+        CHECK( conditions.text() == "First line" );
+        CHECK( conditions.get_reason() == ollama::stop_reason::stop_string );
+
+        ollama::stop_conditions limited;
+        limited.set_max_characters(3);
+        CHECK( !limited.check("h\xC3\xA9llo") );
+        CHECK( limited.text() == "h\xC3\xA9l" );
+
+        ollama::stop_conditions first_object;
+        first_object.set_regex("\\{[^{}]*\\}");
+        CHECK( first_object.check("Here: {\"a\": ") );
+        CHECK( !first_object.check("1} and more") );
+        CHECK( first_object.text() == "Here: {\"a\": 1}" );
+
+        // Only the new text and a window before it are searched, so the regex does not rescan the whole reply.
+        ollama::stop_conditions windowed;
+        windowed.set_regex("\\bend\\b").set_regex_window(8);
+        CHECK( windowed.check(std::string(100, 'x') + " the e") );
+        CHECK( !windowed.check("nd.") );
+        CHECK( windowed.text() == std::string(100, 'x') + " the end" );
+    }
+
+    TEST_CASE("Stop a Mock Stream Early") {
+
+        ollama::mock_server::config config;
+        config.tokens_per_second = 1000;
+
+        ollama::mock_server server(config);
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+
+        ollama::options options;
+        options["num_predict"] = 1000;
+
+        std::string expected;
+        for (size_t i=0; i<5; i++) expected += ollama::mock_server::token(i);
+
+        ollama::stop_conditions conditions;
+        conditions.set_max_characters(expected.size());
+
+        size_t tokens = 0;
+        CHECK( ollama_server.generate("llama3:8b", "Why is the sky blue?", conditions.wrap([&tokens](const ollama::response&) { tokens++; return true; }), options) );
+        CHECK( conditions.text() == expected );
+        CHECK( conditions.get_reason() == ollama::stop_reason::max_characters );
+        CHECK( tokens <= 7 );
+
+        ollama::stop_conditions timed;
+        timed.set_max_time(std::chrono::milliseconds(20));
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        ollama_server.generate("llama3:8b", "Why is the sky blue?", timed.wrap(), options);
+        CHECK( timed.get_reason() == ollama::stop_reason::max_time );
+        CHECK( std::chrono::steady_clock::now() - start < std::chrono::milliseconds(500) );
+    }
+
+    TEST_CASE("Stop a Stalled Stream") {
+
+        // The server stalls before the first token, so the callback is never called and the watchdog cancels the request.
+        ollama::mock_server::config config;
+        config.latency_ms = 1000;
+
+        ollama::mock_server server(config);
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+
+        ollama::stop_conditions timed;
+        timed.set_max_time(std::chrono::milliseconds(50)).set_cancel([&ollama_server]{ ollama_server.cancel(); });
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        CHECK( ollama_server.generate("llama3:8b", "Why is the sky blue?", timed.wrap()) );
+        CHECK( timed.get_reason() == ollama::stop_reason::max_time );
+        CHECK( std::chrono::steady_clock::now() - start < std::chrono::milliseconds(900) );
+
+        // The client can be used again afterwards.
+        CHECK( !ollama_server.generate("llama3:8b", "Why is the sky blue?").as_simple_string().empty() );
+    }
+}
+
+TEST_SUITE("Structured Output Tests") {
+
+    const ollama::json schema = ollama::json::parse(R"({
+        "type": "object",
+        "properties": {
+            "name": {"type": "string", "maxLength": 16},
+            "kind": {"type": "string", "enum": ["cumulus", "cumulonimbus", "stratus"]},
+            "altitude": {"type": "integer", "minimum": 0},
+            "tags": {"type": "array", "items": {"type": "string"}, "maxItems": 3},
+            "rain": {"type": "boolean"}
+        },
+        "required": ["name", "kind"],
+        "additionalProperties": false
+    })");
+
+    TEST_CASE("Send Format with Chat Requests") {
+
+        ollama::messages messages = {ollama::message("user", "Describe a cloud.")};
+
+        ollama::request unset("llama3:8b", messages);
+        CHECK( !unset.contains("format") );
+
+        ollama::request json_mode("llama3:8b", messages, nullptr, false, "json");
+        CHECK( json_mode["format"] == "json" );
+
+        ollama::request structured("llama3:8b", messages, nullptr, true, schema);
+        CHECK( structured["format"] == schema );
+
+        ollama::chat_request_builder builder("llama3:8b");
+        for (const ollama::message& message: messages) builder.add(message);
+        builder.set_format(schema);
+        CHECK( builder.dump(true) == structured.dump() );
+    }
+
+    TEST_CASE("Parse Values as They Complete") {
+
+        std::string text = R"({"name": "Nimbus 🌧", "tags": ["rain", "thunder"], "nested": {"depth": [1, 2.5, null]}, "rain": true})";
+
+        ollama::json_stream_parser parser;
+        std::vector<std::string> paths;
+        parser.on_value([&paths](const std::string& path, const ollama::json&) { paths.push_back(path); });
+
+        // Feed one byte at a time so that every string, escape and literal is split.
+        for (char c: text) REQUIRE( parser.feed(&c, 1) );
+
+        CHECK( parser.is_complete() );
+        CHECK( parser.value() == ollama::json::parse(text) );
+        CHECK( paths == std::vector<std::string>({"name", "tags[0]", "tags[1]", "tags", "nested.depth[0]", "nested.depth[1]", "nested.depth[2]", "nested.depth", "nested", "rain", ""}) );
+
+        ollama::json_stream_parser number;
+        CHECK( number.feed("42") );
+        CHECK( !number.is_complete() );
+        CHECK( number.finish() );
+        CHECK( number.value() == 42 );
+
+        ollama::json_stream_parser invalid;
+        CHECK( !invalid.feed("{\"a\": tru}") );
+        CHECK( invalid.error() == "Invalid literal at a" );
+
+        ollama::json_stream_parser trailing;
+        CHECK( trailing.feed("[1]\n\n ") );
+        CHECK( !trailing.feed("x") );
+    }
+
+    TEST_CASE("Reject Off-Schema Output Early") {
+
+        // Each case fails on the last character fed.
+        const std::pair<std::string, std::string> cases[] = {
+            {R"({"name": 1)", "Expected string but found number at name"},
+            {R"({"nm)", "Unexpected property \"nm\""},
+            {R"({"name": "N", "kind": "ci)", "Value is not one of the allowed values at kind"},
+            {R"({"name": "N", "kind": "cumulus", "altitude": 1.5,)", "Expected integer but found number at altitude"},
+            {R"({"name": "Nimbus the raincl)", "String is too long at name"},
+            {R"({"name": "N", "tags": ["a", "b", "c", ")", "Too many items at tags[3]"},
+            {R"({"name": "N"})", "Missing required property \"kind\""},
+            {R"([)", "Expected object but found array"}
+        };
+
+        for (const std::pair<std::string, std::string>& test: cases)
+        {
+            ollama::json_stream_parser parser(schema);
+            CHECK( parser.feed(test.first.substr(0, test.first.size()-1)) );
+            CHECK( !parser.feed(test.first.substr(test.first.size()-1)) );
+            CHECK( parser.error() == test.second );
+        }
+
+        ollama::json_stream_parser valid(schema);
+        CHECK( valid.feed(R"({"name": "Nimbus", "kind": "cumulonimbus", "altitude": 2000, "tags": ["rain"], "rain": false})") );
+        CHECK( valid.is_complete() );
+    }
+
+    TEST_CASE("Validate a Mock Structured Stream") {
+
+        ollama::mock_server server;
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+
+        ollama::json_stream_parser parser(schema);
+        std::string name;
+        parser.on_value([&name](const std::string& path, const ollama::json& value) { if (path == "name") name = value; });
+
+        size_t tokens = 0, tokens_at_name = 0;
+        CHECK( ollama_server.chat("llama3:8b", ollama::message("user", "Describe a cloud."), parser.wrap([&](const ollama::response&) { tokens++; if (!name.empty() && tokens_at_name == 0) tokens_at_name = tokens; return true; }), nullptr, schema) );
+        CHECK( parser.is_complete() );
+        CHECK( parser.value()["altitude"] == 2000 );
+        CHECK( name == "Nimbus" );
+        CHECK( tokens_at_name < tokens / 2 );
+
+        // An off-schema reply is abandoned as soon as it diverges.
+        ollama::mock_server::config config;
+        config.structured_reply = R"({"name": "Nimbus", "colour": "grey", "kind": "cumulonimbus", "altitude": 2000, "tags": ["rain", "thunder"], "rain": true})";
+        config.tokens_per_second = 1000;
+
+        ollama::mock_server off_schema(config);
+        REQUIRE( off_schema.start() );
+
+        Ollama off_schema_server(off_schema.url());
+        tokens = 0;
+        off_schema_server.chat("llama3:8b", ollama::message("user", "Describe a cloud."), parser.wrap([&tokens](const ollama::response&) { tokens++; return true; }), nullptr, schema);
+        CHECK( parser.has_error() );
+        CHECK( parser.error() == "Unexpected property \"c\"" );
+        CHECK( tokens <= 6 );
+    }
+}
+
+TEST_SUITE("Field Event Tests") {
+
+    TEST_CASE("Match Field Patterns") {
+
+        CHECK( ollama::json_stream_parser::path_matches("items[3].name", "items[3].name") );
+        CHECK( ollama::json_stream_parser::path_matches("items[*].name", "items[12].name") );
+        CHECK( ollama::json_stream_parser::path_matches("*.name", "cloud.name") );
+        CHECK( ollama::json_stream_parser::path_matches("items[*][*]", "items[0][1]") );
+        CHECK( !ollama::json_stream_parser::path_matches("items[*].name", "items[1].names") );
+        CHECK( !ollama::json_stream_parser::path_matches("items[*]", "items") );
+        CHECK( !ollama::json_stream_parser::path_matches("*", "") );
+        CHECK( !ollama::json_stream_parser::path_matches("items", "items[0]") );
+    }
+
+    TEST_CASE("Emit Fields as They Close") {
+
+        ollama::json_stream_parser parser;
+        std::vector<std::string> names;
+        std::vector<std::string> paths;
+        parser.on_field("items[*].name", [&names](const std::string&, const ollama::json& value) { names.push_back(value); });
+        parser.on_field("items[1]", [&paths](const std::string& path, const ollama::json&) { paths.push_back(path); });
+
+        CHECK( parser.feed(R"({"items": [{"name": "cumulus", "rain": false}, {"name": "stra)") );
+        CHECK( names == std::vector<std::string>({"cumulus"}) );
+        CHECK( parser.partial() == ollama::json::parse(R"({"items": [{"name": "cumulus", "rain": false}, {}]})") );
+
+        CHECK( parser.feed(R"(tus"}], "count": 2})") );
+        CHECK( names == std::vector<std::string>({"cumulus", "stratus"}) );
+        CHECK( paths == std::vector<std::string>({"items[1]"}) );
+        CHECK( parser.partial() == parser.value() );
+    }
+
+    TEST_CASE("Start Work on Items while Generating") {
+
+        ollama::json items;
+        for (int i = 0; i < 50; ++i) items["items"].push_back({{"id", i}, {"name", ollama::mock_server::token(i)}});
+
+        ollama::mock_server::config config;
+        config.structured_reply = items.dump();
+        config.structured_piece_size = 8;
+
+        ollama::mock_server server(config);
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+
+        ollama::json_stream_parser parser;
+        size_t tokens = 0;
+        std::vector<size_t> tokens_at_item;
+        parser.on_field("items[*]", [&](const std::string&, const ollama::json&) { tokens_at_item.push_back(tokens); });
+
+        CHECK( ollama_server.chat("llama3:8b", ollama::message("user", "List 50 clouds."), parser.wrap([&tokens](const ollama::response&) { tokens++; return true; }), nullptr, "json") );
+        REQUIRE( tokens_at_item.size() == 50 );
+        CHECK( parser.value() == items );
+
+        // The first item is available long before the reply ends.
+        CHECK( tokens_at_item.front() < tokens / 20 );
+        CHECK( std::is_sorted(tokens_at_item.begin(), tokens_at_item.end()) );
+    }
+}
+
+TEST_SUITE("Tool Calling Tests") {
+
+    TEST_CASE("Run Tasks on a Thread Pool") {
+
+        ollama::thread_pool pool(4);
+        CHECK( pool.size() == 4 );
+
+        std::mutex intervals_mutex;
+        std::vector<task_interval> intervals;
+        std::vector<std::future<int>> results;
+        for (int i = 0; i < 4; ++i) results.push_back(pool.submit([i, &intervals_mutex, &intervals]{
+            task_interval interval;
+            interval.start = std::chrono::steady_clock::now();
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            interval.end = std::chrono::steady_clock::now();
+            std::lock_guard<std::mutex> lock(intervals_mutex);
+            intervals.push_back(interval);
+            return i * i;
+        }));
+        for (int i = 0; i < 4; ++i) CHECK( results[i].get() == i * i );
+        CHECK( all_overlap(intervals) );
+
+        std::future<void> failed = pool.submit([]{ throw std::runtime_error("failed"); });
+        CHECK_THROWS_AS( failed.get(), std::runtime_error );
+    }
+
+    TEST_CASE("Assemble Streamed Tool Calls") {
+
+        ollama::tool_call_assembler assembler;
+        std::function<bool(const ollama::response&)> on_token = assembler.wrap();
+
+        // The first call arrives whole, while the arguments of the second are split across chunks.
+        on_token(ollama::response(R"({"message": {"role": "assistant", "content": "Checking.", "tool_calls": [{"function": {"index": 0, "name": "get_weather", "arguments": {"city": "Paris"}}}]}, "done": false})", ollama::message_type::chat));
+        on_token(ollama::response(R"({"message": {"role": "assistant", "content": "", "tool_calls": [{"function": {"index": 1, "name": "get_time", "arguments": "{\"zone\": "}}]}, "done": false})", ollama::message_type::chat));
+        on_token(ollama::response(R"({"message": {"role": "assistant", "content": "", "tool_calls": [{"function": {"index": 1, "arguments": "\"CET\"}"}}]}, "done": true})", ollama::message_type::chat));
+
+        std::vector<ollama::tool_call> calls = assembler.calls();
+        REQUIRE( calls.size() == 2 );
+        CHECK( calls[0].name == "get_weather" );
+        CHECK( calls[0].arguments["city"] == "Paris" );
+        CHECK( calls[1].name == "get_time" );
+        CHECK( calls[1].arguments["zone"] == "CET" );
+
+        ollama::message message = assembler.message();
+        CHECK( message["content"] == "Checking." );
+        CHECK( message["tool_calls"].size() == 2 );
+        CHECK( ollama::tool_call::from_message(message)[1].arguments == calls[1].arguments );
+    }
+
+    TEST_CASE("Call Registered Tools") {
+
+        ollama::tool_registry registry;
+        registry.add("echo", "Returns its input.", ollama::json::object(), [](const ollama::json& arguments) { return arguments["input"]; });
+        registry.add("sum", "Adds two numbers.", ollama::json::object(), [](const ollama::json& arguments) { return ollama::json({{"sum", arguments["a"].get<int>() + arguments["b"].get<int>()}}); });
+        registry.add("fail", "Always fails.", ollama::json::object(), [](const ollama::json&) -> ollama::json { throw std::runtime_error("no connection"); });
+
+        ollama::tool_call echo; echo.name = "echo"; echo.arguments["input"] = "hello";
+        ollama::tool_call sum; sum.name = "sum"; sum.arguments = {{"a", 2}, {"b", 3}};
+        ollama::tool_call fail; fail.name = "fail";
+        ollama::tool_call unknown; unknown.name = "missing";
+
+        CHECK( registry.definitions().size() == 3 );
+        CHECK( registry.call(echo) == "hello" );
+        CHECK( registry.call(sum) == "{\"sum\":5}" );
+        CHECK( registry.call(fail) == "Error: no connection" );
+        CHECK( registry.call(unknown) == "Error: unknown tool \"missing\"" );
+
+        ollama::message result = ollama::tool_registry::result_message(sum, "5");
+        CHECK( result["role"] == "tool" );
+        CHECK( result["tool_name"] == "sum" );
+
+        ollama::chat_request_builder builder("llama3:8b");
+        builder.add("user", "Add 2 and 3.");
+        builder.set_tools(registry.definitions());
+
+        ollama::request request("llama3:8b", ollama::message("user", "Add 2 and 3."), nullptr, true, nullptr);
+        request["tools"] = registry.definitions().to_json_array();
+        CHECK( builder.dump(true) == request.dump() );
+    }
+
+    TEST_CASE("Run Tool Calls in Parallel in an Agent Loop") {
+
+        ollama::mock_server server;
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+
+        // Each tool takes 100ms, and the three calls run at the same time rather than one after another.
+        std::mutex intervals_mutex;
+        std::vector<task_interval> intervals;
+
+        ollama::tool_registry registry;
+        const char* names[] = {"weather", "time", "news"};
+        for (const char* name: names)
+        {
+            std::string tool_name = name;
+            registry.add(tool_name, "Looks up the " + tool_name + ".", ollama::json::object(), [tool_name, &intervals_mutex, &intervals](const ollama::json& arguments) {
+                task_interval interval;
+                interval.start = std::chrono::steady_clock::now();
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                interval.end = std::chrono::steady_clock::now();
+                { std::lock_guard<std::mutex> lock(intervals_mutex); intervals.push_back(interval); }
+                return ollama::json(tool_name + " for " + arguments["input"].get<std::string>());
+            });
+        }
+
+        ollama::thread_pool pool(3);
+        ollama::messages messages = {ollama::message("user", "Paris")};
+
+        ollama::message reply = ollama_server.chat_with_tools("llama3:8b", messages, registry, nullptr, nullptr, 8, pool);
+        CHECK( intervals.size() == 3 );
+        CHECK( all_overlap(intervals) );
+
+        CHECK( reply["content"] == "Results: weather for Paris time for Paris news for Paris" );
+        REQUIRE( messages.size() == 6 );
+        CHECK( messages[1]["tool_calls"].size() == 3 );
+        CHECK( messages[2]["role"] == "tool" );
+        CHECK( messages[2]["tool_name"] == "weather" );
+        CHECK( messages[4]["content"] == "news for Paris" );
+        CHECK( messages[5] == reply );
+
+        // Without a tool registry, the calls are returned in the reply.
+        ollama::response response = ollama_server.chat("llama3:8b", ollama::message("user", "Paris"), registry.definitions());
+        CHECK( ollama::tool_call::from_message(response.as_json()["message"]).size() == 3 );
+    }
+}
+
+TEST_SUITE("Batch Tests") {
+
+    TEST_CASE("Run a Batch with Bounded Concurrency") {
+
+        ollama::mock_server::config config;
+        config.latency_ms = 50;
+
+        ollama::mock_server server(config);
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+
+        ollama::options options;
+        options["num_predict"] = 3;
+
+        std::vector<ollama::request> requests;
+        for (int i = 0; i < 20; ++i) requests.push_back(ollama::request("llama3:8b", "Prompt " + std::to_string(i), options));
+        requests[7]["model"] = "missing";
+
+        std::vector<size_t> completion_order;
+        size_t last_completed = 0;
+        auto on_complete = [&](const ollama::batch_result& result, size_t completed) {
+            completion_order.push_back(result.index);
+            CHECK( completed == ++last_completed );
+        };
+
+        // Requests of 50ms each overlap on the server, but never more than five at a time.
+        std::vector<ollama::batch_result> results = ollama_server.generate_batch(requests, 5, on_complete);
+        CHECK( server.peak_concurrency() > 1 );
+        CHECK( server.peak_concurrency() <= 5 );
+
+        REQUIRE( results.size() == 20 );
+        CHECK( completion_order.size() == 20 );
+
+        std::string expected;
+        for (size_t i = 0; i < 3; ++i) expected += ollama::mock_server::token(i);
+
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            CHECK( results[i].index == i );
+            if (i == 7) continue;
+            CHECK( results[i].success );
+            CHECK( results[i].response.as_simple_string() == expected );
+        }
+
+        // A failed request is recorded in its result rather than thrown.
+        CHECK( !results[7].success );
+        CHECK( results[7].error.find("missing") != std::string::npos );
+    }
+
+    TEST_CASE("Spread a Chat Batch across Endpoints") {
+
+        ollama::mock_server first, second;
+        REQUIRE( first.start() );
+        REQUIRE( second.start() );
+
+        Ollama ollama_server(first.url());
+        ollama_server.set_batch_endpoints({first.url(), second.url()});
+
+        std::vector<ollama::request> requests;
+        for (int i = 0; i < 8; ++i) requests.push_back(ollama::request("llama3:8b", ollama::message("user", "Hello")));
+
+        std::vector<ollama::batch_result> results = ollama_server.chat_batch(requests, 4);
+        for (const ollama::batch_result& result: results) CHECK( result.success );
+        CHECK( first.requests_served() + second.requests_served() == 8 );
+        CHECK( first.requests_served() > 0 );
+        CHECK( second.requests_served() > 0 );
+
+        // Items sent to an unreachable endpoint fail with an error, while the batch still completes.
+        ollama_server.set_batch_endpoints({"http://127.0.0.1:1"});
+        results = ollama_server.chat_batch(requests, 2);
+        REQUIRE( results.size() == 8 );
+        for (const ollama::batch_result& result: results) { CHECK( !result.success ); CHECK( !result.error.empty() ); }
+    }
+}
+
+TEST_SUITE("Summarization Tests") {
+
+    TEST_CASE("Chunk Text with Overlap") {
+
+        std::string text;
+        for (int i = 0; i < 200; ++i) text += "Sentence number " + std::to_string(i) + " talks about the sky. ";
+
+        ollama::chunk_options options;
+        options.size = 300;
+        options.overlap = 50;
+
+        std::vector<ollama::text_chunk> chunks = ollama::chunk_text(text, options);
+        REQUIRE( chunks.size() > 1 );
+
+        for (size_t i = 0; i < chunks.size(); ++i)
+        {
+            const ollama::text_chunk& chunk = chunks[i];
+            CHECK( chunk.text.size() <= 300 );
+            CHECK( text.compare(chunk.offset, chunk.text.size(), chunk.text) == 0 );
+
+            // Chunks break after a sentence, and each starts inside the previous chunk.
+            if (i + 1 < chunks.size())
+            {
+                CHECK( chunk.text.substr(chunk.text.size() - 2) == ". " );
+                CHECK( chunks[i+1].offset > chunk.offset );
+                CHECK( chunks[i+1].offset < chunk.offset + chunk.text.size() );
+                CHECK( chunk.offset + chunk.text.size() - chunks[i+1].offset <= 50 );
+            }
+        }
+        CHECK( chunks.front().offset == 0 );
+        CHECK( chunks.back().offset + chunks.back().text.size() == text.size() );
+
+        // Without overlap the chunks join back into the original text.
+        options.overlap = 0;
+        std::string joined;
+        for (const ollama::text_chunk& chunk: ollama::chunk_text(text, options)) joined += chunk.text;
+        CHECK( joined == text );
+
+        CHECK( ollama::chunk_text("", options).empty() );
+        CHECK( ollama::chunk_text("Short.", options).size() == 1 );
+    }
+
+    TEST_CASE("Chunk Text without Splitting Characters") {
+
+        // Two-byte characters with no spaces to break at.
+        std::string text;
+        for (int i = 0; i < 101; ++i) text += "\xC3\xA9";
+
+        ollama::chunk_options options;
+        options.size = 25;
+        options.overlap = 5;
+
+        std::vector<ollama::text_chunk> chunks = ollama::chunk_text(text, options);
+        REQUIRE( chunks.size() > 1 );
+        for (const ollama::text_chunk& chunk: chunks)
+        {
+            CHECK( chunk.text.size() <= 25 );
+            CHECK( chunk.text.size() % 2 == 0 );
+            CHECK( chunk.offset % 2 == 0 );
+        }
+        CHECK( chunks.back().offset + chunks.back().text.size() == text.size() );
+    }
+
+    TEST_CASE("Chunk Text by Tokens") {
+
+        std::string text;
+        for (int i = 0; i < 500; ++i) text += "word ";
+
+        ollama::chunk_options options;
+        options.in_tokens = true;
+        options.size = 100;
+        options.overlap = 10;
+
+        std::vector<ollama::text_chunk> chunks = ollama::chunk_text(text, options);
+        REQUIRE( chunks.size() > 1 );
+        for (const ollama::text_chunk& chunk: chunks) CHECK( ollama::estimate_tokens(chunk.text) <= 100 );
+
+        // Counting words as tokens.
+        options.token_estimator = [](const std::string& part) { return static_cast<size_t>(std::count(part.begin(), part.end(), ' ')); };
+        chunks = ollama::chunk_text(text, options);
+        for (const ollama::text_chunk& chunk: chunks) CHECK( options.token_estimator(chunk.text) <= 100 );
+        CHECK( chunks.size() == 6 );
+    }
+
+    TEST_CASE("Fill Prompt Placeholders") {
+
+        CHECK( ollama::fill_prompt("Summarize: {text} Thanks.", "abc") == "Summarize: abc Thanks." );
+        CHECK( ollama::fill_prompt("Summarize this.", "abc") == "Summarize this.\n\nabc" );
+    }
+
+    TEST_CASE("Summarize a Long Document") {
+
+        ollama::mock_server server;
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+
+        std::string document(10000, 'a');
+        for (size_t i = 99; i < document.size(); i += 100) document[i] = ' ';
+
+        ollama::summarize_options settings;
+        settings.chunking.size = 1000;
+        settings.chunking.overlap = 0;
+        settings.fan_in = 4;
+
+        std::map<size_t, size_t> totals;
+        settings.on_progress = [&](size_t level, size_t completed, size_t total) { totals[level] = total; CHECK( completed <= total ); };
+
+        ollama::options options;
+        options["num_predict"] = 4;
+
+        std::string expected;
+        for (size_t i = 0; i < 4; ++i) expected += ollama::mock_server::token(i);
+
+        // Ten chunks are summarized, then combined into three and then one summary.
+        CHECK( ollama_server.summarize("llama3:8b", document, settings, options) == expected );
+        CHECK( server.requests_served() == 14 );
+        CHECK( totals == std::map<size_t, size_t>{{0, 10}, {1, 3}, {2, 1}} );
+
+        // A single leftover summary is carried up to the next level rather than summarized again.
+        document.resize(9000);
+        totals.clear();
+        CHECK( ollama_server.summarize("llama3:8b", document, settings, options) == expected );
+        CHECK( server.requests_served() == 14 + 12 );
+        CHECK( totals == std::map<size_t, size_t>{{0, 9}, {1, 2}, {2, 1}} );
+
+        CHECK( ollama_server.summarize("llama3:8b", "", settings, options).empty() );
+
+        ollama::allow_exceptions(false);
+        CHECK( ollama_server.summarize("missing", document, settings, options).empty() );
+        ollama::allow_exceptions(true);
+        CHECK_THROWS_AS( ollama_server.summarize("missing", document, settings, options), ollama::exception );
+    }
+}
+
+TEST_SUITE("Vector Index Tests") {
+
+    // Indexes of the k closest vectors, found in double precision.
+    static std::vector<size_t> reference_search(const std::vector<std::vector<float>>& vectors, const std::vector<float>& query, size_t k, ollama::metric measure)
+    {
+        auto score = [&](const std::vector<float>& vector) {
+            double dot = 0, distance = 0, norm = 0, query_norm = 0;
+            for (size_t i = 0; i < query.size(); ++i)
+            {
+                dot += double(vector[i]) * query[i];
+                distance += (double(vector[i]) - query[i]) * (double(vector[i]) - query[i]);
+                norm += double(vector[i]) * vector[i];
+                query_norm += double(query[i]) * query[i];
+            }
+            if (measure == ollama::metric::l2) return -distance;
+            if (measure == ollama::metric::dot) return dot;
+            return dot / std::sqrt(norm * query_norm);
+        };
+
+        std::vector<std::pair<double, size_t>> scored;
+        for (size_t i = 0; i < vectors.size(); ++i) scored.push_back(std::make_pair(-score(vectors[i]), i));
+        std::sort(scored.begin(), scored.end());
+
+        std::vector<size_t> closest;
+        for (size_t i = 0; i < k && i < scored.size(); ++i) closest.push_back(scored[i].second);
+        return closest;
+    }
+
+    TEST_CASE("Compare Kernels with the Scalar Versions") {
+
+        std::mt19937 generator(7);
+        std::vector<ollama::simd::kernels> kernels = ollama::simd::available();
+        REQUIRE( std::string(kernels.front().name) == "scalar" );
+        CHECK( std::string(ollama::simd::best().name) == kernels.back().name );
+
+        for (size_t n = 0; n < 100; ++n)
+        {
+            std::vector<float> a = random_vector(generator, n), b = random_vector(generator, n);
+
+            double dot = 0, distance = 0;
+            for (size_t i = 0; i < n; ++i) { dot += double(a[i]) * b[i]; distance += (double(a[i]) - b[i]) * (double(a[i]) - b[i]); }
+
+            for (const ollama::simd::kernels& each: kernels)
+            {
+                CAPTURE( each.name );
+                CAPTURE( n );
+                CHECK( each.dot(a.data(), b.data(), n) == doctest::Approx(dot).epsilon(1e-4) );
+                CHECK( each.l2(a.data(), b.data(), n) == doctest::Approx(distance).epsilon(1e-4) );
+            }
+        }
+    }
+
+    TEST_CASE("Search for the Closest Vectors") {
+
+        std::mt19937 generator(11);
+        std::vector<std::vector<float>> vectors;
+        for (int i = 0; i < 2000; ++i) vectors.push_back(random_vector(generator, 37));
+
+        for (ollama::metric measure: {ollama::metric::cosine, ollama::metric::dot, ollama::metric::l2})
+        {
+            ollama::vector_index index(0, measure);
+            for (size_t i = 0; i < vectors.size(); ++i) REQUIRE( index.add("doc" + std::to_string(i), vectors[i]) );
+            CHECK( index.size() == 2000 );
+            CHECK( index.dimensions() == 37 );
+
+            for (int trial = 0; trial < 5; ++trial)
+            {
+                std::vector<float> query = random_vector(generator, 37);
+                std::vector<ollama::search_result> results = index.search(query, 10);
+                std::vector<size_t> expected = reference_search(vectors, query, 10, measure);
+
+                REQUIRE( results.size() == 10 );
+                for (size_t i = 0; i < results.size(); ++i)
+                {
+                    CHECK( results[i].index == expected[i] );
+                    CHECK( results[i].id == "doc" + std::to_string(expected[i]) );
+                    if (i > 0 && measure == ollama::metric::l2) CHECK( results[i].score >= results[i-1].score );
+                    if (i > 0 && measure != ollama::metric::l2) CHECK( results[i].score <= results[i-1].score );
+                }
+            }
+
+            // A stored vector is its own closest match.
+            std::vector<ollama::search_result> self = index.search(vectors[42], 1);
+            REQUIRE( self.size() == 1 );
+            if (measure != ollama::metric::dot) CHECK( self[0].id == "doc42" );
+            if (measure == ollama::metric::cosine) CHECK( self[0].score == doctest::Approx(1.0) );
+        }
+
+        ollama::vector_index index;
+        CHECK( index.search(vectors[0], 5).empty() );
+        index.add("only", vectors[0]);
+        CHECK( index.search(vectors[0], 5).size() == 1 );
+        CHECK( index.search(vectors[0], 0).empty() );
+    }
+
+    TEST_CASE("Search a Large Index in Parallel") {
+
+        std::mt19937 generator(13);
+        std::vector<std::vector<float>> vectors;
+        ollama::vector_index index(64, ollama::metric::l2);
+        index.reserve(20000);
+        for (int i = 0; i < 20000; ++i) { vectors.push_back(random_vector(generator, 64)); index.add(std::to_string(i), vectors.back()); }
+
+        ollama::thread_pool pool(4);
+        std::vector<float> query = random_vector(generator, 64);
+        std::vector<ollama::search_result> results = index.search(query, 25, pool);
+        std::vector<size_t> expected = reference_search(vectors, query, 25, ollama::metric::l2);
+
+        REQUIRE( results.size() == 25 );
+        for (size_t i = 0; i < results.size(); ++i) CHECK( results[i].index == expected[i] );
+    }
+
+    TEST_CASE("Reject Vectors with the Wrong Dimensions") {
+
+        ollama::vector_index index(3);
+        CHECK_THROWS_AS( index.add("short", std::vector<float>{1, 2}), ollama::exception );
+        CHECK_THROWS_AS( index.search(std::vector<float>{1, 2, 3, 4}, 1), ollama::exception );
+
+        ollama::allow_exceptions(false);
+        CHECK( !index.add("short", std::vector<float>{1, 2}) );
+        CHECK( index.add("right", std::vector<float>{1, 2, 3}) );
+        CHECK( index.search(std::vector<float>{1, 2}, 1).empty() );
+        ollama::allow_exceptions(true);
+
+        CHECK( index.size() == 1 );
+    }
+
+    TEST_CASE("Index Embeddings from the Server") {
+
+        ollama::mock_server server;
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+
+        std::vector<std::string> documents = {"The sky is blue.", "Grass is green.", "The sun is bright."};
+        ollama::request request = ollama::request::from_embedding("llama3:8b", "");
+        request["input"] = documents;
+
+        ollama::vector_index index;
+        CHECK( index.add(documents, ollama_server.generate_embeddings(request)) == 3 );
+        CHECK( index.dimensions() == 64 );
+
+        std::vector<ollama::search_result> results = index.search(ollama::mock_server::embedding("Grass is green.", 64), 2);
+        REQUIRE( results.size() == 2 );
+        CHECK( results[0].id == "Grass is green." );
+        CHECK( results[0].score == doctest::Approx(1.0) );
+
+        CHECK_THROWS_AS( index.add(std::vector<std::string>{"one"}, ollama_server.generate_embeddings(request)), ollama::exception );
+    }
+
+    TEST_CASE("Run Work in Parallel on the Pool") {
+
+        ollama::thread_pool pool(3);
+        std::vector<int> done(100, 0);
+        pool.parallel_for(done.size(), [&](size_t i) { done[i] += 1; });
+        CHECK( std::count(done.begin(), done.end(), 1) == 100 );
+
+        CHECK_THROWS_AS( pool.parallel_for(10, [](size_t i) { if (i == 5) throw std::runtime_error("failed"); }), std::runtime_error );
+
+        // A task may use the pool it runs on, even when every worker is busy.
+        ollama::thread_pool single(1);
+        std::atomic<int> total(0);
+        single.submit([&]{ single.parallel_for(8, [&](size_t) { total++; }); }).get();
+        CHECK( total == 8 );
+    }
+}
+
+TEST_SUITE("HNSW Index Tests") {
+
+    TEST_CASE("Find Nearest Neighbors with High Recall") {
+
+        std::mt19937 generator(17);
+        ollama::hnsw_options options;
+        options.M = 12;
+        options.ef_construction = 64;
+
+        for (ollama::metric measure: {ollama::metric::cosine, ollama::metric::l2})
+        {
+            ollama::hnsw_index index(0, measure, options);
+            ollama::vector_index exact(0, measure);
+            for (int i = 0; i < 1500; ++i)
+            {
+                std::vector<float> vector = random_vector(generator, 24);
+                REQUIRE( index.add(std::to_string(i), vector) );
+                exact.add(std::to_string(i), vector);
+            }
+            CHECK( index.size() == 1500 );
+            CHECK( index.dimensions() == 24 );
+
+            std::vector<std::vector<float>> queries;
+            for (int i = 0; i < 50; ++i) queries.push_back(random_vector(generator, 24));
+            CHECK( recall(index, exact, queries, 10) > 0.9 );
+
+            // Results are ordered closest first, with the same scores as an exact search.
+            std::vector<ollama::search_result> results = index.search(queries[0], 10);
+            REQUIRE( results.size() == 10 );
+            for (size_t i = 1; i < results.size(); ++i)
+            {
+                if (measure == ollama::metric::l2) CHECK( results[i].score >= results[i-1].score );
+                else CHECK( results[i].score <= results[i-1].score );
+            }
+            std::vector<ollama::search_result> expected = exact.search(queries[0], 1);
+            if (results[0].id == expected[0].id) CHECK( results[0].score == doctest::Approx(expected[0].score) );
+
+            // Considering more candidates finds at least as many true neighbors.
+            index.set_ef_search(10);
+            double narrow = recall(index, exact, queries, 10);
+            index.set_ef_search(200);
+            CHECK( recall(index, exact, queries, 10) >= narrow );
+        }
+
+        ollama::hnsw_index empty;
+        CHECK( empty.search(std::vector<float>{1, 2, 3}, 5).empty() );
+    }
+
+    TEST_CASE("Add and Search from Several Threads") {
+
+        std::mt19937 generator(19);
+        std::vector<std::vector<float>> vectors;
+        for (int i = 0; i < 2000; ++i) vectors.push_back(random_vector(generator, 16));
+
+        ollama::hnsw_options options;
+        options.ef_construction = 32;
+        ollama::hnsw_index index(16, ollama::metric::cosine, options);
+
+        std::atomic<bool> adding(true);
+        std::atomic<size_t> searches(0);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t)
+            threads.push_back(std::thread([&, t] { for (size_t i = t; i < vectors.size(); i += 4) index.add(std::to_string(i), vectors[i]); }));
+        std::thread searcher([&] {
+            while (adding) { for (const ollama::search_result& result: index.search(vectors[searches % vectors.size()], 5)) CHECK( result.index < vectors.size() ); ++searches; }
+        });
+        for (std::thread& thread: threads) thread.join();
+        adding = false;
+        searcher.join();
+
+        CHECK( index.size() == 2000 );
+
+        // Every vector is found as its own nearest neighbor.
+        size_t found = 0;
+        for (size_t i = 0; i < vectors.size(); ++i)
+        {
+            std::vector<ollama::search_result> results = index.search(vectors[i], 1);
+            if (!results.empty() && results[0].id == std::to_string(i)) ++found;
+        }
+        CHECK( found >= vectors.size() * 99 / 100 );
+    }
+
+    TEST_CASE("Reserve Space for an Index") {
+
+        ollama::hnsw_index unknown;
+        CHECK( unknown.capacity() == 0 );
+        CHECK_THROWS_AS( unknown.reserve(100), ollama::exception );
+
+        // Slots are reserved in whole segments, and adding within them allocates nothing more.
+        std::mt19937 generator(29);
+        ollama::hnsw_index index(8);
+        REQUIRE( index.reserve(5000) );
+        size_t capacity = index.capacity();
+        CHECK( capacity >= 5000 );
+        for (int i = 0; i < 5000; ++i) REQUIRE( index.add(std::to_string(i), random_vector(generator, 8)) );
+        CHECK( index.capacity() == capacity );
+        CHECK( index.search(random_vector(generator, 8), 3).size() == 3 );
+    }
+
+    TEST_CASE("Save and Load an Index") {
+
+        std::mt19937 generator(23);
+        ollama::hnsw_index index(20, ollama::metric::dot);
+        for (int i = 0; i < 600; ++i) index.add("doc " + std::to_string(i), random_vector(generator, 20));
+
+        std::string path = "hnsw_test.index";
+        REQUIRE( index.save(path) );
+
+        std::shared_ptr<ollama::hnsw_index> loaded = ollama::hnsw_index::load(path);
+        REQUIRE( loaded );
+        CHECK( loaded->size() == 600 );
+        CHECK( loaded->dimensions() == 20 );
+        CHECK( loaded->get_metric() == ollama::metric::dot );
+        CHECK( loaded->get_options().M == index.get_options().M );
+
+        for (int i = 0; i < 20; ++i)
+        {
+            std::vector<float> query = random_vector(generator, 20);
+            std::vector<ollama::search_result> before = index.search(query, 5), after = loaded->search(query, 5);
+            REQUIRE( before.size() == after.size() );
+            for (size_t r = 0; r < before.size(); ++r) { CHECK( before[r].id == after[r].id ); CHECK( before[r].score == after[r].score ); }
+        }
+
+        // A loaded index can keep growing.
+        CHECK( loaded->add("new", random_vector(generator, 20)) );
+        CHECK( loaded->size() == 601 );
+
+        // Truncated and missing files are rejected.
+        std::string contents;
+        { std::ifstream file(path, std::ios::binary); contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()); }
+        { std::ofstream file(path, std::ios::binary | std::ios::trunc); file.write(contents.data(), contents.size() / 2); }
+        CHECK_THROWS_AS( ollama::hnsw_index::load(path), ollama::exception );
+        ollama::allow_exceptions(false);
+        CHECK( !ollama::hnsw_index::load(path) );
+        CHECK( !ollama::hnsw_index::load("missing.index") );
+        ollama::allow_exceptions(true);
+
+        std::remove(path.c_str());
+    }
+
+    TEST_CASE("Index Embeddings from the Server in Parallel") {
+
+        ollama::mock_server server;
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+
+        std::vector<std::string> documents;
+        for (int i = 0; i < 200; ++i) documents.push_back("Document number " + std::to_string(i));
+        ollama::request request = ollama::request::from_embedding("llama3:8b", "");
+        request["input"] = documents;
+
+        ollama::thread_pool pool(4);
+        ollama::hnsw_index index;
+        CHECK( index.add(documents, ollama_server.generate_embeddings(request), pool) == 200 );
+        CHECK( index.dimensions() == 64 );
+
+        std::vector<ollama::search_result> results = index.search(ollama::mock_server::embedding("Document number 42", 64), 1);
+        REQUIRE( results.size() == 1 );
+        CHECK( results[0].id == "Document number 42" );
+
+        CHECK_THROWS_AS( index.add("short", std::vector<float>{1, 2}), ollama::exception );
+        CHECK_THROWS_AS( index.search(std::vector<float>{1, 2}, 1), ollama::exception );
+    }
+}
+
+TEST_SUITE("Quantization Tests") {
+
+    TEST_CASE("Compare Quantized Kernels with the Scalar Versions") {
+
+        std::mt19937 generator(29);
+        std::uniform_int_distribution<int> byte(-127, 127);
+
+        for (size_t n = 0; n < 130; ++n)
+        {
+            std::vector<int8_t> a(n), b(n);
+            int32_t dot = 0;
+            for (size_t i = 0; i < n; ++i) { a[i] = static_cast<int8_t>(byte(generator)); b[i] = static_cast<int8_t>(byte(generator)); dot += a[i] * b[i]; }
+
+            size_t words = (n + 63) / 64;
+            std::vector<uint64_t> x(words), y(words);
+            uint32_t differing = 0;
+            for (size_t i = 0; i < n; ++i)
+            {
+                bool p = generator() % 2 == 0, q = generator() % 2 == 0;
+                if (p) x[i / 64] |= uint64_t(1) << (i % 64);
+                if (q) y[i / 64] |= uint64_t(1) << (i % 64);
+                if (p != q) ++differing;
+            }
+
+            for (const ollama::simd::kernels& kernels: ollama::simd::available())
+            {
+                CAPTURE( kernels.name );
+                CAPTURE( n );
+                CHECK( kernels.dot_int8(a.data(), b.data(), n) == dot );
+                CHECK( kernels.hamming(x.data(), y.data(), words) == differing );
+            }
+        }
+    }
+
+    TEST_CASE("Search Quantized Vectors") {
+
+        // Vectors gathered around topics, like the embeddings of a real collection.
+        std::mt19937 generator(31);
+        std::vector<std::vector<float>> topics, vectors, queries;
+        for (int i = 0; i < 40; ++i) topics.push_back(random_vector(generator, 96));
+        for (int i = 0; i < 2030; ++i)
+        {
+            std::vector<float> vector = random_vector(generator, 96);
+            for (size_t d = 0; d < vector.size(); ++d) vector[d] += topics[i % topics.size()][d];
+            (i < 2000 ? vectors : queries).push_back(vector);
+        }
+
+        for (ollama::metric measure: {ollama::metric::cosine, ollama::metric::dot, ollama::metric::l2})
+        {
+            CAPTURE( static_cast<int>(measure) );
+
+            ollama::vector_index exact(0, measure);
+            ollama::quantization_options int8(ollama::quantization::int8), binary(ollama::quantization::binary), approximate(ollama::quantization::int8);
+            binary.rescore = 10;
+            approximate.rescore = 0;
+            ollama::vector_index int8_index(0, measure, int8), binary_index(0, measure, binary), approximate_index(0, measure, approximate);
+
+            for (size_t i = 0; i < vectors.size(); ++i)
+            {
+                std::string id = std::to_string(i);
+                exact.add(id, vectors[i]);
+                int8_index.add(id, vectors[i]);
+                binary_index.add(id, vectors[i]);
+                approximate_index.add(id, vectors[i]);
+            }
+
+            // Without rescoring, int8 scores are close to the exact scores.
+            CHECK( recall(approximate_index, exact, queries, 10) > 0.85 );
+            std::vector<ollama::search_result> expected = exact.search(queries[0], 1), estimated = approximate_index.search(queries[0], 1);
+            CHECK( estimated[0].score == doctest::Approx(expected[0].score).epsilon(0.05) );
+
+            // Rescored results have the exact scores.
+            CHECK( recall(int8_index, exact, queries, 10) > 0.95 );
+            std::vector<ollama::search_result> rescored = int8_index.search(queries[0], 1);
+            if (rescored[0].index == expected[0].index) CHECK( rescored[0].score == doctest::Approx(expected[0].score) );
+
+            CHECK( recall(binary_index, exact, queries, 10) > 0.9 );
+        }
+    }
+
+    TEST_CASE("Quantize without Keeping Vectors") {
+
+        std::mt19937 generator(37);
+        std::vector<std::vector<float>> vectors;
+        for (int i = 0; i < 1000; ++i) vectors.push_back(random_vector(generator, 256));
+
+        ollama::vector_index exact(256);
+        ollama::quantization_options int8(ollama::quantization::int8), binary(ollama::quantization::binary);
+        int8.keep_vectors = false;
+        binary.keep_vectors = false;
+        ollama::vector_index int8_index(256, ollama::metric::cosine, int8), binary_index(256, ollama::metric::cosine, binary);
+        for (size_t i = 0; i < vectors.size(); ++i)
+        {
+            exact.add(std::to_string(i), vectors[i]);
+            int8_index.add(std::to_string(i), vectors[i]);
+            binary_index.add(std::to_string(i), vectors[i]);
+        }
+
+        // Int8 codes take about a quarter of the memory, and signs about a thirty-second.
+        CHECK( int8_index.memory_bytes() < exact.memory_bytes() * 3 / 10 );
+        CHECK( binary_index.memory_bytes() < exact.memory_bytes() / 20 );
+        CHECK( int8_index.vector(0) == nullptr );
+        CHECK( exact.vector(0) != nullptr );
+
+        // Rescoring reads vectors from a source, which need not be normalized.
+        std::vector<float> query = random_vector(generator, 256);
+        std::vector<ollama::search_result> expected = exact.search(query, 5);
+        binary_index.set_vector_source([&](size_t index) { return vectors[index].data(); });
+        ollama::quantization_options wide = binary_index.get_quantization();
+        CHECK( wide.rescore == 4 );
+
+        std::vector<ollama::search_result> results = binary_index.search(query, 5);
+        REQUIRE( results.size() == 5 );
+        for (const ollama::search_result& result: results)
+            for (const ollama::search_result& each: expected)
+                if (each.index == result.index) CHECK( result.score == doctest::Approx(each.score) );
+
+        // Without a source, the quantized scores are returned.
+        results = int8_index.search(query, 5);
+        REQUIRE( results.size() == 5 );
+        CHECK( results[0].score == doctest::Approx(expected[0].score).epsilon(0.05) );
+    }
+}
+
+TEST_SUITE("Embedding Store Tests") {
+
+    TEST_CASE("Append and Reopen an Embedding Store") {
+
+        std::string path = "test_embeddings.store";
+        std::remove(path.c_str());
+
+        std::mt19937 generator(41);
+        std::vector<std::vector<float>> vectors;
+        std::vector<std::string> ids, metadata;
+        for (int i = 0; i < 300; ++i)
+        {
+            vectors.push_back(random_vector(generator, 48));
+            ids.push_back("document-" + std::to_string(i));
+            metadata.push_back(i % 3 == 0 ? "" : "{\"page\":" + std::to_string(i) + "}");
+        }
+
+        {
+            std::shared_ptr<ollama::embedding_store> store = ollama::embedding_store::open(path, 48);
+            REQUIRE( store );
+            CHECK( store->empty() );
+
+            // Appends in batches of different sizes, one without metadata.
+            CHECK( store->append(std::vector<std::string>(ids.begin(), ids.begin() + 100), std::vector<std::vector<float>>(vectors.begin(), vectors.begin() + 100), std::vector<std::string>(metadata.begin(), metadata.begin() + 100)) );
+            const float* first = store->vector(7);
+            CHECK( store->append(std::vector<std::string>(ids.begin() + 100, ids.begin() + 101), std::vector<std::vector<float>>(vectors.begin() + 100, vectors.begin() + 101)) );
+            CHECK( store->append(std::vector<std::string>(ids.begin() + 101, ids.end()), std::vector<std::vector<float>>(vectors.begin() + 101, vectors.end()), std::vector<std::string>(metadata.begin() + 101, metadata.end())) );
+            CHECK( store->size() == 300 );
+            metadata[100] = "";
+
+            // Vectors read before an append stay valid.
+            CHECK( std::memcmp(first, vectors[7].data(), 48 * sizeof(float)) == 0 );
+        }
+
+        std::shared_ptr<ollama::embedding_store> store = ollama::embedding_store::open(path);
+        REQUIRE( store );
+        CHECK( store->size() == 300 );
+        CHECK( store->dimensions() == 48 );
+        for (size_t i = 0; i < vectors.size(); ++i)
+        {
+            CHECK( std::memcmp(store->vector(i), vectors[i].data(), 48 * sizeof(float)) == 0 );
+            CHECK( store->id(i) == ids[i] );
+            CHECK( store->metadata(i) == metadata[i] );
+        }
+        CHECK_THROWS_AS( store->vector(300), std::out_of_range );
+
+        // A reopened store can keep growing.
+        CHECK( store->append({"last"}, random_vector(generator, 48).data(), 48, {"end"}) );
+        CHECK( store->size() == 301 );
+        CHECK( store->metadata(300) == "end" );
+        CHECK( ollama::embedding_store::open(path)->size() == 301 );
+
+        CHECK_THROWS_AS( store->append({"short"}, std::vector<std::vector<float>>{{1, 2}}), ollama::exception );
+        CHECK_THROWS_AS( store->append({"a", "b"}, std::vector<std::vector<float>>()), ollama::exception );
+        ollama::allow_exceptions(false);
+        CHECK( !store->append({"a", "b"}, std::vector<std::vector<float>>()) );
+        ollama::allow_exceptions(true);
+        CHECK( store->size() == 301 );
+        CHECK_THROWS_AS( ollama::embedding_store::open(path, 12), ollama::exception );
+
+        store.reset();
+        std::remove(path.c_str());
+    }
+
+    TEST_CASE("Search an Embedding Store") {
+
+        std::string path = "test_search.store";
+        std::remove(path.c_str());
+
+        std::mt19937 generator(43);
+        std::shared_ptr<ollama::embedding_store> store = ollama::embedding_store::open(path, 32);
+        REQUIRE( store );
+
+        for (ollama::metric measure: {ollama::metric::cosine, ollama::metric::dot, ollama::metric::l2})
+        {
+            CAPTURE( static_cast<int>(measure) );
+            ollama::vector_index index(32, measure);
+            if (store->empty())
+            {
+                // Several segments, so that results are merged across them.
+                for (int batch = 0; batch < 4; ++batch)
+                {
+                    std::vector<std::string> ids;
+                    std::vector<std::vector<float>> vectors;
+                    for (int i = 0; i < 250; ++i) { ids.push_back(std::to_string(batch * 250 + i)); vectors.push_back(random_vector(generator, 32)); }
+                    REQUIRE( store->append(ids, vectors) );
+                }
+            }
+            for (size_t i = 0; i < store->size(); ++i) index.add(store->id(i), store->vector(i), 32);
+
+            for (int q = 0; q < 10; ++q)
+            {
+                std::vector<float> query = random_vector(generator, 32);
+                std::vector<ollama::search_result> expected = index.search(query, 8), results = store->search(query, 8, measure);
+                REQUIRE( results.size() == expected.size() );
+                for (size_t r = 0; r < results.size(); ++r)
+                {
+                    CHECK( results[r].id == expected[r].id );
+                    CHECK( results[r].index == expected[r].index );
+                    CHECK( results[r].score == doctest::Approx(expected[r].score).epsilon(1e-4) );
+                }
+            }
+        }
+
+        CHECK_THROWS_AS( store->search(std::vector<float>{1, 2}, 1), ollama::exception );
+
+        store.reset();
+        std::remove(path.c_str());
+    }
+
+    TEST_CASE("Append Many Small Batches") {
+
+        std::string path = "test_small_batches.store";
+        std::remove(path.c_str());
+
+        // Enough appends to outgrow the room reserved by the first mapping.
+        std::mt19937 generator(53);
+        std::vector<std::vector<float>> vectors;
+        std::shared_ptr<ollama::embedding_store> store = ollama::embedding_store::open(path, 1024);
+        REQUIRE( store );
+        for (int i = 0; i < 6000; ++i)
+        {
+            vectors.push_back(random_vector(generator, 1024));
+            REQUIRE( store->append({std::to_string(i)}, vectors.back().data(), 1024) );
+        }
+
+        CHECK( store->size() == 6000 );
+        for (size_t i = 0; i < vectors.size(); i += 7)
+        {
+            CHECK( std::memcmp(store->vector(i), vectors[i].data(), 1024 * sizeof(float)) == 0 );
+            CHECK( store->id(i) == std::to_string(i) );
+        }
+        std::vector<ollama::search_result> results = store->search(vectors[5999], 1);
+        REQUIRE( results.size() == 1 );
+        CHECK( results[0].index == 5999 );
+
+        store.reset();
+        CHECK( ollama::embedding_store::open(path)->size() == 6000 );
+        std::remove(path.c_str());
+    }
+
+    TEST_CASE("Ignore an Incomplete Append") {
+
+        std::string path = "test_incomplete.store";
+        std::remove(path.c_str());
+
+        std::mt19937 generator(47);
+        {
+            std::shared_ptr<ollama::embedding_store> store = ollama::embedding_store::open(path, 16);
+            REQUIRE( store->append({"a", "b"}, std::vector<std::vector<float>>{random_vector(generator, 16), random_vector(generator, 16)}) );
+        }
+
+        // Bytes written after the last complete segment, as if an append had been interrupted.
+        { std::ofstream file(path, std::ios::binary | std::ios::app); file << std::string(100, 'x'); }
+
+        std::shared_ptr<ollama::embedding_store> store = ollama::embedding_store::open(path);
+        REQUIRE( store );
+        CHECK( store->size() == 2 );
+        CHECK( store->append({"c"}, std::vector<std::vector<float>>{random_vector(generator, 16)}) );
+        CHECK( store->id(2) == "c" );
+        store.reset();
+        CHECK( ollama::embedding_store::open(path)->size() == 3 );
+
+        // Files which are not stores are rejected, and creating a store needs dimensions.
+        { std::ofstream file(path, std::ios::binary | std::ios::trunc); file << std::string(200, 'x'); }
+        CHECK_THROWS_AS( ollama::embedding_store::open(path), ollama::exception );
+        ollama::allow_exceptions(false);
+        CHECK( !ollama::embedding_store::open(path) );
+        CHECK( !ollama::embedding_store::open("missing.store") );
+        ollama::allow_exceptions(true);
+
+        std::remove(path.c_str());
+    }
+
+    TEST_CASE("Store Embeddings from the Server") {
+
+        std::string path = "test_server.store";
+        std::remove(path.c_str());
+
+        ollama::mock_server server;
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+
+        std::vector<std::string> documents;
+        for (int i = 0; i < 50; ++i) documents.push_back("Document number " + std::to_string(i));
+        ollama::request request = ollama::request::from_embedding("llama3:8b", "");
+        request["input"] = documents;
+
+        std::shared_ptr<ollama::embedding_store> store = ollama::embedding_store::open(path, 64);
+        REQUIRE( store );
+        CHECK( store->append(documents, ollama_server.generate_embeddings(request), documents) );
+        CHECK( store->size() == 50 );
+        CHECK( store->metadata(42) == "Document number 42" );
+
+        std::vector<ollama::search_result> results = store->search(ollama::mock_server::embedding("Document number 42", 64), 1);
+        REQUIRE( results.size() == 1 );
+        CHECK( results[0].id == "Document number 42" );
+        CHECK( results[0].score == doctest::Approx(1.0) );
+
+        // A quantized index can rescore from the store rather than keeping its own copy of the vectors.
+        ollama::quantization_options options(ollama::quantization::binary);
+        options.keep_vectors = false;
+        ollama::vector_index index(64, ollama::metric::cosine, options);
+        for (size_t i = 0; i < store->size(); ++i) index.add(store->id(i), store->vector(i), 64);
+        index.set_vector_source([&](size_t i) { return store->vector(i); });
+        results = index.search(ollama::mock_server::embedding("Document number 7", 64), 1);
+        REQUIRE( results.size() == 1 );
+        CHECK( results[0].id == "Document number 7" );
+
+        CHECK_THROWS_AS( store->append({"one"}, ollama_server.generate_embeddings(request)), ollama::exception );
+
+        store.reset();
+        std::remove(path.c_str());
+    }
+}
+
+TEST_SUITE("Embedding Cache Tests") {
+
+    TEST_CASE("Hash with MurmurHash3") {
+
+        // Reference values of the x64 128-bit variant with a seed of zero.
+        ollama::hash128 empty = ollama::murmur3_128(""), hello = ollama::murmur3_128("hello"), fox = ollama::murmur3_128("The quick brown fox jumps over the lazy dog");
+        CHECK( empty.low == 0 );
+        CHECK( empty.high == 0 );
+        CHECK( hello.low == 0xCBD8A7B341BD9B02ULL );
+        CHECK( hello.high == 0x5B1E906A48AE1D19ULL );
+        CHECK( fox.low == 0xE34BBC7BBC071B6CULL );
+        CHECK( fox.high == 0x7A433CA9C49A9347ULL );
+
+        CHECK( ollama::embedding_cache::key("llama3:8b", true, "text") != ollama::embedding_cache::key("llama3:8b", false, "text") );
+        CHECK( ollama::embedding_cache::key("llama3:8b", true, "text") != ollama::embedding_cache::key("mistral", true, "text") );
+    }
+
+    TEST_CASE("Evict the Least Recently Used Embeddings") {
+
+        ollama::embedding_cache cache(2);
+        std::vector<float> embedding;
+        cache.put("llama3:8b", true, "a", {1, 2});
+        cache.put("llama3:8b", true, "b", {3, 4});
+        CHECK( cache.get("llama3:8b", true, "a", embedding) );
+        CHECK( embedding == std::vector<float>{1, 2} );
+
+        // "b" is now the least recently used.
+        cache.put("llama3:8b", true, "c", {5, 6});
+        CHECK( cache.size() == 2 );
+        CHECK( !cache.get("llama3:8b", true, "b", embedding) );
+        CHECK( cache.get("llama3:8b", true, "a", embedding) );
+        CHECK( cache.get("llama3:8b", true, "c", embedding) );
+        CHECK( cache.hits() == 3 );
+        CHECK( cache.misses() == 1 );
+    }
+
+    TEST_CASE("Send Only Uncached Inputs") {
+
+        ollama::mock_server server;
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+        ollama::embedding_cache cache;
+
+        ollama::request request = ollama::request::from_embedding("llama3:8b", "");
+        request["input"] = std::vector<std::string>{"one", "two", "one", "three"};
+        ollama::response response = ollama_server.generate_embeddings(request, cache);
+        REQUIRE( response.as_json()["embeddings"].size() == 4 );
+        CHECK( response.as_json()["prompt_eval_count"] == 3 );     // The repeated input is only sent once.
+        CHECK( response.as_json()["embeddings"][2].get<std::vector<float>>() == ollama::mock_server::embedding("one", 64) );
+        CHECK( response.as_json()["embeddings"][3].get<std::vector<float>>() == ollama::mock_server::embedding("three", 64) );
+
+        request["input"] = std::vector<std::string>{"three", "four", "two"};
+        response = ollama_server.generate_embeddings(request, cache);
+        CHECK( response.as_json()["prompt_eval_count"] == 1 );
+        for (size_t i = 0; i < 3; ++i)
+            CHECK( response.as_json()["embeddings"][i].get<std::vector<float>>() == ollama::mock_server::embedding(request["input"][i].get<std::string>(), 64) );
+
+        // Nothing is sent when every input is cached.
+        size_t served = server.requests_served();
+        request["input"] = "four";
+        response = ollama_server.generate_embeddings(request, cache);
+        CHECK( server.requests_served() == served );
+        CHECK( response.as_json()["model"] == "llama3:8b" );
+        CHECK( response.as_json()["embeddings"][0].get<std::vector<float>>() == ollama::mock_server::embedding("four", 64) );
+
+        // A different truncate setting is a different entry.
+        request["truncate"] = false;
+        response = ollama_server.generate_embeddings(request, cache);
+        CHECK( server.requests_served() == served + 1 );
+
+        ollama::request missing = ollama::request::from_embedding("missing-model", "five");
+        CHECK_THROWS( ollama_server.generate_embeddings(missing, cache) );
+    }
+
+    TEST_CASE("Reuse Embeddings Stored on Disk") {
+
+        std::string path = "test_cache.store";
+        std::remove(path.c_str());
+
+        ollama::mock_server server;
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+
+        std::vector<std::string> documents;
+        for (int i = 0; i < 40; ++i) documents.push_back("Chunk " + std::to_string(i));
+        ollama::request request = ollama::request::from_embedding("llama3:8b", "");
+        request["input"] = documents;
+
+        {
+            ollama::embedding_cache cache(10);
+            REQUIRE( cache.persist(path) );
+            ollama_server.generate_embeddings(request, cache);
+            CHECK( cache.size() == 10 );
+            CHECK( cache.stored_size() == 40 );
+
+            // Embeddings evicted from memory are still found on disk.
+            std::vector<float> embedding;
+            CHECK( cache.get("llama3:8b", true, "Chunk 0", embedding) );
+            CHECK( embedding == ollama::mock_server::embedding("Chunk 0", 64) );
+        }
+
+        // A later run only sends the chunks which have changed.
+        documents[5] = "Chunk 5, edited";
+        request["input"] = documents;
+        ollama::embedding_cache cache;
+        REQUIRE( cache.persist(path) );
+        CHECK( cache.stored_size() == 40 );
+
+        ollama::response response = ollama_server.generate_embeddings(request, cache);
+        CHECK( response.as_json()["prompt_eval_count"] == 1 );
+        CHECK( response.as_json()["embeddings"][5].get<std::vector<float>>() == ollama::mock_server::embedding("Chunk 5, edited", 64) );
+        CHECK( response.as_json()["embeddings"][39].get<std::vector<float>>() == ollama::mock_server::embedding("Chunk 39", 64) );
+        CHECK( cache.stored_size() == 41 );
+
+        // Embeddings with other dimensions are only kept in memory.
+        cache.put("other", true, "text", {1, 2, 3});
+        CHECK( cache.stored_size() == 41 );
+        std::vector<float> embedding;
+        CHECK( cache.get("other", true, "text", embedding) );
+
+        // A file which is not a store cannot be attached.
+        { std::ofstream file(path, std::ios::binary | std::ios::trunc); file << "not a store"; }
+        ollama::embedding_cache broken;
+        CHECK_THROWS_AS( broken.persist(path), ollama::exception );
+
+        std::remove(path.c_str());
+    }
+
+    #ifndef _WIN32
+    TEST_CASE("Forget a Batch Which Could Not Be Stored") {
+
+        std::string path = "test_failed_cache.store";
+        std::remove(path.c_str());
+
+        // Nothing is kept in memory, so every hit is read from the store.
+        ollama::embedding_cache cache(0);
+        REQUIRE( cache.persist(path) );
+        cache.put("llama3:8b", true, "first", std::vector<float>(64, 1.0f));
+        REQUIRE( cache.stored_size() == 1 );
+
+        // Writes past the current end of the file fail while the limit is lowered.
+        std::vector<ollama::hash128> keys = {ollama::embedding_cache::key("llama3:8b", true, "second"), ollama::embedding_cache::key("llama3:8b", true, "third")};
+        std::vector<std::vector<float>> embeddings(2, std::vector<float>(64, 2.0f));
+        struct rlimit original, limited;
+        REQUIRE( getrlimit(RLIMIT_FSIZE, &original) == 0 );
+        limited = original;
+        limited.rlim_cur = static_cast<rlim_t>(std::ifstream(path, std::ios::binary | std::ios::ate).tellg());
+        void (*previous)(int) = std::signal(SIGXFSZ, SIG_IGN);
+        REQUIRE( setrlimit(RLIMIT_FSIZE, &limited) == 0 );
+        CHECK_THROWS_AS( cache.put(keys, embeddings), ollama::exception );
+        ollama::allow_exceptions(false);
+        CHECK_NOTHROW( cache.put(keys, embeddings) );
+        ollama::allow_exceptions(true);
+        setrlimit(RLIMIT_FSIZE, &original);
+        std::signal(SIGXFSZ, previous);
+
+        CHECK( cache.stored_size() == 1 );
+        std::vector<float> embedding;
+        CHECK( !cache.get("llama3:8b", true, "second", embedding) );
+        CHECK( cache.get("llama3:8b", true, "first", embedding) );
+        CHECK( embedding == std::vector<float>(64, 1.0f) );
+
+        // The batch is stored once the file can grow again.
+        cache.put(keys, embeddings);
+        CHECK( cache.stored_size() == 3 );
+        CHECK( cache.get("llama3:8b", true, "third", embedding) );
+        CHECK( embedding == std::vector<float>(64, 2.0f) );
+        CHECK( ollama::embedding_store::open(path)->size() == 3 );
+
+        std::remove(path.c_str());
+    }
+    #endif
+}
+
+TEST_SUITE("RAG Tests") {
+
+    static std::string make_document(int number)
+    {
+        std::string document;
+        for (int sentence = 0; sentence < 40; ++sentence)
+            document += "Document " + std::to_string(number) + " says fact " + std::to_string(sentence) + " about topic " + std::to_string((number * 7 + sentence) % 13) + ". ";
+        return document;
+    }
+
+    TEST_CASE("Index Documents and Retrieve Passages") {
+
+        ollama::mock_server server;
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+
+        ollama::rag_options settings;
+        settings.embedding_model = "llama3:8b";
+        settings.chunking.size = 300;
+        settings.chunking.overlap = 30;
+        settings.batch_size = 2;
+        settings.concurrency = 2;
+        ollama::rag pipeline(settings, ollama_server);
+
+        std::vector<std::string> documents;
+        size_t chunks = 0;
+        for (int i = 0; i < 6; ++i) { documents.push_back(make_document(i)); chunks += ollama::chunk_text(documents.back(), settings.chunking).size(); }
+
+        // More batches than replies may wait to be indexed, with the last batch only partly full.
+        REQUIRE( chunks > settings.batch_size * settings.concurrency * 4 );
+        size_t served = server.requests_served();
+        CHECK( pipeline.add(documents) == chunks );
+        CHECK( pipeline.size() == chunks );
+        CHECK( server.requests_served() - served == (chunks + 1) / 2 );
+
+        // The embedding of a chunk's own text is closest to that chunk.
+        std::vector<ollama::text_chunk> pieces = ollama::chunk_text(documents[2], settings.chunking);
+        std::vector<ollama::passage> found = pipeline.retrieve(pieces[3].text);
+        REQUIRE( found.size() == settings.top_k );
+        CHECK( found[0].id == "2#3" );
+        CHECK( found[0].source == "2" );
+        CHECK( found[0].text == pieces[3].text );
+        CHECK( found[0].offset == pieces[3].offset );
+        CHECK( found[0].score == doctest::Approx(1.0) );
+        for (size_t i = 1; i < found.size(); ++i) CHECK( found[i].score <= found[i - 1].score );
+
+        // Sources name later documents, and numbering continues otherwise.
+        CHECK( pipeline.add("A short note about the weather.", "notes.txt") == 1 );
+        CHECK( pipeline.add("Another short document.") == 1 );
+        CHECK( pipeline.retrieve("A short note about the weather.", 1)[0].id == "notes.txt#0" );
+        CHECK( pipeline.retrieve("Another short document.", 1)[0].id == "7#0" );
+
+        ollama::response answer = pipeline.chat("llama3:8b", "What does document 2 say?");
+        CHECK( !answer.as_simple_string().empty() );
+    }
+
+    TEST_CASE("Fit Retrieved Passages within the Token Budget") {
+
+        ollama::rag_options settings;
+        settings.context_tokens = 60;
+        ollama::rag pipeline(settings);
+
+        std::vector<ollama::passage> retrieved(3);
+        retrieved[0].text = std::string(120, 'a');      // 30 tokens, and 2 more for the source.
+        retrieved[0].source = "first";
+        retrieved[1].text = std::string(200, 'b');      // 50 tokens, which no longer fit.
+        retrieved[2].text = std::string(80, 'c');       // 20 tokens, which still fit.
+
+        ollama::request request = pipeline.build_chat("llama3:8b", "What is in the context?", retrieved);
+        REQUIRE( request["messages"].size() == 2 );
+        std::string context = request["messages"][0]["content"];
+        CHECK( request["messages"][0]["role"] == "system" );
+        CHECK( context.find("[first]\n" + retrieved[0].text + "\n\n" + retrieved[2].text) != std::string::npos );
+        CHECK( context.find(retrieved[1].text) == std::string::npos );
+        CHECK( request["messages"][1]["content"] == "What is in the context?" );
+        CHECK( request["model"] == "llama3:8b" );
+    }
+
+    TEST_CASE("Embed Batches Concurrently while Indexing") {
+
+        ollama::mock_server::config config;
+        config.latency_ms = 50;
+
+        ollama::mock_server server(config);
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+
+        ollama::embedding_cache cache;
+        ollama::rag_options settings;
+        settings.embedding_model = "llama3:8b";
+        settings.chunking.size = 100;
+        settings.chunking.overlap = 0;
+        settings.batch_size = 1;
+        settings.concurrency = 4;
+        settings.cache = &cache;
+
+        std::vector<std::string> documents;
+        for (int i = 0; i < 16; ++i) documents.push_back("Document number " + std::to_string(i) + ".");
+
+        // Requests overlap on the server, up to the concurrency setting.
+        ollama::rag pipeline(settings, ollama_server);
+        CHECK( pipeline.add(documents) == 16 );
+        CHECK( server.peak_concurrency() > 1 );
+        CHECK( server.peak_concurrency() <= 4 );
+
+        // Embeddings already in the cache are not requested again.
+        ollama::rag again(settings, ollama_server);
+        size_t served = server.requests_served();
+        CHECK( again.add(documents) == 16 );
+        CHECK( server.requests_served() == served );
+
+        // Failed batches are reported once every batch has been handled.
+        settings.embedding_model = "missing";
+        settings.cache = nullptr;
+        ollama::rag missing(settings, ollama_server);
+        CHECK_THROWS_AS( missing.add(documents), ollama::exception );
+        CHECK( missing.size() == 0 );
+        ollama::allow_exceptions(false);
+        CHECK( missing.add(documents) == 0 );
+        ollama::allow_exceptions(true);
+    }
+}
+
+TEST_SUITE("Embedding Decoding Tests") {
+
+    // Checks that each number is decoded to the float which nlohmann::json gives for it. Only the sign of zero may differ,
+    // since json reads -0 as an integer.
+    static void check_numbers(const std::vector<std::string>& numbers)
+    {
+        std::string body = "{\"model\":\"llama3:8b\",\"embeddings\":[[";
+        for (size_t i = 0; i < numbers.size(); ++i) body += (i ? "," : "") + numbers[i];
+        body += "]],\"total_duration\":1000}";
+
+        std::vector<float> expected = ollama::json::parse(body)["embeddings"][0].get<std::vector<float>>(), values;
+        size_t dimensions = 0;
+        REQUIRE( ollama::decode_embeddings(body.data(), body.size(), values, dimensions) );
+        REQUIRE( dimensions == numbers.size() );
+        for (size_t i = 0; i < numbers.size(); ++i)
+        {
+            CAPTURE( numbers[i] );
+            CHECK( values[i] == expected[i] );
+        }
+    }
+
+    TEST_CASE("Decode Numbers like the JSON Parser") {
+
+        check_numbers({"0", "-0", "0.0", "-0.0", "1", "-1", "10", "1E5", "1e+5", "1e-5", "2.5E-3", "123456789", "0.000001",
+                       "1.5e-45", "1e-46", "3.4028235e38", "-3.4028235e38", "1.17549435e-38", "0.30000000000000004",
+                       "9007199254740993", "12345678901234567890123", "0.000000000000000000000000000001234",
+                       "1234567890123456789.5", "4.35e-3", "1e22", "1e23", "1e-22", "1e-23", "0.1", "0.2", "0.7",
+                       "3.40282357e38", "-3.40282357e38", "1e39"});
+
+        std::mt19937 generator(53);
+        std::uniform_real_distribution<double> exponent(-40, 38);
+        std::uniform_real_distribution<double> unit(-1, 1);
+        const char* formats[] = {"%.9g", "%.17g", "%.3e", "%.6f", "%.12g"};
+        for (const char* format: formats)
+        {
+            std::vector<std::string> numbers;
+            char text[64];
+            for (int i = 0; i < 2000; ++i)
+            {
+                float value = static_cast<float>(unit(generator) * std::pow(10.0, exponent(generator)));
+                std::snprintf(text, sizeof(text), format, value);
+                numbers.push_back(text);
+            }
+            check_numbers(numbers);
+        }
+    }
+
+    TEST_CASE("Decode Embeddings from a Reply") {
+
+        std::string body = " {\n  \"model\" : \"embed \\\"embeddings\\\" model\",\n  \"details\": {\"embeddings\": [[9]], \"list\": [true, false, null, {}, []]},\n"
+                           "  \"embeddings\" : [ [ 1.5 , -2 ] ,\n [3e0,4.25] ] ,\n  \"prompt_eval_count\": 2\n}\n";
+        std::vector<float> values;
+        size_t dimensions = 0;
+        std::vector<std::string> others;
+        REQUIRE( ollama::decode_embeddings(body.data(), body.size(), values, dimensions, [&others](const std::string& key, const char* value, size_t length) { others.push_back(key + "=" + std::string(value, length)); }) );
+        CHECK( dimensions == 2 );
+        CHECK( values == std::vector<float>{1.5f, -2.0f, 3.0f, 4.25f} );
+        REQUIRE( others.size() == 3 );
+        CHECK( others[0] == "model=\"embed \\\"embeddings\\\" model\"" );
+        CHECK( others[2] == "prompt_eval_count=2" );
+
+        // Straight into a buffer, which must be large enough.
+        float buffer[4];
+        size_t count = 0;
+        CHECK( ollama::decode_embeddings(body.data(), body.size(), buffer, 4, count, dimensions) );
+        CHECK( count == 2 );
+        CHECK( dimensions == 2 );
+        CHECK( buffer[3] == 4.25f );
+        CHECK( !ollama::decode_embeddings(body.data(), body.size(), buffer, 3, count, dimensions) );
+
+        std::string empty = "{\"embeddings\":[]}";
+        CHECK( ollama::decode_embeddings(empty.data(), empty.size(), values, dimensions) );
+        CHECK( values.empty() );
+
+        const char* invalid[] = {"", "{}", "[]", "{\"embeddings\":[[1,2],[3]]}", "{\"embeddings\":[[1,2]]", "{\"embeddings\":[[1,2]]} x",
+                                 "{\"embeddings\":[[1,\"2\"]]}", "{\"embeddings\":[[01]]}", "{\"embeddings\":[[1.]]}", "{\"embeddings\":[[1e]]}",
+                                 "{\"embeddings\":[[1,2,]]}", "{\"embeddings\":[[1]],\"embeddings\":[[2]]}", "{\"embeddings\":[1,2]}",
+                                 "{\"a\":tru,\"embeddings\":[[1]]}", "{\"a\":\"\\x\",\"embeddings\":[[1]]}"};
+        for (const char* text: invalid)
+        {
+            CAPTURE( text );
+            CHECK( !ollama::decode_embeddings(text, std::strlen(text), values, dimensions) );
+        }
+    }
+
+    TEST_CASE("Read Embeddings from a Response without Parsing It") {
+
+        ollama::mock_server server;
+        REQUIRE( server.start() );
+
+        Ollama ollama_server(server.url());
+        ollama::request request = ollama::request::from_embedding("llama3:8b", "");
+        request["input"] = std::vector<std::string>{"first", "second", "third"};
+        ollama::response response = ollama_server.generate_embeddings(request);
+        CHECK( response.is_valid() );
+        CHECK( !response.has_error() );
+
+        std::vector<float> values;
+        size_t dimensions = 0;
+        REQUIRE( response.get_embeddings(values, dimensions) );
+        REQUIRE( dimensions == 64 );
+        REQUIRE( values.size() == 3 * 64 );
+        CHECK( std::vector<float>(values.begin() + 64, values.begin() + 128) == ollama::mock_server::embedding("second", 64) );
+
+        // The json is still available, and matches.
+        CHECK( response.as_json()["embeddings"][2].get<std::vector<float>>() == std::vector<float>(values.begin() + 128, values.end()) );
+        CHECK( response.as_json()["prompt_eval_count"] == 3 );
+
+        ollama::response error("{\"error\":\"model not found\"}", ollama::message_type::embedding);
+        CHECK( error.has_error() );
+        CHECK( error.get_error() == "model not found" );
+        CHECK( !error.get_embeddings(values, dimensions) );
+
+        // Valid json without embeddings is kept, while anything else is rejected.
+        ollama::response other("{\"embedding\":[1,2]}", ollama::message_type::embedding);
+        CHECK( other.is_valid() );
+        CHECK( other.as_json()["embedding"].size() == 2 );
+        CHECK_THROWS_AS( ollama::response("{\"embeddings\":[[1,2]", ollama::message_type::embedding), ollama::invalid_json_exception );
+        ollama::allow_exceptions(false);
+        CHECK( !ollama::response("{\"embeddings\":[[1,2]", ollama::message_type::embedding).is_valid() );
+        ollama::allow_exceptions(true);
+    }
+
+    TEST_CASE("Decode Numbers in a Locale with a Decimal Comma") {
+
+        const char* previous = std::setlocale(LC_NUMERIC, nullptr);
+        std::string restore = previous ? previous : "C";
+        if (!std::setlocale(LC_NUMERIC, "de_DE.UTF-8") && !std::setlocale(LC_NUMERIC, "de_DE")) return;
+
+        // Numbers outside the fast path are read with strtod.
+        std::string body = "{\"embeddings\":[[0.12345678901234567890, 1e-30, 2.5]]}";
+        std::vector<float> values;
+        size_t dimensions = 0;
+        bool decoded = ollama::decode_embeddings(body.data(), body.size(), values, dimensions);
+        std::setlocale(LC_NUMERIC, restore.c_str());
+
+        REQUIRE( decoded );
+        CHECK( values[0] == 0.12345678901234567890f );
+        CHECK( values[1] == 1e-30f );
+        CHECK( values[2] == 2.5f );
+    }
+}